@@ -0,0 +1,435 @@
+/*
+ * htablebench - benchmarking the htable against a separately chained table
+ *               hashed with FNV-1, which is what htable used to be.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libzeroskip/htable.h>
+#include <libzeroskip/util.h>
+
+#include "bench-common.h"
+
+/* Globals */
+static int NUM_KEYS = 1000000;
+static int KEY_LEN = 24;
+
+struct bench_entry {
+        struct htable_entry entry;
+        struct bench_entry *next;       /* For the chained table */
+        unsigned char *key;
+        size_t keylen;
+};
+
+static struct bench_entry *entries;
+static int *order;              /* The keys are used in random order */
+
+static struct option long_options[] = {
+        {"hash", no_argument, NULL, 'H'},
+        {"htable", no_argument, NULL, 'T'},
+        {"chained", no_argument, NULL, 'C'},
+        {"count", required_argument, NULL, 'n'},
+        {"keylen", required_argument, NULL, 'k'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+};
+
+static void usage(const char *progname)
+{
+        printf("Usage: %s [OPTION]...\n", progname);
+
+        printf("  -H, --hash           run the hash functions\n");
+        printf("  -T, --htable         run with htable\n");
+        printf("  -C, --chained        run with the chained table\n");
+        printf("  -n, --count=N        number of keys (default %d)\n", NUM_KEYS);
+        printf("  -k, --keylen=N       length of the keys (default %d)\n", KEY_LEN);
+        printf("  -h, --help           display this help and exit\n");
+}
+
+static unsigned int fnvhash(const void *buf, size_t len)
+{
+        unsigned int hash = 0x811c9dc5;
+        const unsigned char *ptr = buf;
+
+        while (len--) {
+                unsigned int c = *ptr++;
+                hash = (hash * 0x01000193) ^ c;
+        }
+
+        return hash;
+}
+
+/* The keys share a long prefix, as the keys of a DB tend to */
+static void gen_entries(void)
+{
+        int i;
+
+        entries = xcalloc(NUM_KEYS, sizeof(struct bench_entry));
+        for (i = 0; i < NUM_KEYS; i++) {
+                struct bench_entry *e = &entries[i];
+                char buf[32];
+                int len;
+
+                len = snprintf(buf, sizeof(buf), "%d", i);
+                e->keylen = KEY_LEN > len ? KEY_LEN : len;
+                e->key = xmalloc(e->keylen);
+                memset(e->key, 'k', e->keylen - len);
+                memcpy(e->key + e->keylen - len, buf, len);
+        }
+
+        /* Consecutive keys hash to nearby buckets with some hashes, going
+         * through them in order would hide the cost of cache misses */
+        order = xcalloc(NUM_KEYS, sizeof(int));
+        for (i = 0; i < NUM_KEYS; i++)
+                order[i] = i;
+        srandom(NUM_KEYS);
+        for (i = NUM_KEYS - 1; i > 0; i--) {
+                int j = random() % (i + 1);
+                int tmp = order[i];
+                order[i] = order[j];
+                order[j] = tmp;
+        }
+}
+
+static void free_entries(void)
+{
+        int i;
+
+        for (i = 0; i < NUM_KEYS; i++)
+                xfree(entries[i].key);
+        xfree(entries);
+        xfree(order);
+}
+
+static void print_result(const char *name, const char *op, uint64_t start,
+                         uint64_t finish, int found)
+{
+        fprintf(stderr, "%-16s: %-8s %d keys in %" PRIu64 " μs.\n",
+                name, op, found, (finish - start));
+}
+
+static int run_hash(void)
+{
+        uint64_t start, finish;
+        unsigned int h = 0;
+        int i;
+
+        start = get_time_now();
+        for (i = 0; i < NUM_KEYS; i++)
+                h ^= fnvhash(entries[i].key, entries[i].keylen);
+        finish = get_time_now();
+        print_result("fnv1", "hash", start, finish, NUM_KEYS);
+
+        start = get_time_now();
+        for (i = 0; i < NUM_KEYS; i++)
+                h ^= bufhash(entries[i].key, entries[i].keylen);
+        finish = get_time_now();
+        print_result("bufhash", "hash", start, finish, NUM_KEYS);
+
+        fprintf(stdout, "(%u)\n", h);
+        fprintf(stdout, "------------------------------------------------\n");
+
+        return 0;
+}
+
+/* The operations the tables are benchmarked on. The entries are hashed as
+ * they are put, and the keys looked up with copies of the entries, as the
+ * iterator does. */
+struct table_ops {
+        const char *name;
+        void (*init)(void);
+        void (*put)(struct bench_entry *e);
+        int (*get)(const struct bench_entry *e);
+        int (*remove)(const struct bench_entry *e);
+        void (*fini)(void);
+};
+
+/* htable */
+static struct htable ht;
+
+static int bench_entry_cmpfn(const void *unused1 _unused_,
+                             const void *entry1,
+                             const void *entry2,
+                             const void *unused2 _unused_)
+{
+        const struct bench_entry *e1 = entry1;
+        const struct bench_entry *e2 = entry2;
+
+        return memcmp_raw(e1->key, e1->keylen, e2->key, e2->keylen);
+}
+
+static void htable_bench_init(void)
+{
+        htable_init(&ht, bench_entry_cmpfn, NULL, 0);
+}
+
+static void htable_bench_put(struct bench_entry *e)
+{
+        htable_entry_init(e, bufhash(e->key, e->keylen));
+        htable_put(&ht, e);
+}
+
+static int htable_bench_get(const struct bench_entry *e)
+{
+        struct bench_entry k = *e;
+
+        htable_entry_init(&k, bufhash(k.key, k.keylen));
+
+        return htable_get(&ht, &k, NULL) != NULL;
+}
+
+static int htable_bench_remove(const struct bench_entry *e)
+{
+        struct bench_entry k = *e;
+
+        htable_entry_init(&k, bufhash(k.key, k.keylen));
+
+        return htable_remove(&ht, &k, NULL) != NULL;
+}
+
+static void htable_bench_fini(void)
+{
+        htable_free(&ht, 0);
+}
+
+static const struct table_ops htable_ops = {
+        "htable", htable_bench_init, htable_bench_put, htable_bench_get,
+        htable_bench_remove, htable_bench_fini
+};
+
+/* Chained table, grown and shrunk as htable used to be */
+#define CHAINED_INIT_SIZE 64
+
+static struct {
+        struct bench_entry **table;
+        size_t size;
+        size_t count;
+} ct;
+
+static void chained_resize(size_t size)
+{
+        struct bench_entry **old = ct.table;
+        size_t i, oldsize = ct.size;
+
+        ct.table = xcalloc(size, sizeof(struct bench_entry *));
+        ct.size = size;
+
+        for (i = 0; i < oldsize; i++) {
+                struct bench_entry *e = old[i];
+                while (e) {
+                        struct bench_entry *n = e->next;
+                        size_t b = e->entry.hash & (size - 1);
+                        e->next = ct.table[b];
+                        ct.table[b] = e;
+                        e = n;
+                }
+        }
+
+        xfree(old);
+}
+
+static struct bench_entry **chained_find(const struct bench_entry *k)
+{
+        struct bench_entry **e = &ct.table[k->entry.hash & (ct.size - 1)];
+
+        while (*e && ((*e)->entry.hash != k->entry.hash ||
+                      bench_entry_cmpfn(NULL, *e, k, NULL)))
+                e = &(*e)->next;
+
+        return e;
+}
+
+static void chained_init(void)
+{
+        ct.count = 0;
+        ct.size = 0;
+        chained_resize(CHAINED_INIT_SIZE);
+}
+
+static void chained_put(struct bench_entry *e)
+{
+        size_t b;
+
+        e->entry.hash = fnvhash(e->key, e->keylen);
+        if (++ct.count > ct.size * 80 / 100)
+                chained_resize(ct.size << 2);
+
+        b = e->entry.hash & (ct.size - 1);
+        e->next = ct.table[b];
+        ct.table[b] = e;
+}
+
+static int chained_get(const struct bench_entry *e)
+{
+        struct bench_entry k = *e;
+
+        k.entry.hash = fnvhash(k.key, k.keylen);
+
+        return *chained_find(&k) != NULL;
+}
+
+static int chained_remove(const struct bench_entry *e)
+{
+        struct bench_entry k = *e;
+        struct bench_entry **found;
+
+        k.entry.hash = fnvhash(k.key, k.keylen);
+        found = chained_find(&k);
+        if (!*found)
+                return 0;
+
+        *found = (*found)->next;
+        ct.count--;
+        if (ct.size > CHAINED_INIT_SIZE &&
+            ct.count < ct.size * 80 / 100 / 5)
+                chained_resize(ct.size >> 2);
+
+        return 1;
+}
+
+static void chained_fini(void)
+{
+        xfree(ct.table);
+}
+
+static const struct table_ops chained_ops = {
+        "chained", chained_init, chained_put, chained_get,
+        chained_remove, chained_fini
+};
+
+/* Puts all the keys, looks them up and removes them */
+static void run_bulk(const struct table_ops *ops)
+{
+        uint64_t start, finish;
+        int i, found = 0;
+
+        ops->init();
+
+        start = get_time_now();
+        for (i = 0; i < NUM_KEYS; i++)
+                ops->put(&entries[order[i]]);
+        finish = get_time_now();
+        print_result(ops->name, "put", start, finish, NUM_KEYS);
+
+        start = get_time_now();
+        for (i = 0; i < NUM_KEYS; i++)
+                found += ops->get(&entries[order[i]]);
+        finish = get_time_now();
+        print_result(ops->name, "get", start, finish, found);
+
+        found = 0;
+        start = get_time_now();
+        for (i = 0; i < NUM_KEYS; i++)
+                found += ops->remove(&entries[order[i]]);
+        finish = get_time_now();
+        print_result(ops->name, "remove", start, finish, found);
+
+        ops->fini();
+}
+
+/* Keeps CHURN_KEYS keys in the table, putting one, looking it up and
+ * removing the oldest, the way the iterator uses its table */
+#define CHURN_KEYS 16
+
+static void run_churn(const struct table_ops *ops)
+{
+        uint64_t start, finish;
+        int i, found = 0;
+
+        ops->init();
+
+        start = get_time_now();
+        for (i = 0; i < NUM_KEYS; i++) {
+                ops->put(&entries[i]);
+                found += ops->get(&entries[i]);
+                if (i >= CHURN_KEYS)
+                        ops->remove(&entries[i - CHURN_KEYS]);
+        }
+        finish = get_time_now();
+        print_result(ops->name, "churn", start, finish, found);
+
+        ops->fini();
+}
+
+static int run_table(const struct table_ops *ops)
+{
+        run_bulk(ops);
+        run_churn(ops);
+        fprintf(stdout, "------------------------------------------------\n");
+
+        return 0;
+}
+
+static int parse_options_and_run(int argc, char **argv,
+                                 const struct option *options)
+{
+        int option;
+        int option_index;
+        int run_hash_p = 0, run_htable_p = 0, run_chained_p = 0;
+
+        while ((option = getopt_long(argc, argv, "HTCn:k:h?",
+                                     long_options, &option_index)) != -1) {
+                switch (option) {
+                case 'H':
+                        run_hash_p = 1;
+                        break;
+                case 'T':
+                        run_htable_p = 1;
+                        break;
+                case 'C':
+                        run_chained_p = 1;
+                        break;
+                case 'n':
+                        NUM_KEYS = atoi(optarg);
+                        break;
+                case 'k':
+                        KEY_LEN = atoi(optarg);
+                        break;
+                case 'h':
+                        _fallthrough_;
+                case '?':
+                        usage(basename(argv[0]));
+                        exit(option == 'h');
+                }
+        }
+
+        if (NUM_KEYS <= 0 || KEY_LEN <= 0) {
+                usage(basename(argv[0]));
+                return EXIT_FAILURE;
+        }
+
+        if (!run_hash_p && !run_htable_p && !run_chained_p)
+                run_hash_p = run_htable_p = run_chained_p = 1;
+
+        print_header();
+        fprintf(stderr, "Keys:           %d\n", NUM_KEYS);
+        fprintf(stderr, "Key Length:     %d\n", KEY_LEN);
+        fprintf(stdout, "------------------------------------------------\n");
+
+        gen_entries();
+
+        if (run_hash_p)
+                run_hash();
+        if (run_htable_p)
+                run_table(&htable_ops);
+        if (run_chained_p)
+                run_table(&chained_ops);
+
+        free_entries();
+
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        int ret = EXIT_SUCCESS;
+
+        ret = parse_options_and_run(argc, argv, long_options);
+        exit(ret);
+}
@@ -0,0 +1,299 @@
+/*
+ * keymodelbench - benchmarking lookups of sorted keys with a binary search,
+ *                 and with a keymodel narrowing it first, as the packed
+ *                 files do.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libzeroskip/keymodel.h>
+#include <libzeroskip/util.h>
+
+#include "bench-common.h"
+
+/* Globals */
+static int NUM_KEYS = 1000000;
+static int NUM_LOOKUPS = 1000000;
+static int MAX_ERROR = 8;
+
+/* The keys, one after the other as in a file, and where each starts */
+static unsigned char *keybuf;
+static size_t *offsets;
+static size_t *lens;
+static size_t skip;             /* The bytes all the keys start with */
+static int *order;              /* The keys are looked up in random order */
+static uint64_t ncmps;
+
+static struct option long_options[] = {
+        {"seq", no_argument, NULL, 'S'},
+        {"uid", no_argument, NULL, 'U'},
+        {"random", no_argument, NULL, 'R'},
+        {"count", required_argument, NULL, 'n'},
+        {"lookups", required_argument, NULL, 'l'},
+        {"error", required_argument, NULL, 'e'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+};
+
+static void usage(const char *progname)
+{
+        printf("Usage: %s [OPTION]...\n", progname);
+
+        printf("  -S, --seq            run with sequential 64 bit integer keys\n");
+        printf("  -U, --uid            run with message UID keys\n");
+        printf("  -R, --random         run with random keys\n");
+        printf("  -n, --count=N        number of keys (default %d)\n", NUM_KEYS);
+        printf("  -l, --lookups=N      number of lookups (default %d)\n", NUM_LOOKUPS);
+        printf("  -e, --error=N        error of the model (default %d)\n", MAX_ERROR);
+        printf("  -h, --help           display this help and exit\n");
+}
+
+static int cmp_keys(const void *a, const void *b)
+{
+        const unsigned char *k1 = *(unsigned char * const *)a;
+        const unsigned char *k2 = *(unsigned char * const *)b;
+
+        return memcmp(k1, k2, 16);
+}
+
+/* Generates the keys of the kind `kind`, sorted */
+static void gen_keys(char kind)
+{
+        unsigned char **sorted = NULL;
+        size_t pos = 0, len;
+        int i;
+
+        keybuf = xmalloc(st_mult(NUM_KEYS, 32));
+        offsets = xcalloc(NUM_KEYS, sizeof(size_t));
+        lens = xcalloc(NUM_KEYS, sizeof(size_t));
+        srandom(NUM_KEYS);
+
+        if (kind == 'R') {
+                /* Random, then sorted */
+                sorted = xcalloc(NUM_KEYS, sizeof(unsigned char *));
+                for (i = 0; i < NUM_KEYS; i++) {
+                        sorted[i] = xmalloc(16);
+                        snprintf((char *)sorted[i], 16, "%08lx%07lx",
+                                 random(), random() & 0xfffffff);
+                }
+                qsort(sorted, NUM_KEYS, sizeof(unsigned char *), cmp_keys);
+        }
+
+        for (i = 0; i < NUM_KEYS; i++) {
+                unsigned char *key = keybuf + pos;
+                uint64_t uid;
+
+                switch (kind) {
+                case 'S':
+                        write_be64(key, (uint64_t)i);
+                        len = sizeof(uint64_t);
+                        break;
+                case 'U':
+                        /* The messages of a mailbox, some of them
+                         * expunged */
+                        uid = 1 + (uint64_t)i * 3 + (i % 7 == 0);
+                        len = sprintf((char *)key, "user.someone.INBOX.%010"
+                                      PRIu64, uid);
+                        break;
+                default:
+                        len = 15;
+                        memcpy(key, sorted[i], len);
+                        xfree(sorted[i]);
+                        break;
+                }
+
+                offsets[i] = pos;
+                lens[i] = len;
+                pos += len;
+        }
+        xfree(sorted);
+
+        for (skip = 0; skip < lens[0] && skip < lens[NUM_KEYS - 1]; skip++)
+                if (keybuf[offsets[0] + skip] !=
+                    keybuf[offsets[NUM_KEYS - 1] + skip])
+                        break;
+
+        order = xcalloc(NUM_LOOKUPS, sizeof(int));
+        for (i = 0; i < NUM_LOOKUPS; i++)
+                order[i] = random() % NUM_KEYS;
+}
+
+static void free_keys(void)
+{
+        xfree(keybuf);
+        xfree(offsets);
+        xfree(lens);
+        xfree(order);
+}
+
+/* The key after the bytes all of them start with, as a number */
+static uint64_t project(const unsigned char *key, size_t len)
+{
+        unsigned char buf[8];
+        size_t n = len - skip < sizeof(buf) ? len - skip : sizeof(buf);
+
+        memset(buf, 0, sizeof(buf));
+        memcpy(buf, key + skip, n);
+
+        return read_be64(buf);
+}
+
+static size_t bsearch_keys(const unsigned char *key, size_t len, size_t lo,
+                           size_t hi)
+{
+        while (lo < hi) {
+                size_t mi = lo + (hi - lo) / 2;
+
+                ncmps++;
+                if (memcmp_raw(keybuf + offsets[mi], lens[mi], key, len) < 0)
+                        lo = mi + 1;
+                else
+                        hi = mi;
+        }
+
+        return lo;
+}
+
+static size_t model_search(const struct keymodel *model,
+                           const unsigned char *key, size_t len)
+{
+        uint64_t lo, hi;
+        size_t pos;
+
+        keymodel_window(model, project(key, len), &lo, &hi);
+        pos = bsearch_keys(key, len, lo, hi);
+        if (pos == lo && lo > 0)
+                pos = bsearch_keys(key, len, 0, lo);
+        else if (pos == hi && hi < (uint64_t)NUM_KEYS)
+                pos = bsearch_keys(key, len, hi, NUM_KEYS);
+
+        return pos;
+}
+
+static void print_result(const char *name, const char *op, uint64_t start,
+                         uint64_t finish, int found)
+{
+        fprintf(stderr, "%-16s: %-8s %d keys in %" PRIu64 " μs, "
+                "%.1f compares each.\n", name, op, found, (finish - start),
+                (double)ncmps / NUM_LOOKUPS);
+}
+
+static void run_keys(char kind, const char *name)
+{
+        struct keymodel *model;
+        uint64_t start, finish;
+        int i, found;
+
+        gen_keys(kind);
+        fprintf(stderr, "%s keys, %zu bytes in common\n", name, skip);
+
+        ncmps = 0;
+        found = 0;
+        start = get_time_now();
+        for (i = 0; i < NUM_LOOKUPS; i++) {
+                int k = order[i];
+                found += bsearch_keys(keybuf + offsets[k], lens[k], 0,
+                                      NUM_KEYS) == (size_t)k;
+        }
+        finish = get_time_now();
+        print_result("bsearch", "lookup", start, finish, found);
+
+        start = get_time_now();
+        model = keymodel_new(MAX_ERROR);
+        for (i = 0; i < NUM_KEYS; i++)
+                keymodel_add(model, project(keybuf + offsets[i], lens[i]));
+        keymodel_seal(model);
+        finish = get_time_now();
+        fprintf(stderr, "%-16s: %-8s %" PRIu64 " segments, %zu bytes in %"
+                PRIu64 " μs.\n", "keymodel", "build", model->nsegs,
+                keymodel_bytes(model), (finish - start));
+
+        ncmps = 0;
+        found = 0;
+        start = get_time_now();
+        for (i = 0; i < NUM_LOOKUPS; i++) {
+                int k = order[i];
+                found += model_search(model, keybuf + offsets[k],
+                                      lens[k]) == (size_t)k;
+        }
+        finish = get_time_now();
+        print_result("keymodel", "lookup", start, finish, found);
+
+        keymodel_free(&model);
+        free_keys();
+        fprintf(stdout, "------------------------------------------------\n");
+}
+
+static int parse_options_and_run(int argc, char **argv,
+                                 const struct option *options)
+{
+        int option;
+        int option_index;
+        int run_seq_p = 0, run_uid_p = 0, run_random_p = 0;
+
+        while ((option = getopt_long(argc, argv, "SURn:l:e:h?",
+                                     long_options, &option_index)) != -1) {
+                switch (option) {
+                case 'S':
+                        run_seq_p = 1;
+                        break;
+                case 'U':
+                        run_uid_p = 1;
+                        break;
+                case 'R':
+                        run_random_p = 1;
+                        break;
+                case 'n':
+                        NUM_KEYS = atoi(optarg);
+                        break;
+                case 'l':
+                        NUM_LOOKUPS = atoi(optarg);
+                        break;
+                case 'e':
+                        MAX_ERROR = atoi(optarg);
+                        break;
+                case 'h':
+                        _fallthrough_;
+                case '?':
+                        usage(basename(argv[0]));
+                        exit(option == 'h');
+                }
+        }
+
+        if (NUM_KEYS <= 1 || NUM_LOOKUPS <= 0 || MAX_ERROR < 0) {
+                usage(basename(argv[0]));
+                return EXIT_FAILURE;
+        }
+
+        if (!run_seq_p && !run_uid_p && !run_random_p)
+                run_seq_p = run_uid_p = run_random_p = 1;
+
+        print_header();
+        fprintf(stderr, "Keys:           %d\n", NUM_KEYS);
+        fprintf(stderr, "Lookups:        %d\n", NUM_LOOKUPS);
+        fprintf(stderr, "Model error:    %d\n", MAX_ERROR);
+        fprintf(stdout, "------------------------------------------------\n");
+
+        if (run_seq_p)
+                run_keys('S', "sequential");
+        if (run_uid_p)
+                run_keys('U', "UID");
+        if (run_random_p)
+                run_keys('R', "random");
+
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        int ret = EXIT_SUCCESS;
+
+        ret = parse_options_and_run(argc, argv, long_options);
+        exit(ret);
+}
@@ -25,6 +25,7 @@ static const char *BENCHMARKS;
 static int NUMRECS = 1000;
 static int new_db = 0;          /* set to 1 if we created a new db */
 static size_t VALLEN = 0;
+static int open_mode = 0;       /* Added to the mode the DB is opened in */
 
 enum {
         BATCHED,
@@ -37,6 +38,7 @@ static struct option long_options[] = {
         {"benchmarks", required_argument, NULL, 'b'},
         {"db", required_argument, NULL, 'd'},
         {"numrecs", optional_argument, NULL, 'n'},
+        {"hugepages", no_argument, NULL, 'H'},
         {"help", no_argument, NULL, 'h'},
         {NULL, 0, NULL, 0}
 };
@@ -53,15 +55,17 @@ static void usage(const char *progname)
         printf("                       * writerandomtxn - write values in random key order in separate transactions\n");
         printf("                       * overwriterandom- overwrite values in random key order in separate transactions\n");
         printf("                       * write100k      - write values 100K long in random key order\n");
+        printf("                       * readrandom     - look up keys in random order\n");
         printf("\n");
         printf("                       * open           - cost of opening a DB\n");
         printf("\n");
         printf("  -d, --db             the db to run the benchmarks on\n");
         printf("  -n, --numrecs        number of records to write[default: 1000]\n");
+        printf("  -H, --hugepages      open the DB with MODE_HUGEPAGES\n");
         printf("  -h, --help           display this help and exit\n");
 }
 
-#define ALLBENCHMARKS "writeseq,writeseqtxn,writerandom,writerandomtxn,overwriterandom,write100k,open"
+#define ALLBENCHMARKS "writeseq,writeseqtxn,writerandom,writerandomtxn,overwriterandom,write100k,readrandom,open"
 
 static char *create_tmp_dir_name(void)
 {
@@ -167,7 +171,7 @@ static size_t do_write(int txnmode, int insmode)
         /* Open Zeroskip DB */
         ret = zsdb_init(&db, NULL, NULL);
         assert(ret == ZS_OK);
-        ret = zsdb_open(db, DBNAME, new_db ? MODE_CREATE : MODE_RDWR);
+        ret = zsdb_open(db, DBNAME, (new_db ? MODE_CREATE : MODE_RDWR) | open_mode);
         assert(ret == ZS_OK);
 
         zsdb_write_lock_acquire(db, 0);
@@ -216,6 +220,40 @@ static size_t do_write(int txnmode, int insmode)
         return bytes;
 }
 
+/* Looks up NUMRECS keys written by do_write(), in random order, and
+ * returns how many were found. Only the lookups are timed. */
+static int do_readrandom(uint64_t *elapsed)
+{
+        struct zsdb *db = NULL;
+        uint64_t start, finish;
+        int i, ret, found = 0;
+
+        ret = zsdb_init(&db, NULL, NULL);
+        assert(ret == ZS_OK);
+        ret = zsdb_open(db, DBNAME, MODE_RDWR | open_mode);
+        assert(ret == ZS_OK);
+
+        start = get_time_now();
+        for (i = 0; i < NUMRECS; i++) {
+                char key[100];
+                const unsigned char *val;
+                size_t vallen;
+
+                snprintf(key, sizeof(key), "%016d", rand() % NUMRECS);
+                if (zsdb_fetch(db, (unsigned char *)key, strlen(key),
+                               &val, &vallen, NULL) == ZS_OK)
+                        found++;
+        }
+        finish = get_time_now();
+        *elapsed = finish - start;
+
+        ret = zsdb_close(db);
+        assert(ret == ZS_OK);
+        zsdb_final(&db);
+
+        return found;
+}
+
 static void do_open(int num_iters)
 {
         struct zsdb *db = NULL;
@@ -224,7 +262,7 @@ static void do_open(int num_iters)
         for (j = 0; j < num_iters; j++) {
                 ret = zsdb_init(&db, NULL, NULL);
                 assert(ret == ZS_OK);
-                ret = zsdb_open(db, DBNAME, new_db ? MODE_CREATE : MODE_RDWR);
+                ret = zsdb_open(db, DBNAME, (new_db ? MODE_CREATE : MODE_RDWR) | open_mode);
                 assert(ret == ZS_OK);
                 ret = zsdb_close(db);
                 assert(ret == ZS_OK);
@@ -238,7 +276,7 @@ static int parse_options(int argc, char **argv, const struct option *options)
         int option;
         int option_index;
 
-        while ((option = getopt_long(argc, argv, "d:b:h?",
+        while ((option = getopt_long(argc, argv, "d:b:n:Hh?",
                                      long_options, &option_index)) != -1) {
                 switch (option) {
                 case 'b':
@@ -250,6 +288,9 @@ static int parse_options(int argc, char **argv, const struct option *options)
                 case 'n':
                         NUMRECS = atoi(optarg);
                         break;
+                case 'H':
+                        open_mode |= MODE_HUGEPAGES;
+                        break;
                 case 'h':
                         _fallthrough_;
                 case '?':
@@ -322,6 +363,23 @@ static int run_benchmarks(void)
                         fprintf(stderr, "write100k       : %zu bytes written in %" PRIu64 " μs.\n",
                                 bytes, (finish - start));
                         VALLEN = 0;
+                } else if (strcmp(benchmarks.datav[i], "readrandom") == 0) {
+                        uint64_t elapsed;
+                        int found;
+
+                        if (new_db) {
+                                do_write(NOTBATCHED, SEQUENTIAL);
+                                new_db = 0;
+                                found = do_readrandom(&elapsed);
+                                new_db = 1;
+                        } else {
+                                found = do_readrandom(&elapsed);
+                        }
+
+                        fprintf(stderr, "readrandom      : %d of %d keys found in %" PRIu64 " μs.(avg: %.3f μs)%s.\n",
+                                found, NUMRECS, elapsed,
+                                NUMRECS ? (double)elapsed / NUMRECS : 0.0,
+                                (open_mode & MODE_HUGEPAGES) ? " with huge pages" : "");
                 } else if (strcmp(benchmarks.datav[i], "open") == 0) {
                         int NUM = 1000;
 
@@ -0,0 +1,85 @@
+/*
+ * arena.h
+ *
+ * Arenas for the small, long lived allocations of zeroskip: memtree nodes,
+ * records and index arrays. They are carved out of 2MB chunks, which can be
+ * backed by huge pages, to keep the TLB misses down with millions of keys.
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <libzeroskip/macros.h>
+
+CPP_GUARD_START
+
+/* Flags */
+#define ARENA_HUGEPAGES   1     /* Back the chunks with huge pages */
+
+#define ARENA_CHUNK_SIZE  (2UL * 1024 * 1024)
+
+/* Size classes: 16 byte steps up to 512 bytes, powers of two up to 256K,
+ * anything larger gets a mapping of its own. */
+#define ARENA_SMALL_MAX   512
+#define ARENA_MEDIUM_MAX  (256 * 1024)
+#define ARENA_NUM_CLASSES (ARENA_SMALL_MAX / 16 + 9)
+
+struct arena_chunk {
+        struct arena_chunk *next;
+        struct arena_chunk *prev;
+        size_t size;
+        int huge;               /* Mapped with MAP_HUGETLB */
+};
+
+struct arena {
+        int flags;
+        int nohugetlb;          /* MAP_HUGETLB failed once, don't retry */
+
+        struct arena_chunk *chunks;     /* Chunks the size classes use */
+        struct arena_chunk *large;      /* Allocations past ARENA_MEDIUM_MAX */
+
+        unsigned char *next;            /* Free space in the last chunk */
+        size_t left;
+
+        void *freelist[ARENA_NUM_CLASSES];
+
+        size_t mapped;          /* Bytes mapped */
+        size_t hugetlb;         /* ..of which with MAP_HUGETLB */
+};
+
+/* arena_new():
+ * Creates an arena. With ARENA_HUGEPAGES, chunks are mapped with
+ * MAP_HUGETLB, and if there are no huge pages reserved, 2MB aligned and
+ * advised with MADV_HUGEPAGE instead. Arenas aren't thread safe, their
+ * users serialise the allocations.
+ */
+struct arena *arena_new(int flags);
+
+/* arena_destroy():
+ * Unmaps all the memory of the arena, whatever is still allocated.
+ */
+void arena_destroy(struct arena **arenap);
+
+/* arena_alloc(), arena_release(), arena_realloc():
+ * The size of the allocation has to be passed back when it is released or
+ * reallocated. With a NULL arena, these are xmalloc(), xfree() and
+ * xrealloc(), so callers can use them whether or not they have an arena.
+ * Allocations are 16 byte aligned.
+ */
+void *arena_alloc(struct arena *arena, size_t size);
+void arena_release(struct arena *arena, void *ptr, size_t size);
+void *arena_realloc(struct arena *arena, void *ptr, size_t oldsize,
+                    size_t newsize);
+
+CPP_GUARD_END
+
+#endif  /* _ARENA_H_ */
@@ -0,0 +1,100 @@
+/*
+ * bloom.h
+ *
+ * Blocked bloom filter, for the keys of the packed files. All the bits for
+ * a key are in one block of a cache line, so a lookup touches one cache
+ * line, or one page of a mapped file. The bits are bytes in the same order
+ * everywhere, and the hash reads the keys a big endian word at a time, so
+ * the filters written on one machine can be read on any other.
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#ifndef _BLOOM_H_
+#define _BLOOM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <libzeroskip/macros.h>
+
+CPP_GUARD_START
+
+#define BLOOM_BLOCK_BITS   512
+#define BLOOM_BLOCK_BYTES  (BLOOM_BLOCK_BITS / 8)
+#define BLOOM_MAX_K        16
+
+struct bloom {
+        const unsigned char *bits;
+        uint64_t nblocks;
+        unsigned int k;         /* Bits set per key */
+        unsigned char *data;    /* The bits, when they are ours to add to,
+                                 * NULL if they are mapped */
+};
+
+/* bloom_hash():
+ * The hash of `len` bytes at `buf`, to add or to look up.
+ */
+uint64_t bloom_hash(const void *buf, size_t len);
+
+/* bloom_new():
+ * A filter for `n` keys, with `bitsperkey` bits for each. With 10 bits per
+ * key, about 1 in 100 of the keys that aren't in the filter seem to be.
+ */
+struct bloom *bloom_new(uint64_t n, unsigned int bitsperkey);
+
+/* bloom_new_mapped():
+ * A filter of the `nblocks` blocks at `bits`, which has to stay mapped for
+ * as long as the filter is used. Nothing is copied, nor can be added.
+ */
+struct bloom *bloom_new_mapped(const unsigned char *bits, uint64_t nblocks,
+                               unsigned int k);
+void bloom_free(struct bloom **bloom);
+
+void bloom_add(struct bloom *bloom, uint64_t hash);
+
+/* bloom_bytes():
+ * The size of the bits of the filter.
+ */
+static inline uint64_t bloom_bytes(const struct bloom *bloom)
+{
+        return bloom->nblocks * BLOOM_BLOCK_BYTES;
+}
+
+/* bloom_block():
+ * The offset of the block for `hash`. The high half of the hash picks the
+ * block, the low half the bits in it.
+ */
+static inline uint64_t bloom_block(const struct bloom *bloom, uint64_t hash)
+{
+        return (((hash >> 32) * bloom->nblocks) >> 32) * BLOOM_BLOCK_BYTES;
+}
+
+/* bloom_may_contain():
+ * 0 if the key with `hash` isn't in the filter, 1 if it might be.
+ */
+static inline int bloom_may_contain(const struct bloom *bloom, uint64_t hash)
+{
+        const unsigned char *block = bloom->bits + bloom_block(bloom, hash);
+        uint32_t h = (uint32_t)hash;
+        uint32_t delta = (h >> 17) | (h << 15);
+        unsigned int i;
+
+        for (i = 0; i < bloom->k; i++) {
+                uint32_t bit = h & (BLOOM_BLOCK_BITS - 1);
+
+                if (!(block[bit >> 3] & (1 << (bit & 7))))
+                        return 0;
+                h += delta;
+        }
+
+        return 1;
+}
+
+CPP_GUARD_END
+
+#endif  /* _BLOOM_H_ */
@@ -17,6 +17,9 @@
 
 CPP_GUARD_START
 
+/* bufhash():
+ *  hashes `len` bytes of `buf`, a word at a time.
+ */
 unsigned int bufhash(const void *buf, size_t len);
 
 /* Comparison function */
@@ -28,14 +31,22 @@ typedef int (*htable_cmp_fn)(const void *data, const void *entry1,
  * the entry.
  */
 struct htable_entry {
-        struct htable_entry *next; /* next element in case of collision */
         unsigned int hash;
 };
 
-#define HTABLE_ENTRY_INIT  { .next = NULL, .hash = 0 }
+#define HTABLE_ENTRY_INIT  { .hash = 0 }
+
+/* The table is open addressed, with Robin Hood probing. Each slot holds the
+ * hash next to the entry pointer, so probing only touches the entries whose
+ * hash matches.
+ */
+struct htable_slot {
+        unsigned int hash;
+        struct htable_entry *entry;
+};
 
 struct htable {
-        struct htable_entry **table;
+        struct htable_slot *table;
 
         htable_cmp_fn cmpfn;
         const void *cmpfndata;
@@ -58,7 +69,6 @@ static inline void htable_entry_init(void *entry, unsigned int hash)
 {
         struct htable_entry *e = entry;
         e->hash = hash;
-        e->next = NULL;
 }
 
 /* htable_get():
@@ -68,9 +78,9 @@ extern void *htable_get(const struct htable *ht, const void *key,
                         const void *keydata);
 
 /* htable_get_next():
- *  get the 'next' entry in the hash table, when there are duplicate entries
- * becuase of collision, NULL if there are no duplicate entries. `entry` is
- * where the lookup should start from.
+ *  get the 'next' entry in the hash table, when there are duplicate entries,
+ * NULL if there are no duplicate entries. `entry` is where the lookup should
+ * start from.
  */
 extern const void *htable_get_next(const struct htable *ht, const void *entry);
 
@@ -94,10 +104,9 @@ extern void *htable_replace(struct htable *ht, void *entry);
 extern void *htable_remove(struct htable *ht, const void *key,
                            const void *keydata);
 
-/* hashtable iterator */
+/* hashtable iterator, invalidated by htable_put() and htable_remove() */
 struct htable_iter {
         struct htable *ht;
-        struct htable_entry *next;
         unsigned int pos;
 };
 
@@ -0,0 +1,88 @@
+/*
+ * keymodel.h
+ *
+ * Piecewise linear model of where keys are in a sorted array, for the
+ * lookups in the packed files. The keys are numbers which compare as the
+ * keys they stand for do, or are the same, like the big endian prefixes of
+ * byte ordered keys. Each segment of the model is a line from its first
+ * key, which puts every key of the segment within `maxerror` places of
+ * where it is. A lookup then only has to search the few places around
+ * where the model puts the key, instead of the whole array.
+ *
+ * Sequential keys, or keys that are spread evenly, take a segment or a few,
+ * however many of them there are.
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#ifndef _KEYMODEL_H_
+#define _KEYMODEL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <libzeroskip/macros.h>
+
+CPP_GUARD_START
+
+struct keymodel_segment {
+        uint64_t key;           /* The first key of the segment */
+        uint64_t pos;           /* ..and where it is */
+        double slope;
+};
+
+struct keymodel {
+        struct keymodel_segment *segs;
+        uint64_t nsegs;
+        uint64_t alloc;
+
+        uint64_t count;         /* Keys added */
+        uint64_t maxerror;
+        uint64_t maxdups;       /* The most times a key was added, after
+                                 * the first */
+        int unordered;          /* A key was smaller than the one before,
+                                 * the model is of no use */
+
+        /* While the keys are added */
+        uint64_t lastkey;
+        uint64_t dups;
+        double slopelo;         /* The slopes the last segment can have */
+        double slopehi;
+};
+
+/* keymodel_new():
+ * A model that puts the keys at most `maxerror` places from where they are.
+ */
+struct keymodel *keymodel_new(uint64_t maxerror);
+void keymodel_free(struct keymodel **model);
+
+/* keymodel_add():
+ * Adds the next key, which can't be smaller than the one before.
+ */
+void keymodel_add(struct keymodel *model, uint64_t key);
+
+/* keymodel_seal():
+ * Ends the last segment, once all the keys are in, and gives back the
+ * memory that isn't needed. No more keys can be added after.
+ */
+void keymodel_seal(struct keymodel *model);
+
+/* keymodel_window():
+ * The places [*lo, *hi) to look in for the first key that isn't smaller
+ * than `key`, which is at *hi if it isn't in them.
+ */
+void keymodel_window(const struct keymodel *model, uint64_t key,
+                     uint64_t *lo, uint64_t *hi);
+
+/* keymodel_bytes():
+ * The memory used by the model.
+ */
+size_t keymodel_bytes(const struct keymodel *model);
+
+CPP_GUARD_END
+
+#endif  /* _KEYMODEL_H_ */
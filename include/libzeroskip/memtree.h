@@ -20,6 +20,8 @@
 
 CPP_GUARD_START
 
+struct arena;
+
 #define MEMTREE_MAX_ELEMENTS 10
 #define MEMTREE_MIN_ELEMENTS (MEMTREE_MAX_ELEMENTS >> 1)
 
@@ -53,6 +55,13 @@ struct memtree_node {
 
         uint32_t pos;
 
+        /* Length of the prefix shared by all the keys in the node, the
+         * prefix bytes are those of recs[0]->key. */
+        uint32_t prefixlen;
+
+        /* Bumped whenever the records in the node change */
+        uint32_t version;
+
         struct record *recs[MEMTREE_MAX_ELEMENTS];
 
         struct memtree_node *branches[];
@@ -63,8 +72,13 @@ struct memtree_iter {
         struct memtree_node *node;
 
         uint32_t pos;
+        uint32_t version;       /* Of `node`, when memtree_next() left it */
 
         struct record *record;
+
+        /* Of the tree, when memtree_next() left the iter, 0 if it was
+         * positioned some other way */
+        uint64_t generation;
 };
 
 typedef struct memtree_iter memtree_iter_t[1];
@@ -81,11 +95,25 @@ typedef unsigned int (*memtree_search_cb_t)(const unsigned char *key,
 struct memtree {
         struct memtree_node *root;
         size_t count;
+        size_t bytes;           /* Memory used by the nodes and records */
 
         memtree_action_cb_t destroy;
         void *destroy_data;
 
         memtree_search_cb_t search;
+
+        /* The leaf that took the last insert. Used to skip the descent
+         * from the root for sequential inserts. */
+        struct memtree_node *finger;
+
+        /* `changes` is bumped by every insert and replace. `generation` is
+         * bumped whenever nodes or records may have been freed, which
+         * invalidates all iterators. */
+        uint64_t changes;
+        uint64_t generation;
+
+        /* Nodes and records are allocated from, if not NULL */
+        struct arena *arena;
 };
 
 /* memtree_new():
@@ -95,6 +123,14 @@ struct memtree {
  */
 struct memtree *memtree_new(memtree_action_cb_t destroy, memtree_search_cb_t search);
 
+/* memtree_new_arena():
+ * Like memtree_new(), with the nodes allocated from `arena`. The records
+ * inserted have to come from the same arena, see record_new_arena().
+ */
+struct memtree *memtree_new_arena(memtree_action_cb_t destroy,
+                                  memtree_search_cb_t search,
+                                  struct arena *arena);
+
 void memtree_free(struct memtree *tree);
 
 /* memtree_insert_opt():
@@ -123,6 +159,17 @@ static inline int memtree_replace(struct memtree *tree, struct record *record)
         return memtree_insert_opt(tree, record, 1);
 }
 
+/* memtree_build():
+ * Builds an empty tree from `count` records in one go, bottom up, instead
+ * of inserting them one at a time. The records are sorted first, unless
+ * they already are. Of records with the same key, the last one in `recs`
+ * wins, and the others are destroyed. The tree takes over the records, but
+ * not `recs`, which is used as scratch space.
+ * Returns:
+ *   On Success - returns MEMTREE_OK
+ *   On Failure - returns MEMTREE_INVALID, if the tree isn't empty
+ */
+int memtree_build(struct memtree *tree, struct record **recs, size_t count);
 
 /* memtree_insert_at():
  * Insert a record before the one pointed to by iter
@@ -157,10 +204,26 @@ int memtree_lookup(struct memtree *tree, const void *key);
 int memtree_find(struct memtree *tree, const unsigned char *key, size_t keylen,
                  memtree_iter_t iter);
 
+/* memtree_find_next():
+ * Same as memtree_find(), for a key near the one `iter` was last found
+ * with: the leaf `iter` is on is searched first, and the tree from its root
+ * only if the key isn't within that leaf. For looking up keys in order,
+ * with nothing changing the tree in between.
+ */
+int memtree_find_next(struct memtree *tree, const unsigned char *key,
+                      size_t keylen, memtree_iter_t iter);
+
 int memtree_walk_forward(struct memtree *memtree, memtree_action_cb_t action,
                          void *data);
 int memtree_begin(struct memtree *memtree, memtree_iter_t iter);
 int memtree_prev(memtree_iter_t iter);
+
+/* memtree_next():
+ * Moves `iter` to the next record. An iter that was moved by memtree_next()
+ * stays valid across inserts and replaces, the next call notices if the
+ * node it was left on changed, and finds its way back past the last record
+ * it returned. Removes and memtree_build() still invalidate it.
+ */
 int memtree_next(memtree_iter_t iter);
 
 /* These are the default callbacks that are used in the absence of
@@ -228,6 +291,9 @@ unsigned int memtree_memcmp_raw(const unsigned char *key, size_t keylen,
                  return start;                                          \
         }
 
+/* memtree_destroy():
+ * The default destroy callback, `data` is the arena of the tree.
+ */
 int memtree_destroy(struct record *record, void *data);
 
 int memtree_print_node_data(struct memtree *memtree, void *data);
@@ -238,6 +304,15 @@ struct record * record_new(const unsigned char *key, size_t keylen,
                            int deleted);
 void record_free(struct record *record);
 
+/* record_new_arena(), record_free_arena():
+ * The same, with the record allocated from `arena`.
+ */
+struct record *record_new_arena(struct arena *arena,
+                                const unsigned char *key, size_t keylen,
+                                const unsigned char *val, size_t vallen,
+                                int deleted);
+void record_free_arena(struct arena *arena, struct record *record);
+
 CPP_GUARD_END
 
 #endif  /* _MEMTREE_H_ */
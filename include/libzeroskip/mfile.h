@@ -20,6 +20,8 @@
 
 CPP_GUARD_START
 
+struct mfile_windows;
+
 struct mfile {
         char *filename;
         int fd;
@@ -33,6 +35,8 @@ struct mfile {
         uint64_t offset;
         uint32_t flags;         /* flags passed into the mfile api */
         int mflags;             /* flags parsed into what mmap() understands */
+        struct mfile_windows *win;      /* With MFILE_WINDOWED, if the file
+                                         * isn't mapped as a whole */
 };
 
 enum {
@@ -43,8 +47,14 @@ enum {
         MFILE_WR_CR  = (MFILE_WR | MFILE_CREATE),
         MFILE_RW_CR  = (MFILE_RW | MFILE_CREATE),
         MFILE_EXCL   = 0x00000040,
+        MFILE_WINDOWED = 0x00000100,    /* Read only, map in windows */
 };
 
+/* Windows of MFILE_WINDOWED files, unless mfile_window_config() says
+ * otherwise. Files that fit in the windows are mapped as a whole. */
+#define MFILE_WINDOW_SIZE   (4UL * 1024 * 1024)
+#define MFILE_WINDOW_COUNT  16
+
 extern int mfile_open(const char *fname, uint32_t flags,
                            struct mfile **mfp);
 #if 0                           /* Will eventually split the open() function */
@@ -66,6 +76,80 @@ extern int mfile_flush(struct mfile **mfp);
 extern int mfile_seek(struct mfile **mfp, uint64_t offset,
                            uint64_t *newoffset);
 
+/* mfile_window_config():
+ * The size of the windows, rounded to pages, and how many a file keeps
+ * mapped, for the MFILE_WINDOWED files opened from then on.
+ */
+extern void mfile_window_config(uint64_t size, unsigned int count);
+
+/* mfile_window():
+ * Maps the window that holds `len` bytes at `offset`, of an MFILE_WINDOWED
+ * file, cut short at the end of the file. Windows are kept in LRU order, and
+ * the least recently used is dropped with MADV_DONTNEED to make room for a
+ * new one, as are the windows behind a sequential scan. Dropped windows
+ * stay mapped until mfile_reclaim(), so the pointers handed out are good
+ * until then, and are mapped again if the same window is needed.
+ * Returns NULL past the end of the file, or if the window can't be mapped.
+ */
+extern unsigned char *mfile_window(struct mfile *mf, uint64_t offset,
+                                   uint64_t len);
+
+/* mfile_range():
+ * `len` bytes at `offset`, whether or not the file is mapped in windows.
+ */
+static inline unsigned char *mfile_range(struct mfile *mf, uint64_t offset,
+                                         uint64_t len)
+{
+        if (!mf->win)
+                return mf->ptr + offset;
+
+        return mfile_window(mf, offset, len);
+}
+
+/* mfile_pin():
+ * Like mfile_range(), but the range stays mapped until the file is closed.
+ */
+extern unsigned char *mfile_pin(struct mfile *mf, uint64_t offset,
+                                uint64_t len);
+
+/* mfile_offset():
+ * Finds the offset in the file of the `len` bytes at `ptr`, 1 if they are
+ * in one of its windows or in the mapping of the whole file, 0 if not.
+ */
+extern int mfile_offset(struct mfile *mf, const unsigned char *ptr,
+                        uint64_t len, uint64_t *offset);
+
+/* mfile_map_range(), mfile_unmap_range():
+ * Maps `len` bytes at `offset` on their own, in `map` of `maplen` bytes,
+ * which isn't one of the windows of the file, and stays mapped after it is
+ * closed or even unlinked, until mfile_unmap_range(). NULL if the range
+ * isn't all in the file, or can't be mapped.
+ */
+extern unsigned char *mfile_map_range(struct mfile *mf, uint64_t offset,
+                                      uint64_t len, void **map,
+                                      size_t *maplen);
+extern void mfile_unmap_range(void *map, size_t maplen);
+
+/* mfile_reclaim():
+ * Unmaps the dropped windows. The pointers into them must not be used
+ * anymore.
+ */
+extern void mfile_reclaim(struct mfile *mf);
+
+/* mfile_reclaim_due():
+ * 1 once the file has dropped as many windows as it keeps in use, for
+ * those who don't otherwise get to call mfile_reclaim() to know when to.
+ */
+extern int mfile_reclaim_due(struct mfile *mf);
+
+/* mfile_mapped(), mfile_resident(), mfile_dontneed():
+ * The bytes mapped, the bytes of those in memory, and dropping all of them
+ * from memory with MADV_DONTNEED, for whole files or windows alike.
+ */
+extern uint64_t mfile_mapped(struct mfile *mf);
+extern uint64_t mfile_resident(struct mfile *mf);
+extern void mfile_dontneed(struct mfile *mf);
+
 extern void crc32_begin(struct mfile **mfp);
 extern uint32_t crc32_end(struct mfile **mfp);
 
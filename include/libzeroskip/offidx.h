@@ -0,0 +1,141 @@
+/*
+ * offidx.h
+ *
+ * Compact vector of file offsets, for the indexes of the packed files.
+ * The offsets are kept in blocks of OFFIDX_BLOCK_SIZE, as a 64 bit base
+ * and a delta from it per offset, 16, 32 or 64 bits wide depending on how
+ * far apart the offsets of the block are. Any offset can be read in constant
+ * time, and with records of up to a KB or so, the deltas fit in 16 bits and
+ * the index takes a little over 2 bytes per offset, instead of 8.
+ *
+ * An index can also be a view of big endian offsets in a mapped file, the
+ * pointer section of a packed file, decoded as they are read.
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#ifndef _OFFIDX_H_
+#define _OFFIDX_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <libzeroskip/macros.h>
+#include <libzeroskip/util.h>
+
+CPP_GUARD_START
+
+struct arena;
+
+#define OFFIDX_BLOCK_SHIFT 6
+#define OFFIDX_BLOCK_SIZE  (1U << OFFIDX_BLOCK_SHIFT)
+
+struct offidx_block {
+        uint64_t base;          /* The smallest offset in the block */
+        uint64_t pos;           /* Of the deltas in `data`, 8 byte aligned.
+                                 * The low bits are log2 of their width */
+};
+
+struct offidx {
+        uint64_t count;
+
+        struct offidx_block *blocks;    /* The full blocks, and the last
+                                         * one when sealed */
+        uint64_t nblocks;
+        uint64_t blocksalloc;
+
+        unsigned char *data;            /* The deltas */
+        uint64_t datalen;
+        uint64_t dataalloc;
+
+        uint64_t *tail;                 /* The offsets of the last block,
+                                         * until it is full or sealed */
+
+        struct arena *arena;    /* Everything is allocated from, if not NULL */
+
+        const unsigned char *mapped;    /* Big endian offsets, instead of
+                                         * the blocks, if not NULL */
+};
+
+struct offidx *offidx_new(void);
+struct offidx *offidx_new_arena(struct arena *arena);
+void offidx_free(struct offidx **idx);
+
+/* offidx_new_mapped():
+ * An index of the `count` big endian 64 bit offsets at `ptr`, which has to
+ * stay mapped for as long as the index is used. Nothing is copied, and
+ * nothing can be appended.
+ */
+struct offidx *offidx_new_mapped(const unsigned char *ptr, uint64_t count);
+
+/* offidx_reserve():
+ * Makes room for `n` offsets, guessing they take 16 bits each.
+ */
+void offidx_reserve(struct offidx *idx, uint64_t n);
+
+/* offidx_append():
+ * Appends an offset. Offsets are expected to be increasing, the index
+ * still works if they aren't, but takes more space.
+ */
+void offidx_append(struct offidx *idx, uint64_t n);
+
+/* offidx_seal():
+ * Encodes the last block, if it isn't full, and gives back the memory
+ * that isn't needed, once all the offsets are in. Appending to the index
+ * afterwards is still fine.
+ */
+void offidx_seal(struct offidx *idx);
+
+/* offidx_bytes():
+ * The memory used by the index.
+ */
+size_t offidx_bytes(const struct offidx *idx);
+
+typedef int (*offidx_foreach_cb_t)(void *data, uint64_t offset);
+int offidx_foreach(const struct offidx *idx, offidx_foreach_cb_t cb,
+                   void *cbdata);
+
+static inline uint64_t offidx_count(const struct offidx *idx)
+{
+        return idx->count;
+}
+
+/* offidx_get():
+ * The offset at `i`, 0 if `i` is past the end.
+ */
+static inline uint64_t offidx_get(const struct offidx *idx, uint64_t i)
+{
+        const struct offidx_block *blk;
+        const unsigned char *p;
+        uint64_t b = i >> OFFIDX_BLOCK_SHIFT;
+        unsigned int j = i & (OFFIDX_BLOCK_SIZE - 1);
+
+        if (i >= idx->count)
+                return 0;
+
+        if (idx->mapped)
+                return ntoh64(((const uint64_t *)idx->mapped)[i]);
+
+        if (b >= idx->nblocks)
+                return idx->tail[j];
+
+        blk = &idx->blocks[b];
+        p = idx->data + (blk->pos & ~7ULL);
+
+        switch (blk->pos & 7) {
+        case 1:
+                return blk->base + ((const uint16_t *)p)[j];
+        case 2:
+                return blk->base + ((const uint32_t *)p)[j];
+        default:
+                return blk->base + ((const uint64_t *)p)[j];
+        }
+}
+
+CPP_GUARD_END
+
+#endif  /* _OFFIDX_H_ */
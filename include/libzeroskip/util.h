@@ -287,6 +287,41 @@ static inline int memcmp_raw(const void *s1, size_t l1,
         return ret;
 }
 
+/* memcmp_raw_from():
+ * Same as memcmp_raw(), for keys known to start with the same `skip` bytes,
+ * which aren't compared again. The number of bytes they do start with is
+ * put in `*lcp`, for a binary search to skip the bytes all the keys left
+ * between its bounds share.
+ */
+static inline int memcmp_raw_from(const void *s1, size_t l1,
+                                  const void *s2, size_t l2,
+                                  size_t skip, size_t *lcp)
+{
+        const unsigned char *p1 = s1, *p2 = s2;
+        size_t min = l1 < l2 ? l1 : l2;
+        size_t i = skip < min ? skip : min;
+
+        /* A word at a time, up to the one they differ in */
+        while (i + sizeof(uint64_t) <= min) {
+                uint64_t w1, w2;
+
+                memcpy(&w1, p1 + i, sizeof(w1));
+                memcpy(&w2, p2 + i, sizeof(w2));
+                if (w1 != w2)
+                        break;
+                i += sizeof(uint64_t);
+        }
+
+        while (i < min && p1[i] == p2[i])
+                i++;
+
+        *lcp = i;
+        if (i < min)
+                return p1[i] < p2[i] ? -1 : 1;
+
+        return (l1 > l2) - (l1 < l2);
+}
+
 static inline int memcmp_mboxlist(const void *s1, size_t l1,
                                   const void *s2, size_t l2)
 {
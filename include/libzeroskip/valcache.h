@@ -0,0 +1,137 @@
+/*
+ * valcache.h
+ *
+ * Cache of the values of the keys looked up most often, so that the hot
+ * ones are found without going through the in-memory trees and the packed
+ * files. The values are copies, in a budget of bytes. Entries are evicted
+ * in CLOCK order, and a new value only gets in if its key has been looked
+ * up more often than those of the entries it would evict, as counted by a
+ * count-min sketch (TinyLFU). The counts are halved every so often, for the
+ * keys that were hot a while ago to give way to those hot now.
+ *
+ * Entries that are evicted, removed or invalidated are only freed by
+ * valcache_reclaim(), so that the values handed out stay good until then,
+ * whoever else uses the cache. The cache has a lock of its own, and can be
+ * used from any number of threads.
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#ifndef _VALCACHE_H_
+#define _VALCACHE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <libzeroskip/htable.h>
+#include <libzeroskip/macros.h>
+
+CPP_GUARD_START
+
+#define VALCACHE_SKETCH_ROWS    4
+#define VALCACHE_SKETCH_MAX     15      /* Counts saturate there */
+
+struct valcache_entry {
+        struct htable_entry entry;
+        uint64_t hash;
+        const unsigned char *key;       /* Right after the entry, as is */
+        size_t keylen;
+        const unsigned char *val;       /* ..the value, after the key */
+        size_t vallen;
+        size_t slot;                    /* In the clock */
+        int ref;                        /* Hit since the hand went by */
+        struct valcache_entry *next;    /* When retired */
+};
+
+struct valcache_stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t admitted;              /* Values put in */
+        uint64_t rejected;              /* ..and turned away */
+        uint64_t evicted;
+        uint64_t invalidated;           /* Removed by writes */
+        size_t entries;
+        size_t bytes;                   /* Of the entries, and retired ones */
+        size_t budget;
+};
+
+struct valcache {
+        pthread_mutex_t lock;
+        struct htable table;
+        size_t budget;
+        size_t bytes;
+
+        /* The entries, in a ring the hand goes round */
+        struct valcache_entry **clock;
+        size_t nclock;
+        size_t alloc;
+        size_t hand;
+
+        /* The admission filter */
+        uint8_t *sketch;
+        uint64_t width;                 /* Counters per row, a power of 2 */
+        uint64_t additions;             /* ..since the counts were halved */
+
+        struct valcache_entry *retired;
+        size_t retiredbytes;
+        uint64_t generation;
+
+        struct valcache_stats stats;
+};
+
+/* valcache_new():
+ * A cache of at most `budget` bytes of entries.
+ */
+struct valcache *valcache_new(size_t budget);
+void valcache_free(struct valcache **cache);
+
+/* valcache_get():
+ * 1 with the cached value of `key`, whose bloom_hash() is `hash`, in
+ * `value` and `vallen`, 0 if it isn't cached. Either way, the key is
+ * counted as looked up once more.
+ */
+int valcache_get(struct valcache *cache, const unsigned char *key,
+                 size_t keylen, uint64_t hash, const unsigned char **value,
+                 size_t *vallen);
+
+/* valcache_put():
+ * Offers a copy of `value` for `key`, just looked up with valcache_get().
+ * Returns 1 if it was put in the cache, 0 if it wasn't admitted.
+ */
+int valcache_put(struct valcache *cache, const unsigned char *key,
+                 size_t keylen, uint64_t hash, const unsigned char *value,
+                 size_t vallen);
+
+/* valcache_remove():
+ * Drops the value of `key`, which is changing.
+ */
+void valcache_remove(struct valcache *cache, const unsigned char *key,
+                     size_t keylen, uint64_t hash);
+
+/* valcache_sync():
+ * Drops all the values, if `generation` isn't the one of the last call.
+ */
+void valcache_sync(struct valcache *cache, uint64_t generation);
+
+/* valcache_reclaim():
+ * Frees the entries that were dropped. The values they had must no longer
+ * be used.
+ */
+void valcache_reclaim(struct valcache *cache);
+
+/* valcache_drop():
+ * Evicts all the values and frees them, for the memory. As with
+ * valcache_reclaim(), none of the values handed out must be in use.
+ */
+void valcache_drop(struct valcache *cache);
+
+void valcache_get_stats(struct valcache *cache, struct valcache_stats *stats);
+
+CPP_GUARD_END
+
+#endif  /* _VALCACHE_H_ */
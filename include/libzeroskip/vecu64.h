@@ -18,16 +18,24 @@
 
 CPP_GUARD_START
 
+struct arena;
+
 struct vecu64 {
         uint64_t alloc;
         uint64_t count;
         uint64_t *data;
+        struct arena *arena;    /* `data` is allocated from, if not NULL */
 };
 
-#define VECU64_INIT { 0, 0, NULL }
+#define VECU64_INIT { 0, 0, NULL, NULL }
 
 struct vecu64 *vecu64_new(void);
+struct vecu64 *vecu64_new_arena(struct arena *arena);
 void vecu64_free(struct vecu64 **v);
+/* vecu64_reserve():
+ * Makes room for `n` elements in one go.
+ */
+void vecu64_reserve(struct vecu64 *v, uint64_t n);
 uint64_t vecu64_append(struct vecu64 *v, uint64_t n);
 void vecu64_insert(struct vecu64 *v, uint64_t idx, uint64_t n);
 uint64_t vecu64_remove(struct vecu64 *v, uint64_t idx);
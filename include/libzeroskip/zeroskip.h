@@ -25,6 +25,18 @@ typedef enum {
 #define MODE_RDWR         0           /* Open for reading/writing */
 #define MODE_CREATE       1           /* Mode for creating */
 #define MODE_CUSTOMSEARCH 2           /* Use custom search function */
+#define MODE_THREADED     4           /* Handle is shared between threads */
+#define MODE_CHECKPOINT   8           /* Checkpoint on finalise and close */
+#define MODE_HUGEPAGES    16          /* Memtrees on huge pages */
+
+/* With MODE_THREADED, zsdb_fetch() may run concurrently in any number of
+ * threads, everything else is serialised. Writers in different threads take
+ * turns through zsdb_write_lock_acquire(). The key/value pointers handed out
+ * point into the DB and are valid only until the next write, from any thread.
+ * Packed files too big to be mapped whole are mapped in windows, and those
+ * dropped stay mapped until then too, or until zsdb_reclaim().
+ * zsdb_fetch_pinned() is for values to be kept past that.
+ */
 
 /* Return codes */
 enum {
@@ -73,11 +85,66 @@ typedef int zsdb_foreach_cb(void *data,
 typedef int (*zsdb_cmp_fn)(const unsigned char *s1, size_t l1,
                            const unsigned char *s2, size_t l2);
 
+/*
+ * Memory used by a DB handle, see zsdb_memory_usage()
+ */
+struct zsdb_memory_usage {
+        size_t memtree;             /* Records and nodes of the active records */
+        size_t fmemtree;            /* ..and of the finalised records */
+        size_t frozen;              /* ..and of the frozen records */
+        size_t index;               /* Packed file indexes */
+        size_t iterators;           /* Open iterators */
+        size_t niterators;          /* Number of open iterators */
+        size_t valcache;            /* The value cache */
+        size_t heap;                /* All of the above */
+        size_t arena;               /* Mapped for the records and nodes,
+                                     * with MODE_HUGEPAGES */
+        size_t arena_hugetlb;       /* ..of which on MAP_HUGETLB pages */
+
+        size_t mapped_active;       /* Mapped bytes, per file class */
+        size_t mapped_finalised;
+        size_t mapped_packed;
+        size_t mapped;              /* All of the above */
+        size_t resident;            /* The mapped bytes resident in memory */
+};
+
+struct zsdb_value_cache_stats {
+        uint64_t hits;              /* Lookups answered by the cache */
+        uint64_t misses;
+        uint64_t admitted;          /* Values put in the cache */
+        uint64_t rejected;          /* ..and turned away, as less looked up
+                                     * than those they would replace */
+        uint64_t evicted;
+        uint64_t invalidated;       /* Dropped by writes and reloads */
+        size_t entries;
+        size_t bytes;               /* Held, with those dropped and not yet
+                                     * freed */
+        size_t budget;
+};
+
+struct zsdb_process_memory_usage {
+        size_t limit;               /* The process budget, 0 for none */
+        size_t used;                /* Memtrees, indexes and value caches of
+                                     * all open DBs */
+        size_t ndbs;                /* Number of open DBs */
+        uint64_t evictions;         /* DBs flushed to keep to the budget */
+};
+
+/* A value that stays good until it is released, whatever happens to the
+ * DB in the meantime */
+struct zsdb_value {
+        const unsigned char *val;
+        size_t vallen;
+        unsigned int refs;          /* Private */
+        void *map;                  /* ..the mapping `val` is in, if any */
+        size_t maplen;
+};
+
 /*
  * The main Zeroskip structure
  */
 struct zsdb {
-        struct zsdb_iter *iter;     /* All open iterators */
+        struct zsdb_iter *iter;     /* Unused */
         unsigned int numtrans;      /* Total number of open transactions */
         void *priv;                 /* Private */
 };
@@ -99,6 +166,49 @@ extern int zsdb_commit(struct zsdb *db, struct zsdb_txn **txn);
 extern int zsdb_fetch(struct zsdb *db, const unsigned char *key, size_t keylen,
                       const unsigned char **value, size_t *vallen,
                       struct zsdb_txn **txn);
+
+/* zsdb_fetch_multi():
+ * zsdb_fetch() of `nkeys` keys at once. The keys are looked up in order,
+ * whatever order they are passed in, so that each of the in-memory trees
+ * and packed files is gone through once, from one key to the next, rather
+ * than from the start for every key. For each key, `results` gets ZS_OK,
+ * with its value in `values` and `vallens`, or ZS_NOTFOUND. Returns ZS_OK
+ * unless the lookups couldn't be done at all.
+ */
+extern int zsdb_fetch_multi(struct zsdb *db, size_t nkeys,
+                            const unsigned char **keys, const size_t *keylens,
+                            const unsigned char **values, size_t *vallens,
+                            int *results);
+
+/* zsdb_fetch_pinned():
+ * zsdb_fetch(), with the value in `value`, which stays good until it is
+ * released, through writes, reloads and repacks alike, and even after the
+ * DB is closed. Values of packed files, of at least ZSDB_PIN_MAP_MIN bytes,
+ * get a mapping of their own, of the file they are in, so they aren't
+ * copied; those of the records in memory, and smaller ones, are copied.
+ */
+#define ZSDB_PIN_MAP_MIN (16 * 1024)
+
+extern int zsdb_fetch_pinned(struct zsdb *db, const unsigned char *key,
+                             size_t keylen, struct zsdb_value **value,
+                             struct zsdb_txn **txn);
+
+/* zsdb_value_ref(), zsdb_value_release():
+ * Take another reference on `value`, for another user of it, and drop one.
+ * The value goes away when the last is dropped. Both can be called from any
+ * thread.
+ */
+extern struct zsdb_value *zsdb_value_ref(struct zsdb_value *value);
+extern void zsdb_value_release(struct zsdb_value **value);
+
+/* zsdb_may_contain():
+ * 0 if `key` is surely not in the DB, 1 if it might be, without reading
+ * any records of the packed files: their smallest and largest keys, and
+ * their filters, are all that's looked at.
+ */
+extern int zsdb_may_contain(struct zsdb *db, const unsigned char *key,
+                            size_t keylen);
+
 extern int zsdb_fetchnext(struct zsdb *db,
                           const unsigned char *key, size_t keylen,
                           const unsigned char **found, size_t *foundlen,
@@ -118,6 +228,109 @@ extern int zsdb_repack(struct zsdb *db);
 extern int zsdb_info(struct zsdb *db);
 extern int zsdb_finalise(struct zsdb *db);
 
+/* zsdb_checkpoint():
+ * Save the in-memory records to a checkpoint file in the DB directory, so
+ * the next open reads them from there, and replays only what has been
+ * added to the active file since. A checkpoint left behind by a finalise
+ * or a pack is ignored. Needs the write lock, and fails with ZS_AGAIN while
+ * there are uncommitted changes. With MODE_CHECKPOINT, this is done on
+ * every finalise and on close.
+ */
+extern int zsdb_checkpoint(struct zsdb *db);
+
+/* zsdb_set_memory_budget():
+ * Limit the memory held by the in-memory trees, packed file indexes and
+ * value cache of the DB to `bytes`, 0 removes the limit. Once a commit
+ * leaves the DB over budget, the value cache is emptied, and if that isn't
+ * enough, the in-memory records are flushed to a packed file; in the
+ * background for MODE_THREADED handles, otherwise right away, by the
+ * committing writer.
+ */
+extern int zsdb_set_memory_budget(struct zsdb *db, size_t bytes);
+
+/* zsdb_set_filter():
+ * The packed files written from now on get a bloom filter of their keys,
+ * with `bitsperkey` bits for each, 10 by default, or none if 0. With a
+ * `prefixlen`, the first `prefixlen` bytes of the keys go in too, so that
+ * zsdb_foreach() with a prefix at least as long skips the files without
+ * it. Filters aren't written for DBs with their own comparison function.
+ */
+extern int zsdb_set_filter(struct zsdb *db, unsigned int bitsperkey,
+                           size_t prefixlen);
+
+/* zsdb_set_packed_version():
+ * The format of the packed files written from now on. Version 1, the
+ * default, has an entry per record in the index kept in memory. Version 2
+ * has the records in blocks, with an index per block, and only an entry
+ * per block kept in memory. Older versions of the library can't read
+ * version 2 files: they don't check the version, and crash on them.
+ */
+extern int zsdb_set_packed_version(struct zsdb *db, unsigned int version);
+
+/* zsdb_set_hash_index():
+ * With `enable`, the packed files written from now on get a hash table of
+ * their keys, for zsdb_fetch() to find a key in one of them with a probe or
+ * two rather than a binary search, for 10 or so more bytes a key. Off by
+ * default; the iterators still go through the sorted index, and it isn't
+ * written for DBs with their own comparison function.
+ */
+extern int zsdb_set_hash_index(struct zsdb *db, int enable);
+
+/* zsdb_set_value_cache():
+ * Cache the values zsdb_fetch() finds, in up to `bytes` of memory, so that
+ * the keys looked up most often are found without going through the
+ * records in memory and the packed files. 0, the default, turns the cache
+ * off. A value only gets in over those already cached if it is looked up
+ * more often. The cached values are dropped as their keys are written to,
+ * and all of them when the files of the DB change, and those dropped are
+ * only freed at the next commit, for the values handed out to stay good
+ * until then. The cache counts against the memory budgets, which empty it
+ * first. It goes away when the DB is closed.
+ */
+extern int zsdb_set_value_cache(struct zsdb *db, size_t bytes);
+
+/* zsdb_value_cache_stats():
+ * Fill in `stats` for the value cache of the DB, all 0 without one. The
+ * hit ratio is hits / (hits + misses).
+ */
+extern int zsdb_value_cache_stats(struct zsdb *db,
+                                  struct zsdb_value_cache_stats *stats);
+
+/* zsdb_memory_usage():
+ * Fill in `usage` with the memory used by the DB handle. The heap memory is
+ * accounted as it is allocated, the resident bytes are found with mincore(),
+ * which walks the page tables of all the mapped files.
+ */
+extern int zsdb_memory_usage(struct zsdb *db, struct zsdb_memory_usage *usage);
+
+/* zsdb_reclaim():
+ * Frees what the DB keeps for the keys and values it handed out: the
+ * windows the packed files have dropped, and the values dropped from the
+ * value cache. Commits do this on their own, this is for handles that only
+ * read, once none of the keys and values they were handed out are in use.
+ * Fails with ZS_AGAIN while an iterator is open.
+ */
+extern int zsdb_reclaim(struct zsdb *db);
+
+/* zsdb_set_process_memory_budget():
+ * Limit the memory held by the in-memory trees, packed file indexes and
+ * value caches of all the DBs open in the process to `bytes`, 0 removes the
+ * limit. Once a commit leaves the process over budget, the least recently
+ * used DBs are flushed to packed files, their value caches emptied, and the
+ * pages of their files dropped, until it is back under 3/4 of the budget.
+ * DBs that are busy, in a transaction or iterating, or locked by another
+ * thread, are skipped. So are DBs without MODE_THREADED opened in another
+ * thread, as those aren't safe to touch from the committing thread. The per
+ * DB budgets apply as well.
+ */
+extern int zsdb_set_process_memory_budget(size_t bytes);
+
+/* zsdb_process_memory_usage():
+ * Fill in `usage` for the process. The memory of each DB is as accounted at
+ * its last commit, flush or open.
+ */
+extern int zsdb_process_memory_usage(struct zsdb_process_memory_usage *usage);
+
 extern int zsdb_transaction_begin(struct zsdb *db, struct zsdb_txn **txn);
 extern void zsdb_transaction_end(struct zsdb_txn **txn);
 
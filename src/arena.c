@@ -0,0 +1,300 @@
+/*
+ * arena.c
+ *
+ * Size class allocator on top of 2MB chunks, optionally huge page backed.
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <libzeroskip/arena.h>
+#include <libzeroskip/log.h>
+#include <libzeroskip/util.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* Keeps the allocations after the chunk headers 16 byte aligned */
+#define ARENA_HDR_SIZE 64
+
+/**
+ * Private functions
+ */
+
+/* size_class():
+ * The size class of `size`, ARENA_NUM_CLASSES if it is too large for one.
+ */
+static inline unsigned int size_class(size_t size)
+{
+        unsigned int c;
+
+        if (size <= ARENA_SMALL_MAX)
+                return size ? (size - 1) / 16 : 0;
+
+        if (size > ARENA_MEDIUM_MAX)
+                return ARENA_NUM_CLASSES;
+
+        /* 1K, 2K, ... 256K */
+        for (c = 0; (1024UL << c) < size; c++)
+                ;
+
+        return ARENA_SMALL_MAX / 16 + c;
+}
+
+static inline size_t class_size(unsigned int c)
+{
+        if (c < ARENA_SMALL_MAX / 16)
+                return (c + 1) * 16;
+
+        return 1024UL << (c - ARENA_SMALL_MAX / 16);
+}
+
+static inline size_t large_size(size_t size)
+{
+        size += ARENA_HDR_SIZE;
+
+        return (size + ARENA_CHUNK_SIZE - 1) & ~(ARENA_CHUNK_SIZE - 1);
+}
+
+/* arena_map():
+ * Maps `size` bytes, a multiple of ARENA_CHUNK_SIZE, aligned to it.
+ */
+static void *arena_map(struct arena *arena, size_t size, int *huge)
+{
+        unsigned char *p;
+        size_t lead;
+
+        *huge = 0;
+
+#ifdef MAP_HUGETLB
+        if ((arena->flags & ARENA_HUGEPAGES) && !arena->nohugetlb) {
+                p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                if (p != MAP_FAILED) {
+                        *huge = 1;
+                        return p;
+                }
+
+                zslog(LOGDEBUG, "No huge pages, falling back to madvise().\n");
+                arena->nohugetlb = 1;
+        }
+#endif
+
+        /* Map a chunk more than needed, and trim it to a chunk boundary */
+        p = mmap(NULL, size + ARENA_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+                fprintf(stderr, "Out of memory. mmap failed.\n");
+                exit(EXIT_FAILURE);
+        }
+
+        lead = (ARENA_CHUNK_SIZE - ((uintptr_t)p & (ARENA_CHUNK_SIZE - 1))) &
+                (ARENA_CHUNK_SIZE - 1);
+        if (lead)
+                munmap(p, lead);
+        munmap(p + lead + size, ARENA_CHUNK_SIZE - lead);
+        p += lead;
+
+#ifdef MADV_HUGEPAGE
+        if (arena->flags & ARENA_HUGEPAGES)
+                madvise(p, size, MADV_HUGEPAGE);
+#endif
+
+        return p;
+}
+
+static struct arena_chunk *arena_chunk_new(struct arena *arena, size_t size,
+                                           struct arena_chunk **list)
+{
+        struct arena_chunk *chunk;
+        int huge;
+
+        chunk = arena_map(arena, size, &huge);
+        chunk->size = size;
+        chunk->huge = huge;
+
+        chunk->prev = NULL;
+        chunk->next = *list;
+        if (*list)
+                (*list)->prev = chunk;
+        *list = chunk;
+
+        arena->mapped += size;
+        if (huge)
+                arena->hugetlb += size;
+
+        return chunk;
+}
+
+static void arena_chunk_free(struct arena *arena, struct arena_chunk *chunk,
+                             struct arena_chunk **list)
+{
+        if (chunk->prev)
+                chunk->prev->next = chunk->next;
+        else
+                *list = chunk->next;
+        if (chunk->next)
+                chunk->next->prev = chunk->prev;
+
+        arena->mapped -= chunk->size;
+        if (chunk->huge)
+                arena->hugetlb -= chunk->size;
+
+        munmap(chunk, chunk->size);
+}
+
+/* arena_spill():
+ * Hands what is left of the last chunk to the free lists, before moving on
+ * to a new one.
+ */
+static void arena_spill(struct arena *arena)
+{
+        while (arena->left >= 16) {
+                unsigned int c = size_class(arena->left);
+                size_t csize = class_size(c);
+
+                if (csize > arena->left)
+                        csize = class_size(--c);
+
+                *(void **)arena->next = arena->freelist[c];
+                arena->freelist[c] = arena->next;
+
+                arena->next += csize;
+                arena->left -= csize;
+        }
+}
+
+/**
+ * Public functions
+ */
+struct arena *arena_new(int flags)
+{
+        struct arena *arena;
+
+        arena = xcalloc(1, sizeof(struct arena));
+        arena->flags = flags;
+
+        return arena;
+}
+
+void arena_destroy(struct arena **arenap)
+{
+        struct arena *arena;
+
+        if (!arenap || !*arenap)
+                return;
+
+        arena = *arenap;
+        *arenap = NULL;
+
+        while (arena->chunks)
+                arena_chunk_free(arena, arena->chunks, &arena->chunks);
+
+        while (arena->large)
+                arena_chunk_free(arena, arena->large, &arena->large);
+
+        xfree(arena);
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+        unsigned int c;
+        size_t csize;
+        void *ptr;
+
+        if (!arena)
+                return xmalloc(size);
+
+        c = size_class(size);
+        if (c == ARENA_NUM_CLASSES) {
+                struct arena_chunk *chunk;
+
+                chunk = arena_chunk_new(arena, large_size(size),
+                                        &arena->large);
+
+                return (unsigned char *)chunk + ARENA_HDR_SIZE;
+        }
+
+        if (arena->freelist[c]) {
+                ptr = arena->freelist[c];
+                arena->freelist[c] = *(void **)ptr;
+                return ptr;
+        }
+
+        csize = class_size(c);
+        if (arena->left < csize) {
+                struct arena_chunk *chunk;
+
+                arena_spill(arena);
+
+                chunk = arena_chunk_new(arena, ARENA_CHUNK_SIZE,
+                                        &arena->chunks);
+                arena->next = (unsigned char *)chunk + ARENA_HDR_SIZE;
+                arena->left = ARENA_CHUNK_SIZE - ARENA_HDR_SIZE;
+        }
+
+        ptr = arena->next;
+        arena->next += csize;
+        arena->left -= csize;
+
+        return ptr;
+}
+
+void arena_release(struct arena *arena, void *ptr, size_t size)
+{
+        unsigned int c;
+
+        if (!ptr)
+                return;
+
+        if (!arena) {
+                xfree(ptr);
+                return;
+        }
+
+        c = size_class(size);
+        if (c == ARENA_NUM_CLASSES) {
+                struct arena_chunk *chunk;
+
+                chunk = (void *)((unsigned char *)ptr - ARENA_HDR_SIZE);
+                arena_chunk_free(arena, chunk, &arena->large);
+                return;
+        }
+
+        *(void **)ptr = arena->freelist[c];
+        arena->freelist[c] = ptr;
+}
+
+void *arena_realloc(struct arena *arena, void *ptr, size_t oldsize,
+                    size_t newsize)
+{
+        unsigned int oldc, newc;
+        void *newptr;
+
+        if (!arena)
+                return xrealloc(ptr, newsize);
+
+        if (!ptr)
+                return arena_alloc(arena, newsize);
+
+        oldc = size_class(oldsize);
+        newc = size_class(newsize);
+        if (oldc == newc && (oldc != ARENA_NUM_CLASSES ||
+                             large_size(oldsize) == large_size(newsize)))
+                return ptr;
+
+        newptr = arena_alloc(arena, newsize);
+        memcpy(newptr, ptr, oldsize < newsize ? oldsize : newsize);
+        arena_release(arena, ptr, oldsize);
+
+        return newptr;
+}
@@ -0,0 +1,135 @@
+/*
+ * bloom.c
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <libzeroskip/bloom.h>
+#include <libzeroskip/util.h>
+
+#include <string.h>
+
+#define HASH_SEED  ((uint64_t) 0x9e3779b97f4a7c15ULL)
+#define HASH_C1    ((uint64_t) 0x87c37b91114253d5ULL)
+#define HASH_C2    ((uint64_t) 0x4cf5ad432745937fULL)
+
+/**
+ * Private functions
+ */
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+        return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash_word(uint64_t w)
+{
+        w *= HASH_C1;
+        w = rotl64(w, 31);
+        return w * HASH_C2;
+}
+
+static inline uint64_t hash_final(uint64_t h)
+{
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+
+        return h;
+}
+
+/**
+ * Public functions
+ */
+uint64_t bloom_hash(const void *buf, size_t len)
+{
+        const unsigned char *ptr = buf;
+        uint64_t hash = HASH_SEED ^ len;
+        uint64_t w;
+
+        while (len >= sizeof(w)) {
+                memcpy(&w, ptr, sizeof(w));
+                hash = rotl64(hash ^ hash_word(ntoh64(w)), 27) * 5 +
+                        0x52dce729;
+                ptr += sizeof(w);
+                len -= sizeof(w);
+        }
+
+        if (len) {
+                w = 0;
+                while (len--)
+                        w = (w << 8) | *ptr++;
+                hash ^= hash_word(w);
+        }
+
+        return hash_final(hash);
+}
+
+struct bloom *bloom_new(uint64_t n, unsigned int bitsperkey)
+{
+        struct bloom *bloom;
+        uint64_t nbits;
+
+        bloom = xcalloc(1, sizeof(struct bloom));
+
+        /* k = ln(2) * bits per key is the least false positives */
+        bloom->k = (bitsperkey * 69 + 50) / 100;
+        if (bloom->k < 1)
+                bloom->k = 1;
+        if (bloom->k > BLOOM_MAX_K)
+                bloom->k = BLOOM_MAX_K;
+
+        nbits = st_mult(n ? n : 1, bitsperkey ? bitsperkey : 1);
+        bloom->nblocks = (nbits + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS;
+        bloom->data = xcalloc(bloom->nblocks, BLOOM_BLOCK_BYTES);
+        bloom->bits = bloom->data;
+
+        return bloom;
+}
+
+struct bloom *bloom_new_mapped(const unsigned char *bits, uint64_t nblocks,
+                               unsigned int k)
+{
+        struct bloom *bloom;
+
+        bloom = xcalloc(1, sizeof(struct bloom));
+        bloom->bits = bits;
+        bloom->nblocks = nblocks;
+        bloom->k = k;
+
+        return bloom;
+}
+
+void bloom_free(struct bloom **bloomp)
+{
+        struct bloom *bloom;
+
+        if (!bloomp || !*bloomp)
+                return;
+
+        bloom = *bloomp;
+        *bloomp = NULL;
+
+        xfree(bloom->data);
+        xfree(bloom);
+}
+
+void bloom_add(struct bloom *bloom, uint64_t hash)
+{
+        unsigned char *block = bloom->data + bloom_block(bloom, hash);
+        uint32_t h = (uint32_t)hash;
+        uint32_t delta = (h >> 17) | (h << 15);
+        unsigned int i;
+
+        for (i = 0; i < bloom->k; i++) {
+                uint32_t bit = h & (BLOOM_BLOCK_BITS - 1);
+
+                block[bit >> 3] |= 1 << (bit & 7);
+                h += delta;
+        }
+}
@@ -1,5 +1,5 @@
 /*
- * htable.h : A generic hash table implementation
+ * htable.c : A generic hash table implementation
  *
  * This file is part of zeroskip.
  *
@@ -7,15 +7,16 @@
  * it under the terms of the MIT license. See LICENSE for details.
  *
  */
-#include "htable.h"
+#include <libzeroskip/htable.h>
 #include <libzeroskip/util.h>
 
 #include <stdio.h>
 #include <string.h>
 #include <limits.h>
 
-#define FNV32_BASE  ((unsigned int) 0x811c9dc5)
-#define FNV32_PRIME ((unsigned int) 0x01000193)
+#define HASH_SEED  ((uint64_t) 0x9e3779b97f4a7c15ULL)
+#define HASH_C1    ((uint64_t) 0x87c37b91114253d5ULL)
+#define HASH_C2    ((uint64_t) 0x4cf5ad432745937fULL)
 
 #define HTABLE_INIT_SIZE        64
 #define HTABLE_RESIZE_BITS       2
@@ -30,10 +31,33 @@ static int default_cmp_fn(const void *data _unused_,
         return 0;
 }
 
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+        return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash_word(uint64_t w)
+{
+        w *= HASH_C1;
+        w = rotl64(w, 31);
+        return w * HASH_C2;
+}
+
+static inline uint64_t hash_final(uint64_t h)
+{
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+
+        return h;
+}
+
 static void alloc_htable(struct htable *ht, size_t size)
 {
         ht->size = size;
-        ht->table = xcalloc(size, sizeof(struct htable *));
+        ht->table = xcalloc(size, sizeof(struct htable_slot));
 
         ht->grow_mark = size * HTABLE_RESIZE_THRESHOLD / 100;
         if (size <= HTABLE_INIT_SIZE)
@@ -52,39 +76,108 @@ static inline int entries_equal(const struct htable *ht,
                  !ht->cmpfn(ht->cmpfndata, e1, e2, kdata));
 }
 
-static inline unsigned int bucket(const struct htable *ht,
-                                  const struct htable_entry *key)
+static inline size_t bucket(const struct htable *ht, unsigned int hash)
 {
-        return key->hash & (ht->size - 1);
+        return hash & (ht->size - 1);
 }
 
-static inline struct htable_entry **find_entry(const struct htable *ht,
-                                               const struct htable_entry *key,
-        const void *keydata)
+/* How far the entry in slot `pos` is from its bucket */
+static inline size_t distance(const struct htable *ht, size_t pos)
 {
-        struct htable_entry **e = &ht->table[bucket(ht, key)];
+        return (pos - bucket(ht, ht->table[pos].hash)) & (ht->size - 1);
+}
+
+/* find_slot():
+ *  the slot of the first entry matching `key`, ht->size if there is none.
+ * The table is never full, and entries are kept no further from their
+ * bucket than those they were placed before, so the probe ends at the first
+ * empty slot, or at an entry closer to its own bucket than `key` would be.
+ */
+static inline size_t find_slot(const struct htable *ht,
+                               const struct htable_entry *key,
+                               const void *keydata)
+{
+        size_t mask = ht->size - 1;
+        size_t pos = bucket(ht, key->hash);
+        size_t dist = 0;
+
+        for (;;) {
+                const struct htable_slot *s = &ht->table[pos];
 
-        while (*e && !entries_equal(ht, *e, key, keydata))
-                e = &(*e)->next;
+                if (!s->entry || distance(ht, pos) < dist)
+                        return ht->size;
 
-        return e;
+                if (s->hash == key->hash &&
+                    (s->entry == key ||
+                     !ht->cmpfn(ht->cmpfndata, s->entry, key, keydata)))
+                        return pos;
+
+                pos = (pos + 1) & mask;
+                dist++;
+        }
+}
+
+/* insert_entry():
+ *  Robin Hood insertion, the entry takes the slot of the first entry that is
+ * closer to its bucket, which then moves on looking for a slot of its own.
+ */
+static void insert_entry(struct htable *ht, struct htable_entry *entry)
+{
+        size_t mask = ht->size - 1;
+        struct htable_slot cur = { .hash = entry->hash, .entry = entry };
+        size_t pos = bucket(ht, cur.hash);
+        size_t dist = 0;
+
+        for (;;) {
+                struct htable_slot *s = &ht->table[pos];
+                size_t sdist;
+
+                if (!s->entry) {
+                        *s = cur;
+                        return;
+                }
+
+                sdist = distance(ht, pos);
+                if (sdist < dist) {
+                        struct htable_slot tmp = *s;
+                        *s = cur;
+                        cur = tmp;
+                        dist = sdist;
+                }
+
+                pos = (pos + 1) & mask;
+                dist++;
+        }
+}
+
+/* remove_slot():
+ *  empties slot `pos`, shifting the entries after it back by one, up to one
+ * that is already in its bucket, so that no probe stops early.
+ */
+static void remove_slot(struct htable *ht, size_t pos)
+{
+        size_t mask = ht->size - 1;
+        size_t next = (pos + 1) & mask;
+
+        while (ht->table[next].entry && distance(ht, next) > 0) {
+                ht->table[pos] = ht->table[next];
+                pos = next;
+                next = (next + 1) & mask;
+        }
+
+        ht->table[pos].entry = NULL;
+        ht->table[pos].hash = 0;
 }
 
 static void rehash(struct htable *ht, unsigned int newsize)
 {
         unsigned int i, oldsize = ht->size;
-        struct htable_entry **oldtable = ht->table;
+        struct htable_slot *oldtable = ht->table;
 
         alloc_htable(ht, newsize);
         for (i = 0; i < oldsize; i++) {
-                struct htable_entry *e = oldtable[i];
-                while (e) {
-                        struct htable_entry *n = e->next;
-                        unsigned int b = bucket(ht, e);
-                        e->next = ht->table[b];
-                        ht->table[b] = e;
-                        e = n;
-                }
+                if (oldtable[i].entry)
+                        insert_entry(ht, oldtable[i].entry);
         }
 
         free(oldtable);
@@ -93,15 +186,26 @@ static void rehash(struct htable *ht, unsigned int newsize)
 /* Public functions */
 unsigned int bufhash(const void *buf, size_t len)
 {
-        unsigned int hash = FNV32_BASE;
         const unsigned char *ptr = buf;
+        uint64_t hash = HASH_SEED ^ len;
+        uint64_t w;
+
+        while (len >= sizeof(w)) {
+                memcpy(&w, ptr, sizeof(w));
+                hash = rotl64(hash ^ hash_word(w), 27) * 5 + 0x52dce729;
+                ptr += sizeof(w);
+                len -= sizeof(w);
+        }
 
-        while (len--) {
-                unsigned int c = *ptr++;
-                hash = (hash * FNV32_PRIME) ^ c;
+        if (len) {
+                w = 0;
+                memcpy(&w, ptr, len);
+                hash ^= hash_word(w);
         }
 
-        return hash;
+        hash = hash_final(hash);
+
+        return (unsigned int)(hash ^ (hash >> 32));
 }
 
 void htable_init(struct htable *ht, htable_cmp_fn cmp_fn,
@@ -142,43 +246,58 @@ void htable_free(struct htable *ht, int free_entries)
 
 void *htable_get(const struct htable *ht, const void *key, const void *keydata)
 {
-        return *find_entry(ht, key, keydata);
+        size_t pos = find_slot(ht, key, keydata);
+
+        return pos < ht->size ? ht->table[pos].entry : NULL;
 }
 
 const void *htable_get_next(const struct htable *ht, const void *entry)
 {
-        const struct htable_entry *e = ((const struct htable_entry *) entry)->next;
-        for (; e; e = e->next)
-                if (entries_equal(ht, entry, e, NULL))
-                        return e;
+        const struct htable_entry *e = entry;
+        size_t mask = ht->size - 1;
+        size_t pos = bucket(ht, e->hash);
+        size_t dist = 0;
+        int found = 0;
 
-        return NULL;
+        /* Duplicates are further along the probe that leads to `entry` */
+        for (;;) {
+                const struct htable_slot *s = &ht->table[pos];
+
+                if (!s->entry || distance(ht, pos) < dist)
+                        return NULL;
+
+                if (found) {
+                        if (entries_equal(ht, e, s->entry, NULL))
+                                return s->entry;
+                } else if (s->entry == e) {
+                        found = 1;
+                }
+
+                pos = (pos + 1) & mask;
+                dist++;
+        }
 }
 
 void htable_put(struct htable *ht, void *entry)
 {
-        unsigned int b = bucket(ht, entry);
-
-        ((struct htable_entry *) entry)->next = ht->table[b];
-        ht->table[b] = entry;
-
         ht->count++;
-        if (ht->count < ht->shrink_mark)
+        if (ht->count > ht->grow_mark)
                 rehash(ht, ht->size << HTABLE_RESIZE_BITS);
+
+        insert_entry(ht, entry);
 }
 
 void *htable_remove(struct htable *ht, const void *key,
                     const void *keydata)
 {
         struct htable_entry *old;
-        struct htable_entry **e = find_entry(ht, key, keydata);
+        size_t pos = find_slot(ht, key, keydata);
 
-        if (!*e)
+        if (pos >= ht->size)
                 return NULL;
 
-        old = *e;
-        *e = old->next;
-        old->next = NULL;
+        old = ht->table[pos].entry;
+        remove_slot(ht, pos);
 
         ht->count--;
         if (ht->count < ht->shrink_mark)
@@ -199,22 +318,15 @@ void htable_iter_init(struct htable *ht, struct htable_iter *iter)
 {
         iter->ht = ht;
         iter->pos = 0;
-        iter->next = NULL;
 }
 
 void *htable_iter_next(struct htable_iter *iter)
 {
-        struct htable_entry *current = iter->next;
-
-        for (;;){
-                if (current) {
-                        iter->next = current->next;
-                        return current;
-                }
-
-                if (iter->pos >= iter->ht->size)
-                        return NULL;
-
-                current = iter->ht->table[iter->pos++];
+        while (iter->pos < iter->ht->size) {
+                struct htable_entry *e = iter->ht->table[iter->pos++].entry;
+                if (e)
+                        return e;
         }
+
+        return NULL;
 }
@@ -0,0 +1,185 @@
+/*
+ * keymodel.c
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <libzeroskip/keymodel.h>
+#include <libzeroskip/util.h>
+
+#include <float.h>
+
+/**
+ * Private functions
+ */
+
+/* end_segment():
+ * Picks the slope of the last segment, in the middle of those that keep
+ * all its keys close enough. A segment of one key is flat.
+ */
+static void end_segment(struct keymodel *model)
+{
+        struct keymodel_segment *seg;
+
+        if (!model->nsegs)
+                return;
+
+        seg = &model->segs[model->nsegs - 1];
+        if (model->slopehi == DBL_MAX)
+                seg->slope = 0;
+        else
+                seg->slope = (model->slopelo + model->slopehi) / 2;
+}
+
+static void begin_segment(struct keymodel *model, uint64_t key)
+{
+        struct keymodel_segment *seg;
+
+        end_segment(model);
+
+        ALLOC_GROW(model->segs, model->nsegs + 1, model->alloc);
+        seg = &model->segs[model->nsegs++];
+        seg->key = key;
+        seg->pos = model->count;
+        seg->slope = 0;
+
+        model->slopelo = 0;
+        model->slopehi = DBL_MAX;
+}
+
+/**
+ * Public functions
+ */
+struct keymodel *keymodel_new(uint64_t maxerror)
+{
+        struct keymodel *model;
+
+        model = xcalloc(1, sizeof(struct keymodel));
+        model->maxerror = maxerror;
+
+        return model;
+}
+
+void keymodel_free(struct keymodel **modelp)
+{
+        struct keymodel *model;
+
+        if (!modelp || !*modelp)
+                return;
+
+        model = *modelp;
+        *modelp = NULL;
+
+        xfree(model->segs);
+        xfree(model);
+}
+
+void keymodel_add(struct keymodel *model, uint64_t key)
+{
+        const struct keymodel_segment *seg;
+        double dx, dy, slope;
+
+        if (model->count && key <= model->lastkey) {
+                if (key < model->lastkey)
+                        model->unordered = 1;
+                if (++model->dups > model->maxdups)
+                        model->maxdups = model->dups;
+                model->count++;
+                return;
+        }
+
+        model->dups = 0;
+        model->lastkey = key;
+
+        if (!model->nsegs) {
+                begin_segment(model, key);
+                model->count++;
+                return;
+        }
+
+        /* The key stays in the segment if the line to it is one of the
+         * slopes the segment can still have, which then narrow to those
+         * that put it close enough too */
+        seg = &model->segs[model->nsegs - 1];
+        dx = (double)(key - seg->key);
+        dy = (double)(model->count - seg->pos);
+        slope = dy / dx;
+
+        if (slope < model->slopelo || slope > model->slopehi) {
+                begin_segment(model, key);
+        } else {
+                double lo = (dy - model->maxerror) / dx;
+                double hi = (dy + model->maxerror) / dx;
+
+                if (lo > model->slopelo)
+                        model->slopelo = lo;
+                if (hi < model->slopehi)
+                        model->slopehi = hi;
+        }
+
+        model->count++;
+}
+
+void keymodel_seal(struct keymodel *model)
+{
+        end_segment(model);
+
+        if (model->nsegs && model->alloc > model->nsegs) {
+                REALLOC_ARRAY(model->segs, model->nsegs);
+                model->alloc = model->nsegs;
+        }
+}
+
+void keymodel_window(const struct keymodel *model, uint64_t key,
+                     uint64_t *lo, uint64_t *hi)
+{
+        const struct keymodel_segment *seg;
+        uint64_t l = 0, h = model->nsegs, pos, limit, margin;
+        double pred;
+
+        if (model->unordered || !model->nsegs) {
+                *lo = 0;
+                *hi = model->count;
+                return;
+        }
+
+        /* The last segment that doesn't start after `key` */
+        while (h - l > 1) {
+                uint64_t m = l + (h - l) / 2;
+
+                if (model->segs[m].key <= key)
+                        l = m;
+                else
+                        h = m;
+        }
+
+        seg = &model->segs[l];
+        limit = l + 1 < model->nsegs ? model->segs[l + 1].pos : model->count;
+
+        if (key < seg->key) {
+                pos = 0;
+        } else {
+                /* Past its last key, the line of a segment is no good
+                 * after where the next one starts */
+                pred = seg->pos + seg->slope * (double)(key - seg->key);
+                pos = pred < (double)limit ? (uint64_t)pred : limit;
+        }
+
+        /* The keys are within `maxerror` of the line, the keys added more
+         * than once can be that many places further, and the line is
+         * rounded */
+        margin = model->maxerror + 1;
+        *lo = pos > margin ? pos - margin : 0;
+        margin += model->maxdups + 1;
+        *hi = model->count - pos > margin ? pos + margin : model->count;
+}
+
+size_t keymodel_bytes(const struct keymodel *model)
+{
+        return sizeof(struct keymodel) +
+                model->alloc * sizeof(struct keymodel_segment);
+}
@@ -9,6 +9,7 @@
  * it under the terms of the MIT license. See LICENSE for details.
  *
  */
+#include <libzeroskip/arena.h>
 #include <libzeroskip/memtree.h>
 #include <libzeroskip/util.h>
 
@@ -25,15 +26,6 @@
 
 static int nodecount = 0;
 
-static void print_rec_entry(unsigned char *d, size_t l)
-{
-        size_t i;
-        for (i = 0; i < l; i++)
-                printf("%c", d[i]);
-        printf("\n");
-
-}
-
 /* memtree_ascend()
  *  returns 0 - if iter->node does not have a parent
  *  returns 1 - if iter->node has a parent and ascends
@@ -53,20 +45,150 @@ static inline int memtree_ascend(memtree_iter_t iter)
         return ret;
 }
 
-static struct memtree_node *memtree_node_alloc(enum NodeType type)
+static inline size_t memtree_node_size(enum NodeType type)
 {
-        struct memtree_node *node = NULL;
         size_t nsize;
 
         nsize = (type == INTERNAL_NODE) ?
-                sizeof(struct memtree_node) * (MEMTREE_MAX_ELEMENTS + 1) :
+                sizeof(struct memtree_node *) * (MEMTREE_MAX_ELEMENTS + 1) :
                 0;
 
-        node = xmalloc(sizeof(struct memtree_node) + nsize);
+        return sizeof(struct memtree_node) + nsize;
+}
+
+static inline size_t record_size(const struct record *rec)
+{
+        /* key and val are allocated with an extra byte */
+        return sizeof(struct record) + rec->keylen + rec->vallen + 2;
+}
+
+/* node_update_prefix()
+ * Recomputes the length of the prefix shared by the keys in `node`. The
+ * keys are sorted, so that is the prefix the first and the last key share.
+ */
+static void node_update_prefix(struct memtree_node *node)
+{
+        const struct record *first, *last;
+        size_t i, len;
+
+        node->prefixlen = 0;
+
+        if (node->count < 2)
+                return;
+
+        first = node->recs[0];
+        last = node->recs[node->count - 1];
+
+        len = first->keylen < last->keylen ? first->keylen : last->keylen;
+        if (len > UINT32_MAX)
+                len = UINT32_MAX;
+
+        for (i = 0; i < len && first->key[i] == last->key[i]; i++)
+                ;
+
+        node->prefixlen = i;
+}
+
+/* node_changed()
+ * To be called whenever the records of `node` change. Bumps the version of
+ * the node, for iterators parked on it to notice, see memtree_next().
+ */
+static void node_changed(struct memtree_node *node)
+{
+        node->version++;
+        node_update_prefix(node);
+}
+
+/* memtree_memcmp_raw_from()
+ * Same as memtree_memcmp_raw(), for records which are known to share the
+ * first `skip` bytes of their keys with `key`. The records between the
+ * bounds of the search share with `key` the bytes it shares with both of
+ * the bounds, so each comparison starts after those.
+ */
+static unsigned int memtree_memcmp_raw_from(const unsigned char *key,
+                                            size_t keylen,
+                                            struct record **recs,
+                                            unsigned int count,
+                                            size_t skip, int *found)
+{
+        unsigned int start = 0;
+        size_t lcplo = skip, lcphi = skip;
+
+        while (count) {
+                unsigned int middle = count >> 1;
+                unsigned int pos = start + middle;
+                size_t lcp;
+                int c;
+
+                c = memcmp_raw_from(key, keylen, recs[pos]->key,
+                                    recs[pos]->keylen,
+                                    lcplo < lcphi ? lcplo : lcphi, &lcp);
+
+                if (c > 0) {
+                        start += middle + 1;
+                        count -= middle + 1;
+                        lcplo = lcp;
+                        continue;
+                }
+
+                if (c == 0)
+                        *found = 1;
+                count = middle;
+                lcphi = lcp;
+        }
+
+        return start;
+}
+
+/* memtree_node_search()
+ * Search for `key` among the records of `node`. With the default raw
+ * ordering, the prefix shared by the keys of the node is compared just
+ * once, and the binary search only looks at the rest of the keys.
+ */
+static inline uint32_t memtree_node_search(const struct memtree *memtree,
+                                           const unsigned char *key,
+                                           size_t keylen,
+                                           struct memtree_node *node,
+                                           int *found)
+{
+        size_t plen = node->prefixlen;
+        int c;
+
+        if (!plen || memtree->search != memtree_memcmp_raw)
+                return memtree->search(key, keylen, node->recs, node->count,
+                                       found);
+
+        c = memcmp(key, node->recs[0]->key, keylen < plen ? keylen : plen);
+        if (c < 0 || (c == 0 && keylen < plen))
+                return 0;
+        if (c > 0)
+                return node->count;
+
+        return memtree_memcmp_raw_from(key, keylen, node->recs, node->count,
+                                       plen, found);
+}
+
+static struct memtree_node *memtree_node_alloc(struct memtree *memtree,
+                                               enum NodeType type)
+{
+        struct memtree_node *node = NULL;
+
+        node = arena_alloc(memtree->arena, memtree_node_size(type));
+        memtree->bytes += memtree_node_size(type);
 
         return node;
 }
 
+static void memtree_node_release(struct memtree *memtree,
+                                 struct memtree_node *node)
+{
+        memtree->bytes -= memtree_node_size(node->depth ? INTERNAL_NODE :
+                                            LEAF_NODE);
+        arena_release(memtree->arena, node,
+                      memtree_node_size(node->depth ? INTERNAL_NODE :
+                                        LEAF_NODE));
+}
+
 static void memtree_node_free(struct memtree_node *node, struct memtree *memtree)
 {
         unsigned int i, count = node->count;
@@ -85,7 +207,9 @@ static void memtree_node_free(struct memtree_node *node, struct memtree *memtree
                 memtree_node_free(node->branches[count], memtree);
         }
 
-        xfree(node);
+        arena_release(memtree->arena, node,
+                      memtree_node_size(node->depth ? INTERNAL_NODE :
+                                        LEAF_NODE));
 }
 
 /* branch_begin()
@@ -150,20 +274,43 @@ static void node_insert(struct memtree_node *branch,
         }
 
         node->count++;
+        node_changed(node);
+}
+
+/* node_is_rightmost()
+ * returns 1 if `node` is on the right edge of the tree, i.e. it and all of
+ * its ancestors are the last branch of their parents.
+ */
+static inline int node_is_rightmost(const struct memtree_node *node)
+{
+        while (node->parent) {
+                if (node->pos != node->parent->count)
+                        return 0;
+                node = node->parent;
+        }
+
+        return 1;
 }
 
 /* node_split()
  * Inserts `rec` and `branch` into `node` at `pos` splitting
  * it into nodes `node`, `branch` with median element being `key`.
  */
-static void node_split(struct memtree_node **branch, struct memtree_node *node,
-                       struct record **rec, uint32_t pos)
+static void node_split(struct memtree *memtree, struct memtree_node **branch,
+                       struct memtree_node *node, struct record **rec,
+                       uint32_t pos)
 {
         uint32_t i, split;
         struct memtree_node *left = node;
         struct memtree_node *right = NULL;
 
-        if (pos <= MEMTREE_MIN_ELEMENTS) {
+        if (pos == MEMTREE_MAX_ELEMENTS && node_is_rightmost(node)) {
+                /* Appending to the right edge of the tree, which is what
+                 * sequential inserts do. Leave the left node full and start
+                 * the right one with just the new element, so that
+                 * ascending keys don't leave a trail of half empty nodes. */
+                split = MEMTREE_MAX_ELEMENTS;
+        } else if (pos <= MEMTREE_MIN_ELEMENTS) {
                 /* if pos is <= MEMTREE_MIN_ELEMENTS insert into left tree,
                  * so give the left tree fewer elelemts to start with */
                 split = MEMTREE_MIN_ELEMENTS;
@@ -174,9 +321,9 @@ static void node_split(struct memtree_node **branch, struct memtree_node *node,
         }
 
         if (left->depth)
-                right = memtree_node_alloc(INTERNAL_NODE);
+                right = memtree_node_alloc(memtree, INTERNAL_NODE);
         else
-                right = memtree_node_alloc(LEAF_NODE);
+                right = memtree_node_alloc(memtree, LEAF_NODE);
 
         /* The left and right sumemtrees are siblings, so they will have the
            same parent and depth */
@@ -219,6 +366,9 @@ static void node_split(struct memtree_node **branch, struct memtree_node *node,
         --left->count;
         *rec = (void *)left->recs[left->count];
         *branch = right;
+
+        node_changed(left);
+        node_changed(right);
 }
 
 static void node_move_left(struct memtree_node *node, uint32_t pos)
@@ -248,6 +398,10 @@ static void node_move_left(struct memtree_node *node, uint32_t pos)
 
         left->count++;
         right->count--;
+
+        node_changed(node);
+        node_changed(left);
+        node_changed(right);
 }
 
 static void node_move_right(struct memtree_node *node, uint32_t pos)
@@ -276,9 +430,14 @@ static void node_move_right(struct memtree_node *node, uint32_t pos)
 
         left->count--;
         right->count++;
+
+        node_changed(node);
+        node_changed(left);
+        node_changed(right);
 }
 
-static void node_combine(struct memtree_node *node, uint32_t pos)
+static void node_combine(struct memtree *memtree, struct memtree_node *node,
+                         uint32_t pos)
 {
         struct memtree_node *left = node->branches[pos];
         struct memtree_node *right = node->branches[pos + 1];
@@ -289,7 +448,7 @@ static void node_combine(struct memtree_node *node, uint32_t pos)
         *rec++ = node->recs[pos];
 
         for (i = 0; i < right->count; i++) {
-                *rec++ = node->recs[i];
+                *rec++ = right->recs[i];
         }
 
         if (right->depth) {
@@ -311,45 +470,51 @@ static void node_combine(struct memtree_node *node, uint32_t pos)
         left->count += right->count + 1;
         node->count--;
 
-        xfree(right);
+        node_changed(node);
+        node_changed(left);
+
+        memtree_node_release(memtree, right);
 }
 
 /* node_restore():
  */
-static void node_restore(struct memtree_node *node, uint32_t pos)
+static void node_restore(struct memtree *memtree, struct memtree_node *node,
+                         uint32_t pos)
 {
         if (pos == 0) {
                 if (node->branches[1]->count > MEMTREE_MIN_ELEMENTS)
                         node_move_left(node, 0);
                 else
-                        node_combine(node, 0);
+                        node_combine(memtree, node, 0);
         } else if (pos == node->count) {
                 if (node->branches[pos-1]->count > MEMTREE_MIN_ELEMENTS)
                         node_move_right(node, pos - 1);
                 else
-                        node_combine(node, pos - 1);
+                        node_combine(memtree, node, pos - 1);
         } else if (node->branches[pos-1]->count > MEMTREE_MIN_ELEMENTS) {
                 node_move_right(node, pos - 1);
         } else if (node->branches[pos+1]->count > MEMTREE_MIN_ELEMENTS) {
                 node_move_left(node, pos);
         } else {
-                node_combine(node, pos - 1);
+                node_combine(memtree, node, pos - 1);
         }
 }
 
 /* node_remove_leaf_element():
  */
-static void node_remove_leaf_element(struct memtree_node *node, uint32_t pos)
+static void node_remove_leaf_element(struct memtree *memtree,
+                                     struct memtree_node *node, uint32_t pos)
 {
         uint32_t i;
 
-        record_free(node->recs[pos]);
+        record_free_arena(memtree->arena, node->recs[pos]);
 
         for (i = pos + 1; i < node->count; i++) {
                 node->recs[i-1] = node->recs[i];
         }
 
         node->count--;
+        node_changed(node);
 }
 
 static int node_walk_forward(const struct memtree_node *node,
@@ -398,25 +563,208 @@ static int node_print_data(struct record *record, void *data _unused_)
         return 1;
 }
 
+/* memtree_finger_find():
+ * Look for `key` in the leaf that took the last insert, instead of
+ * descending from the root. Sequential inserts almost always land in the
+ * same leaf as the previous one.
+ * Returns -1 if the key doesn't fall within the range of that leaf, otherwise
+ * returns the same as memtree_find().
+ */
+static int memtree_finger_find(struct memtree *memtree,
+                               const unsigned char *key, size_t keylen,
+                               memtree_iter_t iter)
+{
+        struct memtree_node *leaf = memtree->finger;
+        struct memtree_node *node;
+        uint32_t pos;
+        int found = 0;
+
+        if (!leaf || !leaf->count)
+                return -1;
+
+        /* The key has to sort after the first record in the leaf.. */
+        if (memtree->search(key, keylen, leaf->recs, 1, &found) == 0)
+                return -1;
+
+        /* ..and before the separator that follows the leaf, if there is
+         * one. */
+        for (node = leaf; node->parent; node = node->parent) {
+                if (node->pos < node->parent->count) {
+                        found = 0;
+                        if (memtree->search(key, keylen,
+                                            &node->parent->recs[node->pos],
+                                            1, &found) || found)
+                                return -1;
+                        break;
+                }
+        }
+
+        found = 0;
+        pos = memtree_node_search(memtree, key, keylen, leaf, &found);
+
+        iter->tree = memtree;
+        iter->node = leaf;
+        iter->pos = pos;
+        iter->record = pos < leaf->count ? leaf->recs[pos] : NULL;
+
+        return found;
+}
+
+/* record_cmp()
+ * Compares two records with the search callback of the tree, which is all
+ * the tree knows about the order of the keys.
+ */
+static inline int record_cmp(const struct memtree *memtree,
+                             struct record *a, struct record *b)
+{
+        int found = 0;
+        unsigned int pos;
+
+        if (memtree->search == memtree_memcmp_raw) {
+                size_t min = a->keylen < b->keylen ? a->keylen : b->keylen;
+                int c = memcmp(a->key, b->key, min);
+
+                return c ? c : (a->keylen > b->keylen) - (a->keylen < b->keylen);
+        }
+
+        pos = memtree->search(a->key, a->keylen, &b, 1, &found);
+        if (found)
+                return 0;
+
+        return pos ? 1 : -1;
+}
+
+/* records_sort()
+ * A stable merge sort of `recs`, so that of the records with the same key,
+ * the one that came last, stays last.
+ */
+static void records_sort(const struct memtree *memtree, struct record **recs,
+                         size_t count)
+{
+        struct record **tmp, **src, **dst, **t;
+        size_t width, i;
+
+        tmp = xmalloc(count * sizeof(struct record *));
+        src = recs;
+        dst = tmp;
+
+        for (width = 1; width < count; width *= 2) {
+                for (i = 0; i < count; i += 2 * width) {
+                        size_t l = i, lend = i + width;
+                        size_t r = lend, rend = i + 2 * width;
+                        size_t k = i;
+
+                        if (lend > count)
+                                lend = count;
+                        if (r > count)
+                                r = count;
+                        if (rend > count)
+                                rend = count;
+
+                        while (l < lend && r < rend) {
+                                if (record_cmp(memtree, src[r], src[l]) < 0)
+                                        dst[k++] = src[r++];
+                                else
+                                        dst[k++] = src[l++];
+                        }
+                        while (l < lend)
+                                dst[k++] = src[l++];
+                        while (r < rend)
+                                dst[k++] = src[r++];
+                }
+
+                t = src;
+                src = dst;
+                dst = t;
+        }
+
+        if (src != recs)
+                memcpy(recs, src, count * sizeof(struct record *));
+
+        xfree(tmp);
+}
+
+/* node_build_level()
+ * Builds the level above `nodes`, each new node taking up to
+ * MEMTREE_MAX_ELEMENTS + 1 of them, and the separators in between.
+ * The separators that fall between the new nodes are left in `seps` for
+ * the level above. `nodes` and `seps` are updated in place.
+ */
+static void node_build_level(struct memtree *memtree,
+                             struct memtree_node **nodes, size_t *nnodes,
+                             struct record **seps)
+{
+        size_t m = *nnodes;
+        size_t nparents, per, extra;
+        size_t i, j, c = 0, s = 0;
+        uint32_t depth = nodes[0]->depth + 1;
+
+        nparents = (m + MEMTREE_MAX_ELEMENTS) / (MEMTREE_MAX_ELEMENTS + 1);
+        per = m / nparents;
+        extra = m % nparents;
+
+        for (i = 0; i < nparents; i++) {
+                struct memtree_node *node;
+                size_t nchildren = per + (i < extra);
+
+                node = memtree_node_alloc(memtree, INTERNAL_NODE);
+                node->parent = NULL;
+                node->depth = depth;
+                node->count = nchildren - 1;
+
+                for (j = 0; j < nchildren; j++) {
+                        struct memtree_node *child = nodes[c++];
+
+                        node->branches[j] = child;
+                        child->parent = node;
+                        child->pos = j;
+
+                        if (j < nchildren - 1)
+                                node->recs[j] = seps[s++];
+                }
+                node_update_prefix(node);
+
+                /* The parent nodes are written over the ones consumed */
+                nodes[i] = node;
+                if (i < nparents - 1)
+                        seps[i] = seps[s++];
+        }
+
+        *nnodes = nparents;
+}
+
 /**
  * Public functions
  */
 struct memtree *memtree_new(memtree_action_cb_t destroy, memtree_search_cb_t search)
+{
+        return memtree_new_arena(destroy, search, NULL);
+}
+
+struct memtree *memtree_new_arena(memtree_action_cb_t destroy,
+                                  memtree_search_cb_t search,
+                                  struct arena *arena)
 {
         struct memtree *memtree = NULL;
         struct memtree_node *node;
 
         memtree = xcalloc(1, sizeof(struct memtree));
+        memtree->bytes = sizeof(struct memtree);
+        memtree->generation = 1;
+        memtree->arena = arena;
 
         /* Root node */
-        node = memtree_node_alloc(LEAF_NODE);
+        node = memtree_node_alloc(memtree, LEAF_NODE);
         node->parent = NULL;
         node->count = 0;
         node->depth = 0;
+        node->prefixlen = 0;
 
         memtree->root = node;
 
         memtree->destroy = destroy ? destroy : memtree_default_destroy;
+        if (!destroy)
+                memtree->destroy_data = arena;
         memtree->search = search ? search : memtree_default_search;
 
         return memtree;
@@ -435,6 +783,7 @@ int memtree_begin(struct memtree *memtree, memtree_iter_t iter)
         iter->tree = memtree;
         iter->node = memtree->root;
         iter->pos = 0;
+        iter->generation = 0;
         if (iter->node->depth)
                 branch_begin(iter);
 
@@ -449,6 +798,8 @@ int memtree_begin(struct memtree *memtree, memtree_iter_t iter)
 
 int memtree_prev(memtree_iter_t iter)
 {
+        iter->generation = 0;
+
         if (iter->node->depth) {
                 branch_end(iter);
         } else if (iter->pos == 0) {
@@ -468,11 +819,31 @@ int memtree_prev(memtree_iter_t iter)
 
 int memtree_next(memtree_iter_t iter)
 {
-        int ret = memtree_deref(iter);
+        int ret;
+
+        /* The node changed under the iter, look up the last record it
+         * returned again, and step past it. */
+        if (iter->generation &&
+            iter->generation == iter->tree->generation &&
+            iter->version != iter->node->version) {
+                struct record *rec = iter->record;
+
+                memtree_find(iter->tree, rec->key, rec->keylen, iter);
+                if (memtree_deref(iter)) {
+                        iter->pos++;
+                        if (iter->node->depth)
+                                branch_begin(iter);
+                }
+        }
+
+        ret = memtree_deref(iter);
         if (ret) {
                 iter->pos++;
                 if (iter->node->depth)
                         branch_begin(iter);
+
+                iter->version = iter->node->version;
+                iter->generation = iter->tree->generation;
         }
 
         return ret;
@@ -483,17 +854,33 @@ int memtree_insert_opt(struct memtree *memtree, struct record *record, int repla
         memtree_iter_t iter;
         int ret = MEMTREE_OK;
 
+        int found;
+
         memset(iter, 0, sizeof(iter));
 
-        if (memtree_find(memtree, record->key, record->keylen, iter)) {
+        found = memtree_finger_find(memtree, record->key, record->keylen, iter);
+        if (found < 0)
+                found = memtree_find(memtree, record->key, record->keylen,
+                                     iter);
+
+        if (found) {
                 if (replace) {
                         struct record *rec = iter->record;
-                        xfree(rec->val);
-                        rec->val = xmalloc(record->vallen + 1);
-                        memcpy(rec->val, record->val, record->vallen);
+                        unsigned char *val = rec->val;
+                        size_t vallen = rec->vallen;
+
+                        memtree->bytes -= rec->vallen;
+                        memtree->bytes += record->vallen;
+
+                        /* Take the new value, and free the old one along
+                         * with the new record */
+                        rec->val = record->val;
                         rec->vallen = record->vallen;
                         rec->deleted = record->deleted;
-                        record_free(record);
+                        record->val = val;
+                        record->vallen = vallen;
+                        record_free_arena(memtree->arena, record);
+                        memtree->changes++;
                         goto done;
                 }
 
@@ -502,11 +889,90 @@ int memtree_insert_opt(struct memtree *memtree, struct record *record, int repla
         }
 
         memtree_insert_at(iter, record);
+        memtree->changes++;
 
 done:
         return ret;
 }
 
+int memtree_build(struct memtree *memtree, struct record **recs, size_t count)
+{
+        struct memtree_node **nodes;
+        size_t i, n, nleaves, per, extra, nnodes;
+        size_t r = 0, s = 0;
+        int sorted = 1;
+
+        if (memtree->count)
+                return MEMTREE_INVALID;
+
+        if (!count)
+                return MEMTREE_OK;
+
+        for (i = 1; i < count && sorted; i++)
+                sorted = record_cmp(memtree, recs[i - 1], recs[i]) < 0;
+
+        if (!sorted)
+                records_sort(memtree, recs, count);
+
+        /* Drop all but the last of the records with the same key */
+        for (i = 0, n = 0; i < count; i++) {
+                if (i + 1 < count && record_cmp(memtree, recs[i],
+                                                recs[i + 1]) == 0) {
+                        memtree->destroy(recs[i], memtree->destroy_data);
+                        continue;
+                }
+                recs[n++] = recs[i];
+                memtree->bytes += record_size(recs[i]);
+        }
+
+        /* The leaves, with a separator between each pair of them, hold
+         * all the records. Spread them evenly, so that no leaf is left
+         * underfull at the end. */
+        nleaves = (n + MEMTREE_MAX_ELEMENTS + 1) / (MEMTREE_MAX_ELEMENTS + 1);
+        per = (n - (nleaves - 1)) / nleaves;
+        extra = (n - (nleaves - 1)) % nleaves;
+
+        nodes = xmalloc(nleaves * sizeof(struct memtree_node *));
+
+        for (i = 0; i < nleaves; i++) {
+                struct memtree_node *leaf;
+                size_t j, nrecs = per + (i < extra);
+
+                leaf = memtree_node_alloc(memtree, LEAF_NODE);
+                leaf->parent = NULL;
+                leaf->pos = 0;
+                leaf->depth = 0;
+                leaf->count = nrecs;
+
+                for (j = 0; j < nrecs; j++)
+                        leaf->recs[j] = recs[r++];
+                node_update_prefix(leaf);
+
+                nodes[i] = leaf;
+
+                /* The separators are gathered at the front of `recs`,
+                 * which has been consumed past them */
+                if (i < nleaves - 1)
+                        recs[s++] = recs[r++];
+        }
+
+        nnodes = nleaves;
+        while (nnodes > 1)
+                node_build_level(memtree, nodes, &nnodes, recs);
+
+        memtree_node_release(memtree, memtree->root);
+        memtree->root = nodes[0];
+        memtree->root->parent = NULL;
+        memtree->root->pos = 0;
+        memtree->count = n;
+        memtree->finger = NULL;
+        memtree->generation++;
+
+        xfree(nodes);
+
+        return MEMTREE_OK;
+}
+
 int memtree_remove(struct memtree *memtree, unsigned char *key, size_t keylen)
 {
         memtree_iter_t iter;
@@ -569,16 +1035,16 @@ unsigned int memtree_memcmp_natural(const unsigned char *key, size_t keylen,
         return start;
 }
 
-memtree_memcmp_fn(
-        raw,
-        size_t min = keylen < blen ? keylen : blen,
-        memcmp(k, b, min)
-        )
+unsigned int memtree_memcmp_raw(const unsigned char *key, size_t keylen,
+                                struct record **recs,
+                                unsigned int count, int *found)
+{
+        return memtree_memcmp_raw_from(key, keylen, recs, count, 0, found);
+}
 
-int memtree_destroy(struct record *record,
-                  void *data _unused_)
+int memtree_destroy(struct record *record, void *data)
 {
-        record_free(record);
+        record_free_arena(data, record);
         return 0;
 }
 
@@ -592,12 +1058,13 @@ int memtree_find(struct memtree *memtree, const unsigned char *key, size_t keyle
 
         iter->tree = (struct memtree *)memtree;
         iter->record = NULL;
+        iter->generation = 0;
 
         depth = node->depth;
 
         while (1) {
                 int f = 0;
-                pos = memtree->search(key, keylen, node->recs, node->count, &f);
+                pos = memtree_node_search(memtree, key, keylen, node, &f);
                 if (f) {
                         iter->record = node->recs[pos];
                         found = 1;
@@ -611,8 +1078,37 @@ int memtree_find(struct memtree *memtree, const unsigned char *key, size_t keyle
 
         iter->node = node;
         iter->pos = pos;
-        if (!found)
-                iter->record = iter->node->recs[iter->pos];
+        if (!found) {
+                /* The record after the key, which may be up the tree,
+                 * without moving the iter off where the key would go */
+                memtree_iter_t next;
+
+                *next = *iter;
+                iter->record = memtree_deref(next) ? next->record : NULL;
+        }
+
+        return found;
+}
+
+int memtree_find_next(struct memtree *memtree, const unsigned char *key,
+                      size_t keylen, memtree_iter_t iter)
+{
+        struct memtree_node *node = iter->node;
+        uint32_t pos;
+        int found = 0;
+
+        if (iter->tree != memtree || !node || node->depth || !node->count)
+                return memtree_find(memtree, key, keylen, iter);
+
+        /* Only a key between the first and the last records of the leaf
+         * is sure to be found there, or nowhere */
+        pos = memtree_node_search(memtree, key, keylen, node, &found);
+        if (!found && (pos == 0 || pos == node->count))
+                return memtree_find(memtree, key, keylen, iter);
+
+        iter->record = node->recs[pos];
+        iter->generation = 0;
+        iter->pos = pos;
 
         return found;
 }
@@ -626,6 +1122,7 @@ void memtree_insert_at(memtree_iter_t iter, struct record *record)
 
         /* Set the key/val for iter */
         iter->record = record;
+        memtree->bytes += record_size(record);
 
         /* If the node is not a leaf, iter through to the end of the left
            branch */
@@ -635,12 +1132,22 @@ void memtree_insert_at(memtree_iter_t iter, struct record *record)
         if (iter->node->count < MEMTREE_MAX_ELEMENTS) {
                 /* Insert at the current node the iter points to */
                 node_insert(branch, iter->node, rec, iter->pos);
+                memtree->finger = iter->node;
                 goto done;
         } else {
+                /* The record lands in the right half of the leaf being
+                   split only when it is past the midpoint */
+                memtree->finger = iter->pos > MEMTREE_MIN_ELEMENTS ?
+                        NULL : iter->node;
+
                 /* Split the node, and try inserting the median and right
                    sumemtree into the parent*/
                 for (;;) {
-                        node_split(&branch, iter->node, &rec, iter->pos);
+                        node_split(memtree, &branch, iter->node, &rec,
+                                   iter->pos);
+
+                        if (!memtree->finger)
+                                memtree->finger = branch;
 
                         if (!memtree_ascend(iter))
                                 break;
@@ -653,10 +1160,11 @@ void memtree_insert_at(memtree_iter_t iter, struct record *record)
 
                 /* If we split all the way to the root, we create a new root */
                 assert(iter->node == memtree->root);
-                node = memtree_node_alloc(INTERNAL_NODE);
+                node = memtree_node_alloc(memtree, INTERNAL_NODE);
                 node->parent = NULL;
                 node->count = 1;
                 node->depth = memtree->root->depth + 1;
+                node->prefixlen = 0;
 
                 node->recs[0] = rec;
 
@@ -702,27 +1210,34 @@ int memtree_remove_at(memtree_iter_t iter)
         if (!memtree_deref(iter))
                 return 0;
 
-        /* record_free(iter->record); */
+        /* Nodes may get merged and freed below */
+        memtree->finger = NULL;
+        memtree->generation++;
+
+        memtree->bytes -= record_size(iter->record);
 
         if (!iter->node->depth) {
-                node_remove_leaf_element(iter->node, iter->pos);
+                node_remove_leaf_element(memtree, iter->node, iter->pos);
                 if (iter->node->count >= MEMTREE_MIN_ELEMENTS ||
                     !iter->node->parent)
                         goto done;
         } else {
                 /* Save pointers to the data that needs to be removed*/
+                struct memtree_node *inode = iter->node;
                 struct record **rec = &iter->node->recs[iter->pos];
+                struct record *victim = *rec;
 
                 /* Start branching */
                 iter->pos++;
                 branch_begin(iter);
 
-                /* Replace with the successor */
+                /* Replace with the successor, and remove the record from
+                 * the leaf the successor came from */
                 *rec = iter->node->recs[0];
-                print_rec_entry(iter->node->recs[iter->pos]->key,
-                                iter->node->recs[iter->pos]->keylen);
+                iter->node->recs[0] = victim;
+                node_changed(inode);
 
-                node_remove_leaf_element(iter->node, 0);
+                node_remove_leaf_element(memtree, iter->node, 0);
         }
 
         while (1) {
@@ -732,7 +1247,7 @@ int memtree_remove_at(memtree_iter_t iter)
                 if (!memtree_ascend(iter))
                         break;
 
-                node_restore(iter->node, iter->pos);
+                node_restore(memtree, iter->node, iter->pos);
         }
 
         /* We've got to the root after combining */
@@ -742,7 +1257,7 @@ int memtree_remove_at(memtree_iter_t iter)
         if (root->count == 0) {
                 memtree->root = root->branches[0];
                 memtree->root->parent = NULL;
-                xfree(root);
+                memtree_node_release(memtree, root);
         }
 
 done:
@@ -764,16 +1279,25 @@ int memtree_print_node_data(struct memtree *memtree, void *data)
 struct record * record_new(const unsigned char *key, size_t keylen,
                            const unsigned char *val, size_t vallen,
                            int deleted)
+{
+        return record_new_arena(NULL, key, keylen, val, vallen, deleted);
+}
+
+struct record *record_new_arena(struct arena *arena,
+                                const unsigned char *key, size_t keylen,
+                                const unsigned char *val, size_t vallen,
+                                int deleted)
 {
         struct record *rec = NULL;
 
-        rec = xmalloc(sizeof(struct record));
+        /* The key lives right after the record, in the same allocation */
+        rec = arena_alloc(arena, sizeof(struct record) + keylen + 1);
 
-        rec->key = xmalloc(keylen + 1);
+        rec->key = (unsigned char *)(rec + 1);
         memcpy(rec->key, key, keylen);
         rec->keylen = keylen;
 
-        rec->val = xmalloc(vallen + 1);
+        rec->val = arena_alloc(arena, vallen + 1);
         memcpy(rec->val, val, vallen);
         rec->vallen = vallen;
 
@@ -785,15 +1309,15 @@ struct record * record_new(const unsigned char *key, size_t keylen,
 
 void record_free(struct record *record)
 {
-        assert(record);
+        record_free_arena(NULL, record);
+}
 
-        xfree(record->key);
-        xfree(record->val);
-        record->keylen = 0;
-        record->vallen = 0;
-        record->deleted = 0;
+void record_free_arena(struct arena *arena, struct record *record)
+{
+        assert(record);
 
-        xfree(record);
+        arena_release(arena, record->val, record->vallen + 1);
+        arena_release(arena, record, sizeof(struct record) + record->keylen + 1);
 
         nodecount--;
 }
@@ -12,6 +12,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -24,10 +25,195 @@
 #include <libzeroskip/mfile.h>
 #include <libzeroskip/util.h>
 
-static struct mfile mf_init = {NULL, -1, MAP_FAILED, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+static struct mfile mf_init = {NULL, -1, MAP_FAILED, 0, 0, 0, 0, 0, 0, 0, 0, 0, NULL};
 
 #define OPEN_MODE 0644
 
+struct mfile_window {
+        unsigned char *ptr;
+        uint64_t start;
+        uint64_t len;
+        uint64_t lastused;
+};
+
+/* The windows of a file. The windows in use are kept to `count`, the
+ * dropped ones stay mapped until mfile_reclaim(), so the pointers into
+ * them remain good. With MODE_THREADED DBs, the windows are looked up from
+ * many threads at once, hence the mutex.
+ */
+struct mfile_windows {
+        pthread_mutex_t mutex;
+        uint64_t size;                  /* Of a window */
+        unsigned int count;
+
+        struct mfile_window *used;      /* `count` of them */
+        unsigned int nused;
+
+        struct mfile_window *dropped;
+        unsigned int ndropped;
+        unsigned int droppedalloc;
+
+        struct mfile_window *pinned;
+        unsigned int npinned;
+        unsigned int pinnedalloc;
+
+        uint64_t clock;
+        uint64_t next;                  /* The end of the last window
+                                         * mapped, to spot scans */
+};
+
+static uint64_t window_size = MFILE_WINDOW_SIZE;
+static unsigned int window_count = MFILE_WINDOW_COUNT;
+
+/**
+ * Private functions
+ */
+static uint64_t page_size(void)
+{
+        return (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+static void window_list_add(struct mfile_window **list, unsigned int *n,
+                            unsigned int *alloc, const struct mfile_window *w)
+{
+        ALLOC_GROW(*list, *n + 1, *alloc);
+        (*list)[(*n)++] = *w;
+}
+
+static void window_list_unmap(struct mfile_window *list, unsigned int n)
+{
+        unsigned int i;
+
+        for (i = 0; i < n; i++)
+                munmap(list[i].ptr, list[i].len);
+}
+
+/* window_drop():
+ * Drops window `i` of those in use, its pages go from memory, but it stays
+ * mapped.
+ */
+static void window_drop(struct mfile_windows *win, unsigned int i)
+{
+        struct mfile_window *w = &win->used[i];
+
+        madvise(w->ptr, w->len, MADV_DONTNEED);
+        window_list_add(&win->dropped, &win->ndropped, &win->droppedalloc, w);
+
+        win->used[i] = win->used[--win->nused];
+}
+
+/* window_map():
+ * Maps a window holding [offset, offset + len), or brings back a dropped
+ * one that does.
+ */
+static int window_map(struct mfile *mf, uint64_t offset, uint64_t len,
+                      struct mfile_window *w)
+{
+        struct mfile_windows *win = mf->win;
+        uint64_t start, end, psize = page_size();
+        unsigned int i;
+
+        for (i = 0; i < win->ndropped; i++) {
+                struct mfile_window *d = &win->dropped[i];
+
+                if (d->start <= offset && offset + len <= d->start + d->len) {
+                        *w = *d;
+                        *d = win->dropped[--win->ndropped];
+                        return 0;
+                }
+        }
+
+        start = offset - offset % win->size;
+        end = start + win->size;
+        if (offset + len > end)
+                end = (offset + len + psize - 1) / psize * psize;
+        if (end > mf->size)
+                end = mf->size;
+
+        w->ptr = mmap(0, end - start, PROT_READ, MAP_SHARED, mf->fd, start);
+        if (w->ptr == MAP_FAILED)
+                return errno;
+
+        w->start = start;
+        w->len = end - start;
+
+        return 0;
+}
+
+static struct mfile_window *window_find(struct mfile_window *list,
+                                        unsigned int n, uint64_t offset,
+                                        uint64_t len)
+{
+        unsigned int i;
+
+        for (i = 0; i < n; i++) {
+                if (list[i].start <= offset &&
+                    offset + len <= list[i].start + list[i].len)
+                        return &list[i];
+        }
+
+        return NULL;
+}
+
+/* range_map():
+ * Maps the pages that hold `len` bytes at `offset`, in a mapping of their
+ * own.
+ */
+static int range_map(struct mfile *mf, uint64_t offset, uint64_t len,
+                     struct mfile_window *w)
+{
+        uint64_t start = offset - offset % page_size();
+
+        w->ptr = mmap(0, offset + len - start, PROT_READ, MAP_SHARED,
+                      mf->fd, start);
+        if (w->ptr == MAP_FAILED)
+                return errno;
+
+        w->start = start;
+        w->len = offset + len - start;
+        w->lastused = 0;
+
+        return 0;
+}
+
+static void windows_free(struct mfile_windows *win)
+{
+        window_list_unmap(win->used, win->nused);
+        window_list_unmap(win->dropped, win->ndropped);
+        window_list_unmap(win->pinned, win->npinned);
+
+        xfree(win->used);
+        xfree(win->dropped);
+        xfree(win->pinned);
+        pthread_mutex_destroy(&win->mutex);
+        xfree(win);
+}
+
+static uint64_t range_resident(unsigned char *ptr, uint64_t len)
+{
+        uint64_t psize = page_size();
+        uint64_t npages, i, resident = 0;
+        unsigned char *vec;
+
+        npages = (len + psize - 1) / psize;
+        vec = xmalloc(npages);
+
+        if (mincore(ptr, len, (void *)vec) == 0) {
+                for (i = 0; i < npages; i++) {
+                        if (vec[i] & 1)
+                                resident += psize;
+                }
+        }
+
+        xfree(vec);
+
+        return resident < len ? resident : len;
+}
+
+/**
+ * Public functions
+ */
+
 /*
   mfile_open():
 
@@ -94,7 +280,16 @@ int mfile_open(const char *fname, uint32_t flags, struct mfile **mfp)
         }
 
         mf->size = st.st_size;
-        if (mf->size) {
+        if ((flags & MFILE_WINDOWED) && !(flags & MFILE_WR) &&
+            mf->size > window_size * window_count) {
+                mf->win = xcalloc(1, sizeof(struct mfile_windows));
+                pthread_mutex_init(&mf->win->mutex, NULL);
+                mf->win->size = window_size;
+                mf->win->count = window_count;
+                mf->win->used = xcalloc(window_count,
+                                        sizeof(struct mfile_window));
+                mf->ptr = NULL;
+        } else if (mf->size) {
                 mf->ptr = mmap(0, mf->size, mflags, MAP_SHARED, mf->fd, 0);
                 if (mf->ptr == MAP_FAILED) {
                         int err = errno;
@@ -159,6 +354,11 @@ int mfile_close(struct mfile **mfp)
 
                 xfree(mf->filename);
 
+                if (mf->win) {
+                        windows_free(mf->win);
+                        mf->win = NULL;
+                }
+
                 if (mf->ptr != MAP_FAILED && mf->ptr) {
                         munmap(mf->ptr, mf->size);
                         mf->ptr = MAP_FAILED;
@@ -376,6 +576,13 @@ int mfile_size(struct mfile **mfp, uint64_t *psize)
         if (fstat(mf->fd, &stbuf) != 0)
                 return errno;
 
+        /* Windowed files are read only, and don't change */
+        if (mf->win) {
+                if (psize)
+                        *psize = mf->size;
+                return 0;
+        }
+
         if (mf->size != (uint64_t) stbuf.st_size) {
                 if (mf->ptr)
                         err = munmap(mf->ptr, mf->size);
@@ -522,6 +729,256 @@ int mfile_seek(struct mfile **mfp, uint64_t offset, uint64_t *newoffset)
         return 0;
 }
 
+void mfile_window_config(uint64_t size, unsigned int count)
+{
+        uint64_t psize = page_size();
+
+        window_size = size < psize ? psize : (size + psize - 1) / psize * psize;
+        window_count = count < 2 ? 2 : count;
+}
+
+unsigned char *mfile_window(struct mfile *mf, uint64_t offset, uint64_t len)
+{
+        struct mfile_windows *win = mf->win;
+        struct mfile_window *w, nw;
+        unsigned char *ptr = NULL;
+        unsigned int i;
+
+        if (offset >= mf->size)
+                return NULL;
+
+        if (len > mf->size - offset)
+                len = mf->size - offset;
+
+        pthread_mutex_lock(&win->mutex);
+
+        /* Pinned first, so ranges in them stay good */
+        w = window_find(win->pinned, win->npinned, offset, len);
+        if (!w)
+                w = window_find(win->used, win->nused, offset, len);
+        if (w) {
+                w->lastused = ++win->clock;
+                ptr = w->ptr + (offset - w->start);
+                goto done;
+        }
+
+        if (window_map(mf, offset, len, &nw) != 0) {
+                zslog(LOGWARNING, "Could not map a window of %s\n",
+                      mf->filename);
+                goto done;
+        }
+
+        /* A scan: the windows behind it won't be needed again */
+        if (nw.start == win->next) {
+                for (i = 0; i < win->nused;) {
+                        if (win->used[i].start + win->used[i].len <= nw.start)
+                                window_drop(win, i);
+                        else
+                                i++;
+                }
+                madvise(nw.ptr, nw.len, MADV_SEQUENTIAL);
+        }
+
+        if (win->nused == win->count) {
+                unsigned int lru = 0;
+
+                for (i = 1; i < win->nused; i++) {
+                        if (win->used[i].lastused < win->used[lru].lastused)
+                                lru = i;
+                }
+                window_drop(win, lru);
+        }
+
+        nw.lastused = ++win->clock;
+        win->used[win->nused++] = nw;
+        win->next = nw.start + nw.len;
+        ptr = nw.ptr + (offset - nw.start);
+
+done:
+        pthread_mutex_unlock(&win->mutex);
+        return ptr;
+}
+
+unsigned char *mfile_pin(struct mfile *mf, uint64_t offset, uint64_t len)
+{
+        struct mfile_windows *win = mf->win;
+        struct mfile_window w;
+
+        if (offset >= mf->size)
+                return NULL;
+
+        if (!win)
+                return mf->ptr + offset;
+
+        if (len > mf->size - offset)
+                len = mf->size - offset;
+
+        if (range_map(mf, offset, len, &w) != 0)
+                return NULL;
+
+        pthread_mutex_lock(&win->mutex);
+        window_list_add(&win->pinned, &win->npinned, &win->pinnedalloc, &w);
+        pthread_mutex_unlock(&win->mutex);
+
+        return w.ptr + (offset - w.start);
+}
+
+int mfile_offset(struct mfile *mf, const unsigned char *ptr, uint64_t len,
+                 uint64_t *offset)
+{
+        struct mfile_windows *win = mf->win;
+        struct mfile_window *lists[3];
+        unsigned int counts[3], i, j;
+        int found = 0;
+
+        if (!win) {
+                if (!mf->ptr || mf->ptr == MAP_FAILED || ptr < mf->ptr ||
+                    ptr + len > mf->ptr + mf->size)
+                        return 0;
+
+                *offset = ptr - mf->ptr;
+                return 1;
+        }
+
+        pthread_mutex_lock(&win->mutex);
+
+        lists[0] = win->pinned;
+        counts[0] = win->npinned;
+        lists[1] = win->used;
+        counts[1] = win->nused;
+        lists[2] = win->dropped;
+        counts[2] = win->ndropped;
+
+        for (i = 0; i < 3 && !found; i++) {
+                for (j = 0; j < counts[i]; j++) {
+                        const struct mfile_window *w = &lists[i][j];
+
+                        if (ptr >= w->ptr && ptr + len <= w->ptr + w->len) {
+                                *offset = w->start + (ptr - w->ptr);
+                                found = 1;
+                                break;
+                        }
+                }
+        }
+
+        pthread_mutex_unlock(&win->mutex);
+
+        return found;
+}
+
+unsigned char *mfile_map_range(struct mfile *mf, uint64_t offset,
+                               uint64_t len, void **map, size_t *maplen)
+{
+        struct mfile_window w;
+
+        if (offset >= mf->size || len > mf->size - offset)
+                return NULL;
+
+        if (range_map(mf, offset, len, &w) != 0)
+                return NULL;
+
+        *map = w.ptr;
+        *maplen = w.len;
+
+        return w.ptr + (offset - w.start);
+}
+
+void mfile_unmap_range(void *map, size_t maplen)
+{
+        if (map)
+                munmap(map, maplen);
+}
+
+void mfile_reclaim(struct mfile *mf)
+{
+        struct mfile_windows *win = mf->win;
+
+        if (!win)
+                return;
+
+        pthread_mutex_lock(&win->mutex);
+        window_list_unmap(win->dropped, win->ndropped);
+        win->ndropped = 0;
+        pthread_mutex_unlock(&win->mutex);
+}
+
+int mfile_reclaim_due(struct mfile *mf)
+{
+        struct mfile_windows *win = mf->win;
+
+        if (!win)
+                return 0;
+
+        return __atomic_load_n(&win->ndropped, __ATOMIC_RELAXED) >= win->count;
+}
+
+uint64_t mfile_mapped(struct mfile *mf)
+{
+        struct mfile_windows *win = mf->win;
+        uint64_t mapped = 0;
+        unsigned int i;
+
+        if (!win)
+                return (mf->ptr && mf->ptr != MAP_FAILED) ? mf->size : 0;
+
+        pthread_mutex_lock(&win->mutex);
+        for (i = 0; i < win->nused; i++)
+                mapped += win->used[i].len;
+        for (i = 0; i < win->ndropped; i++)
+                mapped += win->dropped[i].len;
+        for (i = 0; i < win->npinned; i++)
+                mapped += win->pinned[i].len;
+        pthread_mutex_unlock(&win->mutex);
+
+        return mapped;
+}
+
+uint64_t mfile_resident(struct mfile *mf)
+{
+        struct mfile_windows *win = mf->win;
+        uint64_t resident = 0;
+        unsigned int i;
+
+        if (!win) {
+                if (!mf->ptr || mf->ptr == MAP_FAILED || !mf->size)
+                        return 0;
+                return range_resident(mf->ptr, mf->size);
+        }
+
+        pthread_mutex_lock(&win->mutex);
+        for (i = 0; i < win->nused; i++)
+                resident += range_resident(win->used[i].ptr,
+                                           win->used[i].len);
+        for (i = 0; i < win->ndropped; i++)
+                resident += range_resident(win->dropped[i].ptr,
+                                           win->dropped[i].len);
+        for (i = 0; i < win->npinned; i++)
+                resident += range_resident(win->pinned[i].ptr,
+                                           win->pinned[i].len);
+        pthread_mutex_unlock(&win->mutex);
+
+        return resident;
+}
+
+void mfile_dontneed(struct mfile *mf)
+{
+        struct mfile_windows *win = mf->win;
+        unsigned int i;
+
+        if (!win) {
+                if (mf->ptr && mf->ptr != MAP_FAILED && mf->size)
+                        madvise(mf->ptr, mf->size, MADV_DONTNEED);
+                return;
+        }
+
+        pthread_mutex_lock(&win->mutex);
+        while (win->nused)
+                window_drop(win, 0);
+        for (i = 0; i < win->npinned; i++)
+                madvise(win->pinned[i].ptr, win->pinned[i].len,
+                        MADV_DONTNEED);
+        pthread_mutex_unlock(&win->mutex);
+}
 
 void crc32_begin(struct mfile **mfp)
 {
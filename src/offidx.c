@@ -0,0 +1,292 @@
+/*
+ * offidx.c
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <libzeroskip/arena.h>
+#include <libzeroskip/offidx.h>
+#include <libzeroskip/util.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TAIL_BYTES (OFFIDX_BLOCK_SIZE * sizeof(uint64_t))
+
+/**
+ * Private functions
+ */
+static void resize_blocks(struct offidx *idx, uint64_t alloc)
+{
+        idx->blocks = arena_realloc(idx->arena, idx->blocks,
+                                    idx->blocksalloc *
+                                    sizeof(struct offidx_block),
+                                    st_mult(alloc,
+                                            sizeof(struct offidx_block)));
+        idx->blocksalloc = alloc;
+}
+
+static void resize_data(struct offidx *idx, uint64_t alloc)
+{
+        idx->data = arena_realloc(idx->arena, idx->data, idx->dataalloc,
+                                  alloc);
+        idx->dataalloc = alloc;
+}
+
+/* encode_block():
+ * Appends a block with the `n` offsets in `vals`.
+ */
+static void encode_block(struct offidx *idx, const uint64_t *vals,
+                         unsigned int n)
+{
+        struct offidx_block *blk;
+        uint64_t min, max, len;
+        unsigned int i, shift;
+        unsigned char *p;
+
+        min = max = vals[0];
+        for (i = 1; i < n; i++) {
+                if (vals[i] < min)
+                        min = vals[i];
+                if (vals[i] > max)
+                        max = vals[i];
+        }
+
+        if (max - min <= UINT16_MAX)
+                shift = 1;
+        else if (max - min <= UINT32_MAX)
+                shift = 2;
+        else
+                shift = 3;
+
+        /* Keep the next block aligned */
+        len = ((uint64_t)n << shift) + 7;
+        len &= ~7ULL;
+
+        if (idx->datalen + len > idx->dataalloc) {
+                uint64_t alloc = alloc_nr(idx->dataalloc);
+                resize_data(idx, alloc < idx->datalen + len ?
+                            idx->datalen + len : alloc);
+        }
+
+        if (idx->nblocks + 1 > idx->blocksalloc)
+                resize_blocks(idx, alloc_nr(idx->blocksalloc));
+
+        p = idx->data + idx->datalen;
+        for (i = 0; i < n; i++) {
+                uint64_t delta = vals[i] - min;
+
+                switch (shift) {
+                case 1:
+                        ((uint16_t *)p)[i] = (uint16_t)delta;
+                        break;
+                case 2:
+                        ((uint32_t *)p)[i] = (uint32_t)delta;
+                        break;
+                default:
+                        ((uint64_t *)p)[i] = delta;
+                        break;
+                }
+        }
+
+        blk = &idx->blocks[idx->nblocks++];
+        blk->base = min;
+        blk->pos = idx->datalen | shift;
+        idx->datalen += len;
+}
+
+/* unseal():
+ * Decodes the last block, which isn't full, back into the tail, to append
+ * to it.
+ */
+static void unseal(struct offidx *idx)
+{
+        uint64_t first = idx->count & ~((uint64_t)OFFIDX_BLOCK_SIZE - 1);
+        unsigned int j;
+
+        idx->tail = arena_alloc(idx->arena, TAIL_BYTES);
+        for (j = 0; first + j < idx->count; j++)
+                idx->tail[j] = offidx_get(idx, first + j);
+
+        idx->nblocks--;
+        idx->datalen = idx->blocks[idx->nblocks].pos & ~7ULL;
+}
+
+/**
+ * Public functions
+ */
+struct offidx *offidx_new(void)
+{
+        return offidx_new_arena(NULL);
+}
+
+struct offidx *offidx_new_arena(struct arena *arena)
+{
+        struct offidx *idx;
+
+        idx = xcalloc(1, sizeof(struct offidx));
+        idx->arena = arena;
+
+        return idx;
+}
+
+struct offidx *offidx_new_mapped(const unsigned char *ptr, uint64_t count)
+{
+        struct offidx *idx;
+
+        idx = xcalloc(1, sizeof(struct offidx));
+        idx->mapped = ptr;
+        idx->count = count;
+
+        return idx;
+}
+
+void offidx_free(struct offidx **idxptr)
+{
+        struct offidx *idx;
+
+        if (!idxptr || !*idxptr)
+                return;
+
+        idx = *idxptr;
+        *idxptr = NULL;
+
+        arena_release(idx->arena, idx->blocks,
+                      idx->blocksalloc * sizeof(struct offidx_block));
+        arena_release(idx->arena, idx->data, idx->dataalloc);
+        arena_release(idx->arena, idx->tail, TAIL_BYTES);
+        xfree(idx);
+}
+
+void offidx_reserve(struct offidx *idx, uint64_t n)
+{
+        uint64_t nblocks = (n + OFFIDX_BLOCK_SIZE - 1) >> OFFIDX_BLOCK_SHIFT;
+
+        if (nblocks > idx->blocksalloc)
+                resize_blocks(idx, nblocks);
+
+        if (st_mult(n, sizeof(uint16_t)) > idx->dataalloc)
+                resize_data(idx, n * sizeof(uint16_t));
+}
+
+void offidx_append(struct offidx *idx, uint64_t n)
+{
+        unsigned int j = idx->count & (OFFIDX_BLOCK_SIZE - 1);
+
+        assert(!idx->mapped);
+
+        if (unsigned_add_overflows(idx->count, 1)) {
+                fprintf(stderr, "offidx: Cannot allocate more memory\n");
+                exit(EXIT_FAILURE);
+        }
+
+        if (!idx->tail) {
+                if (j)
+                        unseal(idx);
+                else
+                        idx->tail = arena_alloc(idx->arena, TAIL_BYTES);
+        }
+
+        idx->tail[j] = n;
+        idx->count++;
+
+        if (j == OFFIDX_BLOCK_SIZE - 1)
+                encode_block(idx, idx->tail, OFFIDX_BLOCK_SIZE);
+}
+
+void offidx_seal(struct offidx *idx)
+{
+        unsigned int n = idx->count & (OFFIDX_BLOCK_SIZE - 1);
+
+        if (idx->mapped)
+                return;
+
+        if (idx->tail) {
+                if (n)
+                        encode_block(idx, idx->tail, n);
+                arena_release(idx->arena, idx->tail, TAIL_BYTES);
+                idx->tail = NULL;
+        }
+
+        if (!idx->nblocks) {
+                arena_release(idx->arena, idx->blocks,
+                              idx->blocksalloc * sizeof(struct offidx_block));
+                arena_release(idx->arena, idx->data, idx->dataalloc);
+                idx->blocks = NULL;
+                idx->data = NULL;
+                idx->blocksalloc = idx->dataalloc = 0;
+                return;
+        }
+
+        if (idx->blocksalloc > idx->nblocks)
+                resize_blocks(idx, idx->nblocks);
+
+        if (idx->dataalloc > idx->datalen)
+                resize_data(idx, idx->datalen);
+}
+
+size_t offidx_bytes(const struct offidx *idx)
+{
+        size_t bytes = sizeof(struct offidx);
+
+        bytes += idx->blocksalloc * sizeof(struct offidx_block);
+        bytes += idx->dataalloc;
+        if (idx->tail)
+                bytes += TAIL_BYTES;
+
+        return bytes;
+}
+
+int offidx_foreach(const struct offidx *idx, offidx_foreach_cb_t cb,
+                   void *cbdata)
+{
+        uint64_t b, i = 0;
+
+        if (!idx->count)
+                return 0;
+
+        if (idx->mapped) {
+                const uint64_t *p = (const uint64_t *)idx->mapped;
+
+                for (i = 0; i < idx->count; i++)
+                        cb(cbdata, ntoh64(p[i]));
+                return 1;
+        }
+
+        /* A block at a time, rather than offidx_get() for each */
+        for (b = 0; b < idx->nblocks; b++) {
+                const struct offidx_block *blk = &idx->blocks[b];
+                const unsigned char *p = idx->data + (blk->pos & ~7ULL);
+                unsigned int j;
+
+                for (j = 0; j < OFFIDX_BLOCK_SIZE && i < idx->count;
+                     j++, i++) {
+                        uint64_t delta;
+
+                        switch (blk->pos & 7) {
+                        case 1:
+                                delta = ((const uint16_t *)p)[j];
+                                break;
+                        case 2:
+                                delta = ((const uint32_t *)p)[j];
+                                break;
+                        default:
+                                delta = ((const uint64_t *)p)[j];
+                                break;
+                        }
+
+                        cb(cbdata, blk->base + delta);
+                }
+        }
+
+        for (; i < idx->count; i++)
+                cb(cbdata, idx->tail[i & (OFFIDX_BLOCK_SIZE - 1)]);
+
+        return 1;
+}
@@ -0,0 +1,305 @@
+/*
+ * thread-lock.c
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include "thread-lock.h"
+#include <libzeroskip/util.h>
+
+#include <stdint.h>
+#include <string.h>
+
+/* The locks a thread holds, with how deep, in a table of its own. It is
+ * found through one key for the whole library, since there are only so
+ * many keys in a process, and there can be thousands of DBs. Entries go
+ * once the lock is released.
+ */
+struct held_lock {
+        struct thread_lock *lk;
+        uintptr_t depth;            /* Recursion depth, holding rwlock for
+                                     * writing */
+        int writer;                 /* Holds the writer slot */
+};
+
+struct held_locks {
+        struct held_lock *locks;
+        size_t nlocks;
+        size_t alloc;
+};
+
+static pthread_key_t held_key;
+static pthread_once_t held_once = PTHREAD_ONCE_INIT;
+static int held_key_ok;
+
+/* Internal functions */
+static void held_locks_free(void *data)
+{
+        struct held_locks *held = data;
+
+        xfree(held->locks);
+        xfree(held);
+}
+
+static void held_key_create(void)
+{
+        held_key_ok = pthread_key_create(&held_key, held_locks_free) == 0;
+}
+
+/* held_lock():
+ * The entry of `lk` in the table of the calling thread, which is added if
+ * `create`, NULL otherwise if there is none.
+ */
+static struct held_lock *held_lock(struct thread_lock *lk, int create)
+{
+        struct held_locks *held;
+        size_t i;
+
+        held = pthread_getspecific(held_key);
+        if (!held) {
+                if (!create)
+                        return NULL;
+                held = xcalloc(1, sizeof(struct held_locks));
+                pthread_setspecific(held_key, held);
+        }
+
+        for (i = 0; i < held->nlocks; i++) {
+                if (held->locks[i].lk == lk)
+                        return &held->locks[i];
+        }
+
+        if (!create)
+                return NULL;
+
+        ALLOC_GROW(held->locks, held->nlocks + 1, held->alloc);
+        held->locks[held->nlocks].lk = lk;
+        held->locks[held->nlocks].depth = 0;
+        held->locks[held->nlocks].writer = 0;
+
+        return &held->locks[held->nlocks++];
+}
+
+/* held_lock_put():
+ * Drops the entry `h` once it is of no more use.
+ */
+static void held_lock_put(struct held_lock *h)
+{
+        struct held_locks *held;
+
+        if (h->depth || h->writer)
+                return;
+
+        held = pthread_getspecific(held_key);
+        *h = held->locks[--held->nlocks];
+}
+
+static inline uintptr_t thread_lock_depth(struct thread_lock *lk)
+{
+        struct held_lock *h = held_lock(lk, 0);
+
+        return h ? h->depth : 0;
+}
+
+static inline void thread_lock_set_depth(struct thread_lock *lk,
+                                         uintptr_t depth)
+{
+        struct held_lock *h = held_lock(lk, depth != 0);
+
+        if (!h)
+                return;
+
+        h->depth = depth;
+        held_lock_put(h);
+}
+
+/* Public functions */
+
+/* thread_lock_init():
+ * Initialise and activate the lock.
+ * returns -1 on failure and 0 on success.
+ */
+int thread_lock_init(struct thread_lock *lk)
+{
+        pthread_mutexattr_t attr;
+
+        memset(lk, 0, sizeof(struct thread_lock));
+
+        pthread_once(&held_once, held_key_create);
+        if (!held_key_ok)
+                return -1;
+
+        if (pthread_rwlock_init(&lk->rwlock, NULL) != 0)
+                return -1;
+
+        /* An error checking mutex, so that releasing a writer slot that
+         * isn't held is harmless */
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+        if (pthread_mutex_init(&lk->wmutex, &attr) != 0) {
+                pthread_mutexattr_destroy(&attr);
+                pthread_rwlock_destroy(&lk->rwlock);
+                return -1;
+        }
+        pthread_mutexattr_destroy(&attr);
+
+        lk->active = 1;
+
+        return 0;
+}
+
+void thread_lock_destroy(struct thread_lock *lk)
+{
+        if (!lk->active)
+                return;
+
+        pthread_mutex_destroy(&lk->wmutex);
+        pthread_rwlock_destroy(&lk->rwlock);
+        lk->active = 0;
+}
+
+void thread_lock_read(struct thread_lock *lk)
+{
+        uintptr_t depth;
+
+        if (!lk->active)
+                return;
+
+        depth = thread_lock_depth(lk);
+        if (depth) {
+                thread_lock_set_depth(lk, depth + 1);
+                return;
+        }
+
+        pthread_rwlock_rdlock(&lk->rwlock);
+}
+
+void thread_lock_write(struct thread_lock *lk)
+{
+        uintptr_t depth;
+
+        if (!lk->active)
+                return;
+
+        depth = thread_lock_depth(lk);
+        if (depth) {
+                thread_lock_set_depth(lk, depth + 1);
+                return;
+        }
+
+        pthread_rwlock_wrlock(&lk->rwlock);
+        thread_lock_set_depth(lk, 1);
+}
+
+/* thread_lock_try_write():
+ * Like thread_lock_write(), without waiting for other threads.
+ * returns -1 if the lock is held by another thread and 0 on success.
+ */
+int thread_lock_try_write(struct thread_lock *lk)
+{
+        uintptr_t depth;
+
+        if (!lk->active)
+                return 0;
+
+        depth = thread_lock_depth(lk);
+        if (depth) {
+                thread_lock_set_depth(lk, depth + 1);
+                return 0;
+        }
+
+        if (pthread_rwlock_trywrlock(&lk->rwlock) != 0)
+                return -1;
+
+        thread_lock_set_depth(lk, 1);
+
+        return 0;
+}
+
+/* thread_lock_release():
+ * Releases the lock taken by thread_lock_read() or thread_lock_write().
+ */
+void thread_lock_release(struct thread_lock *lk)
+{
+        uintptr_t depth;
+
+        if (!lk->active)
+                return;
+
+        depth = thread_lock_depth(lk);
+        if (depth) {
+                thread_lock_set_depth(lk, depth - 1);
+                if (depth > 1)
+                        return;
+        }
+
+        pthread_rwlock_unlock(&lk->rwlock);
+}
+
+/* thread_lock_writer_acquire():
+ * Acquire the writer slot. Like file_lock_acquire(), a `timeout_ms` of 0
+ * tries only once and a negative `timeout_ms` waits forever.
+ * returns -1 on failure and 0 on success.
+ */
+int thread_lock_writer_acquire(struct thread_lock *lk, long timeout_ms)
+{
+        long waited_ms = 0;
+
+        if (!lk->active)
+                return 0;
+
+        if (timeout_ms < 0) {
+                if (pthread_mutex_lock(&lk->wmutex) != 0)
+                        return -1;
+                goto done;
+        }
+
+        while (pthread_mutex_trylock(&lk->wmutex) != 0) {
+                if (waited_ms >= timeout_ms)
+                        return -1;
+                sleep_ms(1);
+                waited_ms++;
+        }
+
+done:
+        held_lock(lk, 1)->writer = 1;
+        return 0;
+}
+
+/* thread_lock_writer_release():
+ * returns -1 on failure and 0 on success.
+ */
+int thread_lock_writer_release(struct thread_lock *lk)
+{
+        struct held_lock *h;
+
+        if (!lk->active)
+                return 0;
+
+        h = held_lock(lk, 0);
+        if (!h || !h->writer)
+                return -1;
+
+        h->writer = 0;
+        held_lock_put(h);
+
+        return pthread_mutex_unlock(&lk->wmutex) ? -1 : 0;
+}
+
+/* thread_lock_writer_is_held():
+ * 1 if the calling thread holds the writer slot, or the lock is inactive.
+ */
+int thread_lock_writer_is_held(struct thread_lock *lk)
+{
+        struct held_lock *h;
+
+        if (!lk->active)
+                return 1;
+
+        h = held_lock(lk, 0);
+
+        return h && h->writer;
+}
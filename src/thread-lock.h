@@ -0,0 +1,50 @@
+/*
+ * thread-lock.h
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#ifndef _ZS_THREAD_LOCK_H_
+#define _ZS_THREAD_LOCK_H_
+
+#include <pthread.h>
+
+/*
+ * In-process locking for DB handles that are shared between threads.
+ *
+ * `rwlock` protects the in-memory state of the DB. Any number of threads may
+ * hold it for reading, one thread may hold it for writing. The writer may
+ * take it again, for reading or writing, which allows zsdb_foreach()
+ * callbacks to modify the DB.
+ *
+ * `wmutex` serialises write transactions between threads, in the same way
+ * the write lock file serialises them between processes.
+ *
+ * Which locks a thread holds, how deep, and whether it has the writer slot
+ * is kept per thread, in thread-lock.c.
+ *
+ * An inactive lock is a no-op.
+ */
+struct thread_lock {
+        pthread_rwlock_t rwlock;
+        pthread_mutex_t wmutex;
+        int active;
+};
+
+#define THREAD_LOCK_INIT  { .active = 0 }
+
+int thread_lock_init(struct thread_lock *lk);
+void thread_lock_destroy(struct thread_lock *lk);
+void thread_lock_read(struct thread_lock *lk);
+void thread_lock_write(struct thread_lock *lk);
+int thread_lock_try_write(struct thread_lock *lk);
+void thread_lock_release(struct thread_lock *lk);
+int thread_lock_writer_acquire(struct thread_lock *lk, long timeout_ms);
+int thread_lock_writer_release(struct thread_lock *lk);
+int thread_lock_writer_is_held(struct thread_lock *lk);
+
+#endif  /* _ZS_THREAD_LOCK_H_ */
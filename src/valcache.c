@@ -0,0 +1,346 @@
+/*
+ * valcache.c
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <libzeroskip/util.h>
+#include <libzeroskip/valcache.h>
+
+/* The sketch has about a counter per 64 bytes of the budget, in these
+ * bounds */
+#define SKETCH_MIN_WIDTH        1024
+#define SKETCH_MAX_WIDTH        (1 << 22)
+#define SKETCH_BYTES_PER_KEY    64
+
+/* The counts are halved after this many lookups per counter of a row */
+#define SKETCH_SAMPLE           10
+
+/**
+ * Private functions
+ */
+static int entry_cmpfn(const void *unused1 _unused_, const void *entry1,
+                       const void *entry2, const void *unused2 _unused_)
+{
+        const struct valcache_entry *e1 = entry1;
+        const struct valcache_entry *e2 = entry2;
+
+        return memcmp_raw(e1->key, e1->keylen, e2->key, e2->keylen);
+}
+
+static size_t entry_size(size_t keylen, size_t vallen)
+{
+        return sizeof(struct valcache_entry) + keylen + vallen;
+}
+
+static struct valcache_entry *lookup(struct valcache *cache,
+                                     const unsigned char *key, size_t keylen,
+                                     uint64_t hash)
+{
+        struct valcache_entry k;
+
+        htable_entry_init(&k, (unsigned int)hash);
+        k.key = key;
+        k.keylen = keylen;
+
+        return htable_get(&cache->table, &k, NULL);
+}
+
+/* sketch_counter():
+ * The counter of the hash in row `row`, each row hashed differently from
+ * the two halves of the hash.
+ */
+static uint8_t *sketch_counter(struct valcache *cache, uint64_t hash,
+                               unsigned int row)
+{
+        uint64_t h1 = hash & 0xffffffff, h2 = (hash >> 32) | 1;
+
+        return &cache->sketch[row * cache->width +
+                              ((h1 + row * h2) & (cache->width - 1))];
+}
+
+static unsigned int sketch_count(struct valcache *cache, uint64_t hash)
+{
+        unsigned int row, count = VALCACHE_SKETCH_MAX;
+
+        for (row = 0; row < VALCACHE_SKETCH_ROWS; row++) {
+                uint8_t *c = sketch_counter(cache, hash, row);
+                if (*c < count)
+                        count = *c;
+        }
+
+        return count;
+}
+
+/* sketch_add():
+ * Counts a lookup of the hash, in those of its counters that are the
+ * smallest only, so that the others aren't made any further off. Once
+ * there have been enough lookups, all the counts are halved.
+ */
+static void sketch_add(struct valcache *cache, uint64_t hash)
+{
+        unsigned int row, count = sketch_count(cache, hash);
+        uint64_t i;
+
+        if (count < VALCACHE_SKETCH_MAX) {
+                for (row = 0; row < VALCACHE_SKETCH_ROWS; row++) {
+                        uint8_t *c = sketch_counter(cache, hash, row);
+                        if (*c == count)
+                                (*c)++;
+                }
+        }
+
+        if (++cache->additions < cache->width * SKETCH_SAMPLE)
+                return;
+
+        for (i = 0; i < cache->width * VALCACHE_SKETCH_ROWS; i++)
+                cache->sketch[i] >>= 1;
+        cache->additions /= 2;
+}
+
+/* retire():
+ * Takes `e` out of the cache, to be freed by valcache_reclaim().
+ */
+static void retire(struct valcache *cache, struct valcache_entry *e)
+{
+        struct valcache_entry *last;
+
+        htable_remove(&cache->table, e, NULL);
+
+        /* The last entry of the clock takes its place */
+        last = cache->clock[--cache->nclock];
+        cache->clock[e->slot] = last;
+        last->slot = e->slot;
+        if (cache->hand >= cache->nclock)
+                cache->hand = 0;
+
+        cache->bytes -= entry_size(e->keylen, e->vallen);
+        cache->retiredbytes += entry_size(e->keylen, e->vallen);
+        e->next = cache->retired;
+        cache->retired = e;
+}
+
+/* clock_victim():
+ * The entry the hand stops at, the first that wasn't hit since it last
+ * went by. Those that were get another round.
+ */
+static struct valcache_entry *clock_victim(struct valcache *cache)
+{
+        while (1) {
+                struct valcache_entry *e = cache->clock[cache->hand];
+
+                cache->hand = (cache->hand + 1) % cache->nclock;
+                if (!e->ref)
+                        return e;
+                e->ref = 0;
+        }
+}
+
+static void retire_all(struct valcache *cache)
+{
+        while (cache->nclock) {
+                retire(cache, cache->clock[cache->nclock - 1]);
+                cache->stats.invalidated++;
+        }
+}
+
+/**
+ * Public functions
+ */
+struct valcache *valcache_new(size_t budget)
+{
+        struct valcache *cache;
+        uint64_t width;
+
+        cache = xcalloc(1, sizeof(struct valcache));
+        pthread_mutex_init(&cache->lock, NULL);
+        htable_init(&cache->table, entry_cmpfn, NULL, 0);
+        cache->budget = budget;
+
+        for (width = SKETCH_MIN_WIDTH; width < SKETCH_MAX_WIDTH &&
+                     width < budget / SKETCH_BYTES_PER_KEY; width <<= 1)
+                ;
+        cache->width = width;
+        cache->sketch = xcalloc(VALCACHE_SKETCH_ROWS, width);
+
+        return cache;
+}
+
+void valcache_free(struct valcache **cachep)
+{
+        struct valcache *cache;
+
+        if (!cachep || !*cachep)
+                return;
+
+        cache = *cachep;
+        *cachep = NULL;
+
+        retire_all(cache);
+        valcache_reclaim(cache);
+
+        htable_free(&cache->table, 0);
+        xfree(cache->clock);
+        xfree(cache->sketch);
+        pthread_mutex_destroy(&cache->lock);
+        xfree(cache);
+}
+
+int valcache_get(struct valcache *cache, const unsigned char *key,
+                 size_t keylen, uint64_t hash, const unsigned char **value,
+                 size_t *vallen)
+{
+        struct valcache_entry *e;
+
+        pthread_mutex_lock(&cache->lock);
+
+        sketch_add(cache, hash);
+
+        e = lookup(cache, key, keylen, hash);
+        if (e) {
+                e->ref = 1;
+                *value = e->val;
+                *vallen = e->vallen;
+                cache->stats.hits++;
+        } else {
+                cache->stats.misses++;
+        }
+
+        pthread_mutex_unlock(&cache->lock);
+
+        return e ? 1 : 0;
+}
+
+int valcache_put(struct valcache *cache, const unsigned char *key,
+                 size_t keylen, uint64_t hash, const unsigned char *value,
+                 size_t vallen)
+{
+        struct valcache_entry *e;
+        size_t size = entry_size(keylen, vallen);
+        unsigned int count;
+        int ret = 0;
+
+        pthread_mutex_lock(&cache->lock);
+
+        /* Put in by another thread in the meantime */
+        if (lookup(cache, key, keylen, hash))
+                goto done;
+
+        /* Values too big for the cache to hold many of, or more than it can
+         * hold until the retired ones are freed, aren't cached */
+        if (size > cache->budget / 8 ||
+            cache->retiredbytes + size > cache->budget)
+                goto reject;
+
+        /* Only what's looked up more often than what it would replace */
+        count = sketch_count(cache, hash);
+        while (cache->bytes + size > cache->budget) {
+                struct valcache_entry *victim = clock_victim(cache);
+
+                if (sketch_count(cache, victim->hash) >= count)
+                        goto reject;
+
+                retire(cache, victim);
+                cache->stats.evicted++;
+        }
+
+        e = xmalloc(size);
+        htable_entry_init(e, (unsigned int)hash);
+        e->hash = hash;
+        e->key = (const unsigned char *)(e + 1);
+        memcpy(e + 1, key, keylen);
+        e->keylen = keylen;
+        e->val = e->key + keylen;
+        memcpy((unsigned char *)(e + 1) + keylen, value, vallen);
+        e->vallen = vallen;
+        e->ref = 0;
+        e->next = NULL;
+
+        ALLOC_GROW(cache->clock, cache->nclock + 1, cache->alloc);
+        e->slot = cache->nclock;
+        cache->clock[cache->nclock++] = e;
+        htable_put(&cache->table, e);
+
+        cache->bytes += size;
+        cache->stats.admitted++;
+        ret = 1;
+        goto done;
+
+reject:
+        cache->stats.rejected++;
+done:
+        pthread_mutex_unlock(&cache->lock);
+        return ret;
+}
+
+void valcache_remove(struct valcache *cache, const unsigned char *key,
+                     size_t keylen, uint64_t hash)
+{
+        struct valcache_entry *e;
+
+        pthread_mutex_lock(&cache->lock);
+
+        e = lookup(cache, key, keylen, hash);
+        if (e) {
+                retire(cache, e);
+                cache->stats.invalidated++;
+        }
+
+        pthread_mutex_unlock(&cache->lock);
+}
+
+void valcache_sync(struct valcache *cache, uint64_t generation)
+{
+        pthread_mutex_lock(&cache->lock);
+
+        if (generation != cache->generation) {
+                retire_all(cache);
+                cache->generation = generation;
+        }
+
+        pthread_mutex_unlock(&cache->lock);
+}
+
+void valcache_reclaim(struct valcache *cache)
+{
+        struct valcache_entry *e, *next;
+
+        pthread_mutex_lock(&cache->lock);
+
+        for (e = cache->retired; e; e = next) {
+                next = e->next;
+                xfree(e);
+        }
+        cache->retired = NULL;
+        cache->retiredbytes = 0;
+
+        pthread_mutex_unlock(&cache->lock);
+}
+
+void valcache_drop(struct valcache *cache)
+{
+        pthread_mutex_lock(&cache->lock);
+        while (cache->nclock) {
+                retire(cache, cache->clock[cache->nclock - 1]);
+                cache->stats.evicted++;
+        }
+        pthread_mutex_unlock(&cache->lock);
+
+        valcache_reclaim(cache);
+}
+
+void valcache_get_stats(struct valcache *cache, struct valcache_stats *stats)
+{
+        pthread_mutex_lock(&cache->lock);
+
+        *stats = cache->stats;
+        stats->entries = cache->nclock;
+        stats->bytes = cache->bytes + cache->retiredbytes;
+        stats->budget = cache->budget;
+
+        pthread_mutex_unlock(&cache->lock);
+}
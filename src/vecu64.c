@@ -1,5 +1,5 @@
 /*
- * vecu64.h
+ * vecu64.c
  *
  * This file is part of zeroskip.
  *
@@ -8,6 +8,7 @@
  *
  */
 
+#include <libzeroskip/arena.h>
 #include <libzeroskip/log.h>
 #include <libzeroskip/util.h>
 #include <libzeroskip/vecu64.h>
@@ -15,23 +16,38 @@
 /**
  * Private functions
  */
+static void resize(struct vecu64 *v, uint64_t alloc)
+{
+        v->data = arena_realloc(v->arena, v->data,
+                                v->alloc * sizeof(uint64_t),
+                                st_mult(alloc, sizeof(uint64_t)));
+        v->alloc = alloc;
+}
+
+/* Grows the way ALLOC_GROW() does */
 static void ensure_alloc(struct vecu64 *v, uint64_t newsize)
 {
-        /* uint64_t alloced = v->alloc; */
+        if (newsize <= v->alloc)
+                return;
 
-        ALLOC_GROW(v->data, newsize, v->alloc);
-        /* memset(v->data + alloced, 0, sizeof(uint64_t) * (newsize - alloced)); */
+        resize(v, alloc_nr(v->alloc) < newsize ? newsize : alloc_nr(v->alloc));
 }
 
 /**
  * Public functions
  */
 struct vecu64 *vecu64_new(void)
+{
+        return vecu64_new_arena(NULL);
+}
+
+struct vecu64 *vecu64_new_arena(struct arena *arena)
 {
         struct vecu64 *v;
 
         v = xmalloc(sizeof(struct vecu64));
         memset(v, 0, sizeof(struct vecu64));
+        v->arena = arena;
 
         return v;
 }
@@ -45,10 +61,16 @@ void vecu64_free(struct vecu64 **vptr)
         v = *vptr;
         *vptr = NULL;
 
-        xfree(v->data);
+        arena_release(v->arena, v->data, v->alloc * sizeof(uint64_t));
         xfree(v);
 }
 
+void vecu64_reserve(struct vecu64 *v, uint64_t n)
+{
+        if (n > v->alloc)
+                resize(v, n);
+}
+
 uint64_t vecu64_append(struct vecu64 *v, uint64_t n)
 {
         uint64_t pos;
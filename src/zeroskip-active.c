@@ -220,18 +220,22 @@ int zs_active_file_write_delete_record(struct zsdb_priv *priv,
                                            key, keylen);
 }
 
-int zs_active_file_record_foreach(struct zsdb_priv *priv,
+/* zs_active_file_record_foreach():
+ * Calls `cb` or `deleted_cb` for each of the records in the active file
+ * from `offset`, which must be ZS_HDR_SIZE or the start of a record.
+ */
+int zs_active_file_record_foreach(struct zsdb_priv *priv, uint64_t offset,
                                   zsdb_foreach_cb *cb, zsdb_foreach_cb *deleted_cb,
                                   void *cbdata)
 {
         int ret = ZS_OK;
-        size_t dbsize = 0, offset = ZS_HDR_SIZE;
+        size_t dbsize = 0;
 
         mfile_size(&priv->dbfiles.factive.mf, &dbsize);
-        if (dbsize == 0 || dbsize < ZS_HDR_SIZE) {
+        if (dbsize == 0 || dbsize < ZS_HDR_SIZE || offset < ZS_HDR_SIZE) {
                 zslog(LOGDEBUG, "Not a valid active file.\n");
                 return ZS_INVALID_DB;
-        } else if (dbsize == ZS_HDR_SIZE) {
+        } else if (dbsize <= offset) {
                 zslog(LOGDEBUG, "No records in active file.\n");
                 return ret;
         }
@@ -0,0 +1,385 @@
+/*
+ * zeroskip-checkpoint.c
+ *
+ * Checkpoints of the memtrees, to avoid replaying the DB files on open.
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <libzeroskip/crc32c.h>
+#include <libzeroskip/log.h>
+#include <libzeroskip/memtree.h>
+#include <libzeroskip/mfile.h>
+#include <libzeroskip/util.h>
+#include <libzeroskip/zeroskip.h>
+#include "zeroskip-priv.h"
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+
+struct checkpoint_writer {
+        struct mfile *mf;
+        uint64_t size;
+        uint64_t count;
+        int ret;
+};
+
+/**
+ * Private functions
+ */
+static void checkpoint_fname(struct zsdb_priv *priv, cstring *fname,
+                             const char *suffix)
+{
+        cstring_dup(&priv->dbdir, fname);
+        cstring_addch(fname, '/');
+        cstring_addstr(fname, ZS_CHECKPOINT_FNAME);
+        if (suffix)
+                cstring_addstr(fname, suffix);
+}
+
+static int checkpoint_size_cb(struct record *record, void *data)
+{
+        struct checkpoint_writer *w = (struct checkpoint_writer *)data;
+
+        w->size += ZS_CHECKPOINT_REC_SIZE + record->keylen + record->vallen;
+        w->count++;
+
+        return 1;
+}
+
+static int checkpoint_write_cb(struct record *record, void *data)
+{
+        struct checkpoint_writer *w = (struct checkpoint_writer *)data;
+        unsigned char stackbuf[ZS_CHECKPOINT_REC_SIZE];
+        struct iovec iov[3];
+
+        *((uint64_t *)stackbuf) = hton64(record->keylen);
+        *((uint64_t *)(stackbuf + 8)) = hton64(record->vallen);
+        stackbuf[16] = record->deleted ? 1 : 0;
+
+        iov[0].iov_base = stackbuf;
+        iov[0].iov_len = ZS_CHECKPOINT_REC_SIZE;
+        iov[1].iov_base = record->key;
+        iov[1].iov_len = record->keylen;
+        iov[2].iov_base = record->val;
+        iov[2].iov_len = record->vallen;
+
+        if (mfile_write_iov(&w->mf, iov, 3, NULL)) {
+                w->ret = ZS_IOERROR;
+                return 0;
+        }
+
+        return 1;
+}
+
+/* checkpoint_records_foreach():
+ * Walks `count` records starting at `*ptr`, none of which may run past
+ * `end`, calling `cb` or `deleted_cb` for each. With no callbacks, it
+ * just checks the records.
+ */
+static int checkpoint_records_foreach(const unsigned char **ptr,
+                                      const unsigned char *end,
+                                      uint64_t count,
+                                      zsdb_foreach_cb *cb,
+                                      zsdb_foreach_cb *deleted_cb,
+                                      void *cbdata)
+{
+        const unsigned char *p = *ptr;
+
+        while (count--) {
+                uint64_t keylen, vallen;
+                int deleted;
+
+                if ((uint64_t)(end - p) < ZS_CHECKPOINT_REC_SIZE)
+                        return ZS_INVALID_DB;
+
+                keylen = ntoh64(*((const uint64_t *)p));
+                vallen = ntoh64(*((const uint64_t *)(p + 8)));
+                deleted = p[16];
+                p += ZS_CHECKPOINT_REC_SIZE;
+
+                if (keylen > (uint64_t)(end - p) ||
+                    vallen > (uint64_t)(end - p) - keylen)
+                        return ZS_INVALID_DB;
+
+                if (deleted && deleted_cb)
+                        deleted_cb(cbdata, p, keylen, p + keylen, vallen);
+                else if (!deleted && cb)
+                        cb(cbdata, p, keylen, p + keylen, vallen);
+
+                p += keylen + vallen;
+        }
+
+        *ptr = p;
+
+        return ZS_OK;
+}
+
+/* checkpoint_validate():
+ * Checks that the checkpoint in `mf` is intact, and that it covers the
+ * files that are open now: the same active file, up to an offset it still
+ * has, and exactly the same finalised files.
+ */
+static int checkpoint_validate(struct zsdb_priv *priv, struct mfile *mf,
+                               struct zs_checkpoint_header *hdr)
+{
+        const unsigned char *p, *end;
+        struct list_head *pos;
+        uint64_t activesize = 0;
+        uint32_t crc;
+
+        if (mf->size < ZS_CHECKPOINT_HDR_SIZE)
+                return ZS_INVALID_DB;
+
+        memcpy(hdr, mf->ptr, ZS_CHECKPOINT_HDR_SIZE);
+        if (hdr->signature != ZS_CHECKPOINT_SIGNATURE ||
+            ntoh32(hdr->version) != ZS_CHECKPOINT_VERSION)
+                return ZS_INVALID_DB;
+
+        crc = crc32c_hw(0, 0, 0);
+        crc = crc32c_hw(crc, mf->ptr,
+                        offsetof(struct zs_checkpoint_header, crc));
+        crc = crc32c_hw(crc, mf->ptr + ZS_CHECKPOINT_HDR_SIZE,
+                        mf->size - ZS_CHECKPOINT_HDR_SIZE);
+        if (crc != ntoh32(hdr->crc)) {
+                zslog(LOGDEBUG, "Checkpoint checksum mismatch.\n");
+                return ZS_INVALID_DB;
+        }
+
+        hdr->activeidx = ntoh32(hdr->activeidx);
+        hdr->offset = ntoh64(hdr->offset);
+        hdr->nfiles = ntoh32(hdr->nfiles);
+        hdr->nfrecs = ntoh64(hdr->nfrecs);
+        hdr->narecs = ntoh64(hdr->narecs);
+
+        if (memcmp(hdr->uuid, priv->uuid, sizeof(uuid_t)) != 0)
+                return ZS_INVALID_DB;
+
+        /* The active file */
+        mfile_size(&priv->dbfiles.factive.mf, &activesize);
+        if (hdr->activeidx != priv->dbfiles.factive.header.startidx ||
+            hdr->offset < ZS_HDR_SIZE || hdr->offset > activesize) {
+                zslog(LOGDEBUG, "Checkpoint is for another active file.\n");
+                return ZS_INVALID_DB;
+        }
+
+        /* The finalised files */
+        if (hdr->nfiles != priv->dbfiles.ffcount ||
+            (uint64_t)hdr->nfiles * sizeof(uint32_t) >
+            mf->size - ZS_CHECKPOINT_HDR_SIZE) {
+                zslog(LOGDEBUG, "Checkpoint is for other finalised files.\n");
+                return ZS_INVALID_DB;
+        }
+
+        p = mf->ptr + ZS_CHECKPOINT_HDR_SIZE;
+        list_for_each_forward(pos, &priv->dbfiles.fflist) {
+                struct zsdb_file *f;
+
+                f = list_entry(pos, struct zsdb_file, list);
+                if (ntoh32(*((const uint32_t *)p)) != f->header.startidx) {
+                        zslog(LOGDEBUG,
+                              "Checkpoint is for other finalised files.\n");
+                        return ZS_INVALID_DB;
+                }
+                p += sizeof(uint32_t);
+        }
+
+        /* The records */
+        end = mf->ptr + mf->size;
+        if (checkpoint_records_foreach(&p, end, hdr->nfrecs,
+                                       NULL, NULL, NULL) != ZS_OK ||
+            checkpoint_records_foreach(&p, end, hdr->narecs,
+                                       NULL, NULL, NULL) != ZS_OK ||
+            p != end)
+                return ZS_INVALID_DB;
+
+        return ZS_OK;
+}
+
+/**
+ * Public functions
+ */
+
+/* zs_checkpoint_write():
+ * Writes the records in the memtrees to the checkpoint file, along with the
+ * files they were loaded from. The memtrees must hold just what is in the
+ * finalised files and in the active file up to its current offset, so
+ * there can't be uncommitted changes. The file is written under another
+ * name and renamed into place, so a crash never leaves a partial
+ * checkpoint behind.
+ */
+int zs_checkpoint_write(struct zsdb_priv *priv)
+{
+        int ret = ZS_OK;
+        struct zs_checkpoint_header hdr;
+        struct checkpoint_writer w;
+        cstring fname = CSTRING_INIT;
+        cstring tmpfname = CSTRING_INIT;
+        struct list_head *pos;
+        uint64_t nfrecs;
+        uint32_t crc;
+
+        if (!priv->dbfiles.factive.is_open)
+                return ZS_NOT_OPEN;
+
+        if (priv->dbfiles.factive.dirty) {
+                zslog(LOGDEBUG, "Uncommitted changes, not checkpointing.\n");
+                return ZS_AGAIN;
+        }
+
+        memset(&w, 0, sizeof(struct checkpoint_writer));
+        memset(&hdr, 0, sizeof(struct zs_checkpoint_header));
+
+        /* Size up the file, so it is mapped just the once */
+        w.size = ZS_CHECKPOINT_HDR_SIZE +
+                priv->dbfiles.ffcount * sizeof(uint32_t);
+        memtree_walk_forward(priv->fmemtree, checkpoint_size_cb, &w);
+        nfrecs = w.count;
+        memtree_walk_forward(priv->memtree, checkpoint_size_cb, &w);
+
+        checkpoint_fname(priv, &fname, NULL);
+        checkpoint_fname(priv, &tmpfname, ".tmp");
+
+        xunlink(tmpfname.buf);
+        if (mfile_open(tmpfname.buf, MFILE_RW_CR, &w.mf) != 0) {
+                zslog(LOGDEBUG, "Could not create %s!\n", tmpfname.buf);
+                ret = ZS_IOERROR;
+                goto done;
+        }
+
+        /* The header is filled in last, once the crc is known */
+        if (mfile_write(&w.mf, &hdr, ZS_CHECKPOINT_HDR_SIZE, NULL) != 0 ||
+            mfile_truncate(&w.mf, w.size) != 0) {
+                ret = ZS_IOERROR;
+                goto fail;
+        }
+
+        list_for_each_forward(pos, &priv->dbfiles.fflist) {
+                struct zsdb_file *f;
+                uint32_t idx;
+
+                f = list_entry(pos, struct zsdb_file, list);
+                idx = hton32(f->header.startidx);
+                if (mfile_write(&w.mf, &idx, sizeof(uint32_t), NULL) != 0) {
+                        ret = ZS_IOERROR;
+                        goto fail;
+                }
+        }
+
+        w.ret = ZS_OK;
+        memtree_walk_forward(priv->fmemtree, checkpoint_write_cb, &w);
+        if (w.ret == ZS_OK)
+                memtree_walk_forward(priv->memtree, checkpoint_write_cb, &w);
+        if (w.ret != ZS_OK) {
+                ret = w.ret;
+                goto fail;
+        }
+
+        hdr.signature = ZS_CHECKPOINT_SIGNATURE;
+        hdr.version = hton32(ZS_CHECKPOINT_VERSION);
+        memcpy(hdr.uuid, priv->uuid, sizeof(uuid_t));
+        hdr.activeidx = hton32(priv->dbfiles.factive.header.startidx);
+        hdr.offset = hton64(priv->dbfiles.factive.mf->offset);
+        hdr.nfiles = hton32(priv->dbfiles.ffcount);
+        hdr.nfrecs = hton64(nfrecs);
+        hdr.narecs = hton64(w.count - nfrecs);
+
+        crc = crc32c_hw(0, 0, 0);
+        crc = crc32c_hw(crc, &hdr, offsetof(struct zs_checkpoint_header, crc));
+        crc = crc32c_hw(crc, w.mf->ptr + ZS_CHECKPOINT_HDR_SIZE,
+                        w.size - ZS_CHECKPOINT_HDR_SIZE);
+        hdr.crc = hton32(crc);
+
+        memcpy(w.mf->ptr, &hdr, ZS_CHECKPOINT_HDR_SIZE);
+
+        if (mfile_flush(&w.mf) != 0) {
+                zslog(LOGDEBUG, "Error flushing data to disk.\n");
+                ret = ZS_IOERROR;
+                goto fail;
+        }
+
+        mfile_close(&w.mf);
+
+        if (xrename(tmpfname.buf, fname.buf) != 0) {
+                zslog(LOGDEBUG, "Could not rename %s!\n", tmpfname.buf);
+                xunlink(tmpfname.buf);
+                ret = ZS_IOERROR;
+                goto done;
+        }
+
+        zslog(LOGDEBUG, "Checkpointed %" PRIu64 " records to %s.\n",
+              w.count, fname.buf);
+
+        goto done;
+fail:
+        mfile_close(&w.mf);
+        xunlink(tmpfname.buf);
+done:
+        cstring_release(&tmpfname);
+        cstring_release(&fname);
+        return ret;
+}
+
+/* zs_checkpoint_load():
+ * If there is a checkpoint covering the files that are open, calls `cb` or
+ * `deleted_cb` for each of the records in it, with `fdata` for those of
+ * the finalised files, and `adata` for those of the active file. The
+ * records come in the order of the memtree. `offset` is set to where
+ * the records in the active file have to be read from.
+ * Returns:
+ *   ZS_OK, if the records were loaded from the checkpoint
+ *   ZS_NOTFOUND, if there is no checkpoint
+ *   ZS_INVALID_DB, if the checkpoint is out of date or damaged
+ */
+int zs_checkpoint_load(struct zsdb_priv *priv,
+                       zsdb_foreach_cb *cb, zsdb_foreach_cb *deleted_cb,
+                       void *fdata, void *adata, uint64_t *offset)
+{
+        int ret = ZS_OK;
+        struct zs_checkpoint_header hdr;
+        cstring fname = CSTRING_INIT;
+        struct mfile *mf = NULL;
+        const unsigned char *p, *end;
+
+        if (!priv->dbfiles.factive.is_open)
+                return ZS_NOT_OPEN;
+
+        checkpoint_fname(priv, &fname, NULL);
+
+        if (!file_exists(fname.buf)) {
+                ret = ZS_NOTFOUND;
+                goto done;
+        }
+
+        if (mfile_open(fname.buf, MFILE_RD, &mf) != 0) {
+                zslog(LOGDEBUG, "Could not open %s!\n", fname.buf);
+                ret = ZS_NOTFOUND;
+                goto done;
+        }
+
+        ret = checkpoint_validate(priv, mf, &hdr);
+        if (ret != ZS_OK) {
+                zslog(LOGDEBUG, "Ignoring checkpoint %s.\n", fname.buf);
+                goto done;
+        }
+
+        p = mf->ptr + ZS_CHECKPOINT_HDR_SIZE + hdr.nfiles * sizeof(uint32_t);
+        end = mf->ptr + mf->size;
+        checkpoint_records_foreach(&p, end, hdr.nfrecs, cb, deleted_cb, fdata);
+        checkpoint_records_foreach(&p, end, hdr.narecs, cb, deleted_cb, adata);
+
+        *offset = hdr.offset;
+
+        zslog(LOGDEBUG, "Loaded %" PRIu64 " records from %s.\n",
+              hdr.nfrecs + hdr.narecs, fname.buf);
+done:
+        if (mf)
+                mfile_close(&mf);
+        cstring_release(&fname);
+        return ret;
+}
@@ -82,6 +82,7 @@ int zs_dotzsdb_create(struct zsdb_priv *priv)
         /* Generate a new uuid */
         uuid_generate(uuid);
         uuid_unparse_lower(uuid, priv->dotzsdb.uuidstr);
+        memcpy(priv->uuid, uuid, sizeof(uuid_t));
 
         /* Header */
         priv->dotzsdb.signature = ZS_SIGNATURE;
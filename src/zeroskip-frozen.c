@@ -0,0 +1,256 @@
+/*
+ * zeroskip-frozen.c
+ *
+ * Rolling the active file over, by freezing its memtree and packing it in
+ * the background.
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <libzeroskip/log.h>
+#include <libzeroskip/memtree.h>
+#include <libzeroskip/util.h>
+#include <libzeroskip/zeroskip.h>
+#include "zeroskip-priv.h"
+
+#include <stdio.h>
+
+/**
+ * Private functions
+ */
+static void frozen_fname(struct zsdb_priv *priv, cstring *fname)
+{
+        cstring_dup(&priv->dbdir, fname);
+        cstring_addch(fname, '/');
+        cstring_addstr(fname, ZS_FROZEN_FNAME);
+}
+
+/* frozen_writer():
+ * Writes the frozen memtree to a packed file, under a temporary name. The
+ * frozen memtree isn't changed by anyone, so this needs no lock.
+ */
+static void *frozen_writer(void *arg)
+{
+        struct zsdb_priv *priv = arg;
+        struct zs_frozen *fz = &priv->frozen;
+        cstring fname = CSTRING_INIT;
+        int ret;
+
+        frozen_fname(priv, &fname);
+
+        ret = zs_packed_file_new_from_memtree(fname.buf, fz->idx, fz->idx + 1,
+                                              priv, fz->memtree, &fz->f);
+
+        cstring_release(&fname);
+
+        fz->ret = ret;
+        __atomic_store_n(&fz->done, 1, __ATOMIC_RELEASE);
+
+        return NULL;
+}
+
+/* frozen_fallback():
+ * The packed file couldn't be written, so the records are kept as those of
+ * the finalised file, which they are, just like a finalise would have. The
+ * finalised records are empty as long as there are frozen records.
+ */
+static int frozen_fallback(struct zsdb_priv *priv)
+{
+        struct zs_frozen *fz = &priv->frozen;
+        struct zsdb_file *f = NULL;
+        int ret;
+
+        zslog(LOGWARNING, "Failed packing the records of %s, keeping it.\n",
+              fz->fname.buf);
+
+        ret = zs_finalised_file_open(fz->fname.buf, &f);
+        if (ret != ZS_OK)
+                return ret;
+
+        list_add_head(&f->list, &priv->dbfiles.fflist);
+        priv->dbfiles.ffcount++;
+
+        memtree_free(priv->fmemtree);
+        priv->fmemtree = fz->memtree;
+        fz->memtree = NULL;
+
+        return ZS_OK;
+}
+
+/**
+ * Public functions
+ */
+
+/* zs_frozen_begin():
+ * Rolls the active file over. It is finalised, and kept as the log of its
+ * records until they are packed. Its memtree is frozen, and written to a
+ * packed file in the background, while a new memtree takes its place.
+ * The packed file covers the indexes idx and idx + 1, not to be taken for
+ * the finalised file, so the next active file is idx + 2.
+ * Finalised files would be older than the frozen records, but looked up
+ * before the packed file, so with any of those, or with records still
+ * frozen, ZS_AGAIN is returned for the caller to finalise the active file
+ * instead. Needs the write lock.
+ */
+int zs_frozen_begin(struct zsdb_priv *priv)
+{
+        struct zs_frozen *fz = &priv->frozen;
+        cstring fname = CSTRING_INIT;
+        uint32_t idx = priv->dotzsdb.curidx;
+        int ret;
+
+        if (fz->memtree || !list_empty(&priv->dbfiles.fflist))
+                return ZS_AGAIN;
+
+        ret = zs_active_file_finalise(priv);
+        if (ret != ZS_OK)
+                return ret;
+
+        /* The name the active file was finalised to */
+        zs_filename_generate_packed(priv, &fz->fname, idx, idx);
+
+        fz->idx = idx;
+        fz->memtree = priv->memtree;
+        fz->f = NULL;
+        fz->done = 0;
+        fz->ret = ZS_OK;
+        priv->memtree = memtree_new_arena(NULL, priv->btcompare, priv->arena);
+        priv->generation++;
+
+        /* Left behind by a crash */
+        frozen_fname(priv, &fname);
+        xunlink(fname.buf);
+        cstring_release(&fname);
+
+        if (pthread_create(&fz->thread, NULL, frozen_writer, priv) == 0) {
+                fz->running = 1;
+        } else {
+                zslog(LOGDEBUG, "Failed starting the writer, packing now.\n");
+                frozen_writer(priv);
+        }
+
+        ret = zs_active_file_new(priv, idx + 2);
+        zslog(LOGDEBUG, "New active log file %s created.\n",
+              priv->dbfiles.factive.fname.buf);
+
+        return ret;
+}
+
+/* zs_frozen_publish():
+ * Once the writer is done, waiting for it if `wait` is set, moves the
+ * packed file in place and drops the frozen records and the finalised
+ * file. Until then, readers keep finding the records in the frozen
+ * memtree. Called with the thread lock held for writing, returns ZS_AGAIN
+ * if the writer isn't done, and `wait` isn't set.
+ */
+int zs_frozen_publish(struct zsdb_priv *priv, int wait)
+{
+        struct zs_frozen *fz = &priv->frozen;
+        cstring fname = CSTRING_INIT, tmpfname = CSTRING_INIT;
+        struct zsdb_file *f = NULL;
+        struct list_head *pos;
+        uint64_t priority = 0;
+        int ret;
+
+        if (!fz->memtree)
+                return ZS_OK;
+
+        if (!wait && !__atomic_load_n(&fz->done, __ATOMIC_ACQUIRE))
+                return ZS_AGAIN;
+
+        if (fz->running) {
+                pthread_join(fz->thread, NULL);
+                fz->running = 0;
+        }
+
+        frozen_fname(priv, &tmpfname);
+        zs_filename_generate_packed(priv, &fname, fz->idx, fz->idx + 1);
+
+        ret = fz->ret;
+        if (ret == ZS_OK) {
+                zs_packed_file_close(&fz->f);
+                fz->f = NULL;
+
+                if (rename(tmpfname.buf, fname.buf) < 0) {
+                        perror("Rename");
+                        ret = ZS_IOERROR;
+                } else {
+                        ret = zs_packed_file_open(fname.buf, &f);
+                        if (ret != ZS_OK)
+                                xunlink(fname.buf);
+                }
+        }
+
+        if (ret != ZS_OK) {
+                xunlink(tmpfname.buf);
+                ret = frozen_fallback(priv);
+                goto done;
+        }
+
+        list_add_head(&f->list, &priv->dbfiles.pflist);
+        priv->dbfiles.pfcount++;
+
+        /* Set priority of packed files */
+        list_for_each_forward(pos, &priv->dbfiles.pflist) {
+                struct zsdb_file *pf;
+                pf = list_entry(pos, struct zsdb_file, list);
+                pf->priority = ++priority;
+        }
+
+        xunlink(fz->fname.buf);
+
+        memtree_free(fz->memtree);
+        fz->memtree = NULL;
+
+        /* Let the other processes know the files have changed */
+        if (zs_dotzsdb_update_begin(priv) && zs_dotzsdb_update_end(priv))
+                zs_dotzsdb_update_stat(priv);
+
+        zslog(LOGDEBUG, "Packed file %s published.\n", fname.buf);
+
+done:
+        if (!fz->memtree) {
+                cstring_release(&fz->fname);
+                priv->generation++;
+        }
+
+        cstring_release(&tmpfname);
+        cstring_release(&fname);
+
+        return ret;
+}
+
+/* zs_frozen_free():
+ * Drops the frozen records, for when the DB is closed without them being
+ * published. The finalised file is left for the next open.
+ */
+void zs_frozen_free(struct zsdb_priv *priv)
+{
+        struct zs_frozen *fz = &priv->frozen;
+
+        if (fz->running) {
+                pthread_join(fz->thread, NULL);
+                fz->running = 0;
+        }
+
+        if (fz->f) {
+                cstring fname = CSTRING_INIT;
+
+                zs_packed_file_close(&fz->f);
+                fz->f = NULL;
+                frozen_fname(priv, &fname);
+                xunlink(fname.buf);
+                cstring_release(&fname);
+        }
+
+        if (fz->memtree) {
+                memtree_free(fz->memtree);
+                fz->memtree = NULL;
+        }
+
+        cstring_release(&fz->fname);
+}
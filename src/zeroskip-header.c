@@ -121,7 +121,9 @@ int zs_header_validate(struct zsdb_file *f)
                 return ZS_INVALID_DB;
         }
 
-        phdr = (struct zs_header *)f->mf->ptr;
+        phdr = (struct zs_header *)mfile_range(f->mf, 0, ZS_HDR_SIZE);
+        if (!phdr)
+                return ZS_IOERROR;
 
         /* Signature */
         if (phdr->signature != ZS_SIGNATURE) {
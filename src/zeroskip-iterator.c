@@ -224,6 +224,29 @@ static void zsdb_iter_datav_clear_iter(struct zsdb_iter *iter)
 static void zsdb_iter_data_process(struct zsdb_iter *iter,
                                    unsigned char *key, uint64_t keylen,
                                    struct zsdb_iter_data *new_iterd);
+
+/* zsdb_iter_account():
+ * Account the memory used by `iter`, once it has been positioned, with the
+ * DB. The queue and the table of keys change as the iterator moves, but by
+ * no more than one entry per backend.
+ */
+static void zsdb_iter_account(struct zsdb_iter *iter)
+{
+        struct zsdb_priv *priv = iter->db->priv;
+        size_t bytes;
+
+        bytes = sizeof(struct zsdb_iter) +
+                iter->iter_data_alloc * sizeof(struct zsdb_iter_data *) +
+                iter->iter_data_count * sizeof(struct zsdb_iter_data) +
+                iter->pq.alloc * sizeof(struct pqueue_data) +
+                iter->pq.count * sizeof(struct iter_key_data) +
+                iter->ht.table.size * sizeof(struct htable_slot) +
+                iter->ht.table.count * sizeof(struct iter_htable_entry);
+
+        __atomic_add_fetch(&priv->iterbytes, bytes - iter->bytes,
+                           __ATOMIC_RELAXED);
+        iter->bytes = bytes;
+}
 /* Get next entry in zsdb_iter_data */
 static int zsdb_iter_data_next(struct zsdb_iter *iter,
                                struct zsdb_iter_data *iterdata)
@@ -252,9 +275,11 @@ static int zsdb_iter_data_next(struct zsdb_iter *iter,
                 struct zsdb_file *f = iterdata->data.f;
                 enum record_t rectype = REC_TYPE_UNUSED;
                 f->indexpos++;
-                if (f->indexpos < f->index->count)
-                        zs_packed_file_get_key_from_offset(f, &key,
-                                                           &keylen, &rectype);
+                if (f->indexpos < zs_packed_file_count(f) &&
+                    zs_packed_file_get_key_from_offset(f, &key, &keylen,
+                                                       &rectype) != ZS_OK)
+                        zslog(LOGWARNING, "Could not read a key of %s\n",
+                              f->fname.buf);
                 if (rectype == REC_TYPE_DELETED || rectype == REC_TYPE_LONG_DELETED)
                         iterdata->deleted = 1;
 
@@ -290,10 +315,8 @@ static void zsdb_iter_data_process(struct zsdb_iter *iter,
                  */
                 struct zsdb_iter_data *old_iterd = e->value;
                 if (new_iterd->priority > old_iterd->priority) {
-                        /* Replace it with new iter_data */
-                        e = iter_htable_remove(&iter->ht, key, keylen);
-                        free_iter_htable_entry(&e);
-                        iter_htable_put(&iter->ht, key, keylen, new_iterd);
+                        /* Replace it with new iter_data, the key stays */
+                        e->value = new_iterd;
                         /* Process the old iterd */
                         zsdb_iter_data_next(iter, old_iterd);
                 } else {
@@ -344,6 +367,10 @@ int zs_iterator_new(struct zsdb *db, struct zsdb_iter **iter)
         t->iter_data_alloc = 0;
         t->forone_iter = 0;
 
+        t->bytes = sizeof(struct zsdb_iter);
+        __atomic_add_fetch(&priv->iterbytes, t->bytes, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&priv->itercount, 1, __ATOMIC_RELAXED);
+
         *iter = t;
 
         return ZS_OK;
@@ -359,7 +386,7 @@ int zs_iterator_begin(struct zsdb_iter **iter)
         struct zsdb_priv *priv;
         struct list_head *pos;
         int prio = 0;
-        struct zsdb_iter_data *fiterd, *aiterd;
+        struct zsdb_iter_data *fiterd, *ziterd, *aiterd;
 
         if (!iter || !*iter) {
                 zslog(LOGWARNING, "Invalid iterator!\n");
@@ -392,13 +419,18 @@ int zs_iterator_begin(struct zsdb_iter **iter)
                 piterd = zsdb_iter_data_alloc(ZSDB_BE_PACKED, f->priority,
                                               f, NULL);
                 prio = f->priority;
+                zsdb_iter_datav_add_iter(*iter, piterd);
 
-                zs_packed_file_get_key_from_offset(f, &key, &keylen, &rectype);
+                if (zs_packed_file_get_key_from_offset(f, &key, &keylen,
+                                                       &rectype) != ZS_OK) {
+                        zslog(LOGWARNING, "Could not read a key of %s\n",
+                              f->fname.buf);
+                        piterd->done = 1;
+                        continue;
+                }
                 if (rectype == REC_TYPE_DELETED || rectype == REC_TYPE_LONG_DELETED)
                         piterd->deleted = 1;
 
-                zsdb_iter_datav_add_iter(*iter, piterd);
-
                 zsdb_iter_data_process(*iter, key, keylen, piterd);
         }
 
@@ -414,6 +446,18 @@ int zs_iterator_begin(struct zsdb_iter **iter)
                                        fiterd);
         }
 
+        /* Add the frozen records to the iterator */
+        if (priv->frozen.memtree && priv->frozen.memtree->count) {
+                prio++;
+                ziterd = zsdb_iter_data_alloc(ZSDB_BE_FINALISED, prio,
+                                              priv->frozen.memtree, NULL);
+                ziterd->deleted = ziterd->data.iter->record->deleted;
+                zsdb_iter_datav_add_iter(*iter, ziterd);
+                zsdb_iter_data_process(*iter, ziterd->data.iter->record->key,
+                                       ziterd->data.iter->record->keylen,
+                                       ziterd);
+        }
+
         /* Add active file to the iterator */
         if (priv->memtree->count) {
                 prio++;
@@ -426,6 +470,8 @@ int zs_iterator_begin(struct zsdb_iter **iter)
                                        aiterd);
         }
 
+        zsdb_iter_account(*iter);
+
         return ZS_OK;
 }
 
@@ -442,8 +488,8 @@ int zs_iterator_begin_at_key(struct zsdb_iter **iter,
         struct zsdb_priv *priv;
         struct list_head *pos;
         int prio = 0;
-        memtree_iter_t aiter, fiter;
-        struct zsdb_iter_data *fiterd, *aiterd;
+        memtree_iter_t aiter, fiter, ziter;
+        struct zsdb_iter_data *fiterd, *ziterd, *aiterd;
 
         if (!iter || !*iter) {
                 zslog(LOGWARNING, "Invalid iterator!\n");
@@ -465,6 +511,7 @@ int zs_iterator_begin_at_key(struct zsdb_iter **iter,
                 uint64_t location = 0;
                 unsigned char *nextkey = NULL;
                 uint64_t nextkeylen = 0;
+                int cmp_ret;
 
                 f = list_entry(pos, struct zsdb_file, list);
                 prio = f->priority;
@@ -472,9 +519,25 @@ int zs_iterator_begin_at_key(struct zsdb_iter **iter,
                 zslog(LOGDEBUG, "Looking in packed file %s\n",
                       f->fname.buf);
                 zslog(LOGDEBUG, "\tTotal records: %d\n",
-                      f->index->count);
-
-                if (zs_packed_file_bsearch_index(key, keylen, f,
+                      zs_packed_file_count(f));
+
+                /* Files with all their keys before the key have nothing
+                 * to add, and those with all of them after it start at
+                 * the beginning */
+                cmp_ret = zs_packed_file_cmp_bounds(f, key, keylen,
+                                                    priv->dbcompare);
+                if (cmp_ret > 0)
+                        continue;
+
+                /* Nor do those without a key with the prefix scanned for */
+                if ((*iter)->prefixlen &&
+                    !zs_packed_file_may_contain_prefix(f, (*iter)->prefix,
+                                                       (*iter)->prefixlen,
+                                                       priv->dbcompare))
+                        continue;
+
+                if (cmp_ret == 0 &&
+                    zs_packed_file_bsearch_index(key, keylen, f,
                                                  &location, NULL, 0,
                                                  priv->dbcompare)) {
                         zslog(LOGDEBUG, "Record found at location %ld\n",
@@ -488,9 +551,14 @@ int zs_iterator_begin_at_key(struct zsdb_iter **iter,
                                               f, NULL);
                 zsdb_iter_datav_add_iter(*iter, piterd);
 
-                zs_packed_file_get_key_from_offset(f, &nextkey,
-                                                   &nextkeylen,
-                                                   NULL);
+                if (zs_packed_file_get_key_from_offset(f, &nextkey,
+                                                       &nextkeylen,
+                                                       NULL) != ZS_OK) {
+                        zslog(LOGWARNING, "Could not read a key of %s\n",
+                              f->fname.buf);
+                        piterd->done = 1;
+                        continue;
+                }
                 zsdb_iter_data_process(*iter, nextkey, nextkeylen, piterd);
         }
 
@@ -509,6 +577,24 @@ int zs_iterator_begin_at_key(struct zsdb_iter **iter,
                                        fiterd->data.iter->record->keylen, fiterd);
         }
 
+        /* Look for the key in the frozen records and add the iterator */
+        prio++;
+        if (priv->frozen.memtree) {
+                if (memtree_find(priv->frozen.memtree, key, keylen, ziter))
+                        *found = 1;
+
+                if (priv->frozen.memtree->count && ziter->record) {
+                        ziterd = zsdb_iter_data_alloc(ZSDB_BE_FINALISED, prio,
+                                                      priv->frozen.memtree,
+                                                      &ziter);
+                        zsdb_iter_datav_add_iter(*iter, ziterd);
+                        zsdb_iter_data_process(*iter,
+                                               ziterd->data.iter->record->key,
+                                               ziterd->data.iter->record->keylen,
+                                               ziterd);
+                }
+        }
+
         /* Look for the key in the active in-memory memtree and add the iterator */
         prio++;
         if (memtree_find(priv->memtree, key, keylen, aiter)) {
@@ -524,6 +610,8 @@ int zs_iterator_begin_at_key(struct zsdb_iter **iter,
                                        aiterd->data.iter->record->keylen, aiterd);
         }
 
+        zsdb_iter_account(*iter);
+
         return ZS_OK;
 }
 
@@ -568,11 +656,19 @@ int zs_iterator_begin_for_packed_files(struct zsdb_iter **iter,
                                               f, NULL);
                 zsdb_iter_datav_add_iter(*iter, piterd);
 
-                zs_packed_file_get_key_from_offset(f, &key, &keylen, NULL);
+                if (zs_packed_file_get_key_from_offset(f, &key, &keylen,
+                                                       NULL) != ZS_OK) {
+                        zslog(LOGWARNING, "Could not read a key of %s\n",
+                              f->fname.buf);
+                        piterd->done = 1;
+                        continue;
+                }
 
                 zsdb_iter_data_process(*iter, key, keylen, piterd);
         }
 
+        zsdb_iter_account(*iter);
+
         return ZS_OK;
 }
 
@@ -591,22 +687,87 @@ struct zsdb_iter_data *zs_iterator_get(struct zsdb_iter *iter)
         assert(iter->db);
         assert(iter->db->priv);
 
-        ikdata = pqueue_get(&iter->pq);
-        if (!ikdata)
-                return NULL;
+        /* Keys left behind in the queue by zs_iterator_sync_active() have
+         * no entry in the table, and are skipped */
+        while (!iterdata) {
+                ikdata = pqueue_get(&iter->pq);
+                if (!ikdata)
+                        return NULL;
+
+                entry = iter_htable_get(&iter->ht, ikdata->key, ikdata->len);
+                if (entry) {
+                        iterdata = entry->value;
+                        entry = iter_htable_remove(&iter->ht, ikdata->key,
+                                                   ikdata->len);
+                        free_iter_htable_entry(&entry);
+                }
 
-        entry = iter_htable_get(&iter->ht, ikdata->key, ikdata->len);
-        if (entry) {
-                iterdata = entry->value;
-                entry = iter_htable_remove(&iter->ht, ikdata->key, ikdata->len);
-                free_iter_htable_entry(&entry);
+                free_iter_key_data(&ikdata);
         }
 
-        free_iter_key_data(&ikdata);
-
         return iterdata;
 }
 
+/* zs_iterator_sync_active():
+ * To be called when records have been added to, or replaced in the active
+ * memtree, while `iter` was at `key`, the key of `data`, as returned by
+ * zs_iterator_get(). Nothing else can have changed, so rather than begin
+ * the iterator again, only the active memtree is put back to just past
+ * `key`. Its memtree iterator finds its own way when it is `data`.
+ */
+void zs_iterator_sync_active(struct zsdb_iter *iter,
+                             struct zsdb_iter_data *data,
+                             const unsigned char *key,
+                             size_t keylen)
+{
+        struct zsdb_priv *priv = iter->db->priv;
+        struct zsdb_iter_data *aiterd = NULL;
+        memtree_iter_t miter;
+        int i, prio = 0;
+
+        for (i = 0; i < iter->iter_data_count; i++) {
+                struct zsdb_iter_data *d = iter->datav[i];
+
+                if (d->type == ZSDB_BE_ACTIVE)
+                        aiterd = d;
+                if (d->priority > prio)
+                        prio = d->priority;
+        }
+
+        if (aiterd == data || !priv->memtree->count)
+                return;
+
+        if (aiterd && !aiterd->done) {
+                /* Drop the key it is at from the table, it may no longer
+                 * be the next one. Its copy in the queue is skipped. */
+                struct record *rec = aiterd->data.iter->record;
+                struct iter_htable_entry *e;
+
+                e = iter_htable_get(&iter->ht, rec->key, rec->keylen);
+                if (e && e->value == aiterd) {
+                        e = iter_htable_remove(&iter->ht, rec->key,
+                                               rec->keylen);
+                        free_iter_htable_entry(&e);
+                }
+        }
+
+        if (!aiterd) {
+                aiterd = zsdb_iter_data_alloc(ZSDB_BE_ACTIVE, prio + 1,
+                                              priv->memtree, NULL);
+                zsdb_iter_datav_add_iter(iter, aiterd);
+        }
+
+        memset(miter, 0, sizeof(memtree_iter_t));
+        if (memtree_find(priv->memtree, key, keylen, miter))
+                memtree_next(miter);
+
+        aiterd->data.iter[0] = miter[0];
+        aiterd->done = 0;
+        zsdb_iter_data_next(iter, aiterd);
+
+        zsdb_iter_account(iter);
+}
+
 /* zs_iterator_next():
  * Given a valid iterator pointer, move the next iterator data in the DB
  */
@@ -649,6 +810,11 @@ void zs_iterator_end(struct zsdb_iter **iter)
 
                         f->indexpos = 0;
                 }
+
+                __atomic_sub_fetch(&priv->iterbytes, titer->bytes,
+                                   __ATOMIC_RELAXED);
+                __atomic_sub_fetch(&priv->itercount, 1, __ATOMIC_RELAXED);
+
                 titer->db = NULL;
                 priv = NULL;
 
@@ -0,0 +1,632 @@
+/*
+ * zeroskip-memory.c
+ *
+ * Memory accounting, and the memory budgets of the DBs and of the process.
+ *
+ * This file is part of zeroskip.
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <libzeroskip/log.h>
+#include <libzeroskip/memtree.h>
+#include <libzeroskip/offidx.h>
+#include <libzeroskip/util.h>
+#include <libzeroskip/zeroskip.h>
+#include "zeroskip-priv.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+/* A flush only happens once the memtrees hold at least 1/4 of the budget.
+ * The packed file indexes count against the budget too, but can't be
+ * flushed, so a DB where they take up most of the budget would otherwise
+ * turn every commit into a tiny packed file.
+ */
+#define ZS_FLUSH_MIN_SHARE         4
+#define ZS_FLUSH_LOCK_TIMEOUT_MS   1000
+
+/* Once over the process budget, DBs are flushed until the process is back
+ * under 3/4 of it, so that it isn't over again with the next commit.
+ */
+#define ZS_PROCESS_LOW_SHARE       4
+
+/* The DBs open in the process, and their budget. The list and the
+ * accounting are protected by the mutex. The DBs take it with their own
+ * locks held, so it is never held while flushing one. A DB picked for
+ * eviction is marked busy, and stays on the list until it is done with.
+ */
+static struct {
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;        /* Signalled when a DB is no longer busy */
+        struct list_head dbs;
+        size_t ndbs;
+        size_t limit;
+        size_t used;
+        uint64_t evictions;
+        uint64_t clock;             /* Ticks with every use of a DB */
+} zs_process = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+        .dbs = { &zs_process.dbs, &zs_process.dbs },
+};
+
+/**
+ * Private functions
+ */
+static size_t zs_packed_index_bytes(struct zsdb_priv *priv)
+{
+        struct list_head *pos;
+        size_t bytes = 0;
+
+        list_for_each_forward(pos, &priv->dbfiles.pflist) {
+                struct zsdb_file *f;
+
+                f = list_entry(pos, struct zsdb_file, list);
+                if (f->index)
+                        bytes += offidx_bytes(f->index);
+                if (f->blocks)
+                        bytes += (f->nblocks + 1) * sizeof(struct zs_block);
+                if (f->model)
+                        bytes += keymodel_bytes(f->model);
+                bytes += f->minkey.alloc + f->maxkey.alloc;
+        }
+
+        return bytes;
+}
+
+static void zs_memory_account_files(struct list_head *flist, size_t *mapped,
+                                    size_t *resident)
+{
+        struct list_head *pos;
+
+        list_for_each_forward(pos, flist) {
+                struct zsdb_file *f;
+
+                f = list_entry(pos, struct zsdb_file, list);
+                if (!f->mf)
+                        continue;
+
+                *mapped += mfile_mapped(f->mf);
+                *resident += mfile_resident(f->mf);
+        }
+}
+
+static int zs_memory_over_budget(struct zsdb_priv *priv)
+{
+        size_t limit = priv->membudget.limit;
+        size_t used, flushable = 0;
+
+        if (!limit)
+                return 0;
+
+        used = zs_memory_used(priv, &flushable);
+
+        return (used > limit) && (flushable >= limit / ZS_FLUSH_MIN_SHARE);
+}
+
+/* zs_memory_drop_pages():
+ * Drops the pages of the mapped files from the address space of the
+ * process. They stay in the page cache, and are faulted back in if the DB
+ * is used again.
+ */
+static void zs_memory_drop_pages(struct list_head *flist)
+{
+        struct list_head *pos;
+
+        list_for_each_forward(pos, flist) {
+                struct zsdb_file *f;
+
+                f = list_entry(pos, struct zsdb_file, list);
+                if (f->mf)
+                        mfile_dontneed(f->mf);
+        }
+}
+
+/* zs_memory_release():
+ * For a DB over its budget: empties its value cache, and flushes its
+ * memtrees if that isn't enough. Needs the write lock, and the thread
+ * lock.
+ */
+static void zs_memory_release(struct zsdb *db)
+{
+        struct zsdb_priv *priv = db->priv;
+
+        if (priv->valcache)
+                valcache_drop(priv->valcache);
+
+        if (zs_memory_over_budget(priv)) {
+                zslog(LOGDEBUG, "Flushing `%s`\n", priv->dbdir.buf);
+                zsdb_flush_locked(db, 0);
+        }
+}
+
+/* zs_process_account():
+ * Updates what the DB counts against the process budget. Called with the
+ * process mutex, and the DB locked.
+ */
+static void zs_process_account(struct zsdb_priv *priv)
+{
+        struct zs_procmem *pm = &priv->procmem;
+        size_t bytes, flushable;
+
+        bytes = zs_memory_used(priv, &flushable);
+
+        zs_process.used -= pm->bytes;
+        zs_process.used += bytes;
+        pm->bytes = bytes;
+        pm->flushable = flushable;
+}
+
+/* zs_process_evict_locked():
+ * Flushes the memtrees of a locked DB and empties its value cache, and
+ * accounts for it again.
+ */
+static int zs_process_evict_locked(struct zsdb *db, int drop)
+{
+        struct zsdb_priv *priv = db->priv;
+        int ret;
+
+        if (priv->valcache)
+                valcache_drop(priv->valcache);
+
+        ret = zsdb_flush_locked(db, 1);
+        if (ret == ZS_OK && drop) {
+                zs_memory_drop_pages(&priv->dbfiles.fflist);
+                zs_memory_drop_pages(&priv->dbfiles.pflist);
+        }
+
+        pthread_mutex_lock(&zs_process.mutex);
+        zs_process_account(priv);
+        pthread_mutex_unlock(&zs_process.mutex);
+
+        return ret;
+}
+
+/* zs_process_evict():
+ * Flushes the memtrees of a DB to a packed file and empties its value
+ * cache, for the process to get under its budget, and drops the pages of
+ * its files. `self` is the DB
+ * being committed to, which is locked already, any other DB is skipped if
+ * it is busy. A DB that isn't MODE_THREADED is used from the one thread,
+ * presumably the one it was opened in, so it is left alone in the others.
+ *
+ * The keys and values fetched from a DB are good until its next write, and
+ * a flush counts as one, so a DB that handed some out since its last
+ * write, or has transactions or iterators open, is left alone too. `self`
+ * was just written to.
+ *
+ * Called without the process mutex, with `pm` marked busy.
+ */
+static int zs_process_evict(struct zs_procmem *pm, struct zsdb *self)
+{
+        struct zsdb *db = pm->db;
+        struct zsdb_priv *priv = db->priv;
+        int ret;
+
+        if (db == self) {
+                if (!zsdb_write_lock_is_locked(db))
+                        return ZS_AGAIN;
+
+                return zs_process_evict_locked(db, 0);
+        }
+
+        if (!(priv->flags & MODE_THREADED) &&
+            !pthread_equal(pm->owner, pthread_self()))
+                return ZS_AGAIN;
+
+        if (zsdb_write_lock_acquire(db, 0) != ZS_OK)
+                return ZS_AGAIN;
+
+        if (thread_lock_try_write(&priv->tlk) < 0) {
+                zsdb_write_lock_release(db);
+                return ZS_AGAIN;
+        }
+
+        /* Not in the middle of anything */
+        if (__atomic_load_n(&db->numtrans, __ATOMIC_RELAXED) ||
+            __atomic_load_n(&priv->itercount, __ATOMIC_RELAXED) ||
+            __atomic_load_n(&pm->values, __ATOMIC_RELAXED) ||
+            priv->dbfiles.factive.dirty)
+                ret = ZS_AGAIN;
+        else
+                ret = zs_process_evict_locked(db, 1);
+
+        thread_lock_release(&priv->tlk);
+        zsdb_write_lock_release(db);
+
+        return ret;
+}
+
+static int zs_procmem_cmp(const void *a, const void *b)
+{
+        const struct zs_procmem *pa = *(struct zs_procmem * const *)a;
+        const struct zs_procmem *pb = *(struct zs_procmem * const *)b;
+        uint64_t ua = __atomic_load_n(&pa->lastused, __ATOMIC_RELAXED);
+        uint64_t ub = __atomic_load_n(&pb->lastused, __ATOMIC_RELAXED);
+
+        return (ua > ub) - (ua < ub);
+}
+
+/* zs_process_budget_check():
+ * Accounts for `db`, which is locked. If the process is then over its
+ * budget, the least recently used DBs are flushed, until it is back under
+ * ZS_PROCESS_LOW_SHARE of the budget, or there is nothing left to flush.
+ * The packed file indexes can't be flushed. The DBs to flush are picked
+ * under the process mutex, and flushed without it.
+ */
+static void zs_process_budget_check(struct zsdb *db)
+{
+        struct zsdb_priv *priv = db->priv;
+        struct zs_procmem **dbs = NULL;
+        struct list_head *pos;
+        size_t limit, i, n = 0;
+
+        pthread_mutex_lock(&zs_process.mutex);
+
+        if (!priv->procmem.registered)
+                goto done;
+
+        zs_process_account(priv);
+
+        limit = zs_process.limit;
+        if (!limit || zs_process.used <= limit)
+                goto done;
+
+        dbs = xcalloc(zs_process.ndbs, sizeof(struct zs_procmem *));
+        list_for_each_forward(pos, &zs_process.dbs) {
+                struct zs_procmem *pm;
+
+                pm = list_entry(pos, struct zs_procmem, list);
+                if (pm->flushable && !pm->busy) {
+                        pm->busy = 1;
+                        dbs[n++] = pm;
+                }
+        }
+
+        pthread_mutex_unlock(&zs_process.mutex);
+
+        qsort(dbs, n, sizeof(struct zs_procmem *), zs_procmem_cmp);
+
+        for (i = 0; i < n; i++) {
+                struct zs_procmem *pm = dbs[i];
+                int ret = ZS_AGAIN;
+                int under;
+
+                pthread_mutex_lock(&zs_process.mutex);
+                under = zs_process.used <= limit - limit / ZS_PROCESS_LOW_SHARE;
+                pthread_mutex_unlock(&zs_process.mutex);
+
+                if (!under)
+                        ret = zs_process_evict(pm, db);
+
+                pthread_mutex_lock(&zs_process.mutex);
+                if (ret == ZS_OK) {
+                        zslog(LOGDEBUG, "Evicted `%s`\n",
+                              ((struct zsdb_priv *)pm->db->priv)->dbdir.buf);
+                        zs_process.evictions++;
+                }
+                pm->busy = 0;
+                pthread_cond_broadcast(&zs_process.cond);
+                pthread_mutex_unlock(&zs_process.mutex);
+        }
+
+        xfree(dbs);
+        return;
+
+done:
+        pthread_mutex_unlock(&zs_process.mutex);
+}
+
+/* zs_memory_flusher():
+ * The background flusher. It is a writer like any other, so it waits
+ * for its turn through the write lock.
+ */
+static void *zs_memory_flusher(void *arg)
+{
+        struct zsdb *db = arg;
+        struct zsdb_priv *priv = db->priv;
+        struct zs_membudget *mb = &priv->membudget;
+
+        pthread_mutex_lock(&mb->mutex);
+        while (!mb->stop) {
+                if (!mb->pending) {
+                        pthread_cond_wait(&mb->cond, &mb->mutex);
+                        continue;
+                }
+
+                mb->pending = 0;
+                pthread_mutex_unlock(&mb->mutex);
+
+                if (zsdb_write_lock_acquire(db, ZS_FLUSH_LOCK_TIMEOUT_MS) == ZS_OK) {
+                        thread_lock_write(&priv->tlk);
+                        if (zs_memory_over_budget(priv))
+                                zs_memory_release(db);
+
+                        pthread_mutex_lock(&zs_process.mutex);
+                        if (priv->procmem.registered)
+                                zs_process_account(priv);
+                        pthread_mutex_unlock(&zs_process.mutex);
+
+                        thread_lock_release(&priv->tlk);
+                        zsdb_write_lock_release(db);
+                } else {
+                        zslog(LOGDEBUG, "Flusher couldn't get a write lock\n");
+                }
+
+                pthread_mutex_lock(&mb->mutex);
+        }
+        pthread_mutex_unlock(&mb->mutex);
+
+        return NULL;
+}
+
+/**
+ * Public functions
+ */
+
+/* zs_memory_used():
+ * Returns the memory counted against the budget of the DB, `flushable`, if
+ * not NULL, is set to the part of it a flush can release, with the value
+ * cache, which is emptied along.
+ */
+size_t zs_memory_used(struct zsdb_priv *priv, size_t *flushable)
+{
+        size_t trees = 0;
+
+        if (priv->memtree)
+                trees += priv->memtree->bytes;
+
+        if (priv->fmemtree)
+                trees += priv->fmemtree->bytes;
+
+        if (priv->frozen.memtree)
+                trees += priv->frozen.memtree->bytes;
+
+        if (priv->valcache) {
+                struct valcache_stats vs;
+
+                valcache_get_stats(priv->valcache, &vs);
+                trees += vs.bytes;
+        }
+
+        if (flushable)
+                *flushable = trees;
+
+        return trees + zs_packed_index_bytes(priv);
+}
+
+/* zs_memory_usage():
+ * Fill in `usage` for the DB, needs at least a read lock between threads.
+ */
+void zs_memory_usage(struct zsdb_priv *priv, struct zsdb_memory_usage *usage)
+{
+        struct zsdb_file *factive = &priv->dbfiles.factive;
+
+        memset(usage, 0, sizeof(struct zsdb_memory_usage));
+
+        usage->memtree = priv->memtree ? priv->memtree->bytes : 0;
+        usage->fmemtree = priv->fmemtree ? priv->fmemtree->bytes : 0;
+        usage->frozen = priv->frozen.memtree ? priv->frozen.memtree->bytes : 0;
+        usage->index = zs_packed_index_bytes(priv);
+        usage->iterators = __atomic_load_n(&priv->iterbytes, __ATOMIC_RELAXED);
+        usage->niterators = __atomic_load_n(&priv->itercount,
+                                            __ATOMIC_RELAXED);
+        if (priv->valcache) {
+                struct valcache_stats vs;
+
+                valcache_get_stats(priv->valcache, &vs);
+                usage->valcache = vs.bytes;
+        }
+        usage->heap = usage->memtree + usage->fmemtree + usage->frozen +
+                usage->index + usage->iterators + usage->valcache;
+
+        if (priv->arena) {
+                usage->arena = priv->arena->mapped;
+                usage->arena_hugetlb = priv->arena->hugetlb;
+        }
+
+        if (factive->is_open && factive->mf) {
+                usage->mapped_active = mfile_mapped(factive->mf);
+                usage->resident += mfile_resident(factive->mf);
+        }
+
+        zs_memory_account_files(&priv->dbfiles.fflist,
+                                &usage->mapped_finalised, &usage->resident);
+        zs_memory_account_files(&priv->dbfiles.pflist,
+                                &usage->mapped_packed, &usage->resident);
+
+        usage->mapped = usage->mapped_active + usage->mapped_finalised +
+                usage->mapped_packed;
+}
+
+/* zs_memory_budget_set():
+ * Set the budget, and start the background flusher for handles shared
+ * between threads. Called with the thread lock held.
+ */
+int zs_memory_budget_set(struct zsdb *db, size_t limit)
+{
+        struct zsdb_priv *priv = db->priv;
+        struct zs_membudget *mb = &priv->membudget;
+
+        mb->limit = limit;
+
+        if (!limit || !(priv->flags & MODE_THREADED) || mb->running)
+                return ZS_OK;
+
+        pthread_mutex_init(&mb->mutex, NULL);
+        pthread_cond_init(&mb->cond, NULL);
+        mb->pending = 0;
+        mb->stop = 0;
+
+        if (pthread_create(&mb->thread, NULL, zs_memory_flusher, db) != 0) {
+                zslog(LOGWARNING, "Failed starting the flusher!\n");
+                pthread_cond_destroy(&mb->cond);
+                pthread_mutex_destroy(&mb->mutex);
+                return ZS_ERROR;
+        }
+
+        mb->running = 1;
+
+        return ZS_OK;
+}
+
+/* zs_memory_budget_check():
+ * Called once a transaction is committed, with the write lock held. If the
+ * DB is over its budget, the memtrees are flushed to a packed file, in the
+ * background if there is a flusher.
+ */
+void zs_memory_budget_check(struct zsdb *db)
+{
+        struct zsdb_priv *priv = db->priv;
+        struct zs_membudget *mb = &priv->membudget;
+
+        zs_process_budget_check(db);
+
+        if (!zs_memory_over_budget(priv))
+                return;
+
+        if (mb->running) {
+                pthread_mutex_lock(&mb->mutex);
+                mb->pending = 1;
+                pthread_cond_signal(&mb->cond);
+                pthread_mutex_unlock(&mb->mutex);
+                return;
+        }
+
+        if (zsdb_write_lock_is_locked(db))
+                zs_memory_release(db);
+}
+
+/* zs_memory_budget_stop():
+ * Stop the flusher, if it is running. Must not be called with the thread
+ * lock held.
+ */
+void zs_memory_budget_stop(struct zsdb *db)
+{
+        struct zsdb_priv *priv = db->priv;
+        struct zs_membudget *mb = &priv->membudget;
+
+        if (!mb->running)
+                return;
+
+        pthread_mutex_lock(&mb->mutex);
+        mb->stop = 1;
+        pthread_cond_signal(&mb->cond);
+        pthread_mutex_unlock(&mb->mutex);
+
+        pthread_join(mb->thread, NULL);
+
+        pthread_cond_destroy(&mb->cond);
+        pthread_mutex_destroy(&mb->mutex);
+        mb->running = 0;
+}
+
+/* zs_process_register():
+ * Puts the DB, once it is open, on the list of the process.
+ */
+void zs_process_register(struct zsdb *db)
+{
+        struct zsdb_priv *priv = db->priv;
+        struct zs_procmem *pm = &priv->procmem;
+
+        pthread_mutex_lock(&zs_process.mutex);
+
+        pm->db = db;
+        pm->bytes = 0;
+        pm->flushable = 0;
+        pm->values = 0;
+        pm->busy = 0;
+        pm->owner = pthread_self();
+        pm->lastused = __atomic_add_fetch(&zs_process.clock, 1,
+                                          __ATOMIC_RELAXED);
+        pm->registered = 1;
+        list_add_tail(&pm->list, &zs_process.dbs);
+        zs_process.ndbs++;
+
+        zs_process_account(priv);
+
+        pthread_mutex_unlock(&zs_process.mutex);
+}
+
+/* zs_process_unregister():
+ * Takes the DB off the list of the process, before it is closed.
+ */
+void zs_process_unregister(struct zsdb *db)
+{
+        struct zsdb_priv *priv = db->priv;
+        struct zs_procmem *pm = &priv->procmem;
+
+        pthread_mutex_lock(&zs_process.mutex);
+
+        /* Until whoever is evicting it is done with it */
+        while (pm->busy)
+                pthread_cond_wait(&zs_process.cond, &zs_process.mutex);
+
+        if (pm->registered) {
+                list_del(&pm->list);
+                zs_process.ndbs--;
+                zs_process.used -= pm->bytes;
+                pm->bytes = 0;
+                pm->registered = 0;
+        }
+
+        pthread_mutex_unlock(&zs_process.mutex);
+}
+
+/* zs_process_touch():
+ * Marks the DB as used, which keeps it off the list of DBs to be flushed
+ * for a while.
+ */
+void zs_process_touch(struct zsdb_priv *priv)
+{
+        uint64_t now;
+
+        now = __atomic_add_fetch(&zs_process.clock, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&priv->procmem.lastused, now, __ATOMIC_RELAXED);
+}
+
+/* zs_process_read():
+ * Marks the DB as used, and as having handed out keys and values, which
+ * keeps it from being evicted until its next write.
+ */
+void zs_process_read(struct zsdb_priv *priv)
+{
+        zs_process_touch(priv);
+
+        if (!__atomic_load_n(&priv->procmem.values, __ATOMIC_RELAXED))
+                __atomic_store_n(&priv->procmem.values, 1, __ATOMIC_RELAXED);
+}
+
+/* zs_process_write():
+ * Marks the DB as used, and written to, which is the end of the keys and
+ * values it handed out.
+ */
+void zs_process_write(struct zsdb_priv *priv)
+{
+        zs_process_touch(priv);
+
+        if (__atomic_load_n(&priv->procmem.values, __ATOMIC_RELAXED))
+                __atomic_store_n(&priv->procmem.values, 0, __ATOMIC_RELAXED);
+}
+
+void zs_process_budget_set(size_t limit)
+{
+        pthread_mutex_lock(&zs_process.mutex);
+        zs_process.limit = limit;
+        pthread_mutex_unlock(&zs_process.mutex);
+}
+
+void zs_process_memory_usage(struct zsdb_process_memory_usage *usage)
+{
+        memset(usage, 0, sizeof(struct zsdb_process_memory_usage));
+
+        pthread_mutex_lock(&zs_process.mutex);
+        usage->limit = zs_process.limit;
+        usage->used = zs_process.used;
+        usage->ndbs = zs_process.ndbs;
+        usage->evictions = zs_process.evictions;
+        pthread_mutex_unlock(&zs_process.mutex);
+}
@@ -10,11 +10,14 @@
 
 #include "pqueue.h"
 
+#include <libzeroskip/bloom.h>
 #include <libzeroskip/crc32c.h>
+#include <libzeroskip/keymodel.h>
 #include <libzeroskip/memtree.h>
 #include <libzeroskip/log.h>
 #include <libzeroskip/macros.h>
 #include <libzeroskip/mfile.h>
+#include <libzeroskip/offidx.h>
 #include <libzeroskip/util.h>
 #include <libzeroskip/vecu64.h>
 #include <libzeroskip/zeroskip.h>
@@ -71,15 +74,16 @@ static int get_offset_to_pointers(struct zsdb_file *f, uint64_t *offset,
                                   uint32_t *checksum, uint64_t *crc_offset,
                                   enum record_t *rtype)
 {
-        unsigned char *bptr, *fptr;
+        unsigned char *fptr;
         uint64_t data;
         enum record_t rectype;
 
         if (!f->is_open)
                 return ZS_IOERROR;
 
-        bptr = f->mf->ptr;
-        fptr = bptr + *offset;
+        fptr = mfile_range(f->mf, *offset, ZS_LONG_COMMIT_REC_SIZE);
+        if (!fptr)
+                return ZS_IOERROR;
 
         data = read_be64(fptr);
         rectype = data >> 56;
@@ -110,9 +114,8 @@ static int get_offset_to_pointers(struct zsdb_file *f, uint64_t *offset,
                 zslog(LOGDEBUG, "Found a 2nd half commit record.\n");
                 zslog(LOGDEBUG, "Found CRC: %" PRIu32 ".\n", *checksum);
 
-                get_offset_to_pointers(f, offset, checksum, crc_offset, rtype);
-
-                return ZS_OK;
+                return get_offset_to_pointers(f, offset, checksum, crc_offset,
+                                              rtype);
         } else if (rectype == REC_TYPE_LONG_FINAL) {
                 uint64_t len;
 
@@ -130,30 +133,976 @@ static int get_offset_to_pointers(struct zsdb_file *f, uint64_t *offset,
         }
 }
 
-static int read_pointers(struct zsdb_file *f, uint64_t offset)
+static uint64_t key_len(const struct zs_key *k)
+{
+        if (k->base.type == REC_TYPE_LONG_KEY ||
+            k->base.type == REC_TYPE_LONG_DELETED)
+                return k->base.llen;
+
+        return k->base.slen;
+}
+
+/* key_prefix():
+ * The first ZS_KEY_PREFIX_SIZE bytes of `key`, zero padded, as a number
+ * which compares as the keys do, unless it's the same.
+ */
+static inline uint64_t key_prefix(const unsigned char *key, uint64_t keylen)
+{
+        unsigned char buf[ZS_KEY_PREFIX_SIZE];
+        uint64_t prefix;
+
+        memset(buf, 0, sizeof(buf));
+        memcpy(buf, key, keylen < sizeof(buf) ? keylen : sizeof(buf));
+        memcpy(&prefix, buf, sizeof(prefix));
+
+        return ntoh64(prefix);
+}
+
+static uint64_t common_len(const unsigned char *a, uint64_t alen,
+                           const unsigned char *b, uint64_t blen)
+{
+        uint64_t i;
+
+        for (i = 0; i < alen && i < blen; i++)
+                if (a[i] != b[i])
+                        break;
+
+        return i;
+}
+
+/* write_key_prefixes():
+ * Writes the key prefixes after the offsets in the pointers section, the
+ * keys read back from the records just written. Skipping the bytes the
+ * first and the last keys start with, all the keys do, leaves the bytes
+ * that tell them apart in the prefixes.
+ */
+static int write_key_prefixes(struct zsdb_file *f)
+{
+        uint64_t count = offidx_count(f->index);
+        uint64_t i, skip, nbytes;
+        unsigned char *buf;
+        struct zs_key first, k;
+        int ret = ZS_OK;
+
+        if (!count)
+                return ZS_OK;
+
+        if (zs_record_read_key_from_file_offset(f, offidx_get(f->index, 0),
+                                                &first) != ZS_OK ||
+            zs_record_read_key_from_file_offset(f, offidx_get(f->index,
+                                                              count - 1),
+                                                &k) != ZS_OK)
+                return ZS_INTERNAL;
+
+        skip = common_len(first.data, key_len(&first), k.data, key_len(&k));
+
+        buf = xmalloc(st_mult(count + 1, ZS_KEY_PREFIX_SIZE));
+        write_be64(buf, skip);
+        for (i = 0; i < count; i++) {
+                uint64_t len;
+
+                if (zs_record_read_key_from_file_offset(f, offidx_get(f->index,
+                                                                      i),
+                                                        &k) != ZS_OK) {
+                        ret = ZS_INTERNAL;
+                        goto done;
+                }
+
+                len = key_len(&k);
+                write_be64(buf + (i + 1) * ZS_KEY_PREFIX_SIZE,
+                           key_prefix(k.data + skip, len - skip));
+        }
+
+        if (mfile_write(&f->mf, buf, (count + 1) * ZS_KEY_PREFIX_SIZE,
+                        &nbytes)) {
+                zslog(LOGDEBUG, "Error writing key prefixes\n");
+                ret = ZS_IOERROR;
+        }
+
+done:
+        xfree(buf);
+        return ret;
+}
+
+/* The blocks of a version 2 packed file, as it is written */
+struct zs_blockw {
+        uint64_t start;                 /* Of the block being written */
+        uint16_t *recs;                 /* The offsets of its records in it */
+        size_t nrecs;
+        size_t recsalloc;
+        uint64_t count;                 /* The records of those before */
+        uint64_t prevlast;              /* The offset of the last of those */
+        struct vecu64 *blocks;          /* The offset, first record and fence
+                                         * length of each block */
+        cstring fences;
+        int byteorder;
+};
+
+static void blocks_begin(struct zsdb_file *f, struct zsdb_priv *priv)
 {
-        uint64_t count, i;
-        unsigned char *bptr, *fptr;
+        f->bw = xcalloc(1, sizeof(struct zs_blockw));
+        f->bw->blocks = vecu64_new();
+        cstring_init(&f->bw->fences, 0);
+        f->bw->byteorder = !priv->dbcompare;
+}
+
+static void blocks_free(struct zsdb_file *f)
+{
+        if (!f->bw)
+                return;
+
+        xfree(f->bw->recs);
+        vecu64_free(&f->bw->blocks);
+        cstring_release(&f->bw->fences);
+        xfree(f->bw);
+}
+
+/* block_add_record():
+ * The record about to be written goes in the block being written.
+ */
+static void block_add_record(struct zsdb_file *f)
+{
+        struct zs_blockw *bw = f->bw;
+
+        if (!bw->nrecs)
+                bw->start = f->mf->offset;
+
+        /* A block is closed once it is ZS_BLOCK_SIZE, so all but its last
+         * record start before that */
+        assert(f->mf->offset - bw->start < ZS_BLOCK_SIZE);
+
+        ALLOC_GROW(bw->recs, bw->nrecs + 1, bw->recsalloc);
+        bw->recs[bw->nrecs++] = f->mf->offset - bw->start;
+}
+
+/* block_close():
+ * Writes the index of the block being written after its records, and
+ * keeps its offset and fence key for the pointers section.
+ */
+static int block_close(struct zsdb_file *f)
+{
+        struct zs_blockw *bw = f->bw;
+        struct zs_key first, last, k;
+        uint64_t i, n = bw->nrecs, skip = 0, fencelen = 0, len, nbytes;
+        unsigned char *buf, *p;
+        static const unsigned char pad[8];
+        int ret = ZS_OK;
+
+        if (!n)
+                return ZS_OK;
+
+        if (zs_record_read_key_from_file_offset(f, bw->start + bw->recs[0],
+                                                &first) != ZS_OK ||
+            zs_record_read_key_from_file_offset(f, bw->start +
+                                                bw->recs[n - 1],
+                                                &last) != ZS_OK)
+                return ZS_INTERNAL;
+
+        if (bw->byteorder) {
+                skip = common_len(first.data, key_len(&first),
+                                  last.data, key_len(&last));
+                if (skip > UINT32_MAX)
+                        skip = UINT32_MAX;
+        }
+
+        /* The shortest key after the last one of the block before, and
+         * not after the first of this one, is a prefix of the latter */
+        if (bw->count) {
+                fencelen = key_len(&first);
+                if (bw->byteorder) {
+                        if (zs_record_read_key_from_file_offset(f,
+                                                                bw->prevlast,
+                                                                &k) != ZS_OK)
+                                return ZS_INTERNAL;
+                        fencelen = common_len(k.data, key_len(&k), first.data,
+                                              fencelen) + 1;
+                }
+                cstring_add(&bw->fences, first.data, fencelen);
+                cstring_add(&bw->fences, pad, -fencelen & 7);
+        }
+
+        vecu64_append(bw->blocks, bw->start);
+        vecu64_append(bw->blocks, bw->count);
+        vecu64_append(bw->blocks, fencelen);
+
+        len = n * ZS_KEY_PREFIX_SIZE + ((n * sizeof(uint16_t) + 7) & ~7ULL) +
+                sizeof(uint64_t);
+        buf = xcalloc(1, len);
+
+        for (i = 0, p = buf; i < n; i++, p += ZS_KEY_PREFIX_SIZE) {
+                if (!bw->byteorder)
+                        continue;
+
+                if (zs_record_read_key_from_file_offset(f, bw->start +
+                                                        bw->recs[i],
+                                                        &k) != ZS_OK) {
+                        ret = ZS_INTERNAL;
+                        goto done;
+                }
+                write_be64(p, key_prefix(k.data + skip, key_len(&k) - skip));
+        }
+
+        for (i = 0; i < n; i++)
+                write_be16(p + i * sizeof(uint16_t), bw->recs[i]);
+
+        write_be32(buf + len - sizeof(uint64_t), skip);
+        write_be32(buf + len - sizeof(uint32_t), n);
+
+        if (mfile_write(&f->mf, buf, len, &nbytes)) {
+                zslog(LOGDEBUG, "Error writing block index\n");
+                ret = ZS_IOERROR;
+                goto done;
+        }
+
+        bw->prevlast = bw->start + bw->recs[n - 1];
+        bw->count += n;
+        bw->nrecs = 0;
+
+done:
+        xfree(buf);
+        return ret;
+}
+
+/* blocks_end():
+ * Closes the last block, and marks the end of it, after the records.
+ */
+static int blocks_end(struct zsdb_file *f)
+{
+        int ret;
+
+        if (!f->bw)
+                return ZS_OK;
+
+        ret = block_close(f);
+        if (ret != ZS_OK)
+                return ret;
+
+        vecu64_append(f->bw->blocks, f->mf->offset);
+        vecu64_append(f->bw->blocks, f->bw->count);
+        vecu64_append(f->bw->blocks, 0);
+
+        return ZS_OK;
+}
+
+/* write_blocks():
+ * The pointers section of a version 2 packed file.
+ */
+static int write_blocks(struct zsdb_file *f)
+{
+        struct zs_blockw *bw = f->bw;
+        uint64_t i, len, nblocks, nbytes;
+        unsigned char *buf;
+        int ret = ZS_OK;
+
+        nblocks = vecu64_size(bw->blocks) / 3;
+        len = ZS_BLOCKS_HDR_SIZE + nblocks * 3 * sizeof(uint64_t);
+        buf = xmalloc(len);
+
+        write_be64(buf, ZS_BLOCKS_MAGIC);
+        write_be64(buf + 8, bw->count);
+        write_be64(buf + 16, nblocks - 1);
+        write_be64(buf + 24, bw->byteorder ? ZS_BLOCKS_BYTEORDER : 0);
+        for (i = 0; i < nblocks * 3; i++)
+                write_be64(buf + ZS_BLOCKS_HDR_SIZE + i * sizeof(uint64_t),
+                           bw->blocks->data[i]);
+
+        if (mfile_write(&f->mf, buf, len, &nbytes) ||
+            (bw->fences.len &&
+             mfile_write(&f->mf, bw->fences.buf, bw->fences.len, &nbytes))) {
+                zslog(LOGDEBUG, "Error writing blocks\n");
+                ret = ZS_IOERROR;
+        }
+
+        xfree(buf);
+        return ret;
+}
+
+/* write_pointers():
+ * Writes the pointers section, but for its commit record. There are key
+ * prefixes only for keys compared by their bytes.
+ */
+static int write_pointers(struct zsdb_file *f, struct zsdb_priv *priv)
+{
+        int ret;
+
+        crc32_begin(&f->mf);    /* The crc32 for index of the file */
+
+        if (f->bw)
+                return write_blocks(f);
+
+        ret = zs_packed_file_write_index_count(f, offidx_count(f->index));
+        if (ret != ZS_OK)
+                return ret;
+
+        offidx_foreach(f->index, zs_packed_file_write_index, f);
+
+        if (priv->dbcompare)
+                return ZS_OK;
+
+        return write_key_prefixes(f);
+}
+
+/* read_pointers():
+ * The index is the pointer section itself, between `offset` and `end`,
+ * read from the mapping as it is used. Nothing is copied, and the pages are
+ * shared with the other processes that have the file open.
+ */
+static int read_pointers(struct zsdb_file *f, uint64_t offset, uint64_t end)
+{
+        uint64_t count;
+        unsigned char *fptr;
 
         if (!f->is_open)
                 return ZS_IOERROR;
 
-        bptr = f->mf->ptr;
-        fptr = bptr + offset;
-
         /* Get the number of records */
+        fptr = mfile_range(f->mf, offset, sizeof(uint64_t));
+        if (!fptr)
+                return ZS_IOERROR;
         count = read_be64(fptr);
-        fptr += sizeof(uint64_t);
 
-        for (i = 0; i < count; i++) {
-                uint64_t n;
-                n = read_be64(fptr);
-                vecu64_append(f->index, n);
+        if (count > (f->mf->size - offset - sizeof(uint64_t)) /
+            sizeof(uint64_t))
+                return ZS_INVALID_FILE;
+
+        /* In the range zs_packed_file_open() pinned */
+        fptr = mfile_range(f->mf, offset + sizeof(uint64_t),
+                           count * sizeof(uint64_t));
+        if (!fptr)
+                return ZS_IOERROR;
+
+        f->index = offidx_new_mapped(fptr, count);
+
+        /* The key prefixes, if they're there, fill the rest of it */
+        if (count && end - offset == (2 * count + 2) * sizeof(uint64_t)) {
+                fptr = mfile_range(f->mf, offset + (count + 1) *
+                                   sizeof(uint64_t), sizeof(uint64_t));
+                if (!fptr)
+                        return ZS_IOERROR;
+                f->keyprefixskip = read_be64(fptr);
+                f->keyprefixes = fptr + sizeof(uint64_t);
+        }
+
+        return ZS_OK;
+}
+
+/* read_blocks():
+ * The blocks of a version 2 packed file, from the pointers section
+ * between `offset` and `end`. Their fence keys stay where they are.
+ */
+static int read_blocks(struct zsdb_file *f, uint64_t offset, uint64_t end)
+{
+        unsigned char hdr[ZS_BLOCKS_HDR_SIZE];
+        const unsigned char *p, *fence;
+        uint64_t count, nblocks, b, len;
+
+        if (end - offset < ZS_BLOCKS_HDR_SIZE)
+                return ZS_INVALID_FILE;
+
+        p = mfile_range(f->mf, offset, ZS_BLOCKS_HDR_SIZE);
+        if (!p)
+                return ZS_IOERROR;
+        memcpy(hdr, p, ZS_BLOCKS_HDR_SIZE);
+        count = read_be64(hdr + 8);
+        nblocks = read_be64(hdr + 16);
+        f->blockflags = read_be64(hdr + 24);
+
+        len = end - offset - ZS_BLOCKS_HDR_SIZE;
+        if (nblocks >= len / (3 * sizeof(uint64_t)))
+                return ZS_INVALID_FILE;
+
+        /* In the range zs_packed_file_open() pinned */
+        p = mfile_range(f->mf, offset + ZS_BLOCKS_HDR_SIZE, len);
+        if (!p)
+                return ZS_IOERROR;
+        fence = p + (nblocks + 1) * 3 * sizeof(uint64_t);
+        len -= (nblocks + 1) * 3 * sizeof(uint64_t);
+
+        f->blocks = xcalloc(nblocks + 1, sizeof(struct zs_block));
+        f->nblocks = nblocks;
+        for (b = 0; b <= nblocks; b++) {
+                struct zs_block *blk = &f->blocks[b];
+                const uint64_t *q = (const uint64_t *)p + b * 3;
+                uint64_t padded;
+
+                blk->offset = ntoh64(q[0]);
+                blk->first = ntoh64(q[1]);
+                blk->fencelen = ntoh64(q[2]);
+                blk->fence = fence;
+
+                padded = (blk->fencelen + 7) & ~7ULL;
+                if (blk->offset < ZS_HDR_SIZE || blk->offset >= offset ||
+                    padded < blk->fencelen || padded > len ||
+                    (b && (blk->offset <= blk[-1].offset ||
+                           blk->first <= blk[-1].first)))
+                        return ZS_INVALID_FILE;
+
+                fence += padded;
+                len -= padded;
+        }
+
+        if (f->blocks[nblocks].first != count)
+                return ZS_INVALID_FILE;
+
+        return ZS_OK;
+}
+
+/* The index at the end of a block of a version 2 packed file */
+struct block_index {
+        uint64_t base;                  /* The offset of the block */
+        uint64_t first;                 /* ..and of its first record */
+        uint64_t n;
+        const uint64_t *prefixes;       /* NULL if they can't be used */
+        const uint16_t *offsets;        /* NULL for a version 1 file */
+        uint64_t skip;
+};
+
+static int read_block_index(const struct zsdb_file *f, uint64_t b,
+                            struct block_index *bi)
+{
+        const struct zs_block *blk = &f->blocks[b];
+        const unsigned char *p;
+        uint64_t len;
+
+        bi->base = blk->offset;
+        bi->first = blk->first;
+        bi->n = blk[1].first - blk->first;
+
+        len = bi->n * ZS_KEY_PREFIX_SIZE +
+                ((bi->n * sizeof(uint16_t) + 7) & ~7ULL) + sizeof(uint64_t);
+        p = mfile_range(f->mf, blk[1].offset - len, len);
+        if (!p)
+                return ZS_IOERROR;
+
+        bi->prefixes = (const uint64_t *)p;
+        bi->offsets = (const uint16_t *)(p + bi->n * ZS_KEY_PREFIX_SIZE);
+        bi->skip = ntoh32(*(const uint32_t *)(p + len - sizeof(uint64_t)));
+
+        return ZS_OK;
+}
+
+/* find_block():
+ * The block with the record at `i`.
+ */
+static uint64_t find_block(const struct zsdb_file *f, uint64_t i)
+{
+        uint64_t lo = 0, hi = f->nblocks;
+
+        while (hi - lo > 1) {
+                uint64_t mi = lo + (hi - lo) / 2;
+
+                if (f->blocks[mi].first <= i)
+                        lo = mi;
+                else
+                        hi = mi;
+        }
+
+        return lo;
+}
+
+/* read_key_bounds():
+ * Copies the first and the last keys of the file, which are before the
+ * pointers at `end`.
+ */
+static int read_key_bounds(struct zsdb_file *f, uint64_t end)
+{
+        uint64_t count = zs_packed_file_count(f);
+        uint64_t first, last;
+        struct zs_key k;
+
+        if (!count)
+                return ZS_OK;
+
+        first = zs_packed_file_offset(f, 0);
+        last = zs_packed_file_offset(f, count - 1);
+        if (first < ZS_HDR_SIZE || first >= end || last >= end)
+                return ZS_INVALID_FILE;
+
+        if (zs_record_read_key_from_file_offset(f, first, &k) != ZS_OK)
+                return ZS_INVALID_FILE;
+        cstring_add(&f->minkey, k.data, key_len(&k));
 
-                fptr += sizeof(uint64_t);
+        if (zs_record_read_key_from_file_offset(f, last, &k) != ZS_OK)
+                return ZS_INVALID_FILE;
+        cstring_add(&f->maxkey, k.data, key_len(&k));
+
+        if (f->keyprefixskip > f->minkey.len ||
+            f->keyprefixskip > f->maxkey.len)
+                return ZS_INVALID_FILE;
+
+        return ZS_OK;
+}
+
+/* read_model():
+ * The model of the fence keys of a version 2 file, in the order of their
+ * blocks from the second, or of the key prefixes of a version 1 file.
+ */
+static void read_model(struct zsdb_file *f)
+{
+        struct keymodel *model;
+        uint64_t i, skip;
+
+        if (f->blocks) {
+                if (!(f->blockflags & ZS_BLOCKS_BYTEORDER) ||
+                    f->nblocks < ZS_MODEL_MIN_KEYS)
+                        return;
+
+                skip = common_len((const unsigned char *)f->minkey.buf,
+                                  f->minkey.len,
+                                  (const unsigned char *)f->maxkey.buf,
+                                  f->maxkey.len);
+
+                model = keymodel_new(ZS_MODEL_MAX_ERROR);
+                for (i = 1; i < f->nblocks; i++) {
+                        const struct zs_block *blk = &f->blocks[i];
+
+                        if (blk->fencelen < skip) {
+                                keymodel_free(&model);
+                                return;
+                        }
+                        keymodel_add(model, key_prefix(blk->fence + skip,
+                                                       blk->fencelen - skip));
+                }
+        } else {
+                const uint64_t *prefixes = (const uint64_t *)f->keyprefixes;
+                uint64_t count = zs_packed_file_count(f);
+
+                if (!prefixes || count < ZS_MODEL_MIN_KEYS)
+                        return;
+
+                skip = f->keyprefixskip;
+                model = keymodel_new(ZS_MODEL_MAX_ERROR);
+                for (i = 0; i < count; i++)
+                        keymodel_add(model, ntoh64(prefixes[i]));
+        }
+
+        keymodel_seal(model);
+
+        if (model->unordered ||
+            model->nsegs > model->count / ZS_MODEL_MIN_SEGMENT ||
+            model->maxdups > 4 * ZS_MODEL_MAX_ERROR) {
+                keymodel_free(&model);
+                return;
+        }
+
+        f->model = model;
+        f->modelskip = skip;
+}
+
+/* filter_begin():
+ * Collect the hashes of the keys as they are written to `f`, for its
+ * filter. The filters only work for keys that are equal when their bytes
+ * are, which a custom comparator may not go by.
+ */
+static void filter_begin(struct zsdb_file *f, struct zsdb_priv *priv)
+{
+        if (!priv->filterbits || priv->dbcompare)
+                return;
+
+        f->filterhashes = vecu64_new();
+        f->filterprefix = priv->filterprefix;
+}
+
+static void filter_add(struct zsdb_file *f, const unsigned char *key,
+                       uint64_t keylen)
+{
+        uint64_t hash;
+
+        if (!f->filterhashes)
+                return;
+
+        vecu64_append(f->filterhashes, bloom_hash(key, keylen));
+
+        /* The keys are sorted, so those with the same prefix are together */
+        if (f->filterprefix && keylen >= f->filterprefix) {
+                hash = bloom_hash(key, f->filterprefix);
+                if (hash != f->lastprefixhash ||
+                    vecu64_size(f->filterhashes) == 1) {
+                        vecu64_append(f->filterhashes, hash);
+                        f->lastprefixhash = hash;
+                }
+        }
+}
+
+/* write_filter():
+ * Writes the filter block, after the records.
+ */
+static int write_filter(struct zsdb_file *f, unsigned int bitsperkey)
+{
+        unsigned char trailer[ZS_FILTER_TRAILER_SIZE];
+        struct bloom *bloom;
+        uint64_t i, n, nbytes;
+        int ret = ZS_OK;
+
+        if (!f->filterhashes)
+                return ZS_OK;
+
+        n = vecu64_size(f->filterhashes);
+        bloom = bloom_new(n, bitsperkey);
+        for (i = 0; i < n; i++)
+                bloom_add(bloom, f->filterhashes->data[i]);
+        vecu64_free(&f->filterhashes);
+
+        memset(trailer, 0, sizeof(trailer));
+        write_be64(trailer, bloom->nblocks);
+        write_be32(trailer + 8, bloom->k);
+        write_be32(trailer + 12, f->filterprefix);
+        write_be32(trailer + 16, crc32c(0, bloom->bits, bloom_bytes(bloom)));
+        write_be64(trailer + 24, ZS_FILTER_MAGIC);
+
+        if (mfile_write(&f->mf, bloom->data, bloom_bytes(bloom), &nbytes) ||
+            mfile_write(&f->mf, trailer, sizeof(trailer), &nbytes)) {
+                zslog(LOGDEBUG, "Error writing filter\n");
+                ret = ZS_IOERROR;
         }
 
-        return ZS_OK;
+        bloom_free(&bloom);
+
+        return ret;
+}
+
+/* read_trailer():
+ * Copies the `len` bytes before `offset` to `trailer`, if they are the
+ * trailer of a block, which ends with `magic`. ZS_NOTFOUND if they aren't.
+ */
+static int read_trailer(struct zsdb_file *f, uint64_t offset, size_t len,
+                        uint64_t magic, unsigned char *trailer)
+{
+        const unsigned char *p;
+
+        if (offset < ZS_HDR_SIZE + len)
+                return ZS_NOTFOUND;
+
+        p = mfile_range(f->mf, offset - len, len);
+        if (!p)
+                return ZS_IOERROR;
+        memcpy(trailer, p, len);
+
+        if (read_be64(trailer + len - sizeof(uint64_t)) != magic)
+                return ZS_NOTFOUND;
+
+        return ZS_OK;
+}
+
+/* filter_size():
+ * The size of the filter block before the pointers at `offset`, in `size`,
+ * 0 if there is none.
+ */
+static int filter_size(struct zsdb_file *f, uint64_t offset, uint64_t *size)
+{
+        unsigned char trailer[ZS_FILTER_TRAILER_SIZE];
+        uint64_t nblocks;
+        int ret;
+
+        *size = 0;
+
+        ret = read_trailer(f, offset, ZS_FILTER_TRAILER_SIZE, ZS_FILTER_MAGIC,
+                           trailer);
+        if (ret != ZS_OK)
+                return ret == ZS_NOTFOUND ? ZS_OK : ret;
+
+        nblocks = read_be64(trailer);
+        if (nblocks > (offset - ZS_HDR_SIZE - ZS_FILTER_TRAILER_SIZE) /
+            BLOOM_BLOCK_BYTES)
+                return ZS_OK;
+
+        *size = nblocks * BLOOM_BLOCK_BYTES + ZS_FILTER_TRAILER_SIZE;
+
+        return ZS_OK;
+}
+
+/* read_filter():
+ * The filter, if there is one before the pointers at `offset`, is used
+ * from the mapping as it is.
+ */
+static int read_filter(struct zsdb_file *f, uint64_t offset)
+{
+        unsigned char trailer[ZS_FILTER_TRAILER_SIZE];
+        const unsigned char *bits;
+        uint64_t size, nblocks;
+        uint32_t k, prefix, crc;
+        int ret;
+
+        ret = filter_size(f, offset, &size);
+        if (ret != ZS_OK || !size)
+                return ret;
+
+        ret = read_trailer(f, offset, ZS_FILTER_TRAILER_SIZE, ZS_FILTER_MAGIC,
+                           trailer);
+        if (ret != ZS_OK)
+                return ret;
+        nblocks = read_be64(trailer);
+        k = read_be32(trailer + 8);
+        prefix = read_be32(trailer + 12);
+        crc = read_be32(trailer + 16);
+
+        if (!nblocks || !k || k > BLOOM_MAX_K)
+                return ZS_INVALID_FILE;
+
+        /* In the range zs_packed_file_open() pinned */
+        bits = mfile_range(f->mf, offset - size, size - ZS_FILTER_TRAILER_SIZE);
+        if (!bits)
+                return ZS_IOERROR;
+        if (crc32c(0, bits, size - ZS_FILTER_TRAILER_SIZE) != crc)
+                return ZS_INVALID_FILE;
+
+        f->filter = bloom_new_mapped(bits, nblocks, k);
+        f->filterprefix = prefix;
+
+        return ZS_OK;
+}
+
+/* hashidx_begin():
+ * Collect the hashes of the keys as they are written to `f`, and the
+ * offsets of their records, for its hash index. As for the filters, the
+ * keys have to be equal when their bytes are.
+ */
+static void hashidx_begin(struct zsdb_file *f, struct zsdb_priv *priv)
+{
+        if (!priv->hashindex || priv->dbcompare)
+                return;
+
+        f->hashoffsets = vecu64_new();
+}
+
+static void hashidx_add(struct zsdb_file *f, const unsigned char *key,
+                        uint64_t keylen)
+{
+        if (!f->hashoffsets)
+                return;
+
+        vecu64_append(f->hashoffsets, bloom_hash(key, keylen));
+        vecu64_append(f->hashoffsets, f->mf->offset);
+}
+
+/* write_hash_index():
+ * Writes the hash index block, after the records. At most 3 slots in 4
+ * are used, so that most keys are in the first slot looked at, or the
+ * one after.
+ */
+static int write_hash_index(struct zsdb_file *f)
+{
+        unsigned char trailer[ZS_HASHIDX_TRAILER_SIZE];
+        uint64_t *slots = NULL;
+        uint64_t i, n, nslots, mask, nbytes;
+        int ret = ZS_OK;
+
+        if (!f->hashoffsets)
+                return ZS_OK;
+
+        n = vecu64_size(f->hashoffsets) / 2;
+        if (!n)
+                goto done;
+
+        for (nslots = 2; nslots < n + n / 3; nslots <<= 1)
+                ;
+        mask = nslots - 1;
+        slots = xcalloc(nslots, sizeof(uint64_t));
+
+        for (i = 0; i < n; i++) {
+                uint64_t hash = f->hashoffsets->data[2 * i];
+                uint64_t offset = f->hashoffsets->data[2 * i + 1];
+                uint64_t j = hash & mask;
+
+                /* Records too far in for the slots to have room for their
+                 * offsets are in files too big for one anyway */
+                if ((offset & 7) ||
+                    (offset >> 3) >> ZS_HASHIDX_OFFSET_BITS)
+                        goto done;
+
+                while (slots[j])
+                        j = (j + 1) & mask;
+
+                slots[j] = hton64((hash >> ZS_HASHIDX_OFFSET_BITS <<
+                                   ZS_HASHIDX_OFFSET_BITS) | (offset >> 3));
+        }
+
+        memset(trailer, 0, sizeof(trailer));
+        write_be64(trailer, nslots);
+        write_be64(trailer + 8, n);
+        write_be32(trailer + 16, crc32c(0, slots, nslots * sizeof(uint64_t)));
+        write_be64(trailer + 24, ZS_HASHIDX_MAGIC);
+
+        if (mfile_write(&f->mf, slots, nslots * sizeof(uint64_t), &nbytes) ||
+            mfile_write(&f->mf, trailer, sizeof(trailer), &nbytes)) {
+                zslog(LOGDEBUG, "Error writing hash index\n");
+                ret = ZS_IOERROR;
+        }
+
+done:
+        xfree(slots);
+        vecu64_free(&f->hashoffsets);
+        return ret;
+}
+
+/* hash_index_size():
+ * The size of the hash index block before the filter, or the pointers, at
+ * `offset`, in `size`, 0 if there is none.
+ */
+static int hash_index_size(struct zsdb_file *f, uint64_t offset,
+                           uint64_t *size)
+{
+        unsigned char trailer[ZS_HASHIDX_TRAILER_SIZE];
+        uint64_t nslots;
+        int ret;
+
+        *size = 0;
+
+        ret = read_trailer(f, offset, ZS_HASHIDX_TRAILER_SIZE,
+                           ZS_HASHIDX_MAGIC, trailer);
+        if (ret != ZS_OK)
+                return ret == ZS_NOTFOUND ? ZS_OK : ret;
+
+        nslots = read_be64(trailer);
+        if (nslots > (offset - ZS_HDR_SIZE - ZS_HASHIDX_TRAILER_SIZE) /
+            sizeof(uint64_t))
+                return ZS_OK;
+
+        *size = nslots * sizeof(uint64_t) + ZS_HASHIDX_TRAILER_SIZE;
+
+        return ZS_OK;
+}
+
+/* read_hash_index():
+ * The hash index, if there is one before the filter, or the pointers, at
+ * `offset`, is used from the mapping as it is.
+ */
+static int read_hash_index(struct zsdb_file *f, uint64_t offset)
+{
+        unsigned char trailer[ZS_HASHIDX_TRAILER_SIZE];
+        const unsigned char *slots;
+        uint64_t size, nslots, n;
+        uint32_t crc;
+        int ret;
+
+        ret = hash_index_size(f, offset, &size);
+        if (ret != ZS_OK || !size)
+                return ret;
+
+        ret = read_trailer(f, offset, ZS_HASHIDX_TRAILER_SIZE,
+                           ZS_HASHIDX_MAGIC, trailer);
+        if (ret != ZS_OK)
+                return ret;
+        nslots = read_be64(trailer);
+        n = read_be64(trailer + 8);
+        crc = read_be32(trailer + 16);
+
+        /* A power of two, with an empty slot for the lookups to stop at */
+        if (nslots < 2 || (nslots & (nslots - 1)) || n >= nslots)
+                return ZS_INVALID_FILE;
+
+        /* In the range zs_packed_file_open() pinned */
+        slots = mfile_range(f->mf, offset - size,
+                            size - ZS_HASHIDX_TRAILER_SIZE);
+        if (!slots)
+                return ZS_IOERROR;
+        if (crc32c(0, slots, size - ZS_HASHIDX_TRAILER_SIZE) != crc)
+                return ZS_INVALID_FILE;
+
+        f->hashslots = (const uint64_t *)slots;
+        f->hashnslots = nslots;
+
+        return ZS_OK;
+}
+
+/* hash_index_lookup():
+ * Looks for `key` in the hash index of `f`: the slots from that of its
+ * hash on, up to an empty one, and the records of those with the same top
+ * bits of the hash.
+ */
+static int hash_index_lookup(const unsigned char *key, uint64_t keylen,
+                             uint64_t hash, struct zsdb_file *f,
+                             const unsigned char **value, uint64_t *vallen)
+{
+        uint64_t mask = f->hashnslots - 1;
+        uint64_t top = hash >> ZS_HASHIDX_OFFSET_BITS;
+        uint64_t i, n;
+
+        for (i = hash & mask, n = 0; n < f->hashnslots;
+             i = (i + 1) & mask, n++) {
+                uint64_t slot = ntoh64(f->hashslots[i]);
+                uint64_t offset;
+                const unsigned char *k;
+                uint64_t klen = 0;
+                int ret;
+
+                if (!slot)
+                        break;
+
+                if (slot >> ZS_HASHIDX_OFFSET_BITS != top)
+                        continue;
+
+                offset = (slot & ((1ULL << ZS_HASHIDX_OFFSET_BITS) - 1)) << 3;
+                ret = zs_record_read_key_val_from_offset(f, &offset, &k, &klen,
+                                                         value, vallen);
+                if (ret != ZS_OK) {
+                        zslog(LOGWARNING, "Could not read a record of %s\n",
+                              f->fname.buf);
+                        return 0;
+                }
+
+                if (!memcmp_raw(key, keylen, k, klen))
+                        return 1;
+        }
+
+        return 0;
+}
+
+/* record_begin(), record_end():
+ * Around writing each record to a new packed file, for its index, its
+ * filter and its hash index.
+ */
+static void record_begin(struct zsdb_file *f, const unsigned char *key,
+                         uint64_t keylen)
+{
+        if (f->bw)
+                block_add_record(f);
+        else
+                offidx_append(f->index, f->mf->offset);
+
+        filter_add(f, key, keylen);
+        hashidx_add(f, key, keylen);
+}
+
+static int record_end(struct zsdb_file *f, int ret)
+{
+        if (ret == ZS_OK && f->bw &&
+            f->mf->offset - f->bw->start >= ZS_BLOCK_SIZE)
+                ret = block_close(f);
+
+        return (ret == ZS_OK) ? 1 : 0;
+}
+
+/* packed_file_new():
+ * A new packed file, for its records to be written to, in the format
+ * of `priv->packversion`.
+ */
+static struct zsdb_file *packed_file_new(const char *path,
+                                         uint32_t startidx, uint32_t endidx,
+                                         struct zsdb_priv *priv)
+{
+        struct zsdb_file *f;
+
+        f = xcalloc(sizeof(struct zsdb_file), 1);
+        f->type = DB_FTYPE_PACKED;
+        cstring_init(&f->fname, 0);
+        cstring_addstr(&f->fname, path);
+        if (priv->packversion >= 2)
+                blocks_begin(f, priv);
+        else
+                f->index = offidx_new();
+        filter_begin(f, priv);
+        hashidx_begin(f, priv);
+
+        /* Initialise header fields */
+        f->header.signature = ZS_SIGNATURE;
+        f->header.version = f->bw ? ZS_PACKED_VERSION : ZS_VERSION;
+        memcpy(f->header.uuid, priv->uuid, sizeof(uuid_t));
+        f->header.startidx = startidx;
+        f->header.endidx = endidx;
+        f->header.crc32 = 0;
+
+        return f;
 }
 
 /**
@@ -165,14 +1114,14 @@ int zs_packed_file_write_memtree_record(struct record *record, void *data)
         struct zsdb_file *f = (struct zsdb_file *)data;
         int ret = ZS_OK;
 
-        vecu64_append(f->index, f->mf->offset);
+        record_begin(f, record->key, record->keylen);
 
         if (record->deleted)
                 ret = zs_file_write_delete_record(f, record->key, record->keylen);
         else
                 ret = zs_file_write_keyval_record(f, record->key, record->keylen,
                                                   record->val, record->vallen);
-        return (ret == ZS_OK) ? 1 : 0;
+        return record_end(f, ret);
 }
 
 int zs_packed_file_write_record(void *data,
@@ -182,10 +1131,10 @@ int zs_packed_file_write_record(void *data,
         struct zsdb_file *f = (struct zsdb_file *)data;
         int ret = ZS_OK;
 
-        vecu64_append(f->index, f->mf->offset);
+        record_begin(f, key, keylen);
         ret = zs_file_write_keyval_record(f, key, keylen, value, vallen);
 
-        return (ret == ZS_OK) ? 1 : 0;
+        return record_end(f, ret);
 }
 
 int zs_packed_file_write_delete_record(void *data,
@@ -196,10 +1145,10 @@ int zs_packed_file_write_delete_record(void *data,
         struct zsdb_file *f = (struct zsdb_file *)data;
         int ret = ZS_OK;
 
-        vecu64_append(f->index, f->mf->offset);
+        record_begin(f, key, keylen);
         ret = zs_file_write_delete_record(f, key, keylen);
 
-        return (ret == ZS_OK) ? 1 : 0;
+        return record_end(f, ret);
 }
 
 int zs_packed_file_write_commit_record(struct zsdb_file *f)
@@ -215,14 +1164,14 @@ int zs_packed_file_write_final_commit_record(struct zsdb_file *f)
 /* zs_packed_file_open():
  * Open an existing packed file in read-only mode.
  */
-int zs_packed_file_open(const char *path,
-                        struct zsdb_file **fptr)
+int zs_packed_file_open(const char *path, struct zsdb_file **fptr)
 {
         int ret = ZS_OK;
         struct zsdb_file *f;
         size_t mf_size = 0;
-        uint64_t offset, end_offset, crc_offset = 0;
-        int mfile_flags = MFILE_RD;
+        uint64_t offset, end_offset, crc_offset = 0, pin_offset;
+        uint64_t filteroffset, size;
+        int mfile_flags = MFILE_RD | MFILE_WINDOWED;
         uint32_t crc = 0, stored_crc = 0;
         enum record_t commit_rec_type;
 
@@ -258,6 +1207,13 @@ int zs_packed_file_open(const char *path,
                 goto fail;
         }
 
+        if (f->header.version > ZS_PACKED_VERSION) {
+                zslog(LOGDEBUG, "Unknown version %u of packed file %s.\n",
+                      f->header.version, f->fname.buf);
+                ret = ZS_INVALID_DB;
+                goto fail;
+        }
+
         /*  Initialise f->index;
          *  Seek to the end of file
          *   - go back 8 bytes, and check if there is a commit record,
@@ -271,9 +1227,8 @@ int zs_packed_file_open(const char *path,
          *          + verify commit
          *          + read commit record and get length of commit
          *          + go back to 'length' bytes to get the beginning of index
-         *          + Read index into f->index
+         *          + Point f->index at the index
          */
-        f->index = vecu64_new();
 
         /* Verify CRC of the pointers section */
         /* Read the commit record and get to the pointers */
@@ -286,16 +1241,40 @@ int zs_packed_file_open(const char *path,
                 goto fail;
         }
 
+        /* The hash index, the filter, the pointers and the commit records
+         * after them stay mapped, for the index */
+        ret = filter_size(f, offset, &size);
+        if (ret != ZS_OK)
+                goto fail;
+        filteroffset = offset - size;
+
+        ret = hash_index_size(f, filteroffset, &size);
+        if (ret != ZS_OK)
+                goto fail;
+        pin_offset = filteroffset - size;
+
+        if (!mfile_pin(f->mf, pin_offset, mf_size - pin_offset)) {
+                zslog(LOGDEBUG, "Invalid pointer block.\n");
+                ret = ZS_INVALID_FILE;
+                goto fail;
+        }
+
         if (commit_rec_type == REC_TYPE_LONG_FINAL) {
-                unsigned char *dataptr;
+                unsigned char *dataptr, *recs;
                 uint64_t t_data;
 
-                dataptr = f->mf->ptr + crc_offset;
+                dataptr = mfile_range(f->mf, crc_offset,
+                                      mf_size - crc_offset);
                 end_offset = mf_size - ZS_LONG_COMMIT_REC_SIZE;
+                recs = mfile_range(f->mf, offset, end_offset - offset);
+                if (!dataptr || !recs) {
+                        ret = ZS_IOERROR;
+                        goto fail;
+                }
 
                 /* compute the crc */
                 /* data */
-                crc = crc32c_hw(0, (void *)(f->mf->ptr + offset), (end_offset - offset));
+                crc = crc32c_hw(0, recs, (end_offset - offset));
 
                 /* type1 */
                 t_data = read_be64(dataptr);
@@ -312,15 +1291,21 @@ int zs_packed_file_open(const char *path,
                 crc = crc32c_hw(crc, (void *)&t_data, sizeof(uint64_t));
 
         } else if (commit_rec_type == REC_TYPE_FINAL) {
-                unsigned char *dataptr;
+                unsigned char *dataptr, *recs;
                 uint64_t t_data;
 
-                dataptr = f->mf->ptr + crc_offset;
+                dataptr = mfile_range(f->mf, crc_offset,
+                                      mf_size - crc_offset);
                 end_offset = mf_size - ZS_SHORT_COMMIT_REC_SIZE;
+                recs = mfile_range(f->mf, offset, end_offset - offset);
+                if (!dataptr || !recs) {
+                        ret = ZS_IOERROR;
+                        goto fail;
+                }
 
                 /* compute the crc */
                 /* data */
-                crc = crc32c_hw(0, (void *)(f->mf->ptr + offset), (end_offset - offset));
+                crc = crc32c_hw(0, recs, (end_offset - offset));
 
                 /* type & len */
                 t_data = read_be64(dataptr) & 0xFFFFFFFF00000000;
@@ -338,13 +1323,37 @@ int zs_packed_file_open(const char *path,
                 goto fail;
         }
 
-        /* Read the pointers section and get all the offsets */
-        ret = read_pointers(f, offset);
+        /* The index is in the pointers section */
+        if (f->header.version >= 2)
+                ret = read_blocks(f, offset, end_offset);
+        else
+                ret = read_pointers(f, offset, end_offset);
         if (ret != ZS_OK) {
                 zslog(LOGDEBUG, "Could not get pointers from pointer block.\n");
                 goto fail;
         }
 
+        ret = read_key_bounds(f, offset);
+        if (ret != ZS_OK) {
+                zslog(LOGDEBUG, "Invalid first or last record in %s.\n",
+                      f->fname.buf);
+                goto fail;
+        }
+
+        ret = read_filter(f, offset);
+        if (ret != ZS_OK) {
+                zslog(LOGDEBUG, "Invalid filter in %s.\n", f->fname.buf);
+                goto fail;
+        }
+
+        ret = read_hash_index(f, filteroffset);
+        if (ret != ZS_OK) {
+                zslog(LOGDEBUG, "Invalid hash index in %s.\n", f->fname.buf);
+                goto fail;
+        }
+
+        read_model(f);
+
         f->indexpos = 0;
         f->priority = -1;
 
@@ -371,38 +1380,74 @@ int zs_packed_file_close(struct zsdb_file **fptr)
 
         mfile_close(&f->mf);
         cstring_release(&f->fname);
-        vecu64_free(&f->index);
+        cstring_release(&f->minkey);
+        cstring_release(&f->maxkey);
+        bloom_free(&f->filter);
+        vecu64_free(&f->filterhashes);
+        vecu64_free(&f->hashoffsets);
+        offidx_free(&f->index);
+        xfree(f->blocks);
+        blocks_free(f);
+        keymodel_free(&f->model);
         xfree(f);
 
         return ret;
 }
 
+static void packed_files_reclaim(struct list_head *flist)
+{
+        struct list_head *pos;
+
+        list_for_each_forward(pos, flist) {
+                struct zsdb_file *f;
+
+                f = list_entry(pos, struct zsdb_file, list);
+                if (f->mf)
+                        mfile_reclaim(f->mf);
+        }
+}
+
+static int packed_files_reclaim_due(struct list_head *flist)
+{
+        struct list_head *pos;
+
+        list_for_each_forward(pos, flist) {
+                struct zsdb_file *f;
+
+                f = list_entry(pos, struct zsdb_file, list);
+                if (f->mf && mfile_reclaim_due(f->mf))
+                        return 1;
+        }
+
+        return 0;
+}
+
+/* zs_packed_files_reclaim():
+ * Unmaps the windows the packed files have dropped. The pointers into the
+ * DB are only good until the next write, which is when this is called,
+ * or zsdb_reclaim().
+ */
+void zs_packed_files_reclaim(struct zsdb_priv *priv)
+{
+        packed_files_reclaim(&priv->dbfiles.pflist);
+}
+
 /* zs_packed_file_new_from_memtree():
  * Create a new pack file (with sorted records and an index at the end
- * from all the finalised files(which are in memory).
+ * from the records in `memtree`, those of the finalised files or of a
+ * frozen memtree. Only reads `priv`, and can run alongside readers.
  */
 int zs_packed_file_new_from_memtree(const char *path,
                                     uint32_t startidx,
                                     uint32_t endidx,
                                     struct zsdb_priv *priv,
+                                    struct memtree *memtree,
                                     struct zsdb_file **fptr)
 {
         int ret = ZS_OK;
         struct zsdb_file *f;
 
-        f = xcalloc(sizeof(struct zsdb_file), 1);
-        f->type = DB_FTYPE_PACKED;
-        cstring_init(&f->fname, 0);
-        cstring_addstr(&f->fname, path);
-        f->index = vecu64_new();
-
-        /* Initialise header fields */
-        f->header.signature = ZS_SIGNATURE;
-        f->header.version = ZS_VERSION;
-        memcpy(f->header.uuid, priv->uuid, sizeof(uuid_t));
-        f->header.startidx = startidx;
-        f->header.endidx = endidx;
-        f->header.crc32 = 0;
+        f = packed_file_new(path, startidx, endidx, priv);
 
         ret = mfile_open(f->fname.buf, MFILE_RW_CR, &f->mf);
         if (ret) {
@@ -427,10 +1472,14 @@ int zs_packed_file_new_from_memtree(const char *path,
         mfile_seek(&f->mf, ZS_HDR_SIZE, NULL);
 
         /* Write records into packed files */
-        memtree_walk_forward(priv->fmemtree,
+        memtree_walk_forward(memtree,
                            zs_packed_file_write_memtree_record,
                            (void *)f);
 
+        ret = blocks_end(f);
+        if (ret != ZS_OK)
+                goto fail;
+
         ret = mfile_flush(&f->mf);
         if (ret) {
                 zslog(LOGDEBUG, "Error flushing data to disk.\n");
@@ -445,12 +1494,18 @@ int zs_packed_file_new_from_memtree(const char *path,
                 goto fail;
         }
 
-        /* Write the pointer/index section */
-        crc32_begin(&f->mf);    /* The crc32 for index of the file */
+        ret = write_hash_index(f);
+        if (ret != ZS_OK)
+                goto fail;
 
-        zs_packed_file_write_index_count(f, f->index->count); /* count */
+        ret = write_filter(f, priv->filterbits);
+        if (ret != ZS_OK)
+                goto fail;
 
-        vecu64_foreach(f->index, zs_packed_file_write_index, f);
+        /* Write the pointer/index section */
+        ret = write_pointers(f, priv);
+        if (ret != ZS_OK)
+                goto fail;
 
         /* The commit record for pointer section */
         if (zs_packed_file_write_final_commit_record(f) != ZS_OK) {
@@ -466,6 +1521,10 @@ fail:
         xunlink(f->fname.buf);
         mfile_close(&f->mf);
         cstring_release(&f->fname);
+        vecu64_free(&f->filterhashes);
+        vecu64_free(&f->hashoffsets);
+        offidx_free(&f->index);
+        blocks_free(f);
         xfree(f);
 
 done:
@@ -481,12 +1540,13 @@ int zs_packed_file_get_key_from_offset(struct zsdb_file *f,
         int ret;
         struct zs_key k;
 
-        assert(f->indexpos <= f->index->count);
+        assert(f->indexpos <= zs_packed_file_count(f));
 
-        off = f->index->data[f->indexpos];
+        off = zs_packed_file_offset(f, f->indexpos);
 
         ret = zs_record_read_key_from_file_offset(f, off, &k);
-        assert(ret == ZS_OK);   /* This should not be anything otherwise */
+        if (ret != ZS_OK)
+                return ret;
 
         if (k.base.type == REC_TYPE_KEY ||
             k.base.type == REC_TYPE_DELETED)
@@ -515,11 +1575,11 @@ int zs_pq_cmp_key_frm_offset(const void *d1, const void *d2,
         f1 = (const struct zsdb_file *)d1;
         f2 = (const struct zsdb_file *)d2;
 
-        assert(f1->indexpos <= f1->index->count);
-        assert(f2->indexpos <= f2->index->count);
+        assert(f1->indexpos <= zs_packed_file_count(f1));
+        assert(f2->indexpos <= zs_packed_file_count(f2));
 
-        off1 = f1->index->data[f1->indexpos];
-        off2 = f2->index->data[f2->indexpos];
+        off1 = zs_packed_file_offset(f1, f1->indexpos);
+        off2 = zs_packed_file_offset(f2, f2->indexpos);
 
         /* asserts() should be ok here, since we should *not* have anything
          * apart from:
@@ -555,15 +1615,116 @@ int zs_pq_cmp_key_frm_offset(const void *d1, const void *d2,
         return ret;
 }
 
-int zs_packed_file_bsearch_index(const unsigned char *key, const uint64_t keylen,
-                                 struct zsdb_file *f, uint64_t *location,
-                                 const unsigned char **value, uint64_t *vallen,
-                                 zsdb_cmp_fn cmpfn)
+/* zs_packed_file_cmp_bounds():
+ * Where `key` is with respect to the keys in the file: < 0 if it is before
+ * the first, > 0 if it is after the last, 0 if it is in between. An empty
+ * file has nothing at or after any key.
+ */
+int zs_packed_file_cmp_bounds(const struct zsdb_file *f,
+                              const unsigned char *key, uint64_t keylen,
+                              zsdb_cmp_fn cmpfn)
+{
+        int ret;
+
+        if (!zs_packed_file_count(f))
+                return 1;
+
+        if (cmpfn)
+                ret = cmpfn(key, keylen, (const unsigned char *)f->minkey.buf,
+                            f->minkey.len);
+        else
+                ret = memcmp_raw(key, keylen, f->minkey.buf, f->minkey.len);
+        if (ret < 0)
+                return -1;
+
+        if (cmpfn)
+                ret = cmpfn(key, keylen, (const unsigned char *)f->maxkey.buf,
+                            f->maxkey.len);
+        else
+                ret = memcmp_raw(key, keylen, f->maxkey.buf, f->maxkey.len);
+
+        return ret > 0 ? 1 : 0;
+}
+
+/* zs_packed_file_may_contain():
+ * 0 if `key`, of `hash` from bloom_hash(), isn't in the file, going by the
+ * keys it starts and ends with, and its filter.
+ */
+int zs_packed_file_may_contain(const struct zsdb_file *f,
+                               const unsigned char *key, uint64_t keylen,
+                               uint64_t hash, zsdb_cmp_fn cmpfn)
+{
+        if (zs_packed_file_cmp_bounds(f, key, keylen, cmpfn))
+                return 0;
+
+        if (f->filter && !cmpfn)
+                return bloom_may_contain(f->filter, hash);
+
+        return 1;
+}
+
+/* zs_packed_file_may_contain_prefix():
+ * 0 if no key in the file starts with `prefix`, going by its filter, which
+ * can only tell for prefixes at least as long as those it has.
+ */
+int zs_packed_file_may_contain_prefix(const struct zsdb_file *f,
+                                      const unsigned char *prefix,
+                                      uint64_t prefixlen, zsdb_cmp_fn cmpfn)
+{
+        if (!f->filter || cmpfn || !f->filterprefix ||
+            prefixlen < f->filterprefix)
+                return 1;
+
+        return bloom_may_contain(f->filter,
+                                 bloom_hash(prefix, f->filterprefix));
+}
+
+/* zs_packed_file_count():
+ * The number of records in a packed file.
+ */
+uint64_t zs_packed_file_count(const struct zsdb_file *f)
+{
+        if (f->blocks)
+                return f->blocks[f->nblocks].first;
+
+        return f->index ? offidx_count(f->index) : 0;
+}
+
+/* zs_packed_file_offset():
+ * The offset of the record at `i` in a packed file, 0 if `i` is past the
+ * end.
+ */
+uint64_t zs_packed_file_offset(const struct zsdb_file *f, uint64_t i)
+{
+        struct block_index bi;
+
+        if (!f->blocks)
+                return offidx_get(f->index, i);
+
+        if (i >= zs_packed_file_count(f))
+                return 0;
+
+        if (read_block_index(f, find_block(f, i), &bi) != ZS_OK)
+                return 0;
+
+        return bi.base + ntoh16(bi.offsets[i - bi.first]);
+}
+
+/* bsearch_records():
+ * Looks for `key` in the records [lo, hi) of a block, or of the whole of
+ * a version 1 file, `*pos` set to where it is, or would be.
+ */
+static int bsearch_records(const unsigned char *key, uint64_t keylen,
+                           struct zsdb_file *f, const struct block_index *bi,
+                           uint64_t lo, uint64_t hi, uint64_t *pos,
+                           const unsigned char **value, uint64_t *vallen,
+                           zsdb_cmp_fn cmpfn)
 {
-        uint64_t hi, lo;
+        uint64_t prefix = 0;
+        size_t lcplo = 0, lcphi = 0;
 
-        lo = 0;
-        hi = f->index->count;
+        if (bi->prefixes)
+                prefix = key_prefix(key + bi->skip, keylen - bi->skip);
 
         while (lo < hi) {
                 uint64_t mi;
@@ -571,47 +1732,364 @@ int zs_packed_file_bsearch_index(const unsigned char *key, const uint64_t keylen
                 uint64_t klen = 0;
                 int res;
                 uint64_t offset = 0;
+                size_t lcp = 0;
 
                 /* compute the mid */
                 mi = lo + (hi - lo) / 2;
 
+                /* With key prefixes, the records are only read for the
+                 * keys with the same prefix as `key` */
+                if (bi->prefixes && ntoh64(bi->prefixes[mi]) != prefix) {
+                        if (prefix > ntoh64(bi->prefixes[mi]))
+                                lo = mi + 1;
+                        else
+                                hi = mi;
+                        continue;
+                }
+
                 /* Get key from file */
-                offset = f->index->data[mi];
+                if (bi->offsets)
+                        offset = bi->base + ntoh16(bi->offsets[mi]);
+                else
+                        offset = offidx_get(f->index, mi);
 
                 res = zs_record_read_key_val_from_offset(f, &offset,
                                                          &k, &klen,
                                                          value, vallen);
-                assert(res == ZS_OK);
+                if (res != ZS_OK) {
+                        zslog(LOGWARNING, "Could not read a record of %s\n",
+                              f->fname.buf);
+                        break;
+                }
 
-                /* Compare */
+                /* Compare, after the bytes `key` shares with the records
+                 * either side of those left, which they all share too */
                 if (cmpfn)
                         res = cmpfn(key, keylen, k, klen);
                 else
-                        res = memcmp_raw(key, keylen, k, klen);
+                        res = memcmp_raw_from(key, keylen, k, klen,
+                                              lcplo < lcphi ? lcplo : lcphi,
+                                              &lcp);
                 if (!res) {
-                        /* If found, `location` will contain the
-                           offset at which the element can be found.
-                         */
-                        if (location)
-                                *location = mi;
-
+                        *pos = mi;
                         return 1; /* FOUND */
                 }
 
-                if (res > 0)
+                if (res > 0) {
                         lo = mi + 1;
+                        lcplo = lcp;
+                } else {
+                        hi = mi;
+                        lcphi = lcp;
+                }
+        }
+
+        *pos = lo;
+
+        return 0;               /* NOT FOUND */
+}
+
+/* model_window():
+ * The places [*lo, *hi) the model of `f` puts `key` in, if it has one that
+ * can be used for it: those of its records for a version 1 file, those of
+ * the fence keys from the second block for a version 2 file.
+ */
+static int model_window(const struct zsdb_file *f, const unsigned char *key,
+                        uint64_t keylen, zsdb_cmp_fn cmpfn, uint64_t *lo,
+                        uint64_t *hi)
+{
+        if (!f->model || cmpfn || keylen < f->modelskip ||
+            memcmp(key, f->minkey.buf, f->modelskip))
+                return 0;
+
+        keymodel_window(f->model, key_prefix(key + f->modelskip,
+                                             keylen - f->modelskip),
+                        lo, hi);
+
+        return 1;
+}
+
+/* bsearch_fences():
+ * The first of the blocks [lo, hi) with a fence key after `key`, or `hi`.
+ */
+static uint64_t bsearch_fences(const unsigned char *key, uint64_t keylen,
+                               const struct zsdb_file *f, uint64_t lo,
+                               uint64_t hi, zsdb_cmp_fn cmpfn)
+{
+        size_t lcplo = 0, lcphi = 0;
+
+        while (lo < hi) {
+                const struct zs_block *blk;
+                uint64_t mi = lo + (hi - lo) / 2;
+                size_t lcp = 0;
+                int res;
+
+                blk = &f->blocks[mi];
+                if (cmpfn)
+                        res = cmpfn(key, keylen, blk->fence, blk->fencelen);
                 else
+                        res = memcmp_raw_from(key, keylen, blk->fence,
+                                              blk->fencelen,
+                                              lcplo < lcphi ? lcplo : lcphi,
+                                              &lcp);
+
+                if (res >= 0) {
+                        lo = mi + 1;
+                        lcplo = lcp;
+                } else {
                         hi = mi;
+                        lcphi = lcp;
+                }
         }
 
-        /* If the element isn't found, then we return the least
-         * entry that is closest(greater) than the `key` we are
-         * given
-         */
+        return lo;
+}
+
+/* search_block():
+ * Looks for `key` in the block before the one `b` with the first fence key
+ * after it.
+ */
+static int search_block(const unsigned char *key, uint64_t keylen,
+                        struct zsdb_file *f, uint64_t b, uint64_t *location,
+                        const unsigned char **value, uint64_t *vallen,
+                        zsdb_cmp_fn cmpfn)
+{
+        struct block_index bi;
+        struct zs_key first;
+        uint64_t pos;
+        int ret;
+
+        if (read_block_index(f, b - 1, &bi) != ZS_OK) {
+                zslog(LOGWARNING, "Could not read a block of %s\n",
+                      f->fname.buf);
+                if (location)
+                        *location = f->blocks[b - 1].first;
+                return 0;
+        }
+
+        /* The keys of the block start with the bytes its prefixes skip,
+         * which `key` has to as well for them to tell anything */
+        if (!(f->blockflags & ZS_BLOCKS_BYTEORDER) || cmpfn ||
+            keylen < bi.skip)
+                bi.prefixes = NULL;
+        else if (bi.skip) {
+                ret = zs_record_read_key_from_file_offset(f, bi.base, &first);
+                if (ret != ZS_OK || memcmp(key, first.data, bi.skip))
+                        bi.prefixes = NULL;
+        }
+
+        ret = bsearch_records(key, keylen, f, &bi, 0, bi.n, &pos, value,
+                              vallen, cmpfn);
         if (location)
-                *location = lo;
+                *location = bi.first + pos;
 
-        return 0;               /* NOT FOUND */
+        return ret;
+}
+
+/* file_block_index():
+ * A version 1 file is searched as a single block.
+ */
+static void file_block_index(const unsigned char *key, uint64_t keylen,
+                             const struct zsdb_file *f, struct block_index *bi,
+                             zsdb_cmp_fn cmpfn)
+{
+        memset(bi, 0, sizeof(*bi));
+        bi->n = offidx_count(f->index);
+        bi->skip = f->keyprefixskip;
+        if (f->keyprefixes && !cmpfn && keylen >= f->keyprefixskip &&
+            !memcmp(key, f->minkey.buf, f->keyprefixskip))
+                bi->prefixes = (const uint64_t *)f->keyprefixes;
+}
+
+/* gallop_fences():
+ * bsearch_fences() over the blocks from `lo` on, for keys looked up in
+ * order: the fence keys 1, 2, 4... blocks on from `lo` are looked at
+ * first, so that a key close to the one before takes few comparisons.
+ */
+static uint64_t gallop_fences(const unsigned char *key, uint64_t keylen,
+                              const struct zsdb_file *f, uint64_t lo,
+                              zsdb_cmp_fn cmpfn)
+{
+        uint64_t hi = f->nblocks, step = 1;
+
+        while (hi - lo > step) {
+                const struct zs_block *blk = &f->blocks[lo + step - 1];
+                int res;
+
+                if (cmpfn)
+                        res = cmpfn(key, keylen, blk->fence, blk->fencelen);
+                else
+                        res = memcmp_raw(key, keylen, blk->fence,
+                                         blk->fencelen);
+                if (res < 0) {
+                        hi = lo + step - 1;
+                        break;
+                }
+
+                lo += step;
+                step <<= 1;
+        }
+
+        return bsearch_fences(key, keylen, f, lo, hi, cmpfn);
+}
+
+/* gallop_records():
+ * Same as gallop_fences(), over the records of a version 1 file.
+ */
+static int gallop_records(const unsigned char *key, uint64_t keylen,
+                          struct zsdb_file *f, const struct block_index *bi,
+                          uint64_t lo, uint64_t *pos,
+                          const unsigned char **value, uint64_t *vallen,
+                          zsdb_cmp_fn cmpfn)
+{
+        uint64_t hi = bi->n, step = 1;
+
+        while (hi - lo > step) {
+                uint64_t offset = offidx_get(f->index, lo + step - 1);
+                const unsigned char *k;
+                uint64_t klen = 0;
+                int res;
+
+                res = zs_record_read_key_val_from_offset(f, &offset, &k, &klen,
+                                                         value, vallen);
+                if (res != ZS_OK) {
+                        zslog(LOGWARNING, "Could not read a record of %s\n",
+                              f->fname.buf);
+                        *pos = lo;
+                        return 0;
+                }
+
+                if (cmpfn)
+                        res = cmpfn(key, keylen, k, klen);
+                else
+                        res = memcmp_raw(key, keylen, k, klen);
+                if (!res) {
+                        *pos = lo + step - 1;
+                        return 1;
+                }
+                if (res < 0) {
+                        hi = lo + step - 1;
+                        break;
+                }
+
+                lo += step;
+                step <<= 1;
+        }
+
+        return bsearch_records(key, keylen, f, bi, lo, hi, pos, value, vallen,
+                               cmpfn);
+}
+
+/* bsearch_blocks():
+ * The block `key` would be in is the last one with a fence key that isn't
+ * after it, and the records are looked for only there.
+ */
+static int bsearch_blocks(const unsigned char *key, uint64_t keylen,
+                          struct zsdb_file *f, uint64_t *location,
+                          const unsigned char **value, uint64_t *vallen,
+                          zsdb_cmp_fn cmpfn)
+{
+        uint64_t b, hi, lo;
+
+        if (model_window(f, key, keylen, cmpfn, &lo, &hi)) {
+                /* The model counts the fence keys from the second block.
+                 * It's never wrong, but if the block is at the edge of
+                 * where it says, the rest is looked at too */
+                lo++;
+                hi++;
+                b = bsearch_fences(key, keylen, f, lo, hi, cmpfn);
+                if (b == lo && lo > 1)
+                        b = bsearch_fences(key, keylen, f, 1, lo, cmpfn);
+                else if (b == hi && hi < f->nblocks)
+                        b = bsearch_fences(key, keylen, f, hi, f->nblocks,
+                                           cmpfn);
+        } else {
+                b = bsearch_fences(key, keylen, f, 1, f->nblocks, cmpfn);
+        }
+
+        return search_block(key, keylen, f, b, location, value, vallen,
+                            cmpfn);
+}
+
+int zs_packed_file_bsearch_index(const unsigned char *key, const uint64_t keylen,
+                                 struct zsdb_file *f, uint64_t *location,
+                                 const unsigned char **value, uint64_t *vallen,
+                                 zsdb_cmp_fn cmpfn)
+{
+        struct block_index bi;
+        uint64_t hi, lo, pos;
+        int ret;
+
+        if (!zs_packed_file_count(f)) {
+                if (location)
+                        *location = 0;
+                return 0;
+        }
+
+        if (f->blocks)
+                return bsearch_blocks(key, keylen, f, location, value, vallen,
+                                      cmpfn);
+
+        file_block_index(key, keylen, f, &bi, cmpfn);
+
+        /* If the element isn't found, then `location` is that of the least
+         * entry that is closest(greater) than the `key` we are given */
+        if (model_window(f, key, keylen, cmpfn, &lo, &hi)) {
+                ret = bsearch_records(key, keylen, f, &bi, lo, hi, &pos,
+                                      value, vallen, cmpfn);
+                if (!ret && pos == lo && lo > 0)
+                        ret = bsearch_records(key, keylen, f, &bi, 0, lo,
+                                              &pos, value, vallen, cmpfn);
+                else if (!ret && pos == hi && hi < bi.n)
+                        ret = bsearch_records(key, keylen, f, &bi, hi, bi.n,
+                                              &pos, value, vallen, cmpfn);
+        } else {
+                ret = bsearch_records(key, keylen, f, &bi, 0, bi.n, &pos,
+                                      value, vallen, cmpfn);
+        }
+        if (location)
+                *location = pos;
+
+        return ret;
+}
+
+/* zs_packed_file_fetch():
+ * Looks `key`, with the bloom_hash() `hash`, up in `f`. Keys looked up in
+ * order can pass a `cursor`, 0 for the first of them, for the search to
+ * start from where the key before was.
+ */
+int zs_packed_file_fetch(const unsigned char *key, uint64_t keylen,
+                         uint64_t hash, struct zsdb_file *f, uint64_t *cursor,
+                         const unsigned char **value, uint64_t *vallen,
+                         zsdb_cmp_fn cmpfn)
+{
+        struct block_index bi;
+        uint64_t pos;
+        int ret;
+
+        /* The hash index only finds keys with the same bytes */
+        if (f->hashslots && !cmpfn)
+                return hash_index_lookup(key, keylen, hash, f, value, vallen);
+
+        if (!cursor || !zs_packed_file_count(f))
+                return zs_packed_file_bsearch_index(key, keylen, f, NULL,
+                                                    value, vallen, cmpfn);
+
+        /* The keys come in order, each is looked for from where the one
+         * before would be */
+        if (f->blocks) {
+                *cursor = gallop_fences(key, keylen, f,
+                                        *cursor > 1 ? *cursor : 1, cmpfn);
+                return search_block(key, keylen, f, *cursor, NULL, value,
+                                    vallen, cmpfn);
+        }
+
+        file_block_index(key, keylen, f, &bi, cmpfn);
+        ret = gallop_records(key, keylen, f, &bi, *cursor, &pos, value,
+                             vallen, cmpfn);
+        *cursor = pos;
+
+        return ret;
 }
 
 int zs_packed_file_new_from_packed_files(const char *path,
@@ -632,19 +2110,7 @@ int zs_packed_file_new_from_packed_files(const char *path,
                 return ZS_INTERNAL;
         }
 
-        f = xcalloc(sizeof(struct zsdb_file), 1);
-        f->type = DB_FTYPE_PACKED;
-        cstring_init(&f->fname, 0);
-        cstring_addstr(&f->fname, path);
-        f->index = vecu64_new();
-
-        /* Initialise header fields */
-        f->header.signature = ZS_SIGNATURE;
-        f->header.version = ZS_VERSION;
-        memcpy(f->header.uuid, priv->uuid, sizeof(uuid_t));
-        f->header.startidx = startidx;
-        f->header.endidx = endidx;
-        f->header.crc32 = 0;
+        f = packed_file_new(path, startidx, endidx, priv);
 
         ret = mfile_open(f->fname.buf, MFILE_RW_CR, &f->mf);
         if (ret) {
@@ -683,7 +2149,8 @@ int zs_packed_file_new_from_packed_files(const char *path,
                 case ZSDB_BE_PACKED:
                 {
                         struct zsdb_file *tempf = data->data.f;
-                        uint64_t offset = tempf->index->data[tempf->indexpos];
+                        uint64_t offset = zs_packed_file_offset(tempf,
+                                                                tempf->indexpos);
                         zs_record_read_from_file(tempf, &offset,
                                                  zs_packed_file_write_record,
                                                  zs_packed_file_write_delete_record,
@@ -698,8 +2165,17 @@ int zs_packed_file_new_from_packed_files(const char *path,
                 }
 
                 count++;
+
+                /* The iterator only keeps the current key of each file, in
+                 * the last window it mapped, the ones behind it can go */
+                if (packed_files_reclaim_due(flist))
+                        packed_files_reclaim(flist);
         } while (zs_iterator_next(*iter, data));
 
+        ret = blocks_end(f);
+        if (ret != ZS_OK)
+                goto fail;
+
         ret = mfile_flush(&f->mf);
         if (ret) {
                 zslog(LOGDEBUG, "Error flushing data to disk.\n");
@@ -714,12 +2190,18 @@ int zs_packed_file_new_from_packed_files(const char *path,
                 goto fail;
         }
 
-        /* Write the pointer/index section */
-        crc32_begin(&f->mf);    /* The crc32 for index of the file */
+        ret = write_hash_index(f);
+        if (ret != ZS_OK)
+                goto fail;
 
-        zs_packed_file_write_index_count(f, f->index->count); /* count */
+        ret = write_filter(f, priv->filterbits);
+        if (ret != ZS_OK)
+                goto fail;
 
-        vecu64_foreach(f->index, zs_packed_file_write_index, f);
+        /* Write the pointer/index section */
+        ret = write_pointers(f, priv);
+        if (ret != ZS_OK)
+                goto fail;
 
         /* The commit record for pointer section */
         if (zs_packed_file_write_final_commit_record(f) != ZS_OK) {
@@ -735,6 +2217,10 @@ fail:
         xunlink(f->fname.buf);
         mfile_close(&f->mf);
         cstring_release(&f->fname);
+        vecu64_free(&f->filterhashes);
+        vecu64_free(&f->hashoffsets);
+        offidx_free(&f->index);
+        blocks_free(f);
         xfree(f);
 
 done:
@@ -12,15 +12,21 @@
 #define _ZEROSKIP_PRIV_H_
 
 #include "file-lock.h"
-#include "htable.h"
 #include "list.h"
 #include "pqueue.h"
+#include "thread-lock.h"
 
+#include <libzeroskip/arena.h>
+#include <libzeroskip/bloom.h>
 #include <libzeroskip/memtree.h>
 #include <libzeroskip/cstring.h>
+#include <libzeroskip/htable.h>
+#include <libzeroskip/keymodel.h>
 #include <libzeroskip/macros.h>
 #include <libzeroskip/mfile.h>
+#include <libzeroskip/offidx.h>
 #include <libzeroskip/util.h>
+#include <libzeroskip/valcache.h>
 #include <libzeroskip/vecu64.h>
 #include <libzeroskip/zeroskip.h>
 
@@ -90,6 +96,36 @@ struct _packed_ dotzsdb{
 #define DOTZSDB_FNAME ".zsdb"
 #define DOTZSDB_SIZE  sizeof(struct dotzsdb)
 
+/**
+ * Memtree checkpoint
+ *
+ * An image of the memtrees, which saves replaying the DB files on open.
+ * The header is followed by the start index of each of the finalised files
+ * covered, newest first, and then the records of the finalised and the
+ * active files, each in the order of the memtree. A record is:
+ *      key length           -  64 bits
+ *      value length         -  64 bits
+ *      deleted              -   8 bits
+ *      key and value
+ */
+struct _packed_ zs_checkpoint_header {
+        uint64_t signature;
+        uint32_t version;
+        uuid_t   uuid;
+        uint32_t activeidx;         /* Index of the active file covered */
+        uint64_t offset;            /* Offset in the active file covered */
+        uint32_t nfiles;            /* Number of finalised files covered */
+        uint64_t nfrecs;            /* Number of finalised records */
+        uint64_t narecs;            /* Number of active records */
+        uint32_t crc;               /* CRC32 of the rest of the file */
+};
+#define ZS_CHECKPOINT_FNAME     ".zsdb-checkpoint"
+#define ZS_FROZEN_FNAME         ".zsdb-frozen"
+#define ZS_CHECKPOINT_SIGNATURE 0x5a53434b50543031 /* "ZSCKPT01" */
+#define ZS_CHECKPOINT_VERSION   1
+#define ZS_CHECKPOINT_HDR_SIZE  sizeof(struct zs_checkpoint_header)
+#define ZS_CHECKPOINT_REC_SIZE  17
+
 
 
 /* Types of files in the DB */
@@ -170,6 +206,93 @@ struct zs_long_commit {
 #define MAX_SHORT_KEY_LEN 65535
 #define MAX_SHORT_VAL_LEN 16777215
 
+/**
+ * Filter block of packed files.
+ * Between the commit record that ends the records and the pointers, the
+ * bits of a bloom filter of the keys, followed by a trailer:
+ *   nblocks (64 bits), k (32 bits), prefix length (32 bits),
+ *   crc32 of the bits (32 bits), unused (32 bits), ZS_FILTER_MAGIC.
+ * Files without one, and readers that don't know of it, go from the
+ * commit record straight to the pointers.
+ */
+#define ZS_FILTER_MAGIC         0x5a5346494c544552 /* "ZSFILTER" */
+#define ZS_FILTER_TRAILER_SIZE  32
+#define ZS_FILTER_BITS_PER_KEY  10
+
+/**
+ * Hash index block of packed files.
+ * Before the filter block, or the pointers if there is none, an open
+ * addressed table of the keys: a power of two of 64 bit slots, each 0 or
+ * the top bits of the bloom_hash() of a key above the offset of its record
+ * divided by 8, in the low ZS_HASHIDX_OFFSET_BITS bits. A key is looked for
+ * from the slot of the low bits of its hash on. Followed by a trailer:
+ *   number of slots (64 bits), number of keys (64 bits),
+ *   crc32 of the slots (32 bits), unused (32 bits), ZS_HASHIDX_MAGIC.
+ * Files without one, and readers that don't know of it, don't look before
+ * the filter block.
+ */
+#define ZS_HASHIDX_MAGIC        0x5a53484153484958 /* "ZSHASHIX" */
+#define ZS_HASHIDX_TRAILER_SIZE 32
+#define ZS_HASHIDX_OFFSET_BITS  40
+
+/**
+ * Key prefixes of packed files.
+ * After the offsets, the pointers section may go on with the number of
+ * bytes all the keys of the file start with (64 bits), and then for each
+ * offset the ZS_KEY_PREFIX_SIZE bytes of its key after those, zero padded,
+ * as a big endian number. The keys compare as their prefixes do, unless
+ * those are the same. Readers that don't know of them stop at the offsets.
+ */
+#define ZS_KEY_PREFIX_SIZE      8
+
+/**
+ * Packed files, version 2.
+ * The records are in blocks of ZS_BLOCK_SIZE bytes, or just over for the
+ * record that fills one, each followed by its index: the key prefixes of
+ * its records, as above but skipping the bytes the keys of the block start
+ * with, their offsets from the start of the block (16 bits each, padded to
+ * 64 bits), the number of bytes skipped (32 bits) and the number of
+ * records (32 bits).
+ * Instead of the offsets, the pointers section has ZS_BLOCKS_MAGIC, the
+ * number of records, of blocks and flags (64 bits each), then for each
+ * block, and for the end of the last one, its offset, the index of its
+ * first record and the length of its fence key (64 bits each), and the
+ * fence keys, each padded to 64 bits. The fence key of a block is after
+ * all the keys of the block before it, and not after its first key; that
+ * of the first block is empty.
+ * Older versions of the library don't check the version of packed files,
+ * they take ZS_BLOCKS_MAGIC for the number of records and crash, so
+ * version 2 is only written when asked for.
+ */
+#define ZS_PACKED_VERSION       2
+#define ZS_PACKED_VERSION_DEFAULT 1
+#define ZS_BLOCK_SIZE           4096
+#define ZS_BLOCKS_MAGIC         0x5a53424c4f434b53 /* "ZSBLOCKS" */
+#define ZS_BLOCKS_HDR_SIZE      32
+#define ZS_BLOCKS_BYTEORDER     0x1     /* The keys compare as bytes, so the
+                                         * fences are as short as can be and
+                                         * the prefixes are there */
+
+struct zs_block {
+        uint64_t offset;
+        uint64_t first;                 /* The index of its first record */
+        const unsigned char *fence;     /* In the mapped pointers */
+        uint64_t fencelen;
+};
+
+/**
+ * Models of the keys of packed files, see keymodel.h, built as they are
+ * opened from what is in memory already: the fence keys of a version 2
+ * file, the key prefixes of a version 1 file. Only files with enough of
+ * them for a binary search to take a while get one, and only keys that
+ * compare as bytes are on the lines of a model. It's dropped if the keys
+ * aren't on few enough lines for it to be much smaller than them, or too
+ * many of them have the same prefix.
+ */
+#define ZS_MODEL_MAX_ERROR      8
+#define ZS_MODEL_MIN_KEYS       64
+#define ZS_MODEL_MIN_SEGMENT    16      /* Keys per line, on average */
+
 
 /* masks for file stat changes */
 #define ZSDB_FILE_INO_CHANGED    0x0001
@@ -187,12 +310,37 @@ struct zsdb_file {
         struct zs_header header;
         cstring fname;
         struct mfile *mf;
-        struct vecu64 *index;
+        struct offidx *index;
         struct stat st;
         int is_open;
         uint64_t indexpos;      /* Position in the index vec */
         uint64_t priority;      /* Higher the number, higher the priority */
         int dirty;
+        cstring minkey;         /* The smallest and the largest keys of a */
+        cstring maxkey;         /* packed file, to skip it in lookups */
+        struct bloom *filter;   /* The filter of a packed file, if any */
+        uint32_t filterprefix;  /* ..which has the key prefixes of this
+                                 * length too, if not 0 */
+        struct vecu64 *filterhashes; /* The hashes of the keys written,
+                                      * for the filter */
+        uint64_t lastprefixhash;
+        const uint64_t *hashslots; /* The hash index of a packed file, in
+                                    * the mapping, NULL if it has none */
+        uint64_t hashnslots;
+        struct vecu64 *hashoffsets;  /* The hashes of the keys written and
+                                      * the offsets of their records, for
+                                      * the hash index */
+        const unsigned char *keyprefixes; /* Of a packed file, in the mapped
+                                           * pointers, NULL if it has none */
+        uint64_t keyprefixskip; /* ..after the bytes all its keys start with */
+        struct zs_block *blocks;        /* Of a version 2 packed file, and
+                                         * the end of the last one */
+        uint64_t nblocks;
+        uint64_t blockflags;
+        struct zs_blockw *bw;           /* The blocks being written */
+        struct keymodel *model;         /* Of the keys, or the fence keys, of
+                                         * a packed file, if it has one */
+        uint64_t modelskip;     /* ..after the bytes all its keys start with */
 };
 
 struct zsdb_files {
@@ -251,6 +399,13 @@ struct zsdb_iter {
 
         int forone_iter;
         int foreach_iter;
+
+        const unsigned char *prefix; /* Of a zsdb_foreach(), to leave out
+                                      * the packed files whose filters
+                                      * don't have it */
+        size_t prefixlen;
+
+        size_t bytes;               /* Accounted in zsdb_priv.iterbytes */
 };
 
 /** Transactions **/
@@ -268,6 +423,50 @@ struct zsdb_txn {
 };
 
 
+/** Memory budget **/
+struct zs_membudget {
+        size_t limit;               /* In bytes, 0 for no budget */
+        pthread_t thread;           /* The flusher, for MODE_THREADED */
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        int running;
+        int pending;                /* A flush has been requested */
+        int stop;
+};
+
+/* Every open DB is on the list of the process, for the memory of all of
+ * them to be kept under one budget, see zsdb_set_process_memory_budget().
+ */
+struct zs_procmem {
+        struct list_head list;      /* On the list of the open DBs */
+        struct zsdb *db;
+        size_t bytes;               /* Accounted against the process budget */
+        size_t flushable;           /* ..of which a flush can release */
+        uint64_t lastused;          /* The process use clock, when last used */
+        pthread_t owner;            /* The thread the DB was opened in */
+        int values;                 /* Keys and values handed out since the
+                                     * last write, see zs_process_read() */
+        int busy;                   /* Picked for eviction, which runs
+                                     * without the process mutex */
+        int registered;
+};
+
+/** Frozen memtree **/
+/* The records of an active file that was rolled over, while they are
+ * written to a packed file in the background. The active file is kept,
+ * finalised, until the packed file is published.
+ */
+struct zs_frozen {
+        struct memtree *memtree;    /* NULL when there is nothing frozen */
+        uint32_t idx;               /* Index of the active file */
+        cstring fname;              /* ..and its name, once finalised */
+        struct zsdb_file *f;        /* The packed file written */
+        pthread_t thread;           /* The writer */
+        int running;
+        int done;                   /* Set by the writer, when it is done */
+        int ret;                    /* ..and what it returned */
+};
+
 /** Private data structure **/
 struct zsdb_priv {
         uuid_t uuid;                /* The UUID for the DB */
@@ -283,21 +482,49 @@ struct zsdb_priv {
         /* Locks */
         struct file_lock wlk;       /* Lock when writing */
         struct file_lock plk;       /* Lock when packing */
+        struct thread_lock tlk;     /* Lock between threads, MODE_THREADED */
 
+        struct arena *arena;          /* For the memtrees, MODE_HUGEPAGES */
         struct memtree *memtree;      /* in-memory B-Tree */
         struct memtree *fmemtree;     /* in-memory B-Tree of finalised records */
 
         zsdb_cmp_fn dbcompare;       /* The db comparator */
         memtree_search_cb_t btcompare; /* Th memtree comparator */
 
+        unsigned int filterbits;     /* Bits per key of the filters of the
+                                      * packed files written, 0 for none */
+        uint32_t filterprefix;       /* ..and the length of the prefixes
+                                      * they have as well, 0 for none */
+        unsigned int packversion;    /* Of the packed files written */
+        int hashindex;               /* Hash indexes in the packed files
+                                      * written */
+
         int open;                    /* is the db open */
         int flags;                   /* The flags passed during call to open */
         int dbdirty;                 /* Marked dirty when there are changes
                                       * (add/remove/pack) to the db */
+        int stale;                   /* The memtrees no longer match the
+                                      * files, after a finalise or a pack,
+                                      * until the next reload */
+        uint64_t generation;         /* Bumped when the files or the
+                                      * memtrees are replaced, which
+                                      * invalidates open iterators */
+
+        struct zs_membudget membudget; /* Memory budget */
+        struct zs_procmem procmem;     /* ..and that of the process */
+        struct zs_frozen frozen;       /* Frozen memtree */
+        struct valcache *valcache;     /* Values of the hot keys, NULL if
+                                        * there is no cache */
+
+        /* Iterators can be ended outside the thread lock, by
+         * zsdb_transaction_end(), so these are updated atomically */
+        size_t iterbytes;            /* Memory used by open iterators */
+        size_t itercount;            /* Number of open iterators */
 };
 
 
 extern int zsdb_break(int err);
+extern int zsdb_flush_locked(struct zsdb *db, int pack);
 
 /* zeroskip-active.c */
 extern int zs_active_file_open(struct zsdb_priv *priv, uint32_t idx, int mode);
@@ -313,11 +540,18 @@ extern int zs_active_file_write_delete_record(struct zsdb_priv *priv,
                                               const unsigned char *key,
                                               uint64_t keylen);
 extern int zs_active_file_record_foreach(struct zsdb_priv *priv,
+                                         uint64_t offset,
                                          zsdb_foreach_cb *cb,
                                          zsdb_foreach_cb *deleted_cb,
                                          void *cbdata);
 extern int zs_active_file_new(struct zsdb_priv *priv, uint32_t idx);
 
+/* zeroskip-checkpoint.c */
+extern int zs_checkpoint_write(struct zsdb_priv *priv);
+extern int zs_checkpoint_load(struct zsdb_priv *priv,
+                              zsdb_foreach_cb *cb, zsdb_foreach_cb *deleted_cb,
+                              void *fdata, void *adata, uint64_t *offset);
+
 /* zeroskip-dotzsdb.c */
 extern int zs_dotzsdb_create(struct zsdb_priv *priv);
 extern int zs_dotzsdb_validate(struct zsdb_priv *priv);
@@ -352,6 +586,11 @@ extern int zs_finalised_file_record_foreach(struct zsdb_file *f,
                                             zsdb_foreach_cb *cb, zsdb_foreach_cb *deleted_cb,
                                             void *cbdata);
 
+/* zeroskip-frozen.c */
+extern int zs_frozen_begin(struct zsdb_priv *priv);
+extern int zs_frozen_publish(struct zsdb_priv *priv, int wait);
+extern void zs_frozen_free(struct zsdb_priv *priv);
+
 /* zeroskip-header.c */
 extern int zs_header_write(struct zsdb_file *f);
 extern int zs_header_validate(struct zsdb_file *f);
@@ -366,17 +605,38 @@ extern int zs_iterator_begin_at_key(struct zsdb_iter **iter,
 extern int zs_iterator_begin_for_packed_files(struct zsdb_iter **iter,
                                               struct list_head *pflist);
 extern struct zsdb_iter_data *zs_iterator_get(struct zsdb_iter *iter);
+extern void zs_iterator_sync_active(struct zsdb_iter *iter,
+                                    struct zsdb_iter_data *data,
+                                    const unsigned char *key,
+                                    size_t keylen);
 extern int zs_iterator_next(struct zsdb_iter *iter,
                             struct zsdb_iter_data *data);
 extern void zs_iterator_end(struct zsdb_iter **iter);
 
+/* zeroskip-memory.c */
+extern size_t zs_memory_used(struct zsdb_priv *priv, size_t *flushable);
+extern int zs_memory_budget_set(struct zsdb *db, size_t limit);
+extern void zs_memory_budget_check(struct zsdb *db);
+extern void zs_memory_budget_stop(struct zsdb *db);
+extern void zs_memory_usage(struct zsdb_priv *priv,
+                            struct zsdb_memory_usage *usage);
+extern void zs_process_register(struct zsdb *db);
+extern void zs_process_unregister(struct zsdb *db);
+extern void zs_process_touch(struct zsdb_priv *priv);
+extern void zs_process_read(struct zsdb_priv *priv);
+extern void zs_process_write(struct zsdb_priv *priv);
+extern void zs_process_budget_set(size_t limit);
+extern void zs_process_memory_usage(struct zsdb_process_memory_usage *usage);
+
 /* zeroskip-packed.c */
 extern int zs_packed_file_open(const char *path, struct zsdb_file **fptr);
 extern int zs_packed_file_close(struct zsdb_file **fptr);
+extern void zs_packed_files_reclaim(struct zsdb_priv *priv);
 extern int zs_packed_file_new_from_memtree(const char *path,
                                            uint32_t startidx,
                                            uint32_t endidx,
                                            struct zsdb_priv *priv,
+                                           struct memtree *memtree,
                                            struct zsdb_file **fptr);
 extern int zs_packed_file_new_from_packed_files(const char *path,
                                                 uint32_t startidx,
@@ -402,6 +662,19 @@ extern int zs_packed_file_get_key_from_offset(struct zsdb_file *f,
                                               unsigned char **key,
                                               uint64_t *len,
                                               enum record_t *type);
+extern int zs_packed_file_cmp_bounds(const struct zsdb_file *f,
+                                     const unsigned char *key,
+                                     uint64_t keylen, zsdb_cmp_fn cmpfn);
+extern int zs_packed_file_may_contain(const struct zsdb_file *f,
+                                      const unsigned char *key,
+                                      uint64_t keylen, uint64_t hash,
+                                      zsdb_cmp_fn cmpfn);
+extern int zs_packed_file_may_contain_prefix(const struct zsdb_file *f,
+                                             const unsigned char *prefix,
+                                             uint64_t prefixlen,
+                                             zsdb_cmp_fn cmpfn);
+extern uint64_t zs_packed_file_count(const struct zsdb_file *f);
+extern uint64_t zs_packed_file_offset(const struct zsdb_file *f, uint64_t i);
 extern int zs_packed_file_bsearch_index(const unsigned char *key,
                                         const uint64_t keylen,
                                         struct zsdb_file *f,
@@ -409,6 +682,11 @@ extern int zs_packed_file_bsearch_index(const unsigned char *key,
                                         const unsigned char **value,
                                         uint64_t *vallen,
                                         zsdb_cmp_fn cmpfn);
+extern int zs_packed_file_fetch(const unsigned char *key, uint64_t keylen,
+                                uint64_t hash, struct zsdb_file *f,
+                                uint64_t *cursor,
+                                const unsigned char **value, uint64_t *vallen,
+                                zsdb_cmp_fn cmpfn);
 
 /* zeroskip-record.c */
 extern int zs_record_read_from_file(struct zsdb_file *f, uint64_t *offset,
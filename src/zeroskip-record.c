@@ -19,13 +19,13 @@
 static int zs_record_read_key(struct zsdb_file *f, uint64_t *offset,
                               const unsigned char **key, uint64_t *keylen)
 {
-        unsigned char *bptr;
         unsigned char *fptr;
-        uint64_t data;
+        uint64_t data, recoffset = *offset;
         uint8_t type;
 
-        bptr = f->mf->ptr;
-        fptr = bptr + *offset;
+        fptr = mfile_range(f->mf, recoffset, ZS_KEY_BASE_REC_SIZE);
+        if (!fptr)
+                return ZS_IOERROR;
 
         data = read_be64(fptr);
         type = data >> 56;
@@ -38,8 +38,17 @@ static int zs_record_read_key(struct zsdb_file *f, uint64_t *offset,
         } else if (type == REC_TYPE_LONG_KEY || type == REC_TYPE_LONG_DELETED) {
                 *keylen = read_be64(fptr + 8);
                 *offset = read_be64(fptr + 16);
+        } else {
+                *keylen = 0;
         }
 
+        /* The key has to be in the same window */
+        if (f->mf->win) {
+                fptr = mfile_range(f->mf, recoffset,
+                                   ZS_KEY_BASE_REC_SIZE + *keylen);
+                if (!fptr)
+                        return ZS_IOERROR;
+        }
         *key = fptr + ZS_KEY_BASE_REC_SIZE;
 
         return ZS_OK;
@@ -48,13 +57,13 @@ static int zs_record_read_key(struct zsdb_file *f, uint64_t *offset,
 static int zs_record_read_val(struct zsdb_file *f, uint64_t *offset,
                               const unsigned char **val, uint64_t *vallen)
 {
-        unsigned char *bptr;
         unsigned char *fptr;
         uint64_t data;
         uint8_t type;
 
-        bptr = f->mf->ptr;
-        fptr = bptr + *offset;
+        fptr = mfile_range(f->mf, *offset, ZS_VAL_BASE_REC_SIZE);
+        if (!fptr)
+                return ZS_IOERROR;
 
         data = read_be64(fptr);
         type = data >> 56;
@@ -65,8 +74,16 @@ static int zs_record_read_val(struct zsdb_file *f, uint64_t *offset,
                 *vallen = temp;
         } else if (type == REC_TYPE_LONG_VALUE) {
                 *vallen = read_be64(fptr + 8);
+        } else {
+                *vallen = 0;
         }
 
+        if (f->mf->win) {
+                fptr = mfile_range(f->mf, *offset,
+                                   ZS_VAL_BASE_REC_SIZE + *vallen);
+                if (!fptr)
+                        return ZS_IOERROR;
+        }
         *val = fptr + ZS_VAL_BASE_REC_SIZE;
 
         return ZS_OK;
@@ -76,12 +93,12 @@ static int zs_read_key_rec(const struct zsdb_file *f,
                            uint64_t *offset,
                            struct zs_key *key)
 {
-        unsigned char *bptr;
         unsigned char *fptr;
-        uint64_t data;
+        uint64_t data, len = 0;
 
-        bptr = f->mf->ptr;
-        fptr = bptr + *offset;
+        fptr = mfile_range(f->mf, *offset, ZS_KEY_BASE_REC_SIZE);
+        if (!fptr)
+                return ZS_IOERROR;
 
         data = read_be64(fptr);
         key->base.type = data >> 56;
@@ -92,14 +109,21 @@ static int zs_read_key_rec(const struct zsdb_file *f,
                 key->base.sval_offset = data & 0xFFFFFFFF;
                 key->base.llen = 0;
                 key->base.lval_offset = 0;
+                len = key->base.slen;
         } else if (key->base.type == REC_TYPE_LONG_KEY ||
                    key->base.type == REC_TYPE_LONG_DELETED) {
                 key->base.slen = 0;
                 key->base.sval_offset = 0;
                 key->base.llen = read_be64(fptr + 8);
                 key->base.lval_offset = read_be64(fptr + 16);
+                len = key->base.llen;
         }
 
+        if (f->mf->win) {
+                fptr = mfile_range(f->mf, *offset, ZS_KEY_BASE_REC_SIZE + len);
+                if (!fptr)
+                        return ZS_IOERROR;
+        }
         key->data = fptr + ZS_KEY_BASE_REC_SIZE;
 
         return ZS_OK;
@@ -108,12 +132,12 @@ static int zs_read_key_rec(const struct zsdb_file *f,
 static int zs_read_val_rec(struct zsdb_file *f, uint64_t *offset,
                            struct zs_val *val)
 {
-        unsigned char *bptr;
         unsigned char *fptr;
-        uint64_t data;
+        uint64_t data, len = 0;
 
-        bptr = f->mf->ptr;
-        fptr = bptr + *offset;
+        fptr = mfile_range(f->mf, *offset, ZS_VAL_BASE_REC_SIZE);
+        if (!fptr)
+                return ZS_IOERROR;
 
         data = read_be64(fptr);
         val->base.type = data >> 56;
@@ -122,12 +146,19 @@ static int zs_read_val_rec(struct zsdb_file *f, uint64_t *offset,
                 val->base.slen = (data >> 32) & 0xFFFFFF;
                 val->base.nullpad = 0;
                 val->base.llen = 0;
+                len = val->base.slen;
         } else if (val->base.type == REC_TYPE_LONG_VALUE) {
                 val->base.slen = 0;
                 val->base.nullpad = 0;
                 val->base.llen = read_be64(fptr + 8);
+                len = val->base.llen;
         }
 
+        if (f->mf->win) {
+                fptr = mfile_range(f->mf, *offset, ZS_VAL_BASE_REC_SIZE + len);
+                if (!fptr)
+                        return ZS_IOERROR;
+        }
         val->data = fptr + ZS_VAL_BASE_REC_SIZE;
 
         return ZS_OK;
@@ -142,13 +173,17 @@ static int zs_read_key_val_record_cb(struct zsdb_file *f, uint64_t *offset,
         uint64_t keylen, vallen;
 
 
-        zs_read_key_rec(f, offset, &key);
+        ret = zs_read_key_rec(f, offset, &key);
+        if (ret != ZS_OK)
+                return ret;
 
         *offset += (key.base.type == REC_TYPE_KEY ||
                     key.base.type == REC_TYPE_DELETED) ?
                 key.base.sval_offset : key.base.lval_offset;
 
-        zs_read_val_rec(f, offset, &val);
+        ret = zs_read_val_rec(f, offset, &val);
+        if (ret != ZS_OK)
+                return ret;
 
         keylen = (key.base.type == REC_TYPE_KEY ||
                   key.base.type == REC_TYPE_DELETED) ?
@@ -170,8 +205,11 @@ static int zs_read_deleted_record(struct zsdb_file *f, uint64_t *offset,
 {
         struct zs_key key;
         uint64_t keylen;
+        int ret;
 
-        zs_read_key_rec(f, offset, &key);
+        ret = zs_read_key_rec(f, offset, &key);
+        if (ret != ZS_OK)
+                return ret;
 
         keylen = (key.base.type == REC_TYPE_DELETED) ?
                 key.base.slen : key.base.llen;
@@ -189,14 +227,14 @@ static int zs_read_and_verify_commit_record(struct zsdb_file *f,
                                             uint64_t *offset)
 {
         int ret = ZS_OK;
-        unsigned char *bptr;
         unsigned char *fptr;
-        uint64_t data;
+        uint64_t data, recoffset = *offset;
         enum record_t rectype;
         uint32_t crc = 0;
 
-        bptr = f->mf->ptr;
-        fptr = bptr + *offset;
+        fptr = mfile_range(f->mf, recoffset, ZS_LONG_COMMIT_REC_SIZE);
+        if (!fptr)
+                return ZS_IOERROR;
 
         data = read_be64(fptr);
         rectype = data >> 56;
@@ -216,7 +254,9 @@ static int zs_read_and_verify_commit_record(struct zsdb_file *f,
                 sc.crc32 = data & 0xFFFFFFFF;
 
                 /* Ddata begins at `rptr` */
-                rptr = fptr - sc.length;
+                rptr = mfile_range(f->mf, recoffset - sc.length, sc.length);
+                if (!rptr)
+                        return ZS_IOERROR;
 
                 /* The commit record without the CRC */
                 val = data & 0xFFFFFFFF00000000;
@@ -250,7 +290,9 @@ static int zs_read_and_verify_commit_record(struct zsdb_file *f,
                 lc.crc32 = val & 0xFFFFFFFF;
 
                 /* Data begins at `rptr` */
-                rptr = fptr - lc.length;
+                rptr = mfile_range(f->mf, recoffset - lc.length, lc.length);
+                if (!rptr)
+                        return ZS_IOERROR;
 
                 val = 0;        /* 0 used to compute CRC */
                 crc = crc32c_hw(crc, (void *)rptr, lc.length);
@@ -284,7 +326,7 @@ int zs_record_read_from_file(struct zsdb_file *f, uint64_t *offset,
                              zsdb_foreach_cb *cb, zsdb_foreach_cb *deleted_cb,
                              void *cbdata)
 {
-        unsigned char *bptr, *fptr;
+        unsigned char *fptr;
         uint64_t data;
         enum record_t rectype;
         int ret = ZS_OK;
@@ -292,8 +334,9 @@ int zs_record_read_from_file(struct zsdb_file *f, uint64_t *offset,
         if (!f->is_open)
                 return ZS_IOERROR;
 
-        bptr = f->mf->ptr;
-        fptr = bptr + *offset;
+        fptr = mfile_range(f->mf, *offset, sizeof(uint64_t));
+        if (!fptr)
+                return ZS_IOERROR;
 
         data = read_be64(fptr);
         rectype = data >> 56;
@@ -319,7 +362,7 @@ int zs_record_read_from_file(struct zsdb_file *f, uint64_t *offset,
                 break;
         case REC_TYPE_DELETED:
         case REC_TYPE_LONG_DELETED:
-                zs_read_deleted_record(f, offset, deleted_cb, cbdata);
+                ret = zs_read_deleted_record(f, offset, deleted_cb, cbdata);
                 break;
         case REC_TYPE_UNUSED:
                 break;
@@ -339,15 +382,16 @@ int zs_record_read_key_from_file_offset(const struct zsdb_file *f,
                                         uint64_t offset,
                                         struct zs_key *key)
 {
-        unsigned char *bptr, *fptr;
+        unsigned char *fptr;
         uint64_t data;
         enum record_t rectype;
 
         if (!f->is_open)
                 return ZS_IOERROR;
 
-        bptr = f->mf->ptr;
-        fptr = bptr + offset;
+        fptr = mfile_range(f->mf, offset, sizeof(uint64_t));
+        if (!fptr)
+                return ZS_IOERROR;
 
         data = read_be64(fptr);
         rectype = data >> 56;
@@ -357,14 +401,11 @@ int zs_record_read_key_from_file_offset(const struct zsdb_file *f,
         case REC_TYPE_LONG_KEY:
         case REC_TYPE_DELETED:
         case REC_TYPE_LONG_DELETED:
-                zs_read_key_rec(f, &offset, key);
-                break;
+                return zs_read_key_rec(f, &offset, key);
         default:
                 return ZS_ERROR;
                 break;
         }
-
-        return ZS_OK;
 }
 
 int zs_read_key_val_record_from_file_offset(struct zsdb_file *f,
@@ -373,14 +414,19 @@ int zs_read_key_val_record_from_file_offset(struct zsdb_file *f,
                                             struct zs_val *val)
 {
         uint64_t vallen;
+        int ret;
 
-        zs_read_key_rec(f, offset, key);
+        ret = zs_read_key_rec(f, offset, key);
+        if (ret != ZS_OK)
+                return ret;
 
         *offset += (key->base.type == REC_TYPE_KEY ||
                     key->base.type == REC_TYPE_DELETED) ?
                 key->base.sval_offset : key->base.lval_offset;
 
-        zs_read_val_rec(f, offset, val);
+        ret = zs_read_val_rec(f, offset, val);
+        if (ret != ZS_OK)
+                return ret;
 
         vallen = (val->base.type == REC_TYPE_VALUE) ?
                 val->base.slen : val->base.llen;
@@ -396,13 +442,13 @@ int zs_record_read_key_val_from_offset(struct zsdb_file *f, uint64_t *offset,
                                        const unsigned char **val, uint64_t *vallen)
 {
         uint64_t dataoffset = *offset;
+        int ret;
 
-        zs_record_read_key(f, &dataoffset, key, keylen);
+        ret = zs_record_read_key(f, &dataoffset, key, keylen);
+        if (ret != ZS_OK || !val)
+                return ret;
 
-        if (val) {
-                dataoffset = *offset + dataoffset;
-                zs_record_read_val(f, &dataoffset, val, vallen);
-        }
+        dataoffset = *offset + dataoffset;
 
-        return ZS_OK;
+        return zs_record_read_val(f, &dataoffset, val, vallen);
 }
@@ -36,6 +36,8 @@ int zs_transaction_begin(struct zsdb *db, struct zsdb_txn **txn)
         t->curkeylen = 0;
         t->alloced = 1;
 
+        __atomic_add_fetch(&db->numtrans, 1, __ATOMIC_RELAXED);
+
         *txn = t;
 
         return ZS_OK;
@@ -47,6 +49,9 @@ void zs_transaction_end(struct zsdb_txn **txn)
                 struct zsdb_txn *t;
                 t = *txn;
                 *txn = NULL;
+                if (t->db)
+                        __atomic_sub_fetch(&t->db->numtrans, 1,
+                                           __ATOMIC_RELAXED);
                 t->db = NULL;
                 if (t->iter) {
                         zs_iterator_end(&t->iter);
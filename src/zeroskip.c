@@ -11,10 +11,10 @@
 #endif
 #endif
 
-#include "htable.h"
 #include "pqueue.h"
 #include <libzeroskip/memtree.h>
 #include <libzeroskip/cstring.h>
+#include <libzeroskip/htable.h>
 #include <libzeroskip/log.h>
 #include <libzeroskip/macros.h>
 #include <libzeroskip/util.h>
@@ -69,15 +69,40 @@ static int dbfname_cmp(const void *d1, const void *d2, void *cbdata _unused_)
         return natural_strcasecmp(f1->fname.buf, f2->fname.buf);
 }
 
+/* The records read from the DB files, in the order they were written, to
+ * be built into a memtree in one go once they have all been read.
+ */
+struct load_records {
+        struct record **recs;
+        size_t count;
+        size_t alloc;
+        struct arena *arena;    /* The records are allocated from */
+};
+
+#define LOAD_RECORDS_INIT(arena) { NULL, 0, 0, arena }
+
+static int load_records_build(struct load_records *lr, struct memtree *memtree)
+{
+        int ret;
+
+        ret = memtree_build(memtree, lr->recs, lr->count);
+
+        xfree(lr->recs);
+        lr->count = 0;
+        lr->alloc = 0;
+
+        return ret == MEMTREE_OK ? ZS_OK : ZS_INTERNAL;
+}
+
 static int load_memtree_record_cb(void *data,
                                   const unsigned char *key, size_t keylen,
                                   const unsigned char *value, size_t vallen)
 {
-        struct memtree *memtree = (struct memtree *)data;
-        struct record *rec;
+        struct load_records *lr = (struct load_records *)data;
 
-        rec = record_new(key, keylen, value, vallen, 0);
-        memtree_replace(memtree, rec);
+        ALLOC_GROW(lr->recs, lr->count + 1, lr->alloc);
+        lr->recs[lr->count++] = record_new_arena(lr->arena, key, keylen,
+                                                value, vallen, 0);
 
         return 0;
 }
@@ -86,11 +111,11 @@ static int load_deleted_memtree_record_cb(void *data,
                                           const unsigned char *key, size_t keylen,
                                           const unsigned char *value, size_t vallen)
 {
-        struct memtree *memtree = (struct memtree *)data;
-        struct record *rec;
+        struct load_records *lr = (struct load_records *)data;
 
-        rec = record_new(key, keylen, value, vallen, 1);
-        memtree_replace(memtree, rec);
+        ALLOC_GROW(lr->recs, lr->count + 1, lr->alloc);
+        lr->recs[lr->count++] = record_new_arena(lr->arena, key, keylen,
+                                                value, vallen, 1);
 
         return 0;
 }
@@ -424,6 +449,63 @@ static void zs_find_index_range_for_files(struct list_head *flist,
         }
 }
 
+/* zsdb_load_records():
+ * Load the records of the active and the finalised files into the empty
+ * memtrees. The finalised files should be on the fflist already. If there
+ * is a checkpoint covering the files, the records are read from it, and
+ * only what has been added to the active file since is replayed.
+ */
+static int zsdb_load_records(struct zsdb_priv *priv)
+{
+        int ret = ZS_OK;
+        struct list_head *pos;
+        uint64_t priority = 0;
+        uint64_t offset = ZS_HDR_SIZE;
+        struct load_records records = LOAD_RECORDS_INIT(priv->arena);
+        struct load_records frecords = LOAD_RECORDS_INIT(priv->arena);
+        int checkpointed;
+
+        checkpointed = (zs_checkpoint_load(priv, load_memtree_record_cb,
+                                           load_deleted_memtree_record_cb,
+                                           &frecords, &records,
+                                           &offset) == ZS_OK);
+
+        /* Load records from active file to in-memory tree */
+        ret = zs_active_file_record_foreach(priv, offset,
+                                            load_memtree_record_cb,
+                                            load_deleted_memtree_record_cb,
+                                            &records);
+        load_records_build(&records, priv->memtree);
+        if (ret != ZS_OK) {
+                load_records_build(&frecords, priv->fmemtree);
+                goto done;
+        }
+
+        /* Load data from finalised files */
+        if (priv->dbfiles.ffcount && !checkpointed)
+                zslog(LOGDEBUG, "Loading data from finalised files\n");
+
+        list_for_each_reverse(pos, &priv->dbfiles.fflist) {
+                struct zsdb_file *f;
+                f = list_entry(pos, struct zsdb_file, list);
+                if (!checkpointed) {
+                        zslog(LOGDEBUG, "Loading %s\n", f->fname.buf);
+                        zs_finalised_file_record_foreach(f,
+                                                         load_memtree_record_cb,
+                                                         load_deleted_memtree_record_cb,
+                                                         &frecords);
+                }
+                f->priority = ++priority;
+        }
+
+        /* The files were read oldest first, so the newest records win */
+        load_records_build(&frecords, priv->fmemtree);
+
+        priv->stale = 0;
+done:
+        return ret;
+}
+
 static int zsdb_reload(struct zsdb_priv *priv)
 {
         int ret = ZS_OK;
@@ -436,6 +518,9 @@ static int zsdb_reload(struct zsdb_priv *priv)
                 return ZS_ERROR;
         }
 
+        /* The finalised file of frozen records would be loaded too */
+        zs_frozen_publish(priv, 1);
+
         /** Close all files **/
         /* Close active */
         zs_active_file_close(priv);
@@ -475,17 +560,10 @@ static int zsdb_reload(struct zsdb_priv *priv)
                 goto done;
 
         /* Allocate In-memory tree */
-        priv->memtree = memtree_new(NULL, priv->btcompare);
-        priv->fmemtree = memtree_new(NULL, priv->btcompare);
-
-        /* Load records from active file to in-memory tree */
-        ret = zs_active_file_record_foreach(priv, load_memtree_record_cb,
-                                            load_deleted_memtree_record_cb,
-                                            priv->memtree);
-        if (ret != ZS_OK)
-                goto done;
+        priv->memtree = memtree_new_arena(NULL, priv->btcompare, priv->arena);
+        priv->fmemtree = memtree_new_arena(NULL, priv->btcompare, priv->arena);
 
-        /* Load data from finalised files */
+        /* The finalised files */
         while (finalisedpq.count) {
                 struct zsdb_file *f = pqueue_get(&finalisedpq);
                 list_add_head(&f->list, &priv->dbfiles.fflist);
@@ -493,21 +571,9 @@ static int zsdb_reload(struct zsdb_priv *priv)
         }
         pqueue_free(&finalisedpq);
 
-        if (priv->dbfiles.ffcount) {
-                priority = 0;
-                zslog(LOGDEBUG, "Loading data from finalised files\n");
-                list_for_each_reverse(pos, &priv->dbfiles.fflist) {
-                        struct zsdb_file *f;
-                        f = list_entry(pos, struct zsdb_file, list);
-                        zslog(LOGDEBUG, "Loading %s\n", f->fname.buf);
-                        zs_finalised_file_record_foreach(f,
-                                                         load_memtree_record_cb,
-                                                         load_deleted_memtree_record_cb,
-                                                         priv->fmemtree);
-                        f->priority = ++priority;
-                }
-        }
-
+        ret = zsdb_load_records(priv);
+        if (ret != ZS_OK)
+                goto done;
 
         while (packedpq.count) {
                 struct zsdb_file *f = pqueue_get(&packedpq);
@@ -533,10 +599,54 @@ static int zsdb_reload(struct zsdb_priv *priv)
                 mfile_seek(&priv->dbfiles.factive.mf, mfsize, NULL);
 
         priv->dbdirty = 1;
+        priv->generation++;
 done:
         return ret;
 }
 
+/* zsdb_checkpoint_locked():
+ * The memtrees are reloaded first if they don't match the files, since
+ * the checkpoint records which files they were loaded from.
+ * Needs the write lock.
+ */
+static int zsdb_checkpoint_locked(struct zsdb *db)
+{
+        int ret = ZS_OK;
+        struct zsdb_priv *priv;
+
+        assert(db);
+        assert(db->priv);
+
+        priv = db->priv;
+
+        if (!priv->open || !priv->dbfiles.factive.is_open)
+                return ZS_NOT_OPEN;
+
+        if (!zsdb_write_lock_is_locked(db)) {
+                zslog(LOGDEBUG, "Need a write lock to checkpoint.\n");
+                return ZS_ERROR;
+        }
+
+        if (priv->dbfiles.factive.dirty) {
+                zslog(LOGDEBUG, "Uncommitted changes, not checkpointing.\n");
+                return ZS_AGAIN;
+        }
+
+        /* The checkpoint has no room for frozen records */
+        zs_frozen_publish(priv, 1);
+
+        if (priv->stale || zs_dotzsdb_check_stat(priv) > 0) {
+                ret = zsdb_reload(priv);
+                if (ret != ZS_OK) {
+                        zslog(LOGWARNING, "Failed reoloading DB!\n");
+                        return ret;
+                }
+                zslog(LOGDEBUG, "Reloaded DB!\n");
+        }
+
+        return zs_checkpoint_write(priv);
+}
+
 /**
  * Public functions
  */
@@ -561,6 +671,8 @@ int zsdb_init(struct zsdb **pdb, zsdb_cmp_fn dbcmpfn,
                 goto done;
         }
         priv->dbdirty = 0;
+        priv->filterbits = ZS_FILTER_BITS_PER_KEY;
+        priv->packversion = ZS_PACKED_VERSION_DEFAULT;
         db->priv = priv;
 
         if (dbcmpfn)
@@ -667,6 +779,17 @@ int zsdb_open(struct zsdb *db, const char *dbdir, int mode)
                 assert(priv->btcompare);
         }
 
+        priv->flags = mode;
+
+        if (mode & MODE_THREADED) {
+                /* The handle is going to be shared between threads */
+                if (thread_lock_init(&priv->tlk) != 0) {
+                        zslog(LOGWARNING, "Failed initialising locks!\n");
+                        ret = ZS_ERROR;
+                        goto done;
+                }
+        }
+
         /* Compare functions for the pq for finalised and packed files */
         finalisedpq.cmp = dbfname_cmp;
         packedpq.cmp = dbfname_cmp;
@@ -703,9 +826,12 @@ int zsdb_open(struct zsdb *db, const char *dbdir, int mode)
                 goto done;
         }
 
+        if (mode & MODE_HUGEPAGES)
+                priv->arena = arena_new(ARENA_HUGEPAGES);
+
         /* In-memory tree */
-        priv->memtree = memtree_new(NULL, priv->btcompare);
-        priv->fmemtree = memtree_new(NULL, priv->btcompare);
+        priv->memtree = memtree_new_arena(NULL, priv->btcompare, priv->arena);
+        priv->fmemtree = memtree_new_arena(NULL, priv->btcompare, priv->arena);
 
         if (newdb) {
                 if (zsdb_write_lock_acquire(db, 0 /*timeout*/) < 0) {
@@ -739,14 +865,7 @@ int zsdb_open(struct zsdb *db, const char *dbdir, int mode)
                 if (ret != ZS_OK)
                         goto done;
 
-                /* Load records from active file to in-memory tree */
-                ret = zs_active_file_record_foreach(priv, load_memtree_record_cb,
-                                                    load_deleted_memtree_record_cb,
-                                                    priv->memtree);
-                if (ret != ZS_OK)
-                        goto done;
-
-                /* Load data from finalised files */
+                /* The finalised files */
                 while (finalisedpq.count) {
                         struct zsdb_file *f = pqueue_get(&finalisedpq);
                         list_add_head(&f->list, &priv->dbfiles.fflist);
@@ -754,21 +873,9 @@ int zsdb_open(struct zsdb *db, const char *dbdir, int mode)
                 }
                 pqueue_free(&finalisedpq);
 
-                if (priv->dbfiles.ffcount) {
-                        priority = 0;
-                        zslog(LOGDEBUG, "Loading data from finalised files\n");
-                        list_for_each_reverse(pos, &priv->dbfiles.fflist) {
-                                struct zsdb_file *f;
-                                f = list_entry(pos, struct zsdb_file, list);
-                                zslog(LOGDEBUG, "Loading %s\n", f->fname.buf);
-                                zs_finalised_file_record_foreach(f,
-                                                                 load_memtree_record_cb,
-                                                                 load_deleted_memtree_record_cb,
-                                                                 priv->fmemtree);
-                                f->priority = ++priority;
-                        }
-                }
-
+                ret = zsdb_load_records(priv);
+                if (ret != ZS_OK)
+                        goto done;
 
                 while (packedpq.count) {
                         struct zsdb_file *f = pqueue_get(&packedpq);
@@ -803,6 +910,7 @@ int zsdb_open(struct zsdb *db, const char *dbdir, int mode)
         zslog(LOGDEBUG, "DB `%s` opened.\n", priv->dbdir.buf);
 
         priv->open = 1;
+        zs_process_register(db);
 
 done:
         return ret;
@@ -823,6 +931,21 @@ int zsdb_close(struct zsdb *db)
 
         zslog(LOGDEBUG, "Closing DB `%s`.\n", priv->dbdir.buf);
 
+        zs_process_unregister(db);
+        zs_memory_budget_stop(db);
+
+        if (priv->open)
+                zs_frozen_publish(priv, 1);
+
+        if ((priv->flags & MODE_CHECKPOINT) && priv->open) {
+                if (zsdb_write_lock_is_locked(db)) {
+                        zsdb_checkpoint_locked(db);
+                } else if (zsdb_write_lock_acquire(db, 0) == ZS_OK) {
+                        zsdb_checkpoint_locked(db);
+                        zsdb_write_lock_release(db);
+                }
+        }
+
         if (priv->dbfiles.factive.is_open)
                 zsdb_write_lock_release(db);
 
@@ -848,24 +971,32 @@ int zsdb_close(struct zsdb *db)
                 priv->dbfiles.pfcount--;
         }
 
+        zs_frozen_free(priv);
+        valcache_free(&priv->valcache);
+
         if (priv->memtree)
                 memtree_free(priv->memtree);
 
         if (priv->fmemtree)
                 memtree_free(priv->fmemtree);
 
-        if (db->iter || db->numtrans)
+        /* After everything allocated from it */
+        arena_destroy(&priv->arena);
+
+        thread_lock_destroy(&priv->tlk);
+
+        if (priv->itercount || db->numtrans)
                 ret = zsdb_break(ZS_INTERNAL);
 done:
         return ret;
 }
 
-int zsdb_add(struct zsdb *db,
-             const unsigned char *key,
-             size_t keylen,
-             const unsigned char *value,
-             size_t vallen,
-             struct zsdb_txn **txn)
+static int zsdb_add_locked(struct zsdb *db,
+                           const unsigned char *key,
+                           size_t keylen,
+                           const unsigned char *value,
+                           size_t vallen,
+                           struct zsdb_txn **txn)
 {
         int ret = ZS_OK;
         struct zsdb_priv *priv;
@@ -913,15 +1044,23 @@ int zsdb_add(struct zsdb *db,
 
         mfsize = priv->dbfiles.factive.mf->size;
         if (mfsize >= TWOMB) {
-                zslog(LOGDEBUG, "File %s is > 2MB, finalising.\n",
+                zslog(LOGDEBUG, "File %s is > 2MB, rolling over.\n",
                         priv->dbfiles.factive.fname.buf);
-                ret = zs_active_file_finalise(priv);
-                if (ret != ZS_OK) goto done;
 
-                ret = zs_active_file_new(priv,
-                                         priv->dotzsdb.curidx + 1);
-                zslog(LOGDEBUG, "New active log file %s created.\n",
-                        priv->dbfiles.factive.fname.buf);
+                /* The records frozen at the last rollover go first */
+                zs_frozen_publish(priv, 1);
+
+                ret = zs_frozen_begin(priv);
+                if (ret == ZS_AGAIN) {
+                        ret = zs_active_file_finalise(priv);
+                        if (ret != ZS_OK) goto done;
+
+                        ret = zs_active_file_new(priv,
+                                                 priv->dotzsdb.curidx + 1);
+                        zslog(LOGDEBUG, "New active log file %s created.\n",
+                              priv->dbfiles.factive.fname.buf);
+                }
+                if (ret != ZS_OK) goto done;
         }
 
         /* Start computing crc32, if we haven't already. The computation will
@@ -941,18 +1080,46 @@ int zsdb_add(struct zsdb *db,
         priv->dbfiles.factive.dirty = 1;
         priv->dbdirty = 1;
 
-        rec = record_new(key, keylen, value, vallen, 0);
+        rec = record_new_arena(priv->arena, key, keylen, value, vallen, 0);
         memtree_replace(priv->memtree, rec);
 
+        if (priv->valcache)
+                valcache_remove(priv->valcache, key, keylen,
+                                bloom_hash(key, keylen));
+
         zslog(LOGDEBUG, "Inserted record into the DB. %s\n",
                 priv->dbfiles.factive.fname.buf);
 done:
         return ret;
 }
 
-int zsdb_remove(struct zsdb *db,
-                const unsigned char *key, size_t keylen,
-                struct zsdb_txn **txn _unused_)
+int zsdb_add(struct zsdb *db,
+             const unsigned char *key,
+             size_t keylen,
+             const unsigned char *value,
+             size_t vallen,
+             struct zsdb_txn **txn)
+{
+        struct zsdb_priv *priv;
+        int ret;
+
+        assert(db);
+        assert(db->priv);
+
+        priv = db->priv;
+
+        zs_process_write(priv);
+
+        thread_lock_write(&priv->tlk);
+        ret = zsdb_add_locked(db, key, keylen, value, vallen, txn);
+        thread_lock_release(&priv->tlk);
+
+        return ret;
+}
+
+static int zsdb_remove_locked(struct zsdb *db,
+                              const unsigned char *key, size_t keylen,
+                              struct zsdb_txn **txn _unused_)
 {
         int ret = ZS_OK;
         struct zsdb_priv *priv;
@@ -995,15 +1162,40 @@ int zsdb_remove(struct zsdb *db,
         priv->dbdirty = 1;
 
         /* Add the entry to the in-memory tree */
-        rec = record_new(key, keylen, NULL, 0, 1);
+        rec = record_new_arena(priv->arena, key, keylen, NULL, 0, 1);
         memtree_replace(priv->memtree, rec);
 
+        if (priv->valcache)
+                valcache_remove(priv->valcache, key, keylen,
+                                bloom_hash(key, keylen));
+
         zslog(LOGDEBUG, "Removed key from DB `%s`\n", priv->dbdir.buf);
 done:
         return ret;
 }
 
-int zsdb_commit(struct zsdb *db, struct zsdb_txn **txn)
+int zsdb_remove(struct zsdb *db,
+                const unsigned char *key, size_t keylen,
+                struct zsdb_txn **txn)
+{
+        struct zsdb_priv *priv;
+        int ret;
+
+        assert(db);
+        assert(db->priv);
+
+        priv = db->priv;
+
+        zs_process_write(priv);
+
+        thread_lock_write(&priv->tlk);
+        ret = zsdb_remove_locked(db, key, keylen, txn);
+        thread_lock_release(&priv->tlk);
+
+        return ret;
+}
+
+static int zsdb_commit_locked(struct zsdb *db, struct zsdb_txn **txn)
 {
         int ret = ZS_OK;
         struct zsdb_priv *priv;
@@ -1030,6 +1222,16 @@ int zsdb_commit(struct zsdb *db, struct zsdb_txn **txn)
         zs_dotzsdb_update_index_and_offset(priv, priv->dotzsdb.curidx,
                priv->dbfiles.factive.mf->offset);
 
+        if (ret == ZS_OK) {
+                /* Publish the records frozen at the last rollover, if
+                 * they have been packed by now */
+                zs_frozen_publish(priv, 0);
+                zs_memory_budget_check(db);
+                zs_packed_files_reclaim(priv);
+                if (priv->valcache)
+                        valcache_reclaim(priv->valcache);
+        }
+
 done:
         if (txn) {
                 priv->dbdirty = 0;
@@ -1039,17 +1241,37 @@ done:
         return ret;
 }
 
-int zsdb_fetch(struct zsdb *db,
-               const unsigned char *key,
-               size_t keylen,
-               const unsigned char **value,
-               size_t *vallen,
-               struct zsdb_txn **txn)
+int zsdb_commit(struct zsdb *db, struct zsdb_txn **txn)
+{
+        struct zsdb_priv *priv;
+        int ret;
+
+        assert(db);
+        assert(db->priv);
+
+        priv = db->priv;
+
+        zs_process_touch(priv);
+
+        thread_lock_write(&priv->tlk);
+        ret = zsdb_commit_locked(db, txn);
+        thread_lock_release(&priv->tlk);
+
+        return ret;
+}
+
+static int zsdb_fetch_locked(struct zsdb *db,
+                             const unsigned char *key,
+                             size_t keylen,
+                             const unsigned char **value,
+                             size_t *vallen,
+                             struct zsdb_txn **txn)
 {
         int ret = ZS_NOTFOUND;
         struct zsdb_priv *priv;
         memtree_iter_t iter;
         struct list_head *pos;
+        uint64_t hash;
 
         assert(db);
         assert(db->priv);
@@ -1074,27 +1296,21 @@ int zsdb_fetch(struct zsdb *db,
                 zslog(LOGDEBUG, "zsdb_fetch: has transaction\n");
         }
 
-        /* Look for the key in the active in-memory memtree */
+        /* Look for the key in the active in-memory memtree, then in the
+         * frozen and the finalised records. A record marked deleted hides
+         * those in older files. */
         zslog(LOGDEBUG, "Looking in active records\n");
-        if (memtree_find(priv->memtree, key, keylen, iter)) {
-                /* We found the key in active records */
-                if (iter->record && !iter->record->deleted) {
-                        *vallen = iter->record->vallen;
-                        *value = iter->record->val;
-                        ret = ZS_OK;
+        if (memtree_find(priv->memtree, key, keylen, iter) ||
+            (priv->frozen.memtree &&
+             memtree_find(priv->frozen.memtree, key, keylen, iter)) ||
+            memtree_find(priv->fmemtree, key, keylen, iter)) {
+                if (iter->record->deleted) {
+                        ret = ZS_NOTFOUND;
                         goto done;
                 }
-        }
-
-        /* Look for the key in the finalised records */
-        zslog(LOGDEBUG, "Looking in finalised file(s)\n");
-        if (memtree_find(priv->fmemtree, key, keylen, iter)) {
-                /* We found the key in finalised records */
-                if (iter->record) {
-                        *vallen = iter->record->vallen;
-                        *value = iter->record->val;
-                }
 
+                *vallen = iter->record->vallen;
+                *value = iter->record->val;
                 ret = ZS_OK;
                 goto done;
         }
@@ -1102,65 +1318,30 @@ int zsdb_fetch(struct zsdb *db,
         /* The key was not found in either the active file or the finalised
            files, look for it in the packed files */
         zslog(LOGDEBUG, "Looking in the Packed file(s)\n");
+        hash = bloom_hash(key, keylen);
         list_for_each_forward(pos, &priv->dbfiles.pflist) {
                 struct zsdb_file *f;
-                uint64_t location = 0;
-                int cmp_ret;
-                struct zs_key temp_key;
 
                 f = list_entry(pos, struct zsdb_file, list);
 
                 zslog(LOGDEBUG, "Looking in packed file %s\n",
                       f->fname.buf);
                 zslog(LOGDEBUG, "\tTotal records: %d\n",
-                      f->index->count);
+                      zs_packed_file_count(f));
 
                 /* If the given key is smaller than the smallest key in the
-                 * packedfile or bigger than the the biggest key, we continue
+                 * packedfile or bigger than the the biggest key, or the
+                 * filter of the file says it isn't there, we continue
                  * to the next file in the list instead of binary searching
                  * in the current file.
                  */
-                zslog(LOGDEBUG, "\tfirst record at offset: %d\n",
-                      f->index->data[0]);
-                zs_record_read_key_from_file_offset(f, f->index->data[0],
-                                                    &temp_key);
-                if (priv->dbcompare) {
-                        cmp_ret = priv->dbcompare(key, keylen, temp_key.data,
-                                                  (temp_key.base.type == REC_TYPE_KEY ||
-                                                   temp_key.base.type == REC_TYPE_DELETED) ?
-                                                  temp_key.base.slen : temp_key.base.slen);
-                } else {
-                        cmp_ret = memcmp_raw(key, keylen, temp_key.data,
-                                             (temp_key.base.type == REC_TYPE_KEY ||
-                                              temp_key.base.type == REC_TYPE_DELETED) ?
-                                             temp_key.base.slen : temp_key.base.slen);
-                }
-                if (cmp_ret < 0)
-                        continue;
-
-                zslog(LOGDEBUG, "\tlast record at offset: %d\n",
-                      f->index->data[f->index->count - 1]);
-                zs_record_read_key_from_file_offset(f,
-                                                    f->index->data[f->index->count - 1],
-                                                    &temp_key);
-                if (priv->dbcompare) {
-                        cmp_ret = priv->dbcompare(key, keylen, temp_key.data,
-                                                  (temp_key.base.type == REC_TYPE_KEY ||
-                                                   temp_key.base.type == REC_TYPE_DELETED) ?
-                                                  temp_key.base.slen : temp_key.base.slen);
-                } else {
-                        cmp_ret = memcmp_raw(key, keylen, temp_key.data,
-                                             (temp_key.base.type == REC_TYPE_KEY ||
-                                              temp_key.base.type == REC_TYPE_DELETED) ?
-                                             temp_key.base.slen : temp_key.base.slen);
-                }
-                if (cmp_ret > 0)
+                if (!zs_packed_file_may_contain(f, key, keylen, hash,
+                                                priv->dbcompare))
                         continue;
 
-                if (zs_packed_file_bsearch_index(key, keylen, f, &location,
-                                                 value, vallen, priv->dbcompare)) {
-                        zslog(LOGDEBUG, "Record found at location %ld\n",
-                              location);
+                if (zs_packed_file_fetch(key, keylen, hash, f, NULL, value,
+                                         vallen, priv->dbcompare)) {
+                        zslog(LOGDEBUG, "Record found in %s\n", f->fname.buf);
                         ret = ZS_OK;
                         goto done;
                 }
@@ -1172,49 +1353,461 @@ done:
         return ret;
 }
 
-int zsdb_fetchnext(struct zsdb *db,
-                   const unsigned char *key, size_t keylen,
-                   const unsigned char **found, size_t *foundlen,
-                   const unsigned char **value, size_t *vallen,
-                   struct zsdb_txn **txn)
+/* zsdb_fetch_cached_locked():
+ * zsdb_fetch_locked(), through the value cache if there is one.
+ */
+static int zsdb_fetch_cached_locked(struct zsdb *db,
+                                    const unsigned char *key,
+                                    size_t keylen,
+                                    const unsigned char **value,
+                                    size_t *vallen,
+                                    struct zsdb_txn **txn)
+{
+        struct zsdb_priv *priv = db->priv;
+        uint64_t hash;
+        int ret;
+
+        if (!priv->valcache || !priv->open || !key || !keylen)
+                return zsdb_fetch_locked(db, key, keylen, value, vallen, txn);
+
+        /* The cached values are those of the files and memtrees of its
+         * generation */
+        hash = bloom_hash(key, keylen);
+        valcache_sync(priv->valcache, priv->generation);
+        if (valcache_get(priv->valcache, key, keylen, hash, value, vallen))
+                return ZS_OK;
+
+        ret = zsdb_fetch_locked(db, key, keylen, value, vallen, txn);
+        if (ret == ZS_OK)
+                valcache_put(priv->valcache, key, keylen, hash, *value,
+                             *vallen);
+
+        return ret;
+}
+
+int zsdb_fetch(struct zsdb *db,
+               const unsigned char *key,
+               size_t keylen,
+               const unsigned char **value,
+               size_t *vallen,
+               struct zsdb_txn **txn)
 {
-        int ret = ZS_OK;
         struct zsdb_priv *priv;
-        struct zsdb_iter *tempiter = NULL;
-        int keyfound = 0;
-        struct zsdb_iter_data *data;
+        int ret;
 
         assert(db);
         assert(db->priv);
 
-        if (keylen)
-                assert(key);
-
         priv = db->priv;
 
-        if (!priv->open) {
-                zslog(LOGWARNING, "DB `%s` not open!\n", priv->dbdir.buf);
-                return ZS_NOT_OPEN;
-        }
+        zs_process_read(priv);
 
-        /* Create a new iterator */
-        zs_iterator_new(db, &tempiter);
+        thread_lock_read(&priv->tlk);
+        ret = zsdb_fetch_cached_locked(db, key, keylen, value, vallen, txn);
+        thread_lock_release(&priv->tlk);
 
-        ret = zs_iterator_begin_at_key(&tempiter, key, keylen, &keyfound);
-        if (ret != ZS_OK) {
-                goto fail;
-        }
+        return ret;
+}
 
-        data = zs_iterator_get(tempiter);
+/* A key of zsdb_fetch_multi(), with where it was passed */
+struct fetch_key {
+        const unsigned char *key;
+        size_t keylen;
+        size_t idx;
+        uint64_t hash;
+        int done;               /* Found, or found deleted */
+};
 
-        if (keyfound) {
-                /* If we found the key, we go to the next key in the iterator */
-                if (!zs_iterator_next(tempiter, data)) {
-                        ret = ZS_NOTFOUND;
-                        goto done;
-                }
+static int fetch_key_cmp(const struct fetch_key *k1,
+                         const struct fetch_key *k2, zsdb_cmp_fn cmpfn)
+{
+        if (cmpfn)
+                return cmpfn(k1->key, k1->keylen, k2->key, k2->keylen);
 
-                data = zs_iterator_get(tempiter);
+        return memcmp_raw(k1->key, k1->keylen, k2->key, k2->keylen);
+}
+
+/* sort_fetch_keys():
+ * A bottom up merge sort of the keys, qsort() has no way of passing the
+ * comparison function of the DB on.
+ */
+static void sort_fetch_keys(struct fetch_key *keys, size_t n,
+                            zsdb_cmp_fn cmpfn)
+{
+        struct fetch_key *tmp, *src = keys, *dst, *swap;
+        size_t width, i;
+
+        if (n < 2)
+                return;
+
+        ALLOC_ARRAY(tmp, n);
+        dst = tmp;
+
+        for (width = 1; width < n; width *= 2) {
+                for (i = 0; i < n; i += 2 * width) {
+                        size_t l = i, o = i;
+                        size_t m = width < n - i ? i + width : n;
+                        size_t r = m;
+                        size_t e = 2 * width < n - i ? i + 2 * width : n;
+
+                        while (l < m && r < e) {
+                                if (fetch_key_cmp(&src[r], &src[l], cmpfn) < 0)
+                                        dst[o++] = src[r++];
+                                else
+                                        dst[o++] = src[l++];
+                        }
+                        while (l < m)
+                                dst[o++] = src[l++];
+                        while (r < e)
+                                dst[o++] = src[r++];
+                }
+
+                swap = src;
+                src = dst;
+                dst = swap;
+        }
+
+        if (src != keys)
+                memcpy(keys, src, st_mult(n, sizeof(struct fetch_key)));
+
+        xfree(tmp);
+}
+
+static void fetch_multi_locked(struct zsdb_priv *priv,
+                               struct fetch_key *keys, size_t nkeys,
+                               const unsigned char **values, size_t *vallens,
+                               int *results)
+{
+        memtree_iter_t active, frozen, finalised;
+        struct list_head *pos;
+        size_t i;
+
+        memset(active, 0, sizeof(memtree_iter_t));
+        memset(frozen, 0, sizeof(memtree_iter_t));
+        memset(finalised, 0, sizeof(memtree_iter_t));
+
+        /* The in-memory records first, as for zsdb_fetch(). The keys are
+         * in order, so each is looked for from the leaf of the one before
+         * in each tree */
+        for (i = 0; i < nkeys; i++) {
+                struct fetch_key *k = &keys[i];
+                struct record *rec = NULL;
+
+                if (memtree_find_next(priv->memtree, k->key, k->keylen,
+                                      active))
+                        rec = active->record;
+                else if (priv->frozen.memtree &&
+                         memtree_find_next(priv->frozen.memtree, k->key,
+                                           k->keylen, frozen))
+                        rec = frozen->record;
+                else if (memtree_find_next(priv->fmemtree, k->key,
+                                           k->keylen, finalised))
+                        rec = finalised->record;
+
+                if (!rec)
+                        continue;
+
+                k->done = 1;
+                if (!rec->deleted) {
+                        values[k->idx] = rec->val;
+                        vallens[k->idx] = rec->vallen;
+                        results[k->idx] = ZS_OK;
+                }
+        }
+
+        /* Then the packed files, newest first, each swept once for the keys
+         * still not found */
+        list_for_each_forward(pos, &priv->dbfiles.pflist) {
+                struct zsdb_file *f;
+                uint64_t cursor = 0;
+
+                f = list_entry(pos, struct zsdb_file, list);
+
+                for (i = 0; i < nkeys; i++) {
+                        struct fetch_key *k = &keys[i];
+                        const unsigned char *value;
+                        size_t vallen = 0;
+
+                        if (k->done ||
+                            !zs_packed_file_may_contain(f, k->key, k->keylen,
+                                                        k->hash,
+                                                        priv->dbcompare))
+                                continue;
+
+                        if (zs_packed_file_fetch(k->key, k->keylen, k->hash,
+                                                 f, &cursor, &value, &vallen,
+                                                 priv->dbcompare)) {
+                                k->done = 1;
+                                values[k->idx] = value;
+                                vallens[k->idx] = vallen;
+                                results[k->idx] = ZS_OK;
+                        }
+                }
+        }
+}
+
+int zsdb_fetch_multi(struct zsdb *db, size_t nkeys,
+                     const unsigned char **keys, const size_t *keylens,
+                     const unsigned char **values, size_t *vallens,
+                     int *results)
+{
+        struct zsdb_priv *priv;
+        struct fetch_key *fkeys;
+        size_t i;
+
+        assert(db);
+        assert(db->priv);
+
+        priv = db->priv;
+
+        if (!priv->open || !priv->dbfiles.factive.is_open) {
+                zslog(LOGWARNING, "DB `%s` not open!\n", priv->dbdir.buf);
+                return ZS_NOT_OPEN;
+        }
+
+        if (!nkeys)
+                return ZS_OK;
+
+        if (!keys || !keylens || !values || !vallens || !results)
+                return ZS_ERROR;
+
+        fkeys = xcalloc(nkeys, sizeof(struct fetch_key));
+        for (i = 0; i < nkeys; i++) {
+                if (!keys[i] || !keylens[i]) {
+                        xfree(fkeys);
+                        return ZS_ERROR;
+                }
+
+                fkeys[i].key = keys[i];
+                fkeys[i].keylen = keylens[i];
+                fkeys[i].idx = i;
+                fkeys[i].hash = bloom_hash(keys[i], keylens[i]);
+
+                values[i] = NULL;
+                vallens[i] = 0;
+                results[i] = ZS_NOTFOUND;
+        }
+
+        sort_fetch_keys(fkeys, nkeys, priv->dbcompare);
+
+        zs_process_read(priv);
+
+        thread_lock_read(&priv->tlk);
+        if (zs_dotzsdb_check_stat(priv) > 0) {
+                zslog(LOGDEBUG, "DB `%s` has been updated!\n", priv->dbdir.buf);
+        }
+        fetch_multi_locked(priv, fkeys, nkeys, values, vallens, results);
+        thread_lock_release(&priv->tlk);
+
+        xfree(fkeys);
+
+        return ZS_OK;
+}
+
+/* pin_value():
+ * A zsdb_value of `vallen` bytes at `val`. If they are in one of the
+ * packed files, and big enough to be worth a mapping, they are mapped
+ * again on their own, so that they stay there once the file is closed;
+ * otherwise they are copied.
+ */
+static struct zsdb_value *pin_value(struct zsdb_priv *priv,
+                                    const unsigned char *val, size_t vallen)
+{
+        struct zsdb_value *v;
+        struct list_head *pos;
+        const unsigned char *mapped = NULL;
+        void *map = NULL;
+        size_t maplen = 0;
+
+        if (vallen >= ZSDB_PIN_MAP_MIN) {
+                list_for_each_forward(pos, &priv->dbfiles.pflist) {
+                        struct zsdb_file *f;
+                        uint64_t offset;
+
+                        f = list_entry(pos, struct zsdb_file, list);
+                        if (f->mf && mfile_offset(f->mf, val, vallen,
+                                                  &offset)) {
+                                mapped = mfile_map_range(f->mf, offset,
+                                                         vallen, &map,
+                                                         &maplen);
+                                break;
+                        }
+                }
+        }
+
+        if (mapped) {
+                v = xcalloc(1, sizeof(struct zsdb_value));
+                v->val = mapped;
+                v->map = map;
+                v->maplen = maplen;
+        } else {
+                /* The copy right after the handle */
+                v = xcalloc(1, sizeof(struct zsdb_value) + vallen);
+                memcpy(v + 1, val, vallen);
+                v->val = (const unsigned char *)(v + 1);
+        }
+
+        v->vallen = vallen;
+        v->refs = 1;
+
+        return v;
+}
+
+int zsdb_fetch_pinned(struct zsdb *db, const unsigned char *key,
+                      size_t keylen, struct zsdb_value **value,
+                      struct zsdb_txn **txn)
+{
+        struct zsdb_priv *priv;
+        const unsigned char *val = NULL;
+        size_t vallen = 0;
+        int ret;
+
+        assert(db);
+        assert(db->priv);
+        assert(value);
+
+        priv = db->priv;
+        *value = NULL;
+
+        zs_process_touch(priv);
+
+        /* The value is pinned before the lock is released, while the
+         * records and files it is in can't go */
+        thread_lock_read(&priv->tlk);
+        ret = zsdb_fetch_cached_locked(db, key, keylen, &val, &vallen, txn);
+        if (ret == ZS_OK)
+                *value = pin_value(priv, val, vallen);
+        thread_lock_release(&priv->tlk);
+
+        return ret;
+}
+
+struct zsdb_value *zsdb_value_ref(struct zsdb_value *value)
+{
+        assert(value);
+
+        __atomic_add_fetch(&value->refs, 1, __ATOMIC_RELAXED);
+
+        return value;
+}
+
+void zsdb_value_release(struct zsdb_value **valuep)
+{
+        struct zsdb_value *value;
+
+        if (!valuep || !*valuep)
+                return;
+
+        value = *valuep;
+        *valuep = NULL;
+
+        if (__atomic_sub_fetch(&value->refs, 1, __ATOMIC_ACQ_REL))
+                return;
+
+        mfile_unmap_range(value->map, value->maplen);
+        xfree(value);
+}
+
+static int zsdb_may_contain_locked(struct zsdb *db, const unsigned char *key,
+                                   size_t keylen)
+{
+        struct zsdb_priv *priv = db->priv;
+        memtree_iter_t iter;
+        struct list_head *pos;
+        uint64_t hash;
+
+        /* The memtrees know for sure */
+        if (memtree_find(priv->memtree, key, keylen, iter) ||
+            (priv->frozen.memtree &&
+             memtree_find(priv->frozen.memtree, key, keylen, iter)) ||
+            memtree_find(priv->fmemtree, key, keylen, iter))
+                return !iter->record->deleted;
+
+        hash = bloom_hash(key, keylen);
+        list_for_each_forward(pos, &priv->dbfiles.pflist) {
+                struct zsdb_file *f;
+
+                f = list_entry(pos, struct zsdb_file, list);
+                if (zs_packed_file_may_contain(f, key, keylen, hash,
+                                               priv->dbcompare))
+                        return 1;
+        }
+
+        return 0;
+}
+
+int zsdb_may_contain(struct zsdb *db, const unsigned char *key,
+                     size_t keylen)
+{
+        struct zsdb_priv *priv;
+        int ret;
+
+        assert(db);
+        assert(db->priv);
+        assert(key);
+
+        priv = db->priv;
+
+        if (!priv->open || !priv->dbfiles.factive.is_open) {
+                zslog(LOGWARNING, "DB `%s` not open!\n", priv->dbdir.buf);
+                return ZS_NOT_OPEN;
+        }
+
+        thread_lock_read(&priv->tlk);
+        ret = zsdb_may_contain_locked(db, key, keylen);
+        thread_lock_release(&priv->tlk);
+
+        return ret;
+}
+
+static int zsdb_fetchnext_locked(struct zsdb *db,
+                                 const unsigned char *key, size_t keylen,
+                                 const unsigned char **found, size_t *foundlen,
+                                 const unsigned char **value, size_t *vallen,
+                                 struct zsdb_txn **txn)
+{
+        int ret = ZS_OK;
+        struct zsdb_priv *priv;
+        struct zsdb_iter *tempiter = NULL;
+        int keyfound = 0;
+        struct zsdb_iter_data *data;
+
+        assert(db);
+        assert(db->priv);
+
+        if (keylen)
+                assert(key);
+
+        priv = db->priv;
+
+        if (!priv->open) {
+                zslog(LOGWARNING, "DB `%s` not open!\n", priv->dbdir.buf);
+                return ZS_NOT_OPEN;
+        }
+
+        /* Create a new iterator */
+        zs_iterator_new(db, &tempiter);
+
+        ret = zs_iterator_begin_at_key(&tempiter, key, keylen, &keyfound);
+        if (ret != ZS_OK) {
+                goto fail;
+        }
+
+        data = zs_iterator_get(tempiter);
+
+        if (keyfound) {
+                /* If we found the key, we go to the next key in the iterator */
+                if (!zs_iterator_next(tempiter, data))
+                        data = NULL;
+                else
+                        data = zs_iterator_get(tempiter);
+        }
+
+        /* Nothing after the key */
+        if (!data) {
+                ret = ZS_NOTFOUND;
+                zs_iterator_end(&tempiter);
+                goto done;
         }
 
         /* Return data */
@@ -1229,11 +1822,15 @@ int zsdb_fetchnext(struct zsdb *db,
         case ZSDB_BE_PACKED:
         {
                 struct zsdb_file *f = data->data.f;
-                size_t offset = f->index->data[f->indexpos];
+                size_t offset = zs_packed_file_offset(f, f->indexpos);
 
-                zs_record_read_key_val_from_offset(f, &offset,
-                                                   found, foundlen,
-                                                   value, vallen);
+                ret = zs_record_read_key_val_from_offset(f, &offset,
+                                                         found, foundlen,
+                                                         value, vallen);
+                if (ret != ZS_OK) {
+                        zs_iterator_end(&tempiter);
+                        goto done;
+                }
         }
                 break;
         default:
@@ -1253,6 +1850,30 @@ done:
         return ret;
 }
 
+int zsdb_fetchnext(struct zsdb *db,
+                   const unsigned char *key, size_t keylen,
+                   const unsigned char **found, size_t *foundlen,
+                   const unsigned char **value, size_t *vallen,
+                   struct zsdb_txn **txn)
+{
+        struct zsdb_priv *priv;
+        int ret;
+
+        assert(db);
+        assert(db->priv);
+
+        priv = db->priv;
+
+        zs_process_read(priv);
+
+        thread_lock_write(&priv->tlk);
+        ret = zsdb_fetchnext_locked(db, key, keylen, found, foundlen, value,
+                                    vallen, txn);
+        thread_lock_release(&priv->tlk);
+
+        return ret;
+}
+
 static int print_memtree_rec(struct record *record, void *data _unused_)
 {
         size_t i;
@@ -1272,7 +1893,7 @@ static int print_memtree_rec(struct record *record, void *data _unused_)
         return 0;
 }
 
-int zsdb_dump(struct zsdb *db, DBDumpLevel level)
+static int zsdb_dump_locked(struct zsdb *db, DBDumpLevel level)
 {
         int ret = ZS_OK;
         struct zsdb_priv *priv;
@@ -1314,7 +1935,7 @@ int zsdb_dump(struct zsdb *db, DBDumpLevel level)
                                 case ZSDB_BE_PACKED:
                                 {
                                         struct zsdb_file *f = idata->data.f;
-                                        size_t offset = f->index->data[f->indexpos];
+                                        size_t offset = zs_packed_file_offset(f, f->indexpos);
                                         zs_record_read_from_file(f, &offset,
                                                                  print_record_cb,
                                                                  NULL,
@@ -1342,7 +1963,24 @@ int zsdb_dump(struct zsdb *db, DBDumpLevel level)
         return ret;
 }
 
-int zsdb_abort(struct zsdb *db, struct zsdb_txn **txn _unused_)
+int zsdb_dump(struct zsdb *db, DBDumpLevel level)
+{
+        struct zsdb_priv *priv;
+        int ret;
+
+        assert(db);
+        assert(db->priv);
+
+        priv = db->priv;
+
+        thread_lock_write(&priv->tlk);
+        ret = zsdb_dump_locked(db, level);
+        thread_lock_release(&priv->tlk);
+
+        return ret;
+}
+
+static int zsdb_abort_locked(struct zsdb *db, struct zsdb_txn **txn _unused_)
 {
         int ret = ZS_NOTIMPLEMENTED;
         struct zsdb_priv *priv;
@@ -1396,6 +2034,23 @@ done:
         return ret;
 }
 
+int zsdb_abort(struct zsdb *db, struct zsdb_txn **txn)
+{
+        struct zsdb_priv *priv;
+        int ret;
+
+        assert(db);
+        assert(db->priv);
+
+        priv = db->priv;
+
+        thread_lock_write(&priv->tlk);
+        ret = zsdb_abort_locked(db, txn);
+        thread_lock_release(&priv->tlk);
+
+        return ret;
+}
+
 int zsdb_consistent(struct zsdb *db, struct zsdb_txn **txn _unused_)
 {
         int ret = ZS_NOTIMPLEMENTED;
@@ -1416,7 +2071,7 @@ int zsdb_consistent(struct zsdb *db, struct zsdb_txn **txn _unused_)
  * time the db was last opened, the process would have to close the db and
  * reopen again.
  */
-int zsdb_repack(struct zsdb *db)
+static int zsdb_repack_locked(struct zsdb *db)
 {
         int ret = ZS_OK;
         struct zsdb_priv *priv;
@@ -1474,7 +2129,8 @@ int zsdb_repack(struct zsdb *db)
                 /* Pack the records from the in-memory tree*/
                 ret = zs_packed_file_new_from_memtree(fname.buf,
                                                       startidx, endidx,
-                                                      priv, &f);
+                                                      priv, priv->fmemtree,
+                                                      &f);
                 if (ret != ZS_OK) {
                         crc32_end(&f->mf);
                         zslog(LOGDEBUG,
@@ -1482,99 +2138,367 @@ int zsdb_repack(struct zsdb *db)
                         /* ERROR! */
                 }
 
-                zs_packed_file_close(&f);
+                zs_packed_file_close(&f);
+
+                priv->dbfiles.pfcount++;
+
+                /* Close finalised files and unlink them */
+                list_for_each_forward_safe(pos, p, &priv->dbfiles.fflist) {
+                        struct zsdb_file *tempf;
+                        list_del(pos);
+                        tempf = list_entry(pos, struct zsdb_file, list);
+                        xunlink(tempf->fname.buf);
+                        zs_finalised_file_close(&tempf);
+                        priv->dbfiles.ffcount--;
+                }
+
+                cstring_release(&fname);
+
+                priv->dbdirty = 1;
+                priv->stale = 1;
+                priv->generation++;
+
+                /* Done, for now. */
+                goto done;
+        }
+
+        /* If there are no finalised files to be packed and we have more than
+           1 packed files, we repack the packed files.
+         */
+        if (!list_empty(&priv->dbfiles.pflist) && (priv->dbfiles.pfcount > 1)) {
+                struct list_head filelist;
+                struct zsdb_file *newpfile = NULL;
+                struct zsdb_iter *iter = NULL;
+                int i = 0;
+
+                list_head_init(&filelist);
+
+                zslog(LOGDEBUG, "Repacking packed files:\n");
+                list_for_each_forward_safe(pos, p,  &priv->dbfiles.pflist) {
+                        struct zsdb_file *tempf;
+                        tempf = list_entry(pos, struct zsdb_file, list);
+                        if (i == 2) break; /* Pack the 2 oldest files */
+
+                        list_del(pos);
+                        list_add_head(&tempf->list, &filelist);
+                        printf("\t > %s\n", tempf->fname.buf);
+                        i++;
+                }
+
+                /* Find the index range */
+                zs_find_index_range_for_files(&filelist,
+                                              &startidx, &endidx);
+
+                zs_filename_generate_packed(priv, &fname, startidx, endidx);
+                zslog(LOGDEBUG, "Packing into file %s...\n", fname.buf);
+
+                ret = zs_iterator_new(db, &iter);
+                ret = zs_packed_file_new_from_packed_files(fname.buf,
+                                                           startidx, endidx,
+                                                           priv, &filelist,
+                                                           &iter, &newpfile);
+                zs_iterator_end(&iter);
+
+                zs_packed_file_close(&newpfile);
+
+                priv->dbfiles.pfcount++;
+
+                list_for_each_forward_safe(pos, p, &filelist) {
+                        struct zsdb_file *tempf;
+                        list_del(pos);
+                        tempf = list_entry(pos, struct zsdb_file, list);
+                        xunlink(tempf->fname.buf);
+                        zs_packed_file_close(&tempf);
+                        priv->dbfiles.pfcount--;
+                }
+
+                cstring_release(&fname);
+
+                priv->dbdirty = 1;
+                priv->generation++;
+
+                /* Done, for now. */
+                goto done;
+        }
+
+        zslog(LOGDEBUG, "Nothing to be packed for now!\n");
+done:
+        if (!zs_dotzsdb_update_end(priv)) {
+                zslog(LOGDEBUG, "Failed release acquired lock for packing!\n");
+                ret = ZS_ERROR;
+        }
+
+        return ret;
+}
+
+int zsdb_repack(struct zsdb *db)
+{
+        struct zsdb_priv *priv;
+        int ret;
+
+        assert(db);
+        assert(db->priv);
+
+        priv = db->priv;
+
+        thread_lock_write(&priv->tlk);
+        ret = zsdb_repack_locked(db);
+        thread_lock_release(&priv->tlk);
+
+        return ret;
+}
+
+/* zsdb_flush_locked():
+ * Move the records held in the in-memory trees to a packed file. The active
+ * file is finalised, and the finalised files are packed and the DB
+ * reloaded, which leaves the memtrees empty.
+ * A packed file made from a single finalised file would get the same name,
+ * `<uuid>-N-N`, and be taken for a finalised file. So with just the one
+ * finalised file, packing is left for the next flush. Unless `pack` is set,
+ * then the active file is rolled over instead, and the records packed
+ * right away, as zs_frozen_begin() does.
+ * Needs the write lock.
+ */
+int zsdb_flush_locked(struct zsdb *db, int pack)
+{
+        int ret = ZS_OK;
+        struct zsdb_priv *priv = db->priv;
+        int packlocked = 0;
+
+        if (!zsdb_write_lock_is_locked(db)) {
+                zslog(LOGDEBUG, "Need a write lock to flush.\n");
+                return ZS_ERROR;
+        }
+
+        if (!zsdb_pack_lock_is_locked(db)) {
+                if (zsdb_pack_lock_acquire(db, 0) != ZS_OK) {
+                        zslog(LOGDEBUG, "DB is being packed, not flushing.\n");
+                        return ZS_AGAIN;
+                }
+                packlocked = 1;
+        }
+
+        if (pack) {
+                ret = zs_frozen_publish(priv, 1);
+                if (ret != ZS_OK)
+                        goto done;
+
+                if (priv->memtree->count &&
+                    list_empty(&priv->dbfiles.fflist)) {
+                        ret = zs_frozen_begin(priv);
+                        if (ret == ZS_OK)
+                                ret = zs_frozen_publish(priv, 1);
+                        goto done;
+                }
+        }
+
+        if (priv->memtree->count) {
+                ret = zs_active_file_finalise(priv);
+                if (ret != ZS_OK)
+                        goto done;
+
+                ret = zs_active_file_new(priv, priv->dotzsdb.curidx + 1);
+                if (ret != ZS_OK)
+                        goto done;
+        }
+
+        /* Pick up the file we just finalised */
+        ret = zsdb_reload(priv);
+        if (ret != ZS_OK)
+                goto done;
+
+        if (priv->dbfiles.ffcount > 1) {
+                ret = zsdb_repack_locked(db);
+                if (ret != ZS_OK)
+                        goto done;
+
+                /* Drop the finalised records and pick up the packed file */
+                ret = zsdb_reload(priv);
+        }
+
+done:
+        if (packlocked)
+                zsdb_pack_lock_release(db);
+
+        return ret;
+}
+
+int zsdb_set_memory_budget(struct zsdb *db, size_t bytes)
+{
+        struct zsdb_priv *priv;
+        int ret;
+
+        assert(db);
+        assert(db->priv);
+
+        priv = db->priv;
+
+        if (!priv->open) {
+                zslog(LOGWARNING, "DB `%s` not open!\n", priv->dbdir.buf);
+                return ZS_NOT_OPEN;
+        }
+
+        thread_lock_write(&priv->tlk);
+        ret = zs_memory_budget_set(db, bytes);
+        thread_lock_release(&priv->tlk);
+
+        return ret;
+}
+
+int zsdb_set_filter(struct zsdb *db, unsigned int bitsperkey, size_t prefixlen)
+{
+        struct zsdb_priv *priv;
+
+        assert(db);
+        assert(db->priv);
+
+        priv = db->priv;
+
+        if (!priv->open) {
+                zslog(LOGWARNING, "DB `%s` not open!\n", priv->dbdir.buf);
+                return ZS_NOT_OPEN;
+        }
+
+        if (prefixlen > UINT32_MAX)
+                return ZS_ERROR;
+
+        thread_lock_write(&priv->tlk);
+        priv->filterbits = bitsperkey;
+        priv->filterprefix = bitsperkey ? prefixlen : 0;
+        thread_lock_release(&priv->tlk);
+
+        return ZS_OK;
+}
+
+int zsdb_set_packed_version(struct zsdb *db, unsigned int version)
+{
+        struct zsdb_priv *priv;
+
+        assert(db);
+        assert(db->priv);
+
+        priv = db->priv;
+
+        if (!priv->open) {
+                zslog(LOGWARNING, "DB `%s` not open!\n", priv->dbdir.buf);
+                return ZS_NOT_OPEN;
+        }
+
+        if (version < 1 || version > ZS_PACKED_VERSION)
+                return ZS_ERROR;
+
+        thread_lock_write(&priv->tlk);
+        priv->packversion = version;
+        thread_lock_release(&priv->tlk);
 
-                priv->dbfiles.pfcount++;
+        return ZS_OK;
+}
 
-                /* Close finalised files and unlink them */
-                list_for_each_forward_safe(pos, p, &priv->dbfiles.fflist) {
-                        struct zsdb_file *tempf;
-                        list_del(pos);
-                        tempf = list_entry(pos, struct zsdb_file, list);
-                        xunlink(tempf->fname.buf);
-                        zs_finalised_file_close(&tempf);
-                        priv->dbfiles.ffcount--;
-                }
+int zsdb_set_hash_index(struct zsdb *db, int enable)
+{
+        struct zsdb_priv *priv;
 
-                cstring_release(&fname);
+        assert(db);
+        assert(db->priv);
 
-                priv->dbdirty = 1;
+        priv = db->priv;
 
-                /* Done, for now. */
-                goto done;
+        if (!priv->open) {
+                zslog(LOGWARNING, "DB `%s` not open!\n", priv->dbdir.buf);
+                return ZS_NOT_OPEN;
         }
 
-        /* If there are no finalised files to be packed and we have more than
-           1 packed files, we repack the packed files.
-         */
-        if (!list_empty(&priv->dbfiles.pflist) && (priv->dbfiles.pfcount > 1)) {
-                struct list_head filelist;
-                struct zsdb_file *newpfile = NULL;
-                struct zsdb_iter *iter = NULL;
-                int i = 0;
+        thread_lock_write(&priv->tlk);
+        priv->hashindex = enable ? 1 : 0;
+        thread_lock_release(&priv->tlk);
 
-                list_head_init(&filelist);
+        return ZS_OK;
+}
 
-                zslog(LOGDEBUG, "Repacking packed files:\n");
-                list_for_each_forward_safe(pos, p,  &priv->dbfiles.pflist) {
-                        struct zsdb_file *tempf;
-                        tempf = list_entry(pos, struct zsdb_file, list);
-                        if (i == 2) break; /* Pack the 2 oldest files */
+int zsdb_set_value_cache(struct zsdb *db, size_t bytes)
+{
+        struct zsdb_priv *priv;
 
-                        list_del(pos);
-                        list_add_head(&tempf->list, &filelist);
-                        printf("\t > %s\n", tempf->fname.buf);
-                        i++;
-                }
+        assert(db);
+        assert(db->priv);
 
-                /* Find the index range */
-                zs_find_index_range_for_files(&filelist,
-                                              &startidx, &endidx);
+        priv = db->priv;
 
-                zs_filename_generate_packed(priv, &fname, startidx, endidx);
-                zslog(LOGDEBUG, "Packing into file %s...\n", fname.buf);
+        if (!priv->open) {
+                zslog(LOGWARNING, "DB `%s` not open!\n", priv->dbdir.buf);
+                return ZS_NOT_OPEN;
+        }
 
-                ret = zs_iterator_new(db, &iter);
-                ret = zs_packed_file_new_from_packed_files(fname.buf,
-                                                           startidx, endidx,
-                                                           priv, &filelist,
-                                                           &iter, &newpfile);
-                zs_iterator_end(&iter);
+        thread_lock_write(&priv->tlk);
+        valcache_free(&priv->valcache);
+        if (bytes) {
+                priv->valcache = valcache_new(bytes);
+                valcache_sync(priv->valcache, priv->generation);
+        }
+        thread_lock_release(&priv->tlk);
 
-                zs_packed_file_close(&newpfile);
+        return ZS_OK;
+}
 
-                priv->dbfiles.pfcount++;
+int zsdb_value_cache_stats(struct zsdb *db,
+                           struct zsdb_value_cache_stats *stats)
+{
+        struct zsdb_priv *priv;
+        struct valcache_stats vs;
 
-                list_for_each_forward_safe(pos, p, &filelist) {
-                        struct zsdb_file *tempf;
-                        list_del(pos);
-                        tempf = list_entry(pos, struct zsdb_file, list);
-                        xunlink(tempf->fname.buf);
-                        zs_packed_file_close(&tempf);
-                        priv->dbfiles.pfcount--;
-                }
+        assert(db);
+        assert(db->priv);
+        assert(stats);
 
-                priv->dbdirty = 1;
+        priv = db->priv;
 
-                /* Done, for now. */
-                goto done;
+        if (!priv->open) {
+                zslog(LOGWARNING, "DB `%s` not open!\n", priv->dbdir.buf);
+                return ZS_NOT_OPEN;
         }
 
-        zslog(LOGDEBUG, "Nothing to be packed for now!\n");
-done:
-        if (!zs_dotzsdb_update_end(priv)) {
-                zslog(LOGDEBUG, "Failed release acquired lock for packing!\n");
-                ret = ZS_ERROR;
+        memset(stats, 0, sizeof(struct zsdb_value_cache_stats));
+
+        thread_lock_read(&priv->tlk);
+        if (priv->valcache) {
+                valcache_get_stats(priv->valcache, &vs);
+                stats->hits = vs.hits;
+                stats->misses = vs.misses;
+                stats->admitted = vs.admitted;
+                stats->rejected = vs.rejected;
+                stats->evicted = vs.evicted;
+                stats->invalidated = vs.invalidated;
+                stats->entries = vs.entries;
+                stats->bytes = vs.bytes;
+                stats->budget = vs.budget;
         }
+        thread_lock_release(&priv->tlk);
 
-        return ret;
+        return ZS_OK;
 }
 
-int zsdb_info(struct zsdb *db)
+int zsdb_set_process_memory_budget(size_t bytes)
+{
+        zs_process_budget_set(bytes);
+
+        return ZS_OK;
+}
+
+int zsdb_process_memory_usage(struct zsdb_process_memory_usage *usage)
+{
+        assert(usage);
+
+        zs_process_memory_usage(usage);
+
+        return ZS_OK;
+}
+
+static int zsdb_info_locked(struct zsdb *db)
 {
         int ret = ZS_OK;
         struct zsdb_priv *priv;
         struct list_head *pos;
+        struct zsdb_memory_usage usage;
 
         assert(db);
         assert(db->priv);
@@ -1621,10 +2545,117 @@ int zsdb_info(struct zsdb *db)
                 }
         }
 
+        zs_memory_usage(priv, &usage);
+        fprintf(stderr, ">> Memory:\n");
+        fprintf(stderr, "\t * Active records    : %zu bytes\n",
+                usage.memtree);
+        fprintf(stderr, "\t * Finalised records : %zu bytes\n",
+                usage.fmemtree);
+        fprintf(stderr, "\t * Frozen records    : %zu bytes\n",
+                usage.frozen);
+        fprintf(stderr, "\t * Packed indexes    : %zu bytes\n", usage.index);
+        fprintf(stderr, "\t * Iterators         : %zu bytes (%zu open)\n",
+                usage.iterators, usage.niterators);
+        fprintf(stderr, "\t * Heap total        : %zu bytes\n", usage.heap);
+        if (priv->arena)
+                fprintf(stderr, "\t * Arena             : %zu bytes "
+                        "(%zu on huge pages)\n",
+                        usage.arena, usage.arena_hugetlb);
+        fprintf(stderr, "\t * Mapped            : %zu bytes "
+                "(active %zu, finalised %zu, packed %zu)\n",
+                usage.mapped, usage.mapped_active,
+                usage.mapped_finalised, usage.mapped_packed);
+        fprintf(stderr, "\t * Resident          : %zu bytes\n",
+                usage.resident);
+
         return ret;
 }
 
-int zsdb_finalise(struct zsdb *db)
+int zsdb_info(struct zsdb *db)
+{
+        struct zsdb_priv *priv;
+        int ret;
+
+        assert(db);
+        assert(db->priv);
+
+        priv = db->priv;
+
+        thread_lock_read(&priv->tlk);
+        ret = zsdb_info_locked(db);
+        thread_lock_release(&priv->tlk);
+
+        return ret;
+}
+
+int zsdb_memory_usage(struct zsdb *db, struct zsdb_memory_usage *usage)
+{
+        struct zsdb_priv *priv;
+
+        assert(db);
+        assert(db->priv);
+        assert(usage);
+
+        priv = db->priv;
+
+        if (!priv->open) {
+                zslog(LOGWARNING, "DB `%s` not open!\n", priv->dbdir.buf);
+                return ZS_NOT_OPEN;
+        }
+
+        thread_lock_read(&priv->tlk);
+        zs_memory_usage(priv, usage);
+        thread_lock_release(&priv->tlk);
+
+        return ZS_OK;
+}
+
+int zsdb_reclaim(struct zsdb *db)
+{
+        struct zsdb_priv *priv;
+        int ret = ZS_OK;
+
+        assert(db);
+        assert(db->priv);
+
+        priv = db->priv;
+
+        if (!priv->open) {
+                zslog(LOGWARNING, "DB `%s` not open!\n", priv->dbdir.buf);
+                return ZS_NOT_OPEN;
+        }
+
+        thread_lock_write(&priv->tlk);
+        if (__atomic_load_n(&priv->itercount, __ATOMIC_RELAXED)) {
+                ret = ZS_AGAIN;
+        } else {
+                zs_packed_files_reclaim(priv);
+                if (priv->valcache)
+                        valcache_reclaim(priv->valcache);
+        }
+        thread_lock_release(&priv->tlk);
+
+        return ret;
+}
+
+int zsdb_checkpoint(struct zsdb *db)
+{
+        struct zsdb_priv *priv;
+        int ret;
+
+        assert(db);
+        assert(db->priv);
+
+        priv = db->priv;
+
+        thread_lock_write(&priv->tlk);
+        ret = zsdb_checkpoint_locked(db);
+        thread_lock_release(&priv->tlk);
+
+        return ret;
+}
+
+static int zsdb_finalise_locked(struct zsdb *db)
 {
         int ret = ZS_OK;
         struct zsdb_priv *priv;
@@ -1658,11 +2689,19 @@ int zsdb_finalise(struct zsdb *db)
                 zslog(LOGDEBUG, "Reloaded DB!\n");
         }
 
+        /* The frozen records are older than those being finalised */
+        ret = zs_frozen_publish(priv, 1);
+        if (ret != ZS_OK)
+                goto done;
+
         zslog(LOGDEBUG, "Finalising %s.\n",
               priv->dbfiles.factive.fname.buf);
         ret = zs_active_file_finalise(priv);
         if (ret != ZS_OK) goto done;
 
+        /* The records of the finalised file are still in the memtree */
+        priv->stale = 1;
+
         ret = zs_active_file_new(priv,
                                  priv->dotzsdb.curidx + 1);
         zslog(LOGDEBUG, "New active log file %s created.\n",
@@ -1674,18 +2713,41 @@ int zsdb_finalise(struct zsdb *db)
         if (!priv->dbfiles.factive.mf->compute_crc)
                 crc32_begin(&priv->dbfiles.factive.mf);
 
+        if (ret == ZS_OK && (priv->flags & MODE_CHECKPOINT))
+                ret = zsdb_checkpoint_locked(db);
+
 done:
         return ret;
 }
 
-int zsdb_foreach(struct zsdb *db, const unsigned char *prefix, size_t prefixlen,
-                 zsdb_foreach_p *p, zsdb_foreach_cb *cb, void *cbdata,
-                 struct zsdb_txn **txn)
+int zsdb_finalise(struct zsdb *db)
+{
+        struct zsdb_priv *priv;
+        int ret;
+
+        assert(db);
+        assert(db->priv);
+
+        priv = db->priv;
+
+        thread_lock_write(&priv->tlk);
+        ret = zsdb_finalise_locked(db);
+        thread_lock_release(&priv->tlk);
+
+        return ret;
+}
+
+static int zsdb_foreach_locked(struct zsdb *db,
+                               const unsigned char *prefix, size_t prefixlen,
+                               zsdb_foreach_p *p, zsdb_foreach_cb *cb,
+                               void *cbdata, struct zsdb_txn **txn)
 {
         int ret = ZS_OK;
         struct zsdb_priv *priv;
         struct zsdb_iter_data *data;
         struct zsdb_iter *tempiter = NULL;
+        cstring lastkey = CSTRING_INIT;
+        uint64_t generation, changes;
         int newtxn = 0;
         int found = 0;
 
@@ -1703,6 +2765,9 @@ int zsdb_foreach(struct zsdb *db, const unsigned char *prefix, size_t prefixlen,
                 assert(prefix);
         }
 
+        generation = priv->generation;
+        changes = priv->memtree->changes;
+
         if (txn) {
                 if (*txn && (*txn)->iter) { /* Existing transaction */
                         tempiter = (*txn)->iter;
@@ -1716,6 +2781,13 @@ int zsdb_foreach(struct zsdb *db, const unsigned char *prefix, size_t prefixlen,
         if (!tempiter) {
                 zs_iterator_new(db, &tempiter);
 
+                /* The files without a key with the prefix can be left out,
+                 * unless the iterator goes on in the transaction */
+                if (!txn) {
+                        tempiter->prefix = prefix;
+                        tempiter->prefixlen = prefixlen;
+                }
+
                 if (prefix)
                         ret = zs_iterator_begin_at_key(&tempiter,
                                                        prefix,
@@ -1731,9 +2803,7 @@ int zsdb_foreach(struct zsdb *db, const unsigned char *prefix, size_t prefixlen,
         do {
                 const unsigned char *key = NULL, *val = NULL;
                 size_t keylen = 0, vallen = 0;
-                unsigned char *tkey = NULL;
-                size_t tkeylen = 0;
-
+                int err = ZS_OK;
 
                 data = zs_iterator_get(tempiter);
                 if (!data)
@@ -1753,17 +2823,22 @@ int zsdb_foreach(struct zsdb *db, const unsigned char *prefix, size_t prefixlen,
                 case ZSDB_BE_PACKED:
                 {
                         struct zsdb_file *f = data->data.f;
-                        size_t offset = f->index->data[f->indexpos];
+                        size_t offset = zs_packed_file_offset(f, f->indexpos);
 
-                        zs_record_read_key_val_from_offset(f, &offset,
-                                                           &key, &keylen,
-                                                           &val, &vallen);
+                        err = zs_record_read_key_val_from_offset(f, &offset,
+                                                                 &key, &keylen,
+                                                                 &val, &vallen);
                 }
                 break;
                 default:
                         abort(); /* Should never reach here */
                 }
 
+                if (err != ZS_OK) {
+                        ret = err;
+                        break;
+                }
+
                 /* If there is a prefix, then ensure we match it */
                 if (prefixlen) {
                         int r;
@@ -1777,38 +2852,53 @@ int zsdb_foreach(struct zsdb *db, const unsigned char *prefix, size_t prefixlen,
                                 break;
                 }
 
-                /* Save the key  */
-                tkey = xucharbufdup(key, keylen);
-                tkeylen = keylen;
+                /* Save the key, in case the callback reloads the DB */
+                cstring_setlen(&lastkey, 0);
+                cstring_add(&lastkey, key, keylen);
 
                 if (!p || p(cbdata, key, keylen, val, vallen)) {
                         if (cb(cbdata, key, keylen, val, vallen))
                                 break;
                 }
 
-                if (priv->dbdirty) {
+                if (priv->generation != generation) {
+                        /* The files or the memtrees were replaced, begin
+                         * again from where we were */
                         zs_iterator_end(&tempiter);
                         if (txn && *txn)
                                 (*txn)->iter = NULL;
                         tempiter = NULL;
 
                         zs_iterator_new(db, &tempiter);
+                        if (!txn) {
+                                tempiter->prefix = prefix;
+                                tempiter->prefixlen = prefixlen;
+                        }
 
                         zs_iterator_begin_at_key(&tempiter,
-                                                 tkey, tkeylen, &found);
+                                                 (unsigned char *)lastkey.buf,
+                                                 lastkey.len, &found);
                         data = zs_iterator_get(tempiter);
 
                         if (txn && *txn)
                                 (*txn)->iter = tempiter;
 
                         priv->dbdirty = 0;
+                } else if (priv->memtree->changes != changes) {
+                        /* Only the active memtree has changed, and the
+                         * iterator can carry on from where it is. `key`
+                         * may be in a window the callback had unmapped */
+                        zs_iterator_sync_active(tempiter, data,
+                                                (unsigned char *)lastkey.buf,
+                                                lastkey.len);
+                        priv->dbdirty = 0;
                 }
 
-                free(tkey);
-                tkey = NULL;
-
+                generation = priv->generation;
+                changes = priv->memtree->changes;
          } while (zs_iterator_next(tempiter, data));
 
+        cstring_release(&lastkey);
         zs_iterator_end(&tempiter);
         tempiter = NULL;
         if (txn && *txn)
@@ -1822,9 +2912,31 @@ int zsdb_foreach(struct zsdb *db, const unsigned char *prefix, size_t prefixlen,
         return ret;
 }
 
-int zsdb_forone(struct zsdb *db, const unsigned char *key, size_t keylen,
-                zsdb_foreach_p *p, zsdb_foreach_cb *cb, void *cbdata,
-                struct zsdb_txn **txn)
+int zsdb_foreach(struct zsdb *db, const unsigned char *prefix, size_t prefixlen,
+                 zsdb_foreach_p *p, zsdb_foreach_cb *cb, void *cbdata,
+                 struct zsdb_txn **txn)
+{
+        struct zsdb_priv *priv;
+        int ret;
+
+        assert(db);
+        assert(db->priv);
+
+        priv = db->priv;
+
+        zs_process_read(priv);
+
+        thread_lock_write(&priv->tlk);
+        ret = zsdb_foreach_locked(db, prefix, prefixlen, p, cb, cbdata, txn);
+        thread_lock_release(&priv->tlk);
+
+        return ret;
+}
+
+static int zsdb_forone_locked(struct zsdb *db,
+                              const unsigned char *key, size_t keylen,
+                              zsdb_foreach_p *p, zsdb_foreach_cb *cb,
+                              void *cbdata, struct zsdb_txn **txn)
 {
         int ret = ZS_OK;
         struct zsdb_priv *priv;
@@ -1873,10 +2985,14 @@ int zsdb_forone(struct zsdb *db, const unsigned char *key, size_t keylen,
                 case ZSDB_BE_PACKED:
                 {
                         struct zsdb_file *f = data->data.f;
-                        size_t offset = f->index->data[f->indexpos];
+                        size_t offset = zs_packed_file_offset(f, f->indexpos);
 
-                        zs_read_key_val_record_from_file_offset(f, &offset,
-                                                                &krec, &vrec);
+                        ret = zs_read_key_val_record_from_file_offset(f,
+                                                                      &offset,
+                                                                      &krec,
+                                                                      &vrec);
+                        if (ret != ZS_OK)
+                                break;
                         val = vrec.data;
                         vallen = vrec.base.type == REC_TYPE_VALUE ?
                                 vrec.base.slen : vrec.base.llen;
@@ -1886,7 +3002,7 @@ int zsdb_forone(struct zsdb *db, const unsigned char *key, size_t keylen,
                         abort();
                 }
 
-                if (!p || p(cbdata, key, keylen, val, vallen))
+                if (ret == ZS_OK && (!p || p(cbdata, key, keylen, val, vallen)))
                         ret = cb(cbdata, key, keylen, val, vallen);
 
                 /* We've already got the key we wanted,
@@ -1895,6 +3011,8 @@ int zsdb_forone(struct zsdb *db, const unsigned char *key, size_t keylen,
 
                 if (txn && *txn && (*txn)->alloced)
                         (*txn)->iter = tempiter;
+                else
+                        zs_iterator_end(&tempiter);
 
                 goto done;
         }
@@ -1905,6 +3023,27 @@ done:
         return ret;
 }
 
+int zsdb_forone(struct zsdb *db, const unsigned char *key, size_t keylen,
+                zsdb_foreach_p *p, zsdb_foreach_cb *cb, void *cbdata,
+                struct zsdb_txn **txn)
+{
+        struct zsdb_priv *priv;
+        int ret;
+
+        assert(db);
+        assert(db->priv);
+
+        priv = db->priv;
+
+        zs_process_read(priv);
+
+        thread_lock_write(&priv->tlk);
+        ret = zsdb_forone_locked(db, key, keylen, p, cb, cbdata, txn);
+        thread_lock_release(&priv->tlk);
+
+        return ret;
+}
+
 int zsdb_transaction_begin(struct zsdb *db, struct zsdb_txn **txn)
 {
         return zs_transaction_begin(db, txn);
@@ -1928,8 +3067,15 @@ int zsdb_write_lock_acquire(struct zsdb *db, long timeout_ms)
 
         priv = db->priv;
         if (!priv) return ZS_INTERNAL;
+
+        /* Writers in other threads sharing this handle go first */
+        if (thread_lock_writer_acquire(&priv->tlk, timeout_ms) < 0)
+                return ZS_ERROR;
+
         ret = file_lock_acquire(&priv->wlk, priv->dbdir.buf,
                                 WRITE_LOCK_FNAME, timeout_ms);
+        if (ret < 0)
+                thread_lock_writer_release(&priv->tlk);
 
         return (ret >= 0) ? ZS_OK : ZS_ERROR;
 }
@@ -1937,12 +3083,19 @@ int zsdb_write_lock_acquire(struct zsdb *db, long timeout_ms)
 int zsdb_write_lock_release(struct zsdb *db)
 {
         struct zsdb_priv *priv;
+        int ret;
 
         assert(db);
 
         priv = db->priv;
         if (!priv) return ZS_INTERNAL;
-        return (file_lock_release(&priv->wlk)  == 0) ? ZS_OK : ZS_ERROR;
+        if (!zsdb_write_lock_is_locked(db))
+                return ZS_OK;
+
+        ret = file_lock_release(&priv->wlk);
+        thread_lock_writer_release(&priv->tlk);
+
+        return (ret == 0) ? ZS_OK : ZS_ERROR;
 }
 
 int zsdb_write_lock_is_locked(struct zsdb *db)
@@ -1953,7 +3106,11 @@ int zsdb_write_lock_is_locked(struct zsdb *db)
 
         priv = db->priv;
         if (!priv) return ZS_INTERNAL;
-        return file_lock_is_locked(&priv->wlk);
+
+        /* With threads sharing the handle, only the one that holds the
+         * writer slot has the write lock */
+        return file_lock_is_locked(&priv->wlk) &&
+                thread_lock_writer_is_held(&priv->tlk);
 }
 
 int zsdb_pack_lock_acquire(struct zsdb *db, long timeout_ms)
@@ -0,0 +1,221 @@
+/*
+ * zeroskip
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <libzeroskip/arena.h>
+#include <libzeroskip/memtree.h>
+#include <libzeroskip/util.h>
+#include <libzeroskip/vecu64.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+
+Suite *arena_suite(void);
+
+static struct arena *arena;
+
+static void setup(void)
+{
+        arena = arena_new(ARENA_HUGEPAGES);
+}
+
+static void teardown(void)
+{
+        arena_destroy(&arena);
+}
+
+START_TEST(test_arena_alloc_release)
+{
+        size_t sizes[] = { 1, 16, 17, 100, 512, 513, 4000, 70000,
+                           256 * 1024, 256 * 1024 + 1, 3 * ARENA_CHUNK_SIZE };
+        void *ptrs[sizeof(sizes) / sizeof(sizes[0])];
+        size_t i;
+
+        for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+                ptrs[i] = arena_alloc(arena, sizes[i]);
+                ck_assert_ptr_nonnull(ptrs[i]);
+                ck_assert_int_eq((uintptr_t)ptrs[i] % 16, 0);
+                memset(ptrs[i], (int)i, sizes[i]);
+        }
+
+        /* Nothing overlaps */
+        for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+                unsigned char *p = ptrs[i];
+                ck_assert_int_eq(p[0], (int)i);
+                ck_assert_int_eq(p[sizes[i] - 1], (int)i);
+        }
+
+        ck_assert_uint_ge(arena->mapped, 4 * ARENA_CHUNK_SIZE);
+        ck_assert_uint_le(arena->hugetlb, arena->mapped);
+
+        for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+                arena_release(arena, ptrs[i], sizes[i]);
+
+        /* The large allocations are unmapped when released */
+        ck_assert_uint_eq(arena->mapped, ARENA_CHUNK_SIZE);
+}
+END_TEST
+
+START_TEST(test_arena_reuse)
+{
+        void *p1, *p2, *p3;
+
+        p1 = arena_alloc(arena, 40);
+        p2 = arena_alloc(arena, 40);
+        ck_assert_ptr_ne(p1, p2);
+
+        /* Released memory is handed out again for the same size class */
+        arena_release(arena, p1, 40);
+        p3 = arena_alloc(arena, 48);
+        ck_assert_ptr_eq(p1, p3);
+
+        arena_release(arena, p2, 40);
+        arena_release(arena, p3, 48);
+}
+END_TEST
+
+START_TEST(test_arena_realloc)
+{
+        unsigned char *p;
+        size_t size, oldsize = 0;
+        int i;
+
+        /* Through the size classes into large allocations, the contents
+         * are kept as it moves */
+        p = NULL;
+        for (size = 8; size <= 4 * ARENA_CHUNK_SIZE; size *= 2) {
+                p = arena_realloc(arena, p, oldsize, size);
+                for (i = 0; i < 8 && oldsize; i++)
+                        ck_assert_int_eq(p[oldsize / 8 * i], i + 1);
+                for (i = 0; i < 8; i++)
+                        p[size / 8 * i] = i + 1;
+                oldsize = size;
+        }
+
+        p = arena_realloc(arena, p, oldsize, 100);
+        ck_assert_int_eq(p[0], 1);
+        arena_release(arena, p, 100);
+        ck_assert_uint_eq(arena->mapped, ARENA_CHUNK_SIZE);
+}
+END_TEST
+
+START_TEST(test_arena_null)
+{
+        void *p;
+
+        /* Without an arena, it is the heap */
+        p = arena_alloc(NULL, 100);
+        ck_assert_ptr_nonnull(p);
+        p = arena_realloc(NULL, p, 100, 1000);
+        ck_assert_ptr_nonnull(p);
+        arena_release(NULL, p, 1000);
+}
+END_TEST
+
+START_TEST(test_arena_vecu64)
+{
+        struct vecu64 *v;
+        uint64_t i;
+
+        v = vecu64_new_arena(arena);
+        vecu64_reserve(v, 1000);
+        ck_assert_uint_ge(v->alloc, 1000);
+
+        for (i = 0; i < 100000; i++)
+                vecu64_append(v, i * 3);
+
+        ck_assert_uint_eq(vecu64_size(v), 100000);
+        for (i = 0; i < 100000; i++)
+                ck_assert_uint_eq(v->data[i], i * 3);
+
+        vecu64_free(&v);
+        ck_assert_uint_eq(arena->mapped, ARENA_CHUNK_SIZE);
+}
+END_TEST
+
+START_TEST(test_arena_memtree)
+{
+        struct memtree *tree;
+        struct record *rec;
+        memtree_iter_t iter;
+        char key[32], val[64];
+        int i;
+
+        memset(&iter, 0, sizeof(memtree_iter_t));
+
+        tree = memtree_new_arena(NULL, NULL, arena);
+
+        for (i = 0; i < 10000; i++) {
+                snprintf(key, sizeof(key), "key%05d", i);
+                snprintf(val, sizeof(val), "val%d", i);
+                rec = record_new_arena(arena, (unsigned char *)key,
+                                       strlen(key), (unsigned char *)val,
+                                       strlen(val), 0);
+                ck_assert_int_eq(memtree_insert(tree, rec), MEMTREE_OK);
+        }
+
+        /* Replace the even ones, with longer values */
+        for (i = 0; i < 10000; i += 2) {
+                snprintf(key, sizeof(key), "key%05d", i);
+                snprintf(val, sizeof(val), "value-replaced-%d", i);
+                rec = record_new_arena(arena, (unsigned char *)key,
+                                       strlen(key), (unsigned char *)val,
+                                       strlen(val), 0);
+                ck_assert_int_eq(memtree_replace(tree, rec), MEMTREE_OK);
+        }
+
+        /* And remove every third */
+        for (i = 0; i < 10000; i += 3) {
+                snprintf(key, sizeof(key), "key%05d", i);
+                ck_assert_int_eq(memtree_remove(tree, (unsigned char *)key,
+                                                strlen(key)), MEMTREE_OK);
+        }
+
+        for (i = 0; i < 10000; i++) {
+                int found;
+
+                snprintf(key, sizeof(key), "key%05d", i);
+                found = memtree_find(tree, (unsigned char *)key,
+                                     strlen(key), iter);
+                ck_assert_int_eq(found, i % 3 != 0);
+                if (!found)
+                        continue;
+
+                if (i % 2)
+                        snprintf(val, sizeof(val), "val%d", i);
+                else
+                        snprintf(val, sizeof(val), "value-replaced-%d", i);
+                ck_assert_uint_eq(iter->record->vallen, strlen(val));
+                ck_assert_mem_eq(iter->record->val, val, strlen(val));
+        }
+
+        memtree_free(tree);
+}
+END_TEST
+
+Suite *arena_suite(void)
+{
+        Suite *s;
+        TCase *tc_core;
+
+        s = suite_create("arena");
+
+        tc_core = tcase_create("core");
+        tcase_add_checked_fixture(tc_core, setup, teardown);
+        tcase_add_test(tc_core, test_arena_alloc_release);
+        tcase_add_test(tc_core, test_arena_reuse);
+        tcase_add_test(tc_core, test_arena_realloc);
+        tcase_add_test(tc_core, test_arena_null);
+        tcase_add_test(tc_core, test_arena_vecu64);
+        tcase_add_test(tc_core, test_arena_memtree);
+        suite_add_tcase(s, tc_core);
+
+        return s;
+}
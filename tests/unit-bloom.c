@@ -0,0 +1,158 @@
+/*
+ * zeroskip
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <libzeroskip/bloom.h>
+#include <libzeroskip/macros.h>
+#include <libzeroskip/util.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+
+Suite *bloom_suite(void);
+
+#define NUM_KEYS 10000
+
+static struct bloom *bloom;
+
+static void setup(void)
+{
+        bloom = NULL;
+}
+
+static void teardown(void)
+{
+        bloom_free(&bloom);
+}
+
+static uint64_t key_hash(const char *prefix, int i)
+{
+        char key[32];
+
+        snprintf(key, sizeof(key), "%s%06d", prefix, i);
+
+        return bloom_hash(key, strlen(key));
+}
+
+static void fill(unsigned int bitsperkey)
+{
+        int i;
+
+        bloom = bloom_new(NUM_KEYS, bitsperkey);
+        for (i = 0; i < NUM_KEYS; i++)
+                bloom_add(bloom, key_hash("key", i));
+}
+
+static int false_positives(const struct bloom *b)
+{
+        int i, n = 0;
+
+        for (i = 0; i < NUM_KEYS; i++)
+                n += bloom_may_contain(b, key_hash("nokey", i));
+
+        return n;
+}
+
+START_TEST(test_bloom_no_false_negatives)
+{
+        int i;
+
+        fill(10);
+        ck_assert_uint_eq(bloom->k, 7);
+        ck_assert_uint_eq(bloom_bytes(bloom),
+                          (NUM_KEYS * 10 + BLOOM_BLOCK_BITS - 1) /
+                          BLOOM_BLOCK_BITS * BLOOM_BLOCK_BYTES);
+
+        for (i = 0; i < NUM_KEYS; i++)
+                ck_assert_int_eq(bloom_may_contain(bloom,
+                                                   key_hash("key", i)), 1);
+}
+END_TEST
+
+START_TEST(test_bloom_false_positives)
+{
+        int fp;
+
+        /* About 1% at 10 bits per key, a bit more for being blocked */
+        fill(10);
+        fp = false_positives(bloom);
+        ck_assert_int_lt(fp, NUM_KEYS * 2 / 100);
+        bloom_free(&bloom);
+
+        /* Fewer bits, more of them */
+        fill(4);
+        ck_assert_int_gt(false_positives(bloom), fp);
+}
+END_TEST
+
+START_TEST(test_bloom_mapped)
+{
+        struct bloom *mapped;
+        unsigned char *copy;
+        int i;
+
+        fill(10);
+
+        /* As written to a packed file */
+        copy = xmalloc(bloom_bytes(bloom));
+        memcpy(copy, bloom->bits, bloom_bytes(bloom));
+        mapped = bloom_new_mapped(copy, bloom->nblocks, bloom->k);
+
+        for (i = 0; i < NUM_KEYS; i++) {
+                uint64_t h = key_hash("key", i);
+                ck_assert_int_eq(bloom_may_contain(mapped, h), 1);
+
+                h = key_hash("nokey", i);
+                ck_assert_int_eq(bloom_may_contain(mapped, h),
+                                 bloom_may_contain(bloom, h));
+        }
+
+        /* The bits aren't the filter's to free */
+        bloom_free(&mapped);
+        ck_assert_ptr_null(mapped);
+        xfree(copy);
+}
+END_TEST
+
+START_TEST(test_bloom_hash)
+{
+        /* The filters are in the files, the hash can't change */
+        ck_assert_uint_eq(bloom_hash("", 0), 0x9ca066f1a4ab2eeaULL);
+        ck_assert_uint_eq(bloom_hash("key000001", 9), 0xbe1aff3ebefdaf68ULL);
+        ck_assert_uint_ne(bloom_hash("a", 1), bloom_hash("b", 1));
+        ck_assert_uint_ne(bloom_hash("a", 1), bloom_hash("a\0", 2));
+        ck_assert_uint_ne(bloom_hash("key00000", 8),
+                          bloom_hash("key000000", 9));
+        ck_assert_uint_eq(bloom_hash("abcdefghij", 10),
+                          bloom_hash("abcdefghijk", 10));
+
+        /* Bytes past the length don't count */
+        ck_assert_uint_eq(bloom_hash("key0012345", 6),
+                          bloom_hash("key001", 6));
+}
+END_TEST
+
+Suite *bloom_suite(void)
+{
+        Suite *s;
+        TCase *tc_core;
+
+        s = suite_create("bloom");
+
+        tc_core = tcase_create("core");
+        tcase_add_checked_fixture(tc_core, setup, teardown);
+        tcase_add_test(tc_core, test_bloom_no_false_negatives);
+        tcase_add_test(tc_core, test_bloom_false_positives);
+        tcase_add_test(tc_core, test_bloom_mapped);
+        tcase_add_test(tc_core, test_bloom_hash);
+        suite_add_tcase(s, tc_core);
+
+        return s;
+}
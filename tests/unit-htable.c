@@ -0,0 +1,227 @@
+/*
+ * zeroskip
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <libzeroskip/htable.h>
+#include <libzeroskip/macros.h>
+#include <libzeroskip/util.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+
+Suite *htable_suite(void);
+
+#define NUM_ENTRIES 10000
+
+struct test_entry {
+        struct htable_entry entry;
+        char key[16];
+        int value;
+};
+
+static struct htable ht;
+static struct test_entry *entries;
+
+static int test_entry_cmpfn(const void *unused1 _unused_,
+                            const void *entry1,
+                            const void *entry2,
+                            const void *unused2 _unused_)
+{
+        const struct test_entry *e1 = entry1;
+        const struct test_entry *e2 = entry2;
+
+        return strcmp(e1->key, e2->key);
+}
+
+/* `hash` overrides the hash of the key, if non 0, to force collisions */
+static void test_entry_init(struct test_entry *e, int i, unsigned int hash)
+{
+        snprintf(e->key, sizeof(e->key), "key%d", i);
+        e->value = i;
+        htable_entry_init(e, hash ? hash : bufhash(e->key, strlen(e->key)));
+}
+
+static struct test_entry *get(int i, unsigned int hash)
+{
+        struct test_entry k;
+
+        test_entry_init(&k, i, hash);
+
+        return htable_get(&ht, &k, NULL);
+}
+
+static struct test_entry *remove_entry(int i, unsigned int hash)
+{
+        struct test_entry k;
+
+        test_entry_init(&k, i, hash);
+
+        return htable_remove(&ht, &k, NULL);
+}
+
+static void setup(void)
+{
+        htable_init(&ht, test_entry_cmpfn, NULL, 0);
+        entries = xcalloc(NUM_ENTRIES, sizeof(struct test_entry));
+}
+
+static void teardown(void)
+{
+        htable_free(&ht, 0);
+        xfree(entries);
+}
+
+static void put_and_remove(unsigned int hash)
+{
+        int i;
+
+        for (i = 0; i < NUM_ENTRIES; i++) {
+                test_entry_init(&entries[i], i, hash);
+                htable_put(&ht, &entries[i]);
+        }
+        ck_assert_int_eq(ht.count, NUM_ENTRIES);
+        ck_assert_int_ge(ht.size, NUM_ENTRIES);
+
+        for (i = 0; i < NUM_ENTRIES; i++) {
+                struct test_entry *e = get(i, hash);
+                ck_assert_ptr_eq(e, &entries[i]);
+        }
+
+        /* Remove the odd ones */
+        for (i = 1; i < NUM_ENTRIES; i += 2) {
+                struct test_entry *e = remove_entry(i, hash);
+                ck_assert_ptr_eq(e, &entries[i]);
+        }
+        ck_assert_int_eq(ht.count, NUM_ENTRIES / 2);
+
+        for (i = 0; i < NUM_ENTRIES; i++) {
+                struct test_entry *e = get(i, hash);
+                if (i % 2)
+                        ck_assert_ptr_null(e);
+                else
+                        ck_assert_ptr_eq(e, &entries[i]);
+        }
+        ck_assert_ptr_null(remove_entry(1, hash));
+
+        /* And the rest, shrinking the table */
+        for (i = 0; i < NUM_ENTRIES; i += 2) {
+                struct test_entry *e = remove_entry(i, hash);
+                ck_assert_ptr_eq(e, &entries[i]);
+        }
+        ck_assert_int_eq(ht.count, 0);
+        ck_assert_int_lt(ht.size, NUM_ENTRIES);
+}
+
+START_TEST(test_htable_put_remove)
+{
+        put_and_remove(0);
+}
+END_TEST
+
+START_TEST(test_htable_collisions)
+{
+        /* Every entry probes from the same bucket */
+        put_and_remove(42);
+}
+END_TEST
+
+START_TEST(test_htable_duplicates)
+{
+        const void *e;
+        int i, found = 0;
+
+        /* A few others in the same bucket, before and after the duplicates */
+        for (i = 0; i < 8; i++) {
+                test_entry_init(&entries[i], i, 7);
+                htable_put(&ht, &entries[i]);
+        }
+
+        for (i = 8; i < 11; i++) {
+                test_entry_init(&entries[i], 100, 7);
+                htable_put(&ht, &entries[i]);
+        }
+
+        for (i = 11; i < 16; i++) {
+                test_entry_init(&entries[i], i, 7);
+                htable_put(&ht, &entries[i]);
+        }
+
+        for (e = get(100, 7); e; e = htable_get_next(&ht, e)) {
+                const struct test_entry *te = e;
+                ck_assert_int_eq(te->value, 100);
+                found++;
+        }
+        ck_assert_int_eq(found, 3);
+
+        /* Only one is removed at a time */
+        ck_assert_ptr_nonnull(remove_entry(100, 7));
+        ck_assert_ptr_nonnull(get(100, 7));
+        ck_assert_int_eq(ht.count, 15);
+}
+END_TEST
+
+START_TEST(test_htable_iter)
+{
+        struct htable_iter iter;
+        struct test_entry *e;
+        int i, count = 0;
+        long sum = 0;
+
+        for (i = 0; i < NUM_ENTRIES; i++) {
+                test_entry_init(&entries[i], i, 0);
+                htable_put(&ht, &entries[i]);
+        }
+
+        for (e = htable_iter_first(&ht, &iter); e; e = htable_iter_next(&iter)) {
+                count++;
+                sum += e->value;
+        }
+
+        ck_assert_int_eq(count, NUM_ENTRIES);
+        ck_assert_int_eq(sum, (long)NUM_ENTRIES * (NUM_ENTRIES - 1) / 2);
+}
+END_TEST
+
+START_TEST(test_htable_bufhash)
+{
+        const char buf[] = "abcdefghijklmnopqrstuvwxyz";
+        size_t i;
+
+        /* Lengths that differ only in a trailing NUL hash differently,
+         * and the hash doesn't depend on the alignment of the buffer */
+        for (i = 0; i < sizeof(buf) - 1; i++) {
+                char copy[sizeof(buf) + 1];
+
+                ck_assert_uint_ne(bufhash(buf, i), bufhash(buf, i + 1));
+
+                memcpy(copy + 1, buf, i);
+                ck_assert_uint_eq(bufhash(buf, i), bufhash(copy + 1, i));
+        }
+        ck_assert_uint_ne(bufhash("a", 1), bufhash("a\0", 2));
+}
+END_TEST
+
+Suite *htable_suite(void)
+{
+        Suite *s;
+        TCase *tc_core;
+
+        s = suite_create("htable");
+
+        tc_core = tcase_create("core");
+        tcase_add_checked_fixture(tc_core, setup, teardown);
+        tcase_add_test(tc_core, test_htable_put_remove);
+        tcase_add_test(tc_core, test_htable_collisions);
+        tcase_add_test(tc_core, test_htable_duplicates);
+        tcase_add_test(tc_core, test_htable_iter);
+        tcase_add_test(tc_core, test_htable_bufhash);
+        suite_add_tcase(s, tc_core);
+
+        return s;
+}
@@ -0,0 +1,244 @@
+/*
+ * zeroskip
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <libzeroskip/keymodel.h>
+#include <libzeroskip/macros.h>
+#include <libzeroskip/util.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+
+Suite *keymodel_suite(void);
+
+#define NUM_KEYS  100000
+#define MAX_ERROR 16
+
+static struct keymodel *model;
+static uint64_t *keys;
+
+static void setup(void)
+{
+        model = keymodel_new(MAX_ERROR);
+        keys = xcalloc(NUM_KEYS, sizeof(uint64_t));
+        srandom(NUM_KEYS);
+}
+
+static void teardown(void)
+{
+        keymodel_free(&model);
+        xfree(keys);
+}
+
+static uint64_t random64(void)
+{
+        return ((uint64_t)random() << 33) ^ ((uint64_t)random() << 11) ^
+                random();
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+        uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+        return x < y ? -1 : x > y;
+}
+
+static uint64_t lower_bound(uint64_t key)
+{
+        uint64_t lo = 0, hi = NUM_KEYS;
+
+        while (lo < hi) {
+                uint64_t mi = lo + (hi - lo) / 2;
+
+                if (keys[mi] < key)
+                        lo = mi + 1;
+                else
+                        hi = mi;
+        }
+
+        return lo;
+}
+
+static void check_window(uint64_t key)
+{
+        uint64_t lo, hi, pos = lower_bound(key);
+
+        keymodel_window(model, key, &lo, &hi);
+        ck_assert_uint_le(lo, pos);
+        ck_assert_uint_ge(hi, pos);
+        ck_assert_uint_le(hi, NUM_KEYS);
+}
+
+/* Builds the model of `keys`, and checks the windows of all of them, of
+ * the keys just before and after them and of random ones */
+static void build_and_check(void)
+{
+        int i;
+
+        for (i = 0; i < NUM_KEYS; i++)
+                keymodel_add(model, keys[i]);
+        keymodel_seal(model);
+
+        ck_assert_uint_eq(model->count, NUM_KEYS);
+        ck_assert_int_eq(model->unordered, 0);
+
+        for (i = 0; i < NUM_KEYS; i++) {
+                check_window(keys[i]);
+                check_window(keys[i] - 1);
+                check_window(keys[i] + 1);
+                check_window(random64());
+        }
+
+        check_window(0);
+        check_window(UINT64_MAX);
+}
+
+START_TEST(test_keymodel_sequential)
+{
+        uint64_t lo, hi;
+        int i;
+
+        for (i = 0; i < NUM_KEYS; i++)
+                keys[i] = 1000 + 3 * i;
+
+        build_and_check();
+        ck_assert_uint_eq(model->nsegs, 1);
+        ck_assert_uint_eq(keymodel_bytes(model),
+                          sizeof(struct keymodel) +
+                          sizeof(struct keymodel_segment));
+
+        keymodel_window(model, keys[NUM_KEYS / 2], &lo, &hi);
+        ck_assert_uint_le(hi - lo, 2 * MAX_ERROR + 4);
+}
+END_TEST
+
+START_TEST(test_keymodel_gaps)
+{
+        uint64_t key = 1;
+        int i;
+
+        /* UIDs, with some of them expunged */
+        for (i = 0; i < NUM_KEYS; i++) {
+                keys[i] = key;
+                key += 1 + random() % 16;
+        }
+
+        build_and_check();
+        ck_assert_uint_lt(model->nsegs, NUM_KEYS / 100);
+}
+END_TEST
+
+START_TEST(test_keymodel_random)
+{
+        int i;
+
+        for (i = 0; i < NUM_KEYS; i++)
+                keys[i] = random64();
+        qsort(keys, NUM_KEYS, sizeof(uint64_t), cmp_u64);
+
+        build_and_check();
+        ck_assert_uint_lt(model->nsegs, NUM_KEYS / 10);
+}
+END_TEST
+
+START_TEST(test_keymodel_strings)
+{
+        int i;
+
+        /* The prefixes of keys of decimal numbers, after the bytes they all
+         * start with, aren't on a line, but are on a few */
+        for (i = 0; i < NUM_KEYS; i++) {
+                char buf[16];
+                uint64_t k;
+
+                snprintf(buf, sizeof(buf), "%09d", i);
+                memcpy(&k, buf + 1, sizeof(k));
+                keys[i] = ntoh64(k);
+        }
+
+        build_and_check();
+        ck_assert_uint_lt(model->nsegs, NUM_KEYS / 10);
+}
+END_TEST
+
+START_TEST(test_keymodel_dups)
+{
+        uint64_t key = 100;
+        int i;
+
+        /* Keys with the same prefixes */
+        for (i = 0; i < NUM_KEYS; i++) {
+                keys[i] = key;
+                if (random() % 3 == 0)
+                        key += 1 + random() % 100;
+        }
+
+        build_and_check();
+        ck_assert_uint_gt(model->maxdups, 0);
+}
+END_TEST
+
+START_TEST(test_keymodel_unordered)
+{
+        uint64_t lo, hi;
+        int i;
+
+        for (i = 0; i < 100; i++)
+                keymodel_add(model, i % 10 ? i : 1000);
+        keymodel_seal(model);
+
+        /* Of no use, the whole of it is searched */
+        ck_assert_int_eq(model->unordered, 1);
+        keymodel_window(model, 50, &lo, &hi);
+        ck_assert_uint_eq(lo, 0);
+        ck_assert_uint_eq(hi, 100);
+}
+END_TEST
+
+START_TEST(test_keymodel_empty)
+{
+        uint64_t lo, hi;
+
+        keymodel_seal(model);
+        keymodel_window(model, 50, &lo, &hi);
+        ck_assert_uint_eq(lo, 0);
+        ck_assert_uint_eq(hi, 0);
+
+        /* One key */
+        keymodel_free(&model);
+        model = keymodel_new(MAX_ERROR);
+        keymodel_add(model, 42);
+        keymodel_seal(model);
+        keymodel_window(model, 42, &lo, &hi);
+        ck_assert_uint_eq(lo, 0);
+        ck_assert_uint_eq(hi, 1);
+}
+END_TEST
+
+Suite *keymodel_suite(void)
+{
+        Suite *s;
+        TCase *tc_core;
+
+        s = suite_create("keymodel");
+
+        tc_core = tcase_create("core");
+        tcase_add_checked_fixture(tc_core, setup, teardown);
+        tcase_add_test(tc_core, test_keymodel_sequential);
+        tcase_add_test(tc_core, test_keymodel_gaps);
+        tcase_add_test(tc_core, test_keymodel_random);
+        tcase_add_test(tc_core, test_keymodel_strings);
+        tcase_add_test(tc_core, test_keymodel_dups);
+        tcase_add_test(tc_core, test_keymodel_unordered);
+        tcase_add_test(tc_core, test_keymodel_empty);
+        suite_add_tcase(s, tc_core);
+
+        return s;
+}
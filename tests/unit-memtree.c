@@ -12,7 +12,15 @@
 
 #include <check.h>
 
+#if CHECK_MINOR_VERSION < 11
+#include <assert.h>
+#define ck_assert_mem_eq(a,b,c) assert(0 == memcmp(a,b,c))
+#endif
+
 #define NUMRECS 20
+#define SEQRECS 10000
+#define PFXRECS 1000
+#define PFX "user.alice.Archive.2019."
 
 Suite *memtree_suite(void);
 
@@ -56,6 +64,79 @@ START_TEST(test_memtree_insert_records)
 }
 END_TEST                        /* test_memtree_insert_records */
 
+START_TEST(test_memtree_sequential_insert)
+{
+        int i, ret, count = 0;
+        memtree_iter_t iter;
+        char key[16], val[16];
+        struct record *dup;
+        size_t bytes = tree->bytes;
+
+        /* Ascending keys take the right-edge append path */
+        for (i = 0; i < SEQRECS; i += 2) {
+                sprintf(key, "key%08d", i);
+                sprintf(val, "val%d", i);
+
+                ret = memtree_insert(tree,
+                                     record_new((const unsigned char *)key,
+                                                strlen(key),
+                                                (const unsigned char *)val,
+                                                strlen(val), 0));
+                ck_assert_int_eq(ret, MEMTREE_OK);
+        }
+
+        ck_assert_int_eq(tree->count, SEQRECS / 2);
+
+        /* Right edge splits leave full nodes behind, so the tree stays
+         * shallow */
+        ck_assert_int_le(tree->root->depth, 3);
+
+        /* Fill in the gaps, in descending order */
+        for (i = SEQRECS - 1; i > 0; i -= 2) {
+                sprintf(key, "key%08d", i);
+                sprintf(val, "val%d", i);
+
+                ret = memtree_insert(tree,
+                                     record_new((const unsigned char *)key,
+                                                strlen(key),
+                                                (const unsigned char *)val,
+                                                strlen(val), 0));
+                ck_assert_int_eq(ret, MEMTREE_OK);
+        }
+
+        ck_assert_int_eq(tree->count, SEQRECS);
+        ck_assert_uint_gt(tree->bytes, bytes + SEQRECS * sizeof(struct record));
+
+        memset(&iter, 0, sizeof(memtree_iter_t));
+        for (memtree_begin(tree, iter); memtree_next(iter);) {
+                sprintf(key, "key%08d", count);
+                ck_assert_int_eq(iter->record->keylen, strlen(key));
+                ck_assert_mem_eq(iter->record->key, key, strlen(key));
+                count++;
+        }
+        ck_assert_int_eq(count, SEQRECS);
+
+        /* Sequential inserts of existing keys are duplicates */
+        sprintf(key, "key%08d", SEQRECS - 1);
+        dup = record_new((const unsigned char *)key, strlen(key),
+                         (const unsigned char *)key, strlen(key), 0);
+        ret = memtree_insert(tree, dup);
+        ck_assert_int_eq(ret, MEMTREE_DUPLICATE);
+        record_free(dup);
+
+        for (i = 0; i < SEQRECS; i++) {
+                sprintf(key, "key%08d", i);
+                ck_assert_int_eq(memtree_find(tree, (unsigned char *)key,
+                                              strlen(key), iter), 1);
+                ret = memtree_remove(tree, (unsigned char *)key, strlen(key));
+                ck_assert_int_eq(ret, MEMTREE_OK);
+        }
+
+        ck_assert_int_eq(tree->count, 0);
+        ck_assert_uint_eq(tree->bytes, bytes);
+}
+END_TEST                        /* test_memtree_sequential_insert */
+
 START_TEST(test_memtree_insert_duplicate_record)
 {
         struct record *recs[NUMRECS];
@@ -140,11 +221,6 @@ struct mboxkvrec {
         { (const unsigned char *)MBK5, MBK5L, (const unsigned char *)MBV1, VL },
 };
 
-#if CHECK_MINOR_VERSION < 11
-#include <assert.h>
-#define ck_assert_mem_eq(a,b,c) assert(0 == memcmp(a,b,c))
-#endif
-
 START_TEST(test_memtree_mbox_name)
 {
         size_t i;
@@ -210,6 +286,275 @@ START_TEST(test_memtree_iter)
 }
 END_TEST                        /* test_memtree_iter */
 
+static void iter_insert(const char *key, const char *val, int replace)
+{
+        struct record *rec;
+        int ret;
+
+        rec = record_new((const unsigned char *)key, strlen(key),
+                         (const unsigned char *)val, strlen(val), 0);
+        ret = memtree_insert_opt(tree, rec, replace);
+        ck_assert_int_eq(ret, MEMTREE_OK);
+}
+
+START_TEST(test_memtree_iter_inserts)
+{
+        memtree_iter_t iter;
+        char key[24];
+        size_t i, n = 0;
+
+        /* The even keys to begin with */
+        for (i = 0; i < SEQRECS; i += 2) {
+                sprintf(key, "key%06zu", i);
+                iter_insert(key, "old", 0);
+        }
+
+        /* Each even key adds the odd one after it, and replaces the value
+         * of the next even one, splitting nodes all along the way. The
+         * iter carries on through all of it. */
+        memset(iter, 0, sizeof(memtree_iter_t));
+        for (memtree_begin(tree, iter); memtree_next(iter); n++) {
+                sprintf(key, "key%06zu", n);
+                ck_assert_uint_eq(iter->record->keylen, strlen(key));
+                ck_assert_mem_eq(iter->record->key, key, strlen(key));
+
+                if (n % 2)
+                        continue;
+
+                if (n)
+                        ck_assert_mem_eq(iter->record->val, "new", 3);
+                if (n == SEQRECS)
+                        continue;
+
+                sprintf(key, "key%06zu", n + 1);
+                iter_insert(key, "odd", 0);
+                sprintf(key, "key%06zu", n + 2);
+                iter_insert(key, "new", 1);
+        }
+        ck_assert_uint_eq(n, SEQRECS + 1);
+
+        /* The last even key was added past the end, and so is any key
+         * once the iter is done */
+        sprintf(key, "key%06zu", (size_t)SEQRECS + 5);
+        iter_insert(key, "end", 0);
+        ck_assert_int_eq(memtree_next(iter), 1);
+        ck_assert_mem_eq(iter->record->key, key, strlen(key));
+        ck_assert_int_eq(memtree_next(iter), 0);
+}
+END_TEST                        /* test_memtree_iter_inserts */
+
+START_TEST(test_memtree_key_prefix)
+{
+        memtree_iter_t iter;
+        char key[64];
+        int i, ret;
+
+        /* Hierarchical keys, in no particular order */
+        for (i = 0; i < PFXRECS; i++) {
+                struct record *rec;
+
+                sprintf(key, PFX "%05d", (i * 7) % PFXRECS);
+                rec = record_new((const unsigned char *)key, strlen(key),
+                                 (const unsigned char *)"v", 1, 0);
+                ret = memtree_insert(tree, rec);
+                ck_assert_int_eq(ret, MEMTREE_OK);
+        }
+
+        for (i = 0; i < PFXRECS; i++) {
+                sprintf(key, PFX "%05d", i);
+                memset(iter, 0, sizeof(memtree_iter_t));
+                ret = memtree_find(tree, (const unsigned char *)key,
+                                   strlen(key), iter);
+                ck_assert_int_eq(ret, 1);
+                ck_assert_mem_eq(iter->record->key, key, strlen(key));
+
+                if (!iter->node->depth)
+                        ck_assert_uint_ge(iter->node->prefixlen,
+                                          strlen(PFX));
+        }
+
+        /* Keys sorting before, within and after the shared prefix */
+        memset(iter, 0, sizeof(memtree_iter_t));
+        ret = memtree_find(tree, (const unsigned char *)"user.alice",
+                           strlen("user.alice"), iter);
+        ck_assert_int_eq(ret, 0);
+        ck_assert_int_eq(memtree_deref(iter), 1);
+        ck_assert_mem_eq(iter->record->key, PFX "00000",
+                         strlen(PFX "00000"));
+
+        memset(iter, 0, sizeof(memtree_iter_t));
+        ret = memtree_find(tree, (const unsigned char *)PFX "00500x",
+                           strlen(PFX "00500x"), iter);
+        ck_assert_int_eq(ret, 0);
+        ck_assert_int_eq(memtree_deref(iter), 1);
+        ck_assert_mem_eq(iter->record->key, PFX "00501",
+                         strlen(PFX "00501"));
+
+        memset(iter, 0, sizeof(memtree_iter_t));
+        ret = memtree_find(tree, (const unsigned char *)"user.bob",
+                           strlen("user.bob"), iter);
+        ck_assert_int_eq(ret, 0);
+        ck_assert_int_eq(memtree_deref(iter), 0);
+
+        /* Removing records changes the prefixes of the nodes */
+        for (i = 0; i < PFXRECS; i += 2) {
+                sprintf(key, PFX "%05d", i);
+                ret = memtree_remove(tree, (unsigned char *)key, strlen(key));
+                ck_assert_int_eq(ret, MEMTREE_OK);
+        }
+
+        for (i = 0; i < PFXRECS; i++) {
+                sprintf(key, PFX "%05d", i);
+                memset(iter, 0, sizeof(memtree_iter_t));
+                ret = memtree_find(tree, (const unsigned char *)key,
+                                   strlen(key), iter);
+                ck_assert_int_eq(ret, i % 2);
+        }
+
+        ck_assert_int_eq(tree->count, PFXRECS / 2);
+}
+END_TEST                        /* test_memtree_key_prefix */
+
+static int cmp_recs(const void *a, const void *b)
+{
+        const struct record *r1 = *(struct record * const *)a;
+        const struct record *r2 = *(struct record * const *)b;
+
+        return memcmp_raw(r1->key, r1->keylen, r2->key, r2->keylen);
+}
+
+START_TEST(test_memtree_memcmp_raw)
+{
+        struct record *recs[PFXRECS];
+        char key[64];
+        int i, j;
+
+        /* Keys sharing prefixes of all lengths, some of them prefixes of
+         * others, for the search to skip different numbers of bytes */
+        for (i = 0; i < PFXRECS; i++) {
+                sprintf(key, PFX "%0*d", 1 + i % 13, i);
+                recs[i] = record_new((const unsigned char *)key, strlen(key),
+                                     (const unsigned char *)"v", 1, 0);
+        }
+        qsort(recs, PFXRECS, sizeof(struct record *), cmp_recs);
+
+        for (i = 0; i < 3 * PFXRECS; i++) {
+                const struct record *r = recs[i / 3];
+                unsigned int pos;
+                size_t len = r->keylen;
+                int found = 0, c = 1;
+
+                /* The key, one just before it and one just after */
+                memcpy(key, r->key, len);
+                if (i % 3 == 1)
+                        key[len - 1]--;
+                else if (i % 3 == 2)
+                        key[len++] = '\0';
+
+                pos = memtree_memcmp_raw((const unsigned char *)key, len,
+                                         recs, PFXRECS, &found);
+
+                for (j = 0; j < PFXRECS; j++) {
+                        c = memcmp_raw(recs[j]->key, recs[j]->keylen,
+                                       key, len);
+                        if (c >= 0)
+                                break;
+                }
+                ck_assert_uint_eq(pos, j);
+                ck_assert_int_eq(found, j < PFXRECS && c == 0);
+        }
+
+        for (i = 0; i < PFXRECS; i++)
+                record_free(recs[i]);
+}
+END_TEST                        /* test_memtree_memcmp_raw */
+
+/* Checks the links between the nodes, and that all leaves are at depth 0 */
+static void check_node(struct memtree_node *node)
+{
+        uint32_t i;
+
+        ck_assert_uint_le(node->count, MEMTREE_MAX_ELEMENTS);
+
+        if (!node->depth)
+                return;
+
+        for (i = 0; i <= node->count; i++) {
+                ck_assert_ptr_eq(node->branches[i]->parent, node);
+                ck_assert_uint_eq(node->branches[i]->pos, i);
+                ck_assert_uint_eq(node->branches[i]->depth, node->depth - 1);
+                check_node(node->branches[i]);
+        }
+}
+
+START_TEST(test_memtree_build)
+{
+        static const size_t sizes[] = { 1, 10, 11, 21, 122, 1331, SEQRECS };
+        size_t t;
+
+        for (t = 0; t < ARRAY_SIZE(sizes); t++) {
+                size_t n = sizes[t], i, bytes;
+                struct record **recs;
+                struct memtree *mt;
+                memtree_iter_t iter;
+                char key[24], val[24];
+                int ret;
+
+                mt = memtree_new(NULL, NULL);
+                bytes = mt->bytes;
+
+                /* Every key twice, in no particular order, the second time
+                 * with the value that should win */
+                recs = xmalloc(2 * n * sizeof(struct record *));
+                for (i = 0; i < 2 * n; i++) {
+                        size_t k = (i * 7919) % n;
+
+                        sprintf(key, "key%06zu", k);
+                        sprintf(val, "%s%zu", i < n ? "old" : "new", k);
+                        recs[i] = record_new((const unsigned char *)key,
+                                             strlen(key),
+                                             (const unsigned char *)val,
+                                             strlen(val), 0);
+                }
+
+                ret = memtree_build(mt, recs, 2 * n);
+                ck_assert_int_eq(ret, MEMTREE_OK);
+                ck_assert_uint_eq(mt->count, n);
+                check_node(mt->root);
+
+                i = 0;
+                memset(iter, 0, sizeof(memtree_iter_t));
+                for (memtree_begin(mt, iter); memtree_next(iter); i++) {
+                        sprintf(key, "key%06zu", i);
+                        sprintf(val, "new%zu", i);
+                        ck_assert_mem_eq(iter->record->key, key, strlen(key));
+                        ck_assert_uint_eq(iter->record->vallen, strlen(val));
+                        ck_assert_mem_eq(iter->record->val, val, strlen(val));
+                }
+                ck_assert_uint_eq(i, n);
+
+                /* A built tree is a tree like any other */
+                for (i = 0; i < n; i++) {
+                        sprintf(key, "key%06zu", i);
+                        ret = memtree_remove(mt, (unsigned char *)key,
+                                             strlen(key));
+                        ck_assert_int_eq(ret, MEMTREE_OK);
+                }
+                ck_assert_uint_eq(mt->count, 0);
+                ck_assert_uint_eq(mt->bytes, bytes);
+
+                /* ..and only an empty one can be built */
+                recs[0] = record_new((const unsigned char *)"k", 1,
+                                     (const unsigned char *)"v", 1, 0);
+                ck_assert_int_eq(memtree_insert(mt, recs[0]), MEMTREE_OK);
+                ck_assert_int_eq(memtree_build(mt, recs, 1), MEMTREE_INVALID);
+
+                xfree(recs);
+                memtree_free(mt);
+        }
+}
+END_TEST                        /* test_memtree_build */
+
 Suite *memtree_suite(void)
 {
         Suite *s;
@@ -226,6 +571,10 @@ Suite *memtree_suite(void)
         tcase_add_test(tc_core, test_memtree_create);
         tcase_add_test(tc_core, test_memtree_insert_records);
         tcase_add_test(tc_core, test_memtree_insert_duplicate_record);
+        tcase_add_test(tc_core, test_memtree_sequential_insert);
+        tcase_add_test(tc_core, test_memtree_key_prefix);
+        tcase_add_test(tc_core, test_memtree_memcmp_raw);
+        tcase_add_test(tc_core, test_memtree_build);
 
         suite_add_tcase(s, tc_core);
 
@@ -242,6 +591,7 @@ Suite *memtree_suite(void)
         tcase_add_checked_fixture(tc_iter, setup, teardown);
 
         tcase_add_test(tc_iter, test_memtree_iter);
+        tcase_add_test(tc_iter, test_memtree_iter_inserts);
 
         suite_add_tcase(s, tc_iter);
 
@@ -0,0 +1,245 @@
+/*
+ * zeroskip
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <libzeroskip/arena.h>
+#include <libzeroskip/macros.h>
+#include <libzeroskip/offidx.h>
+#include <libzeroskip/util.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+
+Suite *offidx_suite(void);
+
+#define NUM_OFFSETS 100000
+
+static struct offidx *idx;
+static uint64_t *offsets;
+static uint64_t foreach_pos;
+static int foreach_bad;
+
+static void setup(void)
+{
+        idx = offidx_new();
+        offsets = xcalloc(NUM_OFFSETS, sizeof(uint64_t));
+        foreach_pos = 0;
+        foreach_bad = 0;
+}
+
+static void teardown(void)
+{
+        offidx_free(&idx);
+        xfree(offsets);
+}
+
+/* Offsets of records of around `reclen` bytes, with the odd huge one every
+ * `every` records, if not 0 */
+static void gen_offsets(uint64_t reclen, uint64_t huge, int every)
+{
+        uint64_t off = 64;
+        int i;
+
+        srandom(NUM_OFFSETS);
+        for (i = 0; i < NUM_OFFSETS; i++) {
+                offsets[i] = off;
+                off += reclen / 2 + random() % reclen;
+                if (every && i % every == every - 1)
+                        off += huge;
+        }
+}
+
+static void check(int n)
+{
+        int i;
+
+        ck_assert_uint_eq(offidx_count(idx), n);
+        for (i = 0; i < n; i++)
+                ck_assert_uint_eq(offidx_get(idx, i), offsets[i]);
+
+        /* Past the end */
+        ck_assert_uint_eq(offidx_get(idx, n), 0);
+}
+
+static void append_and_check(int n)
+{
+        int i;
+
+        for (i = 0; i < n; i++)
+                offidx_append(idx, offsets[i]);
+
+        check(n);
+}
+
+static int foreach_cb(void *data _unused_, uint64_t offset)
+{
+        if (offsets[foreach_pos++] != offset)
+                foreach_bad++;
+
+        return 0;
+}
+
+START_TEST(test_offidx_small_records)
+{
+        gen_offsets(100, 0, 0);
+        append_and_check(NUM_OFFSETS);
+
+        offidx_seal(idx);
+        check(NUM_OFFSETS);
+
+        /* All 16 bit deltas, the index is under a third of a vecu64 */
+        ck_assert_uint_lt(offidx_bytes(idx),
+                          NUM_OFFSETS * sizeof(uint64_t) / 3);
+}
+END_TEST
+
+START_TEST(test_offidx_wide_deltas)
+{
+        /* Blocks with 32 and 64 bit deltas, mixed with 16 bit ones */
+        gen_offsets(50, 100000, 100);
+        offsets[NUM_OFFSETS / 2] += 1ULL << 40;
+        offsets[NUM_OFFSETS / 2 + 1] += 1ULL << 41;
+        append_and_check(NUM_OFFSETS);
+
+        offidx_seal(idx);
+        check(NUM_OFFSETS);
+}
+END_TEST
+
+START_TEST(test_offidx_seal_and_append)
+{
+        int i;
+
+        gen_offsets(200, 0, 0);
+
+        /* Seal at the end of full and partial blocks, and keep going */
+        for (i = 0; i < 1000; i++) {
+                offidx_append(idx, offsets[i]);
+                if (i % 37 == 0 || i % OFFIDX_BLOCK_SIZE == 0)
+                        offidx_seal(idx);
+        }
+        offidx_seal(idx);
+
+        ck_assert_uint_eq(offidx_count(idx), 1000);
+        ck_assert_ptr_null(idx->tail);
+        for (i = 0; i < 1000; i++)
+                ck_assert_uint_eq(offidx_get(idx, i), offsets[i]);
+}
+END_TEST
+
+START_TEST(test_offidx_unordered)
+{
+        int i;
+
+        /* Not what the packed files have, but still works */
+        for (i = 0; i < 1000; i++)
+                offsets[i] = (uint64_t)random() * random();
+
+        append_and_check(1000);
+        offidx_seal(idx);
+        check(1000);
+}
+END_TEST
+
+START_TEST(test_offidx_foreach)
+{
+        gen_offsets(300, 0, 0);
+
+        /* Empty */
+        ck_assert_int_eq(offidx_foreach(idx, foreach_cb, NULL), 0);
+
+        /* Full blocks and a tail */
+        append_and_check(1000);
+        ck_assert_int_eq(offidx_foreach(idx, foreach_cb, NULL), 1);
+        ck_assert_uint_eq(foreach_pos, 1000);
+        ck_assert_int_eq(foreach_bad, 0);
+
+        /* And sealed */
+        offidx_seal(idx);
+        foreach_pos = 0;
+        offidx_foreach(idx, foreach_cb, NULL);
+        ck_assert_uint_eq(foreach_pos, 1000);
+        ck_assert_int_eq(foreach_bad, 0);
+}
+END_TEST
+
+START_TEST(test_offidx_mapped)
+{
+        uint64_t *be;
+        int i;
+
+        gen_offsets(100, 0, 0);
+
+        /* As in the pointer section of a packed file */
+        be = xcalloc(1000, sizeof(uint64_t));
+        for (i = 0; i < 1000; i++)
+                be[i] = hton64(offsets[i]);
+
+        offidx_free(&idx);
+        idx = offidx_new_mapped((unsigned char *)be, 1000);
+        check(1000);
+
+        offidx_foreach(idx, foreach_cb, NULL);
+        ck_assert_uint_eq(foreach_pos, 1000);
+        ck_assert_int_eq(foreach_bad, 0);
+
+        /* Nothing of it is copied */
+        offidx_seal(idx);
+        ck_assert_uint_eq(offidx_bytes(idx), sizeof(struct offidx));
+
+        offidx_free(&idx);
+        xfree(be);
+}
+END_TEST
+
+START_TEST(test_offidx_arena)
+{
+        struct arena *arena;
+        int i;
+
+        arena = arena_new(0);
+        offidx_free(&idx);
+        idx = offidx_new_arena(arena);
+
+        gen_offsets(100, 0, 0);
+        offidx_reserve(idx, NUM_OFFSETS);
+        for (i = 0; i < NUM_OFFSETS; i++)
+                offidx_append(idx, offsets[i]);
+        offidx_seal(idx);
+
+        for (i = 0; i < NUM_OFFSETS; i++)
+                ck_assert_uint_eq(offidx_get(idx, i), offsets[i]);
+
+        offidx_free(&idx);
+        ck_assert_uint_eq(arena->mapped, ARENA_CHUNK_SIZE);
+        arena_destroy(&arena);
+}
+END_TEST
+
+Suite *offidx_suite(void)
+{
+        Suite *s;
+        TCase *tc_core;
+
+        s = suite_create("offidx");
+
+        tc_core = tcase_create("core");
+        tcase_add_checked_fixture(tc_core, setup, teardown);
+        tcase_add_test(tc_core, test_offidx_small_records);
+        tcase_add_test(tc_core, test_offidx_wide_deltas);
+        tcase_add_test(tc_core, test_offidx_seal_and_append);
+        tcase_add_test(tc_core, test_offidx_unordered);
+        tcase_add_test(tc_core, test_offidx_foreach);
+        tcase_add_test(tc_core, test_offidx_mapped);
+        tcase_add_test(tc_core, test_offidx_arena);
+        suite_add_tcase(s, tc_core);
+
+        return s;
+}
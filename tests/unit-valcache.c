@@ -0,0 +1,199 @@
+/*
+ * zeroskip
+ *
+ * zeroskip is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ *
+ */
+
+#include <libzeroskip/bloom.h>
+#include <libzeroskip/macros.h>
+#include <libzeroskip/util.h>
+#include <libzeroskip/valcache.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+
+#if CHECK_MINOR_VERSION < 11
+#include <assert.h>
+#define ck_assert_mem_eq(a,b,c) assert(0 == memcmp(a,b,c))
+#endif
+
+Suite *valcache_suite(void);
+
+#define BUDGET  (64 * 1024)
+#define VALLEN  100
+
+static struct valcache *cache;
+
+static void setup(void)
+{
+        cache = valcache_new(BUDGET);
+}
+
+static void teardown(void)
+{
+        valcache_free(&cache);
+}
+
+static size_t make_key(char *key, const char *prefix, int i)
+{
+        return sprintf(key, "%s%d", prefix, i);
+}
+
+/* Looks `i` up, and puts its value in if it isn't there, as zsdb_fetch()
+ * does. 1 if it was there */
+static int lookup(const char *prefix, int i)
+{
+        const unsigned char *value;
+        unsigned char val[VALLEN];
+        size_t len, vallen = 0;
+        char key[32];
+
+        len = make_key(key, prefix, i);
+        if (valcache_get(cache, (unsigned char *)key, len,
+                         bloom_hash(key, len), &value, &vallen)) {
+                memset(val, i % 256, VALLEN);
+                ck_assert_uint_eq(vallen, VALLEN);
+                ck_assert_mem_eq(value, val, VALLEN);
+                return 1;
+        }
+
+        memset(val, i % 256, VALLEN);
+        valcache_put(cache, (unsigned char *)key, len, bloom_hash(key, len),
+                     val, VALLEN);
+
+        return 0;
+}
+
+START_TEST(test_valcache_get_put)
+{
+        struct valcache_stats stats;
+        int i;
+
+        for (i = 0; i < 100; i++)
+                ck_assert_int_eq(lookup("key", i), 0);
+        for (i = 0; i < 100; i++)
+                ck_assert_int_eq(lookup("key", i), 1);
+
+        valcache_get_stats(cache, &stats);
+        ck_assert_uint_eq(stats.hits, 100);
+        ck_assert_uint_eq(stats.misses, 100);
+        ck_assert_uint_eq(stats.admitted, 100);
+        ck_assert_uint_eq(stats.entries, 100);
+        ck_assert_uint_le(stats.bytes, BUDGET);
+        ck_assert_uint_eq(stats.budget, BUDGET);
+}
+END_TEST
+
+START_TEST(test_valcache_budget)
+{
+        struct valcache_stats stats;
+        unsigned char big[BUDGET / 4];
+        int i;
+
+        /* Many more keys than fit, each looked up a couple of times */
+        for (i = 0; i < 10000; i++) {
+                lookup("key", i);
+                lookup("key", i);
+                valcache_get_stats(cache, &stats);
+                ck_assert_uint_le(stats.bytes - cache->retiredbytes, BUDGET);
+                valcache_reclaim(cache);
+        }
+
+        valcache_get_stats(cache, &stats);
+        ck_assert_uint_gt(stats.evicted, 0);
+        ck_assert_uint_lt(stats.entries, 10000);
+
+        /* Values too big for the cache aren't put in */
+        memset(big, 0, sizeof(big));
+        ck_assert_int_eq(valcache_put(cache, (const unsigned char *)"big", 3,
+                                      bloom_hash("big", 3), big,
+                                      sizeof(big)), 0);
+}
+END_TEST
+
+START_TEST(test_valcache_admission)
+{
+        int i, j, hits = 0;
+
+        /* The hot keys, looked up again and again */
+        for (j = 0; j < 10; j++)
+                for (i = 0; i < 100; i++)
+                        lookup("hot", i);
+
+        /* ..aren't pushed out by keys looked up once each */
+        for (i = 0; i < 10000; i++) {
+                lookup("cold", i);
+                if (i % 1000 == 0)
+                        valcache_reclaim(cache);
+        }
+
+        for (i = 0; i < 100; i++)
+                hits += lookup("hot", i);
+        ck_assert_int_ge(hits, 90);
+        ck_assert_uint_gt(cache->stats.rejected, 0);
+}
+END_TEST
+
+START_TEST(test_valcache_remove)
+{
+        const unsigned char *value;
+        struct valcache_stats stats;
+        size_t vallen = 0;
+        char key[32];
+        size_t len;
+        int i;
+
+        for (i = 0; i < 100; i++)
+                lookup("key", i);
+
+        /* A value dropped stays good until it is reclaimed */
+        len = make_key(key, "key", 42);
+        ck_assert_int_eq(valcache_get(cache, (unsigned char *)key, len,
+                                      bloom_hash(key, len), &value,
+                                      &vallen), 1);
+        valcache_remove(cache, (unsigned char *)key, len,
+                        bloom_hash(key, len));
+        ck_assert_uint_eq(value[0], 42);
+        ck_assert_int_eq(lookup("key", 42), 0);
+
+        /* A new generation drops all of them */
+        valcache_sync(cache, 1);
+        valcache_get_stats(cache, &stats);
+        ck_assert_uint_eq(stats.entries, 0);
+        ck_assert_uint_eq(stats.invalidated, 101);
+        ck_assert_uint_gt(stats.bytes, 0);
+        ck_assert_int_eq(lookup("key", 7), 0);
+
+        valcache_sync(cache, 1);
+        ck_assert_int_eq(lookup("key", 7), 1);
+
+        valcache_reclaim(cache);
+        valcache_get_stats(cache, &stats);
+        ck_assert_uint_eq(stats.entries, 1);
+        ck_assert_uint_lt(stats.bytes, 2 * (sizeof(struct valcache_entry) +
+                                           VALLEN + 32));
+}
+END_TEST
+
+Suite *valcache_suite(void)
+{
+        Suite *s;
+        TCase *tc_core;
+
+        s = suite_create("valcache");
+
+        tc_core = tcase_create("core");
+        tcase_add_checked_fixture(tc_core, setup, teardown);
+        tcase_add_test(tc_core, test_valcache_get_put);
+        tcase_add_test(tc_core, test_valcache_budget);
+        tcase_add_test(tc_core, test_valcache_admission);
+        tcase_add_test(tc_core, test_valcache_remove);
+        suite_add_tcase(s, tc_core);
+
+        return s;
+}
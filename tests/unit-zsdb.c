@@ -10,14 +10,18 @@
 #include <libzeroskip/zeroskip.h>
 #include <libzeroskip/macros.h>
 #include <libzeroskip/log.h>
+#include <libzeroskip/mfile.h>
 #include <libzeroskip/util.h>
 
 #include <assert.h>
 #include <error.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <check.h>
 
@@ -131,6 +135,19 @@ static void setup(void)
         ck_assert_int_eq(ret, ZS_OK);
 }
 
+static void setup_threaded(void)
+{
+        int ret;
+
+        basedir = get_basedir();
+
+        ret = zsdb_init(&db, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        ret = zsdb_open(db, basedir, MODE_CREATE | MODE_THREADED);
+        ck_assert_int_eq(ret, ZS_OK);
+}
+
 static void teardown(void)
 {
         int ret;
@@ -239,6 +256,51 @@ START_TEST(test_abort_transaction)
 }
 END_TEST
 
+START_TEST(test_memory_usage)
+{
+        struct zsdb_txn *txn = NULL;
+        struct zsdb_memory_usage usage;
+        size_t i;
+        int ret;
+
+        ret = zsdb_memory_usage(db, &usage);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_eq(usage.niterators, 0);
+        ck_assert_uint_eq(usage.iterators, 0);
+
+        zsdb_write_lock_acquire(db, 0);
+        for (i = 0; i < ARRAY_SIZE(kvrecsgen); i++) {
+                ret = zsdb_add(db, kvrecsgen[i].k, kvrecsgen[i].klen,
+                               kvrecsgen[i].v, kvrecsgen[i].vlen, &txn);
+                ck_assert_int_eq(ret, ZS_OK);
+        }
+        ret = zsdb_commit(db, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+
+        ret = zsdb_memory_usage(db, &usage);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_gt(usage.memtree, 0);
+        ck_assert_uint_eq(usage.heap, usage.memtree + usage.fmemtree +
+                          usage.frozen + usage.index + usage.iterators);
+        ck_assert_uint_gt(usage.mapped_active, 0);
+        ck_assert_uint_eq(usage.mapped, usage.mapped_active +
+                          usage.mapped_finalised + usage.mapped_packed);
+        ck_assert_uint_le(usage.resident, usage.mapped);
+
+        /* Iterators are accounted for only while they are open */
+        record_count = 0;
+        ret = zsdb_foreach(db, NULL, 0, count_fe_p, NULL, NULL, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(record_count, ARRAY_SIZE(kvrecsgen));
+
+        ret = zsdb_memory_usage(db, &usage);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_eq(usage.niterators, 0);
+        ck_assert_uint_eq(usage.iterators, 0);
+}
+END_TEST
+
 START_TEST(test_delete)
 {
         struct zsdb_txn *txn;
@@ -403,81 +465,1770 @@ START_TEST(test_multiopen)
         /* Acquire write lock */
         zsdb_write_lock_acquire(db, 0);
 
-        ret = zsdb_add(db, kvmultiopen[2].k, kvmultiopen[2].klen,
-                       kvmultiopen[2].v, kvmultiopen[2].vlen, NULL);
-        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_add(db, kvmultiopen[2].k, kvmultiopen[2].klen,
+                       kvmultiopen[2].v, kvmultiopen[2].vlen, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        /* Commit the add record transaction */
+        zsdb_commit(db, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        /* Release write lock */
+        zsdb_write_lock_release(db);
+
+        /** CLOSE first instance of the DB **/
+        ret = zsdb_close(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_final(&db);
+
+        /** REOPEN DB **/
+        ret = zsdb_init(&db, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        ret = zsdb_open(db, basedir, MODE_RDWR);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        /** COUNT RECORDS **/
+        record_count = 0;
+        ret = zsdb_foreach(db, NULL, 0, count_fe_p, NULL, NULL, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(record_count, ARRAY_SIZE(kvmultiopen));
+}
+END_TEST
+
+START_TEST(test_many_records)
+{
+        struct zsdb_txn *txn;
+        size_t i, NUM_RECS;
+        int ret;
+
+        NUM_RECS = 4096;
+
+        txn = NULL;
+
+        /* Begin transaction */
+        ret = zsdb_transaction_begin(db, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        /* Acquire write lock */
+        zsdb_write_lock_acquire(db, 0);
+
+        /* Add 4096 records */
+        for (i = 0; i < NUM_RECS; i++) {
+                unsigned char key[24], val[24];
+
+                snprintf((char *)key, 8, "key%zu", i);
+                snprintf((char *)val, 8, "val%zu", i);
+
+                ret = zsdb_add(db, key, strlen((char *)key), val,
+                               strlen((char *)val), &txn);
+                ck_assert_int_eq(ret, ZS_OK);
+        }
+
+        /* Commit the add records transaction */
+        zsdb_commit(db, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        /* Release write lock */
+        zsdb_write_lock_release(db);
+
+        zsdb_transaction_end(&txn);
+
+        /* Count records */
+        record_count = 0;
+        txn = NULL;
+        ret = zsdb_foreach(db, NULL, 0, count_fe_p, NULL, NULL, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(record_count, NUM_RECS);
+}
+END_TEST
+
+#define BUDGET_BYTES (64 * 1024)
+#define BUDGET_TXNS 256
+#define BUDGET_RECS_PER_TXN 16
+
+static int count_db_files(void)
+{
+        struct str_array files;
+        char *const paths[] = { basedir, NULL };
+        int count;
+
+        str_array_init(&files);
+        get_filenames_with_matching_prefix(paths, "zeroskip-", &files, 0);
+        count = files.count;
+        str_array_clear(&files);
+
+        return count;
+}
+
+/* Adds records in many small transactions, to a DB with a small memory
+ * budget, which should have them flushed to packed files.
+ */
+static void memory_budget_fill(void)
+{
+        struct zsdb_txn *txn = NULL;
+        size_t i, j;
+        int ret;
+
+        ret = zsdb_set_memory_budget(db, BUDGET_BYTES);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        for (i = 0; i < BUDGET_TXNS; i++) {
+                ret = zsdb_write_lock_acquire(db, 1000);
+                ck_assert_int_eq(ret, ZS_OK);
+
+                for (j = 0; j < BUDGET_RECS_PER_TXN; j++) {
+                        unsigned char key[24], val[64];
+
+                        snprintf((char *)key, sizeof(key), "key%06zu",
+                                 i * BUDGET_RECS_PER_TXN + j);
+                        snprintf((char *)val, sizeof(val),
+                                 "value-for-the-memory-budget-%zu", i);
+
+                        ret = zsdb_add(db, key, strlen((char *)key), val,
+                                       strlen((char *)val), &txn);
+                        ck_assert_int_eq(ret, ZS_OK);
+                }
+
+                ret = zsdb_commit(db, &txn);
+                ck_assert_int_eq(ret, ZS_OK);
+
+                zsdb_write_lock_release(db);
+        }
+}
+
+static void memory_budget_verify(void)
+{
+        struct zsdb_txn *txn = NULL;
+        size_t i;
+        int ret;
+
+        for (i = 0; i < BUDGET_TXNS * BUDGET_RECS_PER_TXN; i++) {
+                unsigned char key[24];
+                const unsigned char *value = NULL;
+                size_t vallen = 0;
+
+                snprintf((char *)key, sizeof(key), "key%06zu", i);
+                ret = zsdb_fetch(db, key, strlen((char *)key), &value,
+                                 &vallen, &txn);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_ptr_ne(value, NULL);
+        }
+
+        record_count = 0;
+        ret = zsdb_foreach(db, NULL, 0, count_fe_p, NULL, NULL, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(record_count, BUDGET_TXNS * BUDGET_RECS_PER_TXN);
+}
+
+START_TEST(test_memory_budget)
+{
+        memory_budget_fill();
+
+        /* The records should have been flushed to packed files, and none
+         * of them lost */
+        ck_assert_int_gt(count_db_files(), 1);
+
+        memory_budget_verify();
+}
+END_TEST
+
+START_TEST(test_memory_budget_threaded)
+{
+        int i;
+
+        memory_budget_fill();
+
+        /* The flusher runs in the background */
+        for (i = 0; i < 500 && count_db_files() < 2; i++)
+                sleep_ms(10);
+        ck_assert_int_gt(count_db_files(), 1);
+
+        memory_budget_verify();
+}
+END_TEST
+
+#define ROLLOVER_RECS 5000
+#define ROLLOVER_RECS_PER_TXN 500
+#define ROLLOVER_VALLEN 1000
+
+static int count_db_files_ending(const char *suffix)
+{
+        struct str_array files;
+        char *const paths[] = { basedir, NULL };
+        size_t len = strlen(suffix);
+        int i, count = 0;
+
+        str_array_init(&files);
+        get_filenames_with_matching_prefix(paths, "zeroskip-", &files, 0);
+        for (i = 0; i < files.count; i++) {
+                size_t flen = strlen(files.datav[i]);
+                if (flen >= len &&
+                    strcmp(files.datav[i] + flen - len, suffix) == 0)
+                        count++;
+        }
+        str_array_clear(&files);
+
+        return count;
+}
+
+static void rollover_value(size_t i, unsigned char *val)
+{
+        memset(val, 'a' + i % 26, ROLLOVER_VALLEN);
+        snprintf((char *)val, 16, "%zu", i);
+}
+
+/* All the records but the first, which was removed, are there */
+static void rollover_verify(void)
+{
+        struct zsdb_txn *txn = NULL;
+        unsigned char key[24], val[ROLLOVER_VALLEN];
+        size_t i;
+        int ret;
+
+        for (i = 0; i < ROLLOVER_RECS; i++) {
+                const unsigned char *value = NULL;
+                size_t vallen = 0;
+
+                snprintf((char *)key, sizeof(key), "key%06zu", i);
+                ret = zsdb_fetch(db, key, strlen((char *)key), &value,
+                                 &vallen, &txn);
+                if (i == 0) {
+                        ck_assert_int_eq(ret, ZS_NOTFOUND);
+                        continue;
+                }
+
+                rollover_value(i, val);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_int_eq(vallen, ROLLOVER_VALLEN);
+                ck_assert_mem_eq(value, val, vallen);
+        }
+
+        record_count = 0;
+        ret = zsdb_foreach(db, NULL, 0, count_fe_p, NULL, NULL, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(record_count, ROLLOVER_RECS - 1);
+}
+
+/* Adds enough records for the active file to be rolled over twice, and
+ * removes the first of them again.
+ */
+static void rollover_fill(void)
+{
+        struct zsdb_txn *txn = NULL;
+        unsigned char key[24], val[ROLLOVER_VALLEN];
+        size_t i;
+        int ret;
+
+        ret = zsdb_write_lock_acquire(db, 0);
+        ck_assert_int_eq(ret, ZS_OK);
+        for (i = 0; i < ROLLOVER_RECS; i++) {
+                snprintf((char *)key, sizeof(key), "key%06zu", i);
+                rollover_value(i, val);
+                ret = zsdb_add(db, key, strlen((char *)key), val,
+                               ROLLOVER_VALLEN, &txn);
+                ck_assert_int_eq(ret, ZS_OK);
+
+                if ((i + 1) % ROLLOVER_RECS_PER_TXN == 0) {
+                        ret = zsdb_commit(db, &txn);
+                        ck_assert_int_eq(ret, ZS_OK);
+                }
+        }
+
+        /* A record that has been frozen or packed by now */
+        snprintf((char *)key, sizeof(key), "key%06zu", (size_t)0);
+        ret = zsdb_remove(db, key, strlen((char *)key), &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_commit(db, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+}
+
+START_TEST(test_rollover)
+{
+        int ret;
+
+        rollover_fill();
+        rollover_verify();
+
+        ret = zsdb_close(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_final(&db);
+
+        /* The rolled over files went straight to packed files, skipping
+         * the indexes the packed files are named after */
+        ck_assert_int_eq(count_db_files_ending("-0-0"), 0);
+        ck_assert_int_eq(count_db_files_ending("-0-1"), 1);
+        ck_assert_int_eq(count_db_files_ending("-2-3"), 1);
+        ck_assert_int_eq(count_db_files_ending("-4"), 1);
+        ck_assert_int_eq(count_db_files(), 3);
+
+        ret = zsdb_init(&db, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_open(db, basedir, MODE_RDWR);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        rollover_verify();
+}
+END_TEST
+
+START_TEST(test_hugepages)
+{
+        struct zsdb_memory_usage usage;
+        int ret;
+
+        /* Huge pages or not, the records come out the same, with the
+         * memtrees in the arena */
+        ret = zsdb_close(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_final(&db);
+
+        ret = zsdb_init(&db, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_open(db, basedir, MODE_RDWR | MODE_HUGEPAGES);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        rollover_fill();
+        rollover_verify();
+
+        ret = zsdb_memory_usage(db, &usage);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_gt(usage.arena, 0);
+        ck_assert_uint_le(usage.arena_hugetlb, usage.arena);
+
+        ret = zsdb_close(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_final(&db);
+
+        ret = zsdb_init(&db, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_open(db, basedir, MODE_RDWR | MODE_HUGEPAGES);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        rollover_verify();
+}
+END_TEST
+
+START_TEST(test_windowed)
+{
+        struct zsdb_memory_usage before, after;
+        struct zsdb_txn *txn = NULL;
+        unsigned char val[ROLLOVER_VALLEN];
+        int ret;
+
+        rollover_fill();
+
+        /* Small windows, so that the packed files are mapped in them when
+         * the DB is opened again */
+        mfile_window_config(64 * 1024, 4);
+
+        ret = zsdb_close(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_final(&db);
+
+        ret = zsdb_init(&db, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_open(db, basedir, MODE_RDWR);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        /* Fetches and a scan, across the windows */
+        rollover_verify();
+
+        ret = zsdb_memory_usage(db, &before);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_gt(before.mapped_packed, 0);
+        ck_assert_uint_le(before.resident, before.mapped);
+
+        /* The dropped windows are unmapped on the next write, one that
+         * leaves the records as they are */
+        rollover_value(1, val);
+        ret = zsdb_write_lock_acquire(db, 0);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_add(db, (const unsigned char *)"key000001", 9,
+                       val, ROLLOVER_VALLEN, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_commit(db, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+
+        ret = zsdb_memory_usage(db, &after);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_lt(after.mapped_packed, before.mapped_packed);
+
+        /* And the windows that are needed are mapped again */
+        rollover_verify();
+
+        /* ..and unmapped without a write when asked, leaving only a few
+         * of them mapped, not all of the records read */
+        ret = zsdb_reclaim(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_memory_usage(db, &after);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_lt(after.mapped_packed,
+                          ROLLOVER_RECS * ROLLOVER_VALLEN / 4);
+
+        mfile_window_config(MFILE_WINDOW_SIZE, MFILE_WINDOW_COUNT);
+}
+END_TEST
+
+/* The values zsdb_fetch_multi() hands out from a packed file mapped in
+ * windows are all still mapped once it returns.
+ */
+START_TEST(test_fetch_multi_windowed)
+{
+        size_t n = ROLLOVER_RECS, i, *keylens, *vallens;
+        const unsigned char **keys, **values;
+        unsigned char *buf, val[ROLLOVER_VALLEN];
+        int *results, ret;
+
+        rollover_fill();
+
+        mfile_window_config(64 * 1024, 4);
+
+        ret = zsdb_close(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_final(&db);
+
+        ret = zsdb_init(&db, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_open(db, basedir, MODE_RDWR);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        keys = xcalloc(n, sizeof(unsigned char *));
+        keylens = xcalloc(n, sizeof(size_t));
+        values = xcalloc(n, sizeof(unsigned char *));
+        vallens = xcalloc(n, sizeof(size_t));
+        results = xcalloc(n, sizeof(int));
+        buf = xcalloc(n, 24);
+
+        for (i = 0; i < n; i++) {
+                keys[i] = buf + i * 24;
+                keylens[i] = snprintf((char *)buf + i * 24, 24, "key%06zu",
+                                      i);
+        }
+
+        ret = zsdb_fetch_multi(db, n, keys, keylens, values, vallens,
+                               results);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        for (i = 0; i < n; i++) {
+                if (i == 0) {
+                        ck_assert_int_eq(results[i], ZS_NOTFOUND);
+                        continue;
+                }
+
+                rollover_value(i, val);
+                ck_assert_int_eq(results[i], ZS_OK);
+                ck_assert_uint_eq(vallens[i], ROLLOVER_VALLEN);
+                ck_assert_mem_eq(values[i], val, vallens[i]);
+        }
+
+        xfree(keys);
+        xfree(keylens);
+        xfree(values);
+        xfree(vallens);
+        xfree(results);
+        xfree(buf);
+
+        mfile_window_config(MFILE_WINDOW_SIZE, MFILE_WINDOW_COUNT);
+}
+END_TEST
+
+static size_t prefix_count(const char *prefix)
+{
+        struct zsdb_txn *txn = NULL;
+        int ret;
+
+        record_count = 0;
+        ret = zsdb_foreach(db, (const unsigned char *)prefix, strlen(prefix),
+                           count_fe_p, NULL, NULL, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        return record_count;
+}
+
+START_TEST(test_packed_bounds)
+{
+        const unsigned char *found, *value;
+        size_t foundlen = 0, vallen = 0;
+        unsigned char key[24];
+        char next[24];
+        size_t i;
+        int ret;
+
+        /* All the records in packed files, each with a range of the keys */
+        rollover_fill();
+
+        ret = zsdb_close(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_final(&db);
+
+        ret = zsdb_init(&db, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_open(db, basedir, MODE_RDWR);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        rollover_verify();
+
+        /* Keys before, after and in between the files */
+        ret = zsdb_fetch(db, (const unsigned char *)"a", 1, &value, &vallen,
+                         NULL);
+        ck_assert_int_eq(ret, ZS_NOTFOUND);
+        ret = zsdb_fetch(db, (const unsigned char *)"zzz", 3, &value, &vallen,
+                         NULL);
+        ck_assert_int_eq(ret, ZS_NOTFOUND);
+        ret = zsdb_fetch(db, (const unsigned char *)"key0012345", 10, &value,
+                         &vallen, NULL);
+        ck_assert_int_eq(ret, ZS_NOTFOUND);
+
+        /* The next key, across the ends of the files */
+        for (i = 0; i < ROLLOVER_RECS - 1; i++) {
+                snprintf((char *)key, sizeof(key), "key%06zu", i);
+                snprintf(next, sizeof(next), "key%06zu", i + 1);
+                ret = zsdb_fetchnext(db, key, strlen((char *)key), &found,
+                                     &foundlen, &value, &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_int_eq(foundlen, strlen(next));
+                ck_assert_mem_eq(found, next, foundlen);
+        }
+
+        snprintf((char *)key, sizeof(key), "key%06zu",
+                 (size_t)ROLLOVER_RECS - 1);
+        ret = zsdb_fetchnext(db, key, strlen((char *)key), &found,
+                             &foundlen, &value, &vallen, NULL);
+        ck_assert_int_eq(ret, ZS_NOTFOUND);
+        ret = zsdb_fetchnext(db, (const unsigned char *)"zzz", 3, &found,
+                             &foundlen, &value, &vallen, NULL);
+        ck_assert_int_eq(ret, ZS_NOTFOUND);
+
+        /* One key */
+        record_count = 0;
+        ret = zsdb_forone(db, key, strlen((char *)key), count_fe_p, NULL,
+                          NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(record_count, 1);
+
+        ret = zsdb_forone(db, (const unsigned char *)"zzz", 3, count_fe_p,
+                          NULL, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_NOTFOUND);
+
+        /* And prefixes */
+        ck_assert_uint_eq(prefix_count("key001"), 1000);
+        ck_assert_uint_eq(prefix_count("key0012"), 100);
+        ck_assert_uint_eq(prefix_count("key0049"), 100);
+        ck_assert_uint_eq(prefix_count("key005"), 0);
+        ck_assert_uint_eq(prefix_count("a"), 0);
+        ck_assert_uint_eq(prefix_count("zz"), 0);
+}
+END_TEST
+
+static void reopen(void)
+{
+        int ret;
+
+        ret = zsdb_close(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_final(&db);
+
+        ret = zsdb_init(&db, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_open(db, basedir, MODE_RDWR);
+        ck_assert_int_eq(ret, ZS_OK);
+}
+
+/* The keys that aren't there, but between the smallest and the largest of
+ * the packed files, that seem to be */
+static size_t may_contain_absent(void)
+{
+        unsigned char key[24];
+        size_t i, n = 0;
+        int ret;
+
+        for (i = 1; i < ROLLOVER_RECS - 1; i++) {
+                snprintf((char *)key, sizeof(key), "key%06zux", i);
+                ret = zsdb_may_contain(db, key, strlen((char *)key));
+                ck_assert_int_ge(ret, 0);
+                n += ret;
+        }
+
+        return n;
+}
+
+START_TEST(test_filter)
+{
+        const unsigned char *value;
+        unsigned char key[24];
+        size_t i, vallen = 0;
+        int ret;
+
+        ret = zsdb_set_filter(db, 10, 6);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        rollover_fill();
+        reopen();
+        rollover_verify();
+
+        for (i = 1; i < ROLLOVER_RECS; i++) {
+                snprintf((char *)key, sizeof(key), "key%06zu", i);
+                ret = zsdb_may_contain(db, key, strlen((char *)key));
+                ck_assert_int_eq(ret, 1);
+        }
+
+        /* Outside of all the files, and mostly left out by the filters */
+        ck_assert_int_eq(zsdb_may_contain(db, (const unsigned char *)"a", 1),
+                         0);
+        ck_assert_int_eq(zsdb_may_contain(db, (const unsigned char *)"zzz", 3),
+                         0);
+        ck_assert_uint_lt(may_contain_absent(), ROLLOVER_RECS / 20);
+
+        ret = zsdb_fetch(db, (const unsigned char *)"key0012345", 10, &value,
+                         &vallen, NULL);
+        ck_assert_int_eq(ret, ZS_NOTFOUND);
+
+        /* Prefixes, both in the filters and longer */
+        ck_assert_uint_eq(prefix_count("key001"), 1000);
+        ck_assert_uint_eq(prefix_count("key0012"), 100);
+        ck_assert_uint_eq(prefix_count("key00499"), 10);
+        ck_assert_uint_eq(prefix_count("key005"), 0);
+
+        /* Written again, from the packed files */
+        ret = zsdb_pack_lock_acquire(db, 0);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_repack(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_pack_lock_release(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        reopen();
+        rollover_verify();
+        ck_assert_uint_lt(may_contain_absent(), ROLLOVER_RECS / 20);
+        ck_assert_uint_eq(prefix_count("key0012"), 100);
+}
+END_TEST
+
+START_TEST(test_filter_none)
+{
+        int ret;
+
+        /* Packed files without filters still work, with no help */
+        ret = zsdb_set_filter(db, 0, 0);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        rollover_fill();
+        reopen();
+        rollover_verify();
+
+        ck_assert_uint_gt(may_contain_absent(), ROLLOVER_RECS / 2);
+        ck_assert_uint_eq(prefix_count("key0012"), 100);
+}
+END_TEST
+
+#define KEYPFX_RECS 2000
+#define KEYPFX_BASE "user.someone.INBOX."
+
+/* Keys which all start the same, of many lengths, and some with the same
+ * 8 bytes after that, or only zeros in them */
+static size_t keypfx_key(size_t i, unsigned char *key)
+{
+        size_t len = strlen(KEYPFX_BASE);
+
+        memcpy(key, KEYPFX_BASE, len);
+        if (i == 0)
+                return len;
+        if (i == 1) {
+                key[len] = 0;
+                return len + 1;
+        }
+
+        len += sprintf((char *)key + len, "%zu", i);
+        if (i % 3 == 0) {
+                memcpy(key + len, "\0\0.Sent.Items", 13);
+                len += 13;
+        }
+
+        return len;
+}
+
+START_TEST(test_key_prefixes)
+{
+        struct zsdb_txn *txn = NULL;
+        const unsigned char *value;
+        unsigned char key[64];
+        size_t i, len, vallen = 0;
+        int ret;
+
+        /* The prefixes are those of the blocks */
+        ret = zsdb_set_packed_version(db, 2);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        zsdb_write_lock_acquire(db, 0);
+        for (i = 0; i < KEYPFX_RECS; i++) {
+                len = keypfx_key(i, key);
+                ret = zsdb_add(db, key, len, key, len, &txn);
+                ck_assert_int_eq(ret, ZS_OK);
+        }
+        ret = zsdb_commit(db, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_finalise(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+        zsdb_transaction_end(&txn);
+
+        ret = zsdb_pack_lock_acquire(db, 0);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_repack(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_pack_lock_release(db);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        reopen();
+
+        for (i = 0; i < KEYPFX_RECS; i++) {
+                len = keypfx_key(i, key);
+                ret = zsdb_fetch(db, key, len, &value, &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_int_eq(vallen, len);
+                ck_assert_mem_eq(value, key, len);
+
+                /* Longer and shorter, with the same prefix or not */
+                key[len] = 0;
+                ret = zsdb_fetch(db, key, len + 1, &value, &vallen, NULL);
+                ck_assert_int_eq(ret, i == 0 ? ZS_OK : ZS_NOTFOUND);
+                key[len] = 'x';
+                ret = zsdb_fetch(db, key, len + 1, &value, &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_NOTFOUND);
+                if (i > 1 && i % 3 == 0) {
+                        ret = zsdb_fetch(db, key, len - 1, &value, &vallen,
+                                         NULL);
+                        ck_assert_int_eq(ret, ZS_NOTFOUND);
+                }
+        }
+
+        /* Shorter than what all the keys start with */
+        ret = zsdb_fetch(db, (const unsigned char *)"user.someone", 12,
+                         &value, &vallen, NULL);
+        ck_assert_int_eq(ret, ZS_NOTFOUND);
+        ck_assert_uint_eq(prefix_count(KEYPFX_BASE "1"), 1110);
+}
+END_TEST
+
+START_TEST(test_packed_versions)
+{
+        const unsigned char *found, *value;
+        size_t foundlen = 0, vallen = 0;
+        int ret;
+
+        /* Files of both versions, and one from files of both */
+        ret = zsdb_set_packed_version(db, 3);
+        ck_assert_int_eq(ret, ZS_ERROR);
+        ret = zsdb_set_packed_version(db, 1);
+        ck_assert_int_eq(ret, ZS_OK);
+        rollover_fill();
+        reopen();
+        rollover_verify();
+
+        /* Version 1 is the default again after the reopen */
+        ret = zsdb_set_packed_version(db, 2);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_pack_lock_acquire(db, 0);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_repack(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_pack_lock_release(db);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        reopen();
+        rollover_verify();
+        ck_assert_uint_eq(prefix_count("key0012"), 100);
+        ck_assert_uint_eq(prefix_count("key0049"), 100);
+
+        ret = zsdb_fetchnext(db, (const unsigned char *)"key001999", 9,
+                             &found, &foundlen, &value, &vallen, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_mem_eq(found, "key002000", foundlen);
+        ret = zsdb_fetch(db, (const unsigned char *)"key0012345", 10, &value,
+                         &vallen, NULL);
+        ck_assert_int_eq(ret, ZS_NOTFOUND);
+}
+END_TEST
+
+#define MODEL_RECS 20000
+
+/* Message UIDs, some of them expunged */
+static size_t model_key(size_t i, unsigned char *key)
+{
+        return sprintf((char *)key, "user.someone.INBOX.%zu",
+                       100000 + i * 3 + i % 2);
+}
+
+static void model_repack(void)
+{
+        int ret;
+
+        ret = zsdb_pack_lock_acquire(db, 0);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_repack(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_pack_lock_release(db);
+        ck_assert_int_eq(ret, ZS_OK);
+}
+
+static void model_fill(size_t start, unsigned int version, int hashindex)
+{
+        struct zsdb_txn *txn = NULL;
+        unsigned char key[64];
+        size_t i, len;
+        int ret;
+
+        /* In two finalised files, for a packed file not to be named as
+         * one of them */
+        zsdb_write_lock_acquire(db, 0);
+        for (i = start; i < MODEL_RECS; i += 2) {
+                len = model_key(i, key);
+                ret = zsdb_add(db, key, len, key, len, &txn);
+                ck_assert_int_eq(ret, ZS_OK);
+
+                if (i / 2 == MODEL_RECS / 4 || i + 2 >= MODEL_RECS) {
+                        ret = zsdb_commit(db, &txn);
+                        ck_assert_int_eq(ret, ZS_OK);
+                        ret = zsdb_finalise(db);
+                        ck_assert_int_eq(ret, ZS_OK);
+                }
+        }
+        zsdb_write_lock_release(db);
+        zsdb_transaction_end(&txn);
+
+        /* For the repack to see them */
+        reopen();
+        ret = zsdb_set_packed_version(db, version);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_set_hash_index(db, hashindex);
+        ck_assert_int_eq(ret, ZS_OK);
+        model_repack();
+}
+
+static void model_verify(void)
+{
+        const unsigned char *found, *value;
+        unsigned char key[64], next[64];
+        size_t i, len, nextlen, foundlen = 0, vallen = 0;
+        int ret;
+
+        for (i = 0; i < MODEL_RECS; i++) {
+                len = model_key(i, key);
+                ret = zsdb_fetch(db, key, len, &value, &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_int_eq(vallen, len);
+                ck_assert_mem_eq(value, key, len);
+
+                /* Between the keys */
+                key[len] = '5';
+                ret = zsdb_fetch(db, key, len + 1, &value, &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_NOTFOUND);
+                ret = zsdb_fetchnext(db, key, len + 1, &found, &foundlen,
+                                     &value, &vallen, NULL);
+                if (i == MODEL_RECS - 1) {
+                        ck_assert_int_eq(ret, ZS_NOTFOUND);
+                        continue;
+                }
+
+                nextlen = model_key(i + 1, next);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_int_eq(foundlen, nextlen);
+                ck_assert_mem_eq(found, next, nextlen);
+        }
+
+        ck_assert_uint_eq(prefix_count("user.someone.INBOX.1"), MODEL_RECS);
+        ck_assert_uint_eq(prefix_count("user.someone.INBOX.12"), 3333);
+}
+
+START_TEST(test_key_model)
+{
+        /* Files of both versions, each with every other key, and one
+         * from both */
+        model_fill(0, 1, 0);
+        model_fill(1, 2, 0);
+        reopen();
+        model_verify();
+
+        model_repack();
+        reopen();
+        model_verify();
+}
+END_TEST
+
+START_TEST(test_hash_index)
+{
+        int ret;
+
+        /* A file with a hash index and one without */
+        model_fill(0, 2, 1);
+        model_fill(1, 1, 0);
+        reopen();
+        model_verify();
+
+        /* All the keys, in one file with a hash index */
+        ret = zsdb_set_hash_index(db, 1);
+        ck_assert_int_eq(ret, ZS_OK);
+        model_repack();
+        reopen();
+        model_verify();
+}
+END_TEST
+
+/* Checks zsdb_fetch_multi() against zsdb_fetch(), for all the keys of
+ * model_key(), keys between them, and some twice, in no particular order */
+static void fetch_multi_verify(void)
+{
+        size_t n = 2 * MODEL_RECS + 100, i, *keylens, *vallens;
+        const unsigned char **keys, **values;
+        unsigned char *buf;
+        int *results, ret;
+
+        keys = xcalloc(n, sizeof(unsigned char *));
+        keylens = xcalloc(n, sizeof(size_t));
+        values = xcalloc(n, sizeof(unsigned char *));
+        vallens = xcalloc(n, sizeof(size_t));
+        results = xcalloc(n, sizeof(int));
+        buf = xcalloc(n, 64);
+
+        for (i = 0; i < n; i++) {
+                unsigned char *key = buf + i * 64;
+                size_t k = (i * 7919) % MODEL_RECS;
+
+                keylens[i] = model_key(k, key);
+                if (i >= MODEL_RECS && i < 2 * MODEL_RECS)
+                        key[keylens[i]++] = '5';
+                keys[i] = key;
+        }
+
+        ret = zsdb_fetch_multi(db, n, keys, keylens, values, vallens,
+                               results);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        for (i = 0; i < n; i++) {
+                const unsigned char *value = NULL;
+                size_t vallen = 0;
+
+                ret = zsdb_fetch(db, keys[i], keylens[i], &value, &vallen,
+                                 NULL);
+                ck_assert_int_eq(results[i], ret);
+                if (ret == ZS_OK) {
+                        ck_assert_uint_eq(vallens[i], vallen);
+                        ck_assert_mem_eq(values[i], value, vallen);
+                }
+        }
+
+        xfree(keys);
+        xfree(keylens);
+        xfree(values);
+        xfree(vallens);
+        xfree(results);
+        xfree(buf);
+}
+
+START_TEST(test_fetch_multi)
+{
+        struct zsdb_txn *txn = NULL;
+        unsigned char key[64];
+        size_t i, len;
+        int ret;
+
+        /* Packed files of both versions */
+        model_fill(0, 1, 0);
+        model_fill(1, 2, 0);
+        reopen();
+        fetch_multi_verify();
+
+        /* Records in memory, newer than those packed: some changed, some
+         * removed, some new */
+        zsdb_write_lock_acquire(db, 0);
+        for (i = 0; i < MODEL_RECS; i += 5) {
+                len = model_key(i, key);
+                if (i % 3 == 0)
+                        ret = zsdb_remove(db, key, len, &txn);
+                else
+                        ret = zsdb_add(db, key, len,
+                                       (const unsigned char *)"new", 3,
+                                       &txn);
+                ck_assert_int_eq(ret, ZS_OK);
+
+                key[len++] = '5';
+                ret = zsdb_add(db, key, len, key, len, &txn);
+                ck_assert_int_eq(ret, ZS_OK);
+
+                if (i == MODEL_RECS / 2) {
+                        ret = zsdb_commit(db, &txn);
+                        ck_assert_int_eq(ret, ZS_OK);
+                        ret = zsdb_finalise(db);
+                        ck_assert_int_eq(ret, ZS_OK);
+                }
+        }
+        ret = zsdb_commit(db, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+        zsdb_transaction_end(&txn);
+
+        fetch_multi_verify();
+
+        /* Nothing to look up */
+        ret = zsdb_fetch_multi(db, 0, NULL, NULL, NULL, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+}
+END_TEST
+
+/* Looks the first `n` keys of the model up `times` times each, and checks
+ * their values */
+static void value_cache_fetch(size_t n, int times, const char *val)
+{
+        const unsigned char *value;
+        unsigned char key[64];
+        size_t i, len, vallen = 0;
+        int ret, t;
+
+        for (t = 0; t < times; t++) {
+                for (i = 0; i < n; i++) {
+                        len = model_key(i, key);
+                        ret = zsdb_fetch(db, key, len, &value, &vallen, NULL);
+                        if (val && i % 5 == 0 && i % 3 == 0) {
+                                ck_assert_int_eq(ret, ZS_NOTFOUND);
+                                continue;
+                        }
+                        ck_assert_int_eq(ret, ZS_OK);
+                        if (val && i % 5 == 0) {
+                                ck_assert_int_eq(vallen, strlen(val));
+                                ck_assert_mem_eq(value, val, vallen);
+                        } else {
+                                ck_assert_int_eq(vallen, len);
+                                ck_assert_mem_eq(value, key, len);
+                        }
+                }
+        }
+}
+
+START_TEST(test_value_cache)
+{
+        struct zsdb_value_cache_stats stats;
+        struct zsdb_txn *txn = NULL;
+        const unsigned char *value;
+        unsigned char key[64];
+        size_t i, len, vallen = 0, entries;
+        int ret;
+
+        model_fill(0, 2, 0);
+        model_fill(1, 2, 0);
+        reopen();
+
+        /* Off by default */
+        value_cache_fetch(100, 1, NULL);
+        ret = zsdb_value_cache_stats(db, &stats);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_eq(stats.hits + stats.misses, 0);
+        ck_assert_uint_eq(stats.budget, 0);
+
+        ret = zsdb_set_value_cache(db, 1024 * 1024);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        /* The hot keys are found in the cache */
+        value_cache_fetch(1000, 10, NULL);
+        ret = zsdb_value_cache_stats(db, &stats);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_eq(stats.misses, 1000);
+        ck_assert_uint_eq(stats.hits, 9000);
+        ck_assert_uint_eq(stats.entries, 1000);
+        ck_assert_uint_le(stats.bytes, stats.budget);
+
+        /* Written to, they are looked up again */
+        zsdb_write_lock_acquire(db, 0);
+        for (i = 0; i < 1000; i += 5) {
+                len = model_key(i, key);
+                if (i % 3 == 0)
+                        ret = zsdb_remove(db, key, len, &txn);
+                else
+                        ret = zsdb_add(db, key, len,
+                                       (const unsigned char *)"new", 3,
+                                       &txn);
+                ck_assert_int_eq(ret, ZS_OK);
+        }
+
+        /* ..even before the commit */
+        len = model_key(10, key);
+        ret = zsdb_fetch(db, key, len, &value, &vallen, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(vallen, 3);
+        ck_assert_mem_eq(value, "new", 3);
+
+        ret = zsdb_commit(db, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+        zsdb_transaction_end(&txn);
+
+        value_cache_fetch(1000, 2, "new");
+        ret = zsdb_value_cache_stats(db, &stats);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_eq(stats.invalidated, 200);
+
+        /* A repack changes the files, and drops all of them; the handle
+         * picks the new ones up when it reloads, as an abort does */
+        entries = stats.entries;
+        model_repack();
+        ret = zsdb_abort(db, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        value_cache_fetch(1000, 2, "new");
+        ret = zsdb_value_cache_stats(db, &stats);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_eq(stats.invalidated, 200 + entries);
+
+        /* Turned off */
+        ret = zsdb_set_value_cache(db, 0);
+        ck_assert_int_eq(ret, ZS_OK);
+        value_cache_fetch(1000, 1, "new");
+        ret = zsdb_value_cache_stats(db, &stats);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_eq(stats.entries, 0);
+        ck_assert_uint_eq(stats.hits, 0);
+}
+END_TEST
+
+/* Commits a record that isn't one of the model */
+static void value_cache_commit(void)
+{
+        struct zsdb_txn *txn = NULL;
+        int ret;
+
+        ret = zsdb_write_lock_acquire(db, 0);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_add(db, (const unsigned char *)"value-cache-budget", 18,
+                       (const unsigned char *)"x", 1, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_commit(db, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+        zsdb_transaction_end(&txn);
+}
+
+/* The value cache counts against the memory budgets, and is emptied for
+ * them.
+ */
+START_TEST(test_value_cache_budget)
+{
+        struct zsdb_value_cache_stats stats;
+        struct zsdb_process_memory_usage pusage;
+        struct zsdb_memory_usage usage;
+        size_t cached;
+        int ret;
+
+        model_fill(0, 2, 0);
+        model_fill(1, 2, 0);
+        reopen();
+
+        ret = zsdb_set_value_cache(db, 1024 * 1024);
+        ck_assert_int_eq(ret, ZS_OK);
+        value_cache_fetch(1000, 2, NULL);
+
+        ret = zsdb_memory_usage(db, &usage);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_gt(usage.valcache, 0);
+        cached = usage.valcache;
+
+        /* The DB is over its budget with the cache alone */
+        ret = zsdb_set_memory_budget(db, cached / 2);
+        ck_assert_int_eq(ret, ZS_OK);
+        value_cache_commit();
+
+        ret = zsdb_value_cache_stats(db, &stats);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_eq(stats.entries, 0);
+        ck_assert_uint_eq(stats.bytes, 0);
+        ck_assert_uint_ge(stats.evicted, 1000);
+        ret = zsdb_memory_usage(db, &usage);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_eq(usage.valcache, 0);
+
+        ret = zsdb_set_memory_budget(db, 0);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        /* ..and so is the process */
+        value_cache_fetch(1000, 2, NULL);
+        ret = zsdb_value_cache_stats(db, &stats);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_eq(stats.entries, 1000);
+
+        ret = zsdb_set_process_memory_budget(cached / 2);
+        ck_assert_int_eq(ret, ZS_OK);
+        value_cache_commit();
+
+        ret = zsdb_process_memory_usage(&pusage);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_gt(pusage.evictions, 0);
+        ck_assert_uint_lt(pusage.used, cached);
+        ret = zsdb_value_cache_stats(db, &stats);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_eq(stats.entries, 0);
+
+        ret = zsdb_set_process_memory_budget(0);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        /* The values are all still found */
+        value_cache_fetch(1000, 2, NULL);
+        ret = zsdb_value_cache_stats(db, &stats);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_eq(stats.entries, 1000);
+}
+END_TEST
+
+#define BIGVAL_RECS 200
+#define BIGVAL_LEN (100 * 1024)
+
+START_TEST(test_packed_big_values)
+{
+        struct zsdb_txn *txn = NULL;
+        const unsigned char *value;
+        unsigned char key[24], *val;
+        size_t i, len, vallen = 0;
+        int ret;
+
+        /* Records bigger than the blocks, between small ones */
+        ret = zsdb_set_packed_version(db, 2);
+        ck_assert_int_eq(ret, ZS_OK);
+        val = xmalloc(BIGVAL_LEN);
+        zsdb_write_lock_acquire(db, 0);
+        for (i = 0; i < BIGVAL_RECS; i++) {
+                snprintf((char *)key, sizeof(key), "key%06zu", i);
+                len = i % 7 == 3 ? BIGVAL_LEN : i % 100 + 1;
+                memset(val, 'a' + i % 26, len);
+                ret = zsdb_add(db, key, strlen((char *)key), val, len, &txn);
+                ck_assert_int_eq(ret, ZS_OK);
+        }
+        ret = zsdb_commit(db, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_finalise(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+        zsdb_transaction_end(&txn);
+
+        ret = zsdb_pack_lock_acquire(db, 0);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_repack(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_pack_lock_release(db);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        reopen();
+
+        for (i = 0; i < BIGVAL_RECS; i++) {
+                snprintf((char *)key, sizeof(key), "key%06zu", i);
+                len = i % 7 == 3 ? BIGVAL_LEN : i % 100 + 1;
+                memset(val, 'a' + i % 26, len);
+                ret = zsdb_fetch(db, key, strlen((char *)key), &value,
+                                 &vallen, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_uint_eq(vallen, len);
+                ck_assert_mem_eq(value, val, len);
+        }
+        ck_assert_uint_eq(prefix_count("key"), BIGVAL_RECS);
+
+        xfree(val);
+}
+END_TEST
+
+#define PINNED_RECS 50
+
+static size_t pinned_len(size_t i)
+{
+        return i % 3 ? i % 100 + 1 : BIGVAL_LEN;
+}
+
+static void pinned_fill(const unsigned char *val)
+{
+        struct zsdb_txn *txn = NULL;
+        unsigned char key[24];
+        size_t i;
+        int ret;
+
+        zsdb_write_lock_acquire(db, 0);
+        for (i = 0; i < PINNED_RECS; i++) {
+                snprintf((char *)key, sizeof(key), "key%06zu", i);
+                ret = zsdb_add(db, key, strlen((char *)key), val,
+                               pinned_len(i), &txn);
+                ck_assert_int_eq(ret, ZS_OK);
+
+                /* In two finalised files, once packed */
+                if (i == PINNED_RECS / 2) {
+                        ret = zsdb_commit(db, &txn);
+                        ck_assert_int_eq(ret, ZS_OK);
+                        ret = zsdb_finalise(db);
+                        ck_assert_int_eq(ret, ZS_OK);
+                }
+        }
+        ret = zsdb_commit(db, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+        zsdb_transaction_end(&txn);
+}
+
+static void pinned_pack(void)
+{
+        int ret;
+
+        zsdb_write_lock_acquire(db, 0);
+        ret = zsdb_finalise(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+
+        /* For the repack to see them */
+        reopen();
+        model_repack();
+        reopen();
+}
+
+START_TEST(test_fetch_pinned)
+{
+        struct zsdb_value *pinned[PINNED_RECS], *v;
+        unsigned char key[24], *val, *newval;
+        size_t i;
+        int ret;
+
+        val = xmalloc(BIGVAL_LEN);
+        newval = xmalloc(BIGVAL_LEN);
+        memset(val, 'a', BIGVAL_LEN);
+        memset(newval, 'b', BIGVAL_LEN);
+
+        /* In a packed file */
+        pinned_fill(val);
+        pinned_pack();
+
+        for (i = 0; i < PINNED_RECS; i++) {
+                snprintf((char *)key, sizeof(key), "key%06zu", i);
+                ret = zsdb_fetch_pinned(db, key, strlen((char *)key),
+                                        &pinned[i], NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_uint_eq(pinned[i]->vallen, pinned_len(i));
+                ck_assert_mem_eq(pinned[i]->val, val, pinned_len(i));
+
+                /* The big values are mapped, not copied */
+                if (pinned_len(i) >= ZSDB_PIN_MAP_MIN)
+                        ck_assert_ptr_ne(pinned[i]->map, NULL);
+                else
+                        ck_assert_ptr_eq(pinned[i]->map, NULL);
+        }
+
+        ret = zsdb_fetch_pinned(db, (const unsigned char *)"nokey", 5, &v,
+                                NULL);
+        ck_assert_int_eq(ret, ZS_NOTFOUND);
+        ck_assert_ptr_eq(v, NULL);
+
+        /* Written over, the records in memory are copied */
+        pinned_fill(newval);
+        ret = zsdb_fetch_pinned(db, (const unsigned char *)"key000000", 9,
+                                &v, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_ptr_eq(v->map, NULL);
+        ck_assert_mem_eq(v->val, newval, BIGVAL_LEN);
+
+        /* The files they were in are repacked and gone, and the DB closed,
+         * the pinned values are still there */
+        pinned_pack();
+        model_repack();
+        ret = zsdb_close(db);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        for (i = 0; i < PINNED_RECS; i++) {
+                ck_assert_uint_eq(pinned[i]->vallen, pinned_len(i));
+                ck_assert_mem_eq(pinned[i]->val, val, pinned_len(i));
+        }
+
+        /* Gone once released by all who have them */
+        zsdb_value_release(&v);
+        ck_assert_ptr_eq(v, NULL);
+        v = zsdb_value_ref(pinned[0]);
+        ck_assert_ptr_eq(v, pinned[0]);
+        zsdb_value_release(&v);
+        ck_assert_mem_eq(pinned[0]->val, val, BIGVAL_LEN);
+
+        for (i = 0; i < PINNED_RECS; i++)
+                zsdb_value_release(&pinned[i]);
+
+        /* For the teardown */
+        zsdb_final(&db);
+        ret = zsdb_init(&db, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_open(db, basedir, MODE_RDWR);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        xfree(val);
+        xfree(newval);
+}
+END_TEST
+
+#define PROCESS_DBS 8
+#define PROCESS_RECS 500
+#define PROCESS_BUDGET (256 * 1024)
+
+static void process_db_fill(struct zsdb *pdb, size_t n)
+{
+        struct zsdb_txn *txn = NULL;
+        unsigned char key[24], val[64];
+        size_t i;
+        int ret;
+
+        ret = zsdb_write_lock_acquire(pdb, 0);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        for (i = 0; i < PROCESS_RECS; i++) {
+                snprintf((char *)key, sizeof(key), "key%06zu", i);
+                snprintf((char *)val, sizeof(val),
+                         "value-%zu-for-the-process-budget-%zu", n, i);
+                ret = zsdb_add(pdb, key, strlen((char *)key), val,
+                               strlen((char *)val), &txn);
+                ck_assert_int_eq(ret, ZS_OK);
+        }
+
+        ret = zsdb_commit(pdb, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        zsdb_write_lock_release(pdb);
+}
+
+static void process_db_verify(struct zsdb *pdb, size_t n)
+{
+        struct zsdb_txn *txn = NULL;
+        unsigned char key[24], val[64];
+        size_t i;
+        int ret;
+
+        for (i = 0; i < PROCESS_RECS; i++) {
+                const unsigned char *value = NULL;
+                size_t vallen = 0;
+
+                snprintf((char *)key, sizeof(key), "key%06zu", i);
+                snprintf((char *)val, sizeof(val),
+                         "value-%zu-for-the-process-budget-%zu", n, i);
+                ret = zsdb_fetch(pdb, key, strlen((char *)key), &value,
+                                 &vallen, &txn);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_int_eq(vallen, strlen((char *)val));
+                ck_assert_mem_eq(value, val, vallen);
+        }
+}
+
+START_TEST(test_process_budget)
+{
+        struct zsdb *dbs[PROCESS_DBS];
+        char *dirs[PROCESS_DBS];
+        struct zsdb_process_memory_usage pusage;
+        struct zsdb_memory_usage usage;
+        size_t i;
+        int ret;
+
+        ret = zsdb_set_process_memory_budget(PROCESS_BUDGET);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        /* Each of them well under the budget, all of them well over */
+        for (i = 0; i < PROCESS_DBS; i++) {
+                char path[PATH_MAX];
+
+                snprintf(path, sizeof(path), "%s.%zu", basedir, i);
+                dirs[i] = xstrdup(path);
+
+                ret = zsdb_init(&dbs[i], NULL, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ret = zsdb_open(dbs[i], dirs[i], MODE_CREATE);
+                ck_assert_int_eq(ret, ZS_OK);
+
+                process_db_fill(dbs[i], i);
+
+                ret = zsdb_process_memory_usage(&pusage);
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_uint_le(pusage.used, PROCESS_BUDGET);
+        }
+
+        /* The DB of the fixture is open too */
+        ck_assert_uint_eq(pusage.ndbs, PROCESS_DBS + 1);
+        ck_assert_uint_gt(pusage.evictions, 0);
+
+        /* The first DB was the coldest, and flushed, the last one is where
+         * the commit was, and kept */
+        ret = zsdb_memory_usage(dbs[0], &usage);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_gt(usage.mapped_packed, 0);
+        /* ..and left with empty memtrees */
+        ck_assert_uint_lt(usage.memtree + usage.fmemtree + usage.frozen,
+                          4096);
+
+        ret = zsdb_memory_usage(dbs[PROCESS_DBS - 1], &usage);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_eq(usage.mapped_packed, 0);
+        ck_assert_uint_gt(usage.memtree, PROCESS_RECS * 64);
+
+        for (i = 0; i < PROCESS_DBS; i++)
+                process_db_verify(dbs[i], i);
+
+        ret = zsdb_set_process_memory_budget(0);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        for (i = 0; i < PROCESS_DBS; i++) {
+                ret = zsdb_close(dbs[i]);
+                ck_assert_int_eq(ret, ZS_OK);
+                zsdb_final(&dbs[i]);
+
+                /* Evicted or not, the records are all there */
+                ret = zsdb_init(&dbs[i], NULL, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ret = zsdb_open(dbs[i], dirs[i], MODE_RDWR);
+                ck_assert_int_eq(ret, ZS_OK);
+                process_db_verify(dbs[i], i);
+
+                ret = zsdb_close(dbs[i]);
+                ck_assert_int_eq(ret, ZS_OK);
+                zsdb_final(&dbs[i]);
+
+                recursive_rm(dirs[i]);
+                xfree(dirs[i]);
+        }
+
+        ret = zsdb_process_memory_usage(&pusage);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_eq(pusage.ndbs, 1);
+}
+END_TEST
+
+/* A DB is only evicted for the budget of the process when nobody can be
+ * using what it handed out.
+ */
+START_TEST(test_process_budget_readers)
+{
+        struct zsdb *dbs[PROCESS_DBS];
+        char *dirs[PROCESS_DBS];
+        struct zsdb_process_memory_usage pusage;
+        struct zsdb_memory_usage usage;
+        struct zsdb_txn *txn = NULL;
+        const unsigned char *value = NULL;
+        size_t vallen = 0;
+        unsigned char copy[64];
+        size_t i;
+        int ret;
+
+        ret = zsdb_set_process_memory_budget(PROCESS_BUDGET);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        for (i = 0; i < PROCESS_DBS; i++) {
+                char path[PATH_MAX];
+
+                snprintf(path, sizeof(path), "%s.%zu", basedir, i);
+                dirs[i] = xstrdup(path);
+
+                ret = zsdb_init(&dbs[i], NULL, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ret = zsdb_open(dbs[i], dirs[i], MODE_CREATE);
+                ck_assert_int_eq(ret, ZS_OK);
+
+                process_db_fill(dbs[i], i);
+
+                /* The first DB hands out a value, the second one has a
+                 * transaction open, and both are the coldest */
+                if (i == 0) {
+                        ret = zsdb_fetch(dbs[0],
+                                         (const unsigned char *)"key000000",
+                                         9, &value, &vallen, NULL);
+                        ck_assert_int_eq(ret, ZS_OK);
+                        ck_assert_uint_le(vallen, sizeof(copy));
+                        memcpy(copy, value, vallen);
+                } else if (i == 1) {
+                        ret = zsdb_transaction_begin(dbs[1], &txn);
+                        ck_assert_int_eq(ret, ZS_OK);
+                }
+        }
+
+        ret = zsdb_process_memory_usage(&pusage);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_gt(pusage.evictions, 0);
+
+        /* Neither of them was flushed, the others were */
+        for (i = 0; i < 3; i++) {
+                ret = zsdb_memory_usage(dbs[i], &usage);
+                ck_assert_int_eq(ret, ZS_OK);
+                if (i < 2)
+                        ck_assert_uint_eq(usage.mapped_packed, 0);
+                else
+                        ck_assert_uint_gt(usage.mapped_packed, 0);
+        }
+        ck_assert_mem_eq(value, copy, vallen);
+
+        /* Once the transaction is over, the second DB is fair game */
+        zsdb_transaction_end(&txn);
+
+        ret = zsdb_set_process_memory_budget(PROCESS_BUDGET / 4);
+        ck_assert_int_eq(ret, ZS_OK);
+        process_db_fill(dbs[PROCESS_DBS - 1], PROCESS_DBS - 1);
+
+        ret = zsdb_memory_usage(dbs[1], &usage);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_gt(usage.mapped_packed, 0);
+
+        ret = zsdb_memory_usage(dbs[0], &usage);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_uint_eq(usage.mapped_packed, 0);
+        ck_assert_mem_eq(value, copy, vallen);
+
+        ret = zsdb_set_process_memory_budget(0);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        for (i = 0; i < PROCESS_DBS; i++) {
+                process_db_verify(dbs[i], i);
+
+                ret = zsdb_close(dbs[i]);
+                ck_assert_int_eq(ret, ZS_OK);
+                zsdb_final(&dbs[i]);
+
+                recursive_rm(dirs[i]);
+                xfree(dirs[i]);
+        }
+}
+END_TEST
+
+#define CKPT_RECS_PER_TXN 500
+#define CKPT_FNAME ".zsdb-checkpoint"
+
+/* Adds the records from `start` to `end` and commits them. With `delete`,
+ * the first of them is removed again, in the same transaction.
+ */
+static void checkpoint_add(size_t start, size_t end, int delete)
+{
+        struct zsdb_txn *txn = NULL;
+        unsigned char key[24], val[64];
+        size_t i;
+        int ret;
+
+        ret = zsdb_write_lock_acquire(db, 0);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        for (i = start; i < end; i++) {
+                snprintf((char *)key, sizeof(key), "key%06zu", i);
+                snprintf((char *)val, sizeof(val), "value%zu", i);
+
+                ret = zsdb_add(db, key, strlen((char *)key), val,
+                               strlen((char *)val), &txn);
+                ck_assert_int_eq(ret, ZS_OK);
+        }
+
+        if (delete) {
+                snprintf((char *)key, sizeof(key), "key%06zu", start);
+                ret = zsdb_remove(db, key, strlen((char *)key), &txn);
+                ck_assert_int_eq(ret, ZS_OK);
+        }
 
-        /* Commit the add record transaction */
-        zsdb_commit(db, NULL);
+        ret = zsdb_commit(db, &txn);
         ck_assert_int_eq(ret, ZS_OK);
 
-        /* Release write lock */
         zsdb_write_lock_release(db);
+}
+
+static void checkpoint_reopen_verify(size_t nrecs, size_t deleted)
+{
+        struct zsdb_txn *txn = NULL;
+        size_t i;
+        int ret;
 
-        /** CLOSE first instance of the DB **/
         ret = zsdb_close(db);
         ck_assert_int_eq(ret, ZS_OK);
         zsdb_final(&db);
 
-        /** REOPEN DB **/
         ret = zsdb_init(&db, NULL, NULL);
         ck_assert_int_eq(ret, ZS_OK);
-
         ret = zsdb_open(db, basedir, MODE_RDWR);
         ck_assert_int_eq(ret, ZS_OK);
 
-        /** COUNT RECORDS **/
+        for (i = 0; i < nrecs; i++) {
+                unsigned char key[24], val[64];
+                const unsigned char *value = NULL;
+                size_t vallen = 0;
+
+                snprintf((char *)key, sizeof(key), "key%06zu", i);
+                snprintf((char *)val, sizeof(val), "value%zu", i);
+                ret = zsdb_fetch(db, key, strlen((char *)key), &value,
+                                 &vallen, &txn);
+                /* The deleted record is checked by the count below */
+                if (i == deleted)
+                        continue;
+                ck_assert_int_eq(ret, ZS_OK);
+                ck_assert_int_eq(vallen, strlen((char *)val));
+                ck_assert_mem_eq(value, val, vallen);
+        }
+
         record_count = 0;
         ret = zsdb_foreach(db, NULL, 0, count_fe_p, NULL, NULL, &txn);
         ck_assert_int_eq(ret, ZS_OK);
-        ck_assert_int_eq(record_count, ARRAY_SIZE(kvmultiopen));
+        ck_assert_int_eq(record_count, nrecs - 1);
 }
-END_TEST
 
-START_TEST(test_many_records)
+START_TEST(test_checkpoint)
 {
-        struct zsdb_txn *txn;
-        size_t i, NUM_RECS;
+        char path[PATH_MAX];
+        struct stat st;
+        FILE *fp;
         int ret;
 
-        NUM_RECS = 4096;
-
-        txn = NULL;
+        snprintf(path, sizeof(path), "%s/%s", basedir, CKPT_FNAME);
 
-        /* Begin transaction */
-        ret = zsdb_transaction_begin(db, &txn);
-        ck_assert_int_eq(ret, ZS_OK);
+        /* Records in a finalised file, and then in the active file, one of
+         * them deleted */
+        checkpoint_add(0, CKPT_RECS_PER_TXN, 0);
 
-        /* Acquire write lock */
         zsdb_write_lock_acquire(db, 0);
+        ret = zsdb_finalise(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
 
-        /* Add 4096 records */
-        for (i = 0; i < NUM_RECS; i++) {
-                unsigned char key[24], val[24];
+        checkpoint_add(CKPT_RECS_PER_TXN, 2 * CKPT_RECS_PER_TXN, 1);
 
-                snprintf((char *)key, 8, "key%zu", i);
-                snprintf((char *)val, 8, "val%zu", i);
+        /* Needs the write lock, and nothing uncommitted */
+        ret = zsdb_checkpoint(db);
+        ck_assert_int_ne(ret, ZS_OK);
 
-                ret = zsdb_add(db, key, strlen((char *)key), val,
-                               strlen((char *)val), &txn);
-                ck_assert_int_eq(ret, ZS_OK);
-        }
+        zsdb_write_lock_acquire(db, 0);
+        ret = zsdb_add(db, (const unsigned char *)"uncommitted", 11,
+                       (const unsigned char *)"value", 5, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_checkpoint(db);
+        ck_assert_int_eq(ret, ZS_AGAIN);
+        ret = zsdb_remove(db, (const unsigned char *)"uncommitted", 11, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_commit(db, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
 
-        /* Commit the add records transaction */
-        zsdb_commit(db, &txn);
+        ret = zsdb_checkpoint(db);
         ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+        ck_assert_int_eq(stat(path, &st), 0);
 
-        /* Release write lock */
+        /* Records added after the checkpoint are replayed from the active
+         * file */
+        checkpoint_add(2 * CKPT_RECS_PER_TXN, 3 * CKPT_RECS_PER_TXN, 0);
+        checkpoint_reopen_verify(3 * CKPT_RECS_PER_TXN, CKPT_RECS_PER_TXN);
+
+        /* A checkpoint from before a finalise is ignored */
+        zsdb_write_lock_acquire(db, 0);
+        ret = zsdb_finalise(db);
+        ck_assert_int_eq(ret, ZS_OK);
         zsdb_write_lock_release(db);
 
-        zsdb_transaction_end(&txn);
+        checkpoint_add(3 * CKPT_RECS_PER_TXN, 4 * CKPT_RECS_PER_TXN, 0);
+        checkpoint_reopen_verify(4 * CKPT_RECS_PER_TXN, CKPT_RECS_PER_TXN);
 
-        /* Count records */
-        record_count = 0;
-        txn = NULL;
-        ret = zsdb_foreach(db, NULL, 0, count_fe_p, NULL, NULL, &txn);
+        /* So is a damaged one */
+        zsdb_write_lock_acquire(db, 0);
+        ret = zsdb_checkpoint(db);
         ck_assert_int_eq(ret, ZS_OK);
-        ck_assert_int_eq(record_count, NUM_RECS);
+        zsdb_write_lock_release(db);
+
+        fp = fopen(path, "r+");
+        ck_assert_ptr_ne(fp, NULL);
+        fseek(fp, -1, SEEK_END);
+        fputc('X', fp);
+        fclose(fp);
+
+        checkpoint_reopen_verify(4 * CKPT_RECS_PER_TXN, CKPT_RECS_PER_TXN);
 }
 END_TEST
 
@@ -649,6 +2400,181 @@ START_TEST(test_foreach_changes)
 }
 END_TEST
 
+#define FEINS_RECS 1000
+
+struct feirock {
+        struct zsdb *db;
+        struct zsdb_txn **tid;
+        size_t n;
+};
+
+static int fe_cb_foreach_inserts(void *data,
+                                 const unsigned char *key, size_t keylen,
+                                 const unsigned char *val, size_t vallen)
+{
+        struct feirock *fr = (struct feirock *)data;
+        unsigned char k[24];
+        int r;
+
+        snprintf((char *)k, sizeof(k), "key%06zu", fr->n);
+        ck_assert_int_eq(keylen, strlen((char *)k));
+        ck_assert_mem_eq(key, k, keylen);
+
+        if (fr->n % 2 == 0 && fr->n) {
+                ck_assert_int_eq(vallen, 3);
+                ck_assert_mem_eq(val, "new", 3);
+        }
+
+        /* Add a key before this one, which isn't visited, the odd key after
+         * it, which is, and replace the value of the next even key */
+        if (fr->n % 2 == 0 && fr->n < FEINS_RECS) {
+                zsdb_write_lock_acquire(fr->db, 0);
+                r = zsdb_add(fr->db, k, keylen - 1, (const unsigned char *)"", 0,
+                             fr->tid);
+                ck_assert_int_eq(r, ZS_OK);
+
+                snprintf((char *)k, sizeof(k), "key%06zu", fr->n + 1);
+                r = zsdb_add(fr->db, k, strlen((char *)k),
+                             (const unsigned char *)"odd", 3, fr->tid);
+                ck_assert_int_eq(r, ZS_OK);
+
+                snprintf((char *)k, sizeof(k), "key%06zu", fr->n + 2);
+                r = zsdb_add(fr->db, k, strlen((char *)k),
+                             (const unsigned char *)"new", 3, fr->tid);
+                ck_assert_int_eq(r, ZS_OK);
+                zsdb_write_lock_release(fr->db);
+        }
+
+        fr->n++;
+
+        return 0;
+}
+
+START_TEST(test_foreach_inserts)
+{
+        struct zsdb_txn *txn = NULL;
+        struct feirock rock;
+        unsigned char key[24];
+        size_t i;
+        int ret;
+
+        /* The even keys, in a finalised file */
+        zsdb_write_lock_acquire(db, 0);
+        for (i = 0; i < FEINS_RECS; i += 2) {
+                snprintf((char *)key, sizeof(key), "key%06zu", i);
+                ret = zsdb_add(db, key, strlen((char *)key),
+                               (const unsigned char *)"old", 3, &txn);
+                ck_assert_int_eq(ret, ZS_OK);
+        }
+        ret = zsdb_commit(db, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_finalise(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+
+        ret = zsdb_close(db);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_final(&db);
+
+        ret = zsdb_init(&db, NULL, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_open(db, basedir, MODE_RDWR);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        /* Records added to the active memtree by the callback, ahead of
+         * where foreach is, are visited, in order, exactly once */
+        rock.db = db;
+        rock.tid = &txn;
+        rock.n = 0;
+
+        ret = zsdb_foreach(db, NULL, 0, NULL, fe_cb_foreach_inserts,
+                           &rock, rock.tid);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(rock.n, FEINS_RECS + 1);
+
+        zsdb_write_lock_acquire(db, 0);
+        ret = zsdb_commit(db, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+        zsdb_transaction_end(&txn);
+}
+END_TEST
+
+struct fecrock {
+        struct zsdb *db;
+        struct zsdb_txn **tid;
+        size_t n;
+};
+
+/* Every so often, reads records far from the one it is at, which drops the
+ * window that one is in, and commits, which unmaps it */
+static int fe_cb_foreach_commits(void *data,
+                                 const unsigned char *key, size_t keylen,
+                                 const unsigned char *val _unused_,
+                                 size_t vallen _unused_)
+{
+        struct fecrock *fr = (struct fecrock *)data;
+        const unsigned char *value;
+        unsigned char k[64];
+        size_t len, vallen2 = 0;
+        int r;
+
+        len = model_key(fr->n, k);
+        ck_assert_int_eq(keylen, len);
+        ck_assert_mem_eq(key, k, keylen);
+
+        if (fr->n % 100 == 0) {
+                zsdb_write_lock_acquire(fr->db, 0);
+
+                /* Before the keys, not visited */
+                len = sprintf((char *)k, "a%06zu", fr->n);
+                r = zsdb_add(fr->db, k, len, k, len, NULL);
+                ck_assert_int_eq(r, ZS_OK);
+
+                len = model_key((fr->n + MODEL_RECS / 2) % MODEL_RECS, k);
+                r = zsdb_fetch(fr->db, k, len, &value, &vallen2, NULL);
+                ck_assert_int_eq(r, ZS_OK);
+                len = model_key((fr->n + MODEL_RECS / 4) % MODEL_RECS, k);
+                r = zsdb_fetch(fr->db, k, len, &value, &vallen2, NULL);
+                ck_assert_int_eq(r, ZS_OK);
+
+                r = zsdb_commit(fr->db, NULL);
+                ck_assert_int_eq(r, ZS_OK);
+                zsdb_write_lock_release(fr->db);
+        }
+
+        fr->n++;
+
+        return 0;
+}
+
+START_TEST(test_foreach_commits)
+{
+        struct zsdb_txn *txn = NULL;
+        struct fecrock rock;
+        int ret;
+
+        model_fill(0, 2, 0);
+        model_fill(1, 2, 0);
+
+        /* A couple of small windows */
+        mfile_window_config(4096, 2);
+        reopen();
+
+        rock.db = db;
+        rock.tid = &txn;
+        rock.n = 0;
+
+        ret = zsdb_foreach(db, (const unsigned char *)"user", 4, NULL,
+                           fe_cb_foreach_commits, &rock, rock.tid);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(rock.n, MODEL_RECS);
+        zsdb_transaction_end(&txn);
+
+        mfile_window_config(MFILE_WINDOW_SIZE, MFILE_WINDOW_COUNT);
+}
+END_TEST
+
 START_TEST(test_foreach_count)
 {
         struct zsdb_txn *txn;
@@ -802,6 +2728,201 @@ START_TEST(test_fetchnext_simple)
 }
 END_TEST
 
+#define THREAD_NUM_READERS 4
+#define THREAD_NUM_WRITERS 2
+#define THREAD_WRITER_RECS 1000
+
+static void *thread_reader(void *arg)
+{
+        int *failed = arg;
+        int n;
+        size_t i;
+
+        for (n = 0; n < 500; n++) {
+                for (i = 0; i < ARRAY_SIZE(kvrecsgen); i++) {
+                        const unsigned char *value = NULL;
+                        size_t vallen = 0;
+
+                        if (zsdb_fetch(db, kvrecsgen[i].k, kvrecsgen[i].klen,
+                                       &value, &vallen, NULL) != ZS_OK ||
+                            vallen != kvrecsgen[i].vlen ||
+                            memcmp(value, kvrecsgen[i].v, vallen) != 0)
+                                (*failed)++;
+                }
+        }
+
+        return NULL;
+}
+
+static void *thread_writer(void *arg)
+{
+        int *id = arg;
+        int i, failed = 0;
+        char key[32];
+
+        if (zsdb_write_lock_acquire(db, -1) != ZS_OK)
+                return NULL;
+
+        for (i = 0; i < THREAD_WRITER_RECS; i++) {
+                snprintf(key, sizeof(key), "thread%d.%05d", *id, i);
+                if (zsdb_add(db, (const unsigned char *)key, strlen(key),
+                             (const unsigned char *)key, strlen(key),
+                             NULL) != ZS_OK)
+                        failed++;
+        }
+
+        zsdb_commit(db, NULL);
+        zsdb_write_lock_release(db);
+
+        *id = failed;
+
+        return NULL;
+}
+
+START_TEST(test_threaded_readers_writers)
+{
+        pthread_t readers[THREAD_NUM_READERS];
+        pthread_t writers[THREAD_NUM_WRITERS];
+        int rfailed[THREAD_NUM_READERS];
+        int wids[THREAD_NUM_WRITERS];
+        struct zsdb_txn *txn = NULL;
+        size_t i;
+        int ret;
+
+        /* Records every reader looks for */
+        ret = zsdb_write_lock_acquire(db, 0);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        for (i = 0; i < ARRAY_SIZE(kvrecsgen); i++) {
+                ret = zsdb_add(db, kvrecsgen[i].k, kvrecsgen[i].klen,
+                               kvrecsgen[i].v, kvrecsgen[i].vlen, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+        }
+
+        ret = zsdb_commit(db, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+
+        /* Writers and readers share the same handle */
+        for (i = 0; i < THREAD_NUM_WRITERS; i++) {
+                wids[i] = i;
+                ret = pthread_create(&writers[i], NULL, thread_writer,
+                                     &wids[i]);
+                ck_assert_int_eq(ret, 0);
+        }
+
+        for (i = 0; i < THREAD_NUM_READERS; i++) {
+                rfailed[i] = 0;
+                ret = pthread_create(&readers[i], NULL, thread_reader,
+                                     &rfailed[i]);
+                ck_assert_int_eq(ret, 0);
+        }
+
+        for (i = 0; i < THREAD_NUM_READERS; i++) {
+                pthread_join(readers[i], NULL);
+                ck_assert_int_eq(rfailed[i], 0);
+        }
+
+        for (i = 0; i < THREAD_NUM_WRITERS; i++) {
+                pthread_join(writers[i], NULL);
+                ck_assert_int_eq(wids[i], 0);
+        }
+
+        record_count = 0;
+        ret = zsdb_foreach(db, NULL, 0, count_fe_p, NULL, NULL, &txn);
+        ck_assert_int_eq(ret, ZS_OK);
+        ck_assert_int_eq(record_count, ARRAY_SIZE(kvrecsgen) +
+                         THREAD_NUM_WRITERS * THREAD_WRITER_RECS);
+}
+END_TEST
+
+/* Writes without the writer slot, which another thread holds */
+static void *thread_intruder(void *arg)
+{
+        int *rets = arg;
+
+        rets[0] = zsdb_write_lock_is_locked(db);
+        rets[1] = zsdb_add(db, (const unsigned char *)"intruder", 8,
+                           (const unsigned char *)"x", 1, NULL);
+        rets[2] = zsdb_remove(db, kvrecsgen[0].k, kvrecsgen[0].klen, NULL);
+        zsdb_write_lock_release(db);
+
+        return NULL;
+}
+
+START_TEST(test_threaded_writer_slot)
+{
+        const unsigned char *value;
+        size_t vallen = 0;
+        pthread_t thread;
+        int rets[3];
+        int ret;
+
+        ret = zsdb_write_lock_acquire(db, 0);
+        ck_assert_int_eq(ret, ZS_OK);
+        ret = zsdb_add(db, kvrecsgen[0].k, kvrecsgen[0].klen,
+                       kvrecsgen[0].v, kvrecsgen[0].vlen, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+
+        ret = pthread_create(&thread, NULL, thread_intruder, rets);
+        ck_assert_int_eq(ret, 0);
+        pthread_join(thread, NULL);
+
+        ck_assert_int_eq(rets[0], 0);
+        ck_assert_int_eq(rets[1], ZS_ERROR);
+        ck_assert_int_eq(rets[2], ZS_ERROR);
+
+        /* Still ours */
+        ck_assert_int_eq(zsdb_write_lock_is_locked(db), 1);
+        ret = zsdb_commit(db, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+        zsdb_write_lock_release(db);
+
+        ret = zsdb_fetch(db, (const unsigned char *)"intruder", 8, &value,
+                         &vallen, NULL);
+        ck_assert_int_eq(ret, ZS_NOTFOUND);
+        ret = zsdb_fetch(db, kvrecsgen[0].k, kvrecsgen[0].klen, &value,
+                         &vallen, NULL);
+        ck_assert_int_eq(ret, ZS_OK);
+}
+END_TEST
+
+/* More than the keys a process can have, PTHREAD_KEYS_MAX */
+#define THREADED_DBS 1100
+
+START_TEST(test_threaded_many_dbs)
+{
+        struct zsdb **dbs;
+        struct rlimit rl;
+        size_t i, n = THREADED_DBS;
+        int ret;
+
+        /* A few files each */
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < 8 * n) {
+                rl.rlim_cur = rl.rlim_max;
+                setrlimit(RLIMIT_NOFILE, &rl);
+                getrlimit(RLIMIT_NOFILE, &rl);
+                if (rl.rlim_cur < 8 * n)
+                        n = rl.rlim_cur / 8;
+        }
+
+        dbs = xcalloc(n, sizeof(struct zsdb *));
+        for (i = 0; i < n; i++) {
+                ret = zsdb_init(&dbs[i], NULL, NULL);
+                ck_assert_int_eq(ret, ZS_OK);
+                ret = zsdb_open(dbs[i], basedir, MODE_RDWR | MODE_THREADED);
+                ck_assert_int_eq(ret, ZS_OK);
+        }
+
+        for (i = 0; i < n; i++) {
+                ret = zsdb_close(dbs[i]);
+                ck_assert_int_eq(ret, ZS_OK);
+                zsdb_final(&dbs[i]);
+        }
+        xfree(dbs);
+}
+END_TEST
+
 Suite *zsdb_suite(void)
 {
         Suite *s;
@@ -809,6 +2930,7 @@ Suite *zsdb_suite(void)
         TCase *tc_many;
         TCase *tc_foreach;
         TCase *tc_fetch;
+        TCase *tc_threads;
 
         s = suite_create("zeroskip");
 
@@ -819,6 +2941,8 @@ Suite *zsdb_suite(void)
         tcase_add_test(tc_core, test_abort_transaction);
         tcase_add_test(tc_core, test_delete);
         tcase_add_test(tc_core, test_multiopen);
+        tcase_add_test(tc_core, test_memory_usage);
+        tcase_add_test(tc_core, test_checkpoint);
         suite_add_tcase(s, tc_core);
 
         /* foreach */
@@ -826,6 +2950,8 @@ Suite *zsdb_suite(void)
         tcase_add_checked_fixture(tc_foreach, setup, teardown);
 
         tcase_add_test(tc_foreach, test_foreach_changes);
+        tcase_add_test(tc_foreach, test_foreach_inserts);
+        tcase_add_test(tc_foreach, test_foreach_commits);
         tcase_add_test(tc_foreach, test_foreach_count);
         tcase_add_test(tc_foreach, test_foreach_heirarchy);
         suite_add_tcase(s, tc_foreach);
@@ -847,7 +2973,37 @@ Suite *zsdb_suite(void)
         tcase_set_timeout(tc_many, 50);
 
         tcase_add_test(tc_many, test_many_records);
+        tcase_add_test(tc_many, test_memory_budget);
+        tcase_add_test(tc_many, test_rollover);
+        tcase_add_test(tc_many, test_hugepages);
+        tcase_add_test(tc_many, test_windowed);
+        tcase_add_test(tc_many, test_fetch_multi_windowed);
+        tcase_add_test(tc_many, test_packed_bounds);
+        tcase_add_test(tc_many, test_filter);
+        tcase_add_test(tc_many, test_filter_none);
+        tcase_add_test(tc_many, test_key_prefixes);
+        tcase_add_test(tc_many, test_packed_versions);
+        tcase_add_test(tc_many, test_packed_big_values);
+        tcase_add_test(tc_many, test_fetch_pinned);
+        tcase_add_test(tc_many, test_key_model);
+        tcase_add_test(tc_many, test_hash_index);
+        tcase_add_test(tc_many, test_fetch_multi);
+        tcase_add_test(tc_many, test_value_cache);
+        tcase_add_test(tc_many, test_value_cache_budget);
+        tcase_add_test(tc_many, test_process_budget);
+        tcase_add_test(tc_many, test_process_budget_readers);
         suite_add_tcase(s, tc_many);
 
+        /* handle shared between threads */
+        tc_threads = tcase_create("threads");
+        tcase_add_checked_fixture(tc_threads, setup_threaded, teardown);
+        tcase_set_timeout(tc_threads, 50);
+
+        tcase_add_test(tc_threads, test_threaded_readers_writers);
+        tcase_add_test(tc_threads, test_threaded_writer_slot);
+        tcase_add_test(tc_threads, test_threaded_many_dbs);
+        tcase_add_test(tc_threads, test_memory_budget_threaded);
+        suite_add_tcase(s, tc_threads);
+
         return s;
 }
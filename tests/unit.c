@@ -24,6 +24,12 @@ int main(int argc, char **argv)
         srunner_add_suite(sr, memtree_suite());
         srunner_add_suite(sr, strarr_suite());
         srunner_add_suite(sr, crc32c_suite());
+        srunner_add_suite(sr, htable_suite());
+        srunner_add_suite(sr, arena_suite());
+        srunner_add_suite(sr, offidx_suite());
+        srunner_add_suite(sr, bloom_suite());
+        srunner_add_suite(sr, keymodel_suite());
+        srunner_add_suite(sr, valcache_suite());
 
         /* Log to stdout by default, change this eventually and make
          * it an option */
@@ -15,6 +15,12 @@ extern Suite *vecu64_suite(void);
 extern Suite *zsdb_suite(void);
 extern Suite *strarr_suite(void);
 extern Suite *crc32c_suite(void);
+extern Suite *htable_suite(void);
+extern Suite *arena_suite(void);
+extern Suite *offidx_suite(void);
+extern Suite *bloom_suite(void);
+extern Suite *keymodel_suite(void);
+extern Suite *valcache_suite(void);
 
 #endif  /* _UNIT_H_ */
 